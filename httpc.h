@@ -0,0 +1,211 @@
+//
+// httpc.h
+//
+// These functions are designed to provide a simple
+// HTTP/1.1 client, which keeps connections to upstream
+// servers alive and pipelines requests on them.
+//
+// Manage HTTPC session
+//
+//   HTTPC *httpc_open(char *host, int port, enum netflags flags) ;
+//   int httpc_send(HTTPC *hc, char *method, char *path, char *headers, char *body, int bodylen) ;
+//   int httpc_recv(HTTPC *hc) ;
+//   int httpc_status(HTTPC *hc) ;
+//   char *httpc_header(HTTPC *hc, char *name) ;
+//   char *httpc_body(HTTPC *hc, int *len) ;
+//   int httpc_setbodycallback(HTTPC *hc, httpc_body_callback fn, void *arg) ;
+//   int httpc_pending(HTTPC *hc) ;
+//   int httpc_fd(HTTPC *hc) ;
+//   int httpc_wantwrite(HTTPC *hc) ;
+//   int httpc_close(HTTPC *hc) ;
+//
+// Parallel download
+//
+//   int httpc_download(char *host, int port, enum netflags flags, char *path,
+//                      char *filename, int connections, HTTPCDLSTATS *stats) ;
+//
+// link with: -lssl -lcrypto -lpthread
+//
+// NOTES
+//
+// Connections are taken from the net connection pool (netacquire),
+// and returned to it by httpc_close if the last response left the
+// connection usable.  Each request is written with a single
+// netsendv, and the body is not copied.  Several requests can be
+// sent before their responses are read (pipelining), and responses
+// are returned by httpc_recv in the order the requests were sent.
+//
+
+#ifndef _HTTPC_DEFINED
+#define _HTTPC_DEFINED
+
+#include "net.h"
+
+#ifndef HTTPC
+typedef struct {} HTTPC ;
+#endif
+
+//
+// @brief Callback receiving response body as it arrives
+// @param(in) arg Argument given to httpc_setbodycallback
+// @param(in) data Part of body (only valid during the callback)
+// @param(in) len Length of data
+// @return true to continue, false to abandon the response (and connection)
+//
+
+typedef int (*httpc_body_callback)(void *arg, char *data, int len) ;
+
+
+//
+// Statistics of a parallel download
+//
+
+typedef struct {
+  long long bytes ;            // Bytes received (including retried ranges)
+  int ranges ;                 // Range requests completed
+  int retries ;                // Ranges retried after failing or stalling
+  int connections ;            // Connections opened (or taken from the pool)
+  long ms ;                    // Duration of download in milliseconds
+} HTTPCDLSTATS ;
+
+
+//
+// @brief Open client session to server
+// @param(in) host Name of server
+// @param(in) port Port number on server
+// @param(in) flags Type of connection (OPEN|TLS|NONBLOCK...)
+// @return Handle of session, or NULL on failure
+//
+
+HTTPC *httpc_open(char *host, int port, enum netflags flags) ;
+
+
+//
+// @brief Send request
+// @param(in) hc Handle of session
+// @param(in) method Request method (e.g. "GET")
+// @param(in) path Request target (e.g. "/index.html?a=1")
+// @param(in) headers Additional header lines, each ending "\r\n", or NULL
+// @param(in) body Request body, or NULL
+// @param(in) bodylen Length of body
+// @return true on success
+//
+// Host and Content-Length headers are added.  If a non-blocking
+// connection can't take the whole request, the rest is kept and sent
+// by httpc_recv (see httpc_wantwrite).
+//
+
+int httpc_send(HTTPC *hc, char *method, char *path, char *headers, char *body, int bodylen) ;
+
+
+//
+// @brief Receive response to the oldest request still outstanding
+// @param(in) hc Handle of session
+// @return Status code once the response is complete, 0 if a non-blocking
+//         connection is still waiting for it, or -1 on error
+//
+
+int httpc_recv(HTTPC *hc) ;
+
+
+//
+// @brief Obtain status code of response
+// @param(in) hc Handle of session
+// @return Status code, or 0 if no response has been received
+//
+
+int httpc_status(HTTPC *hc) ;
+
+
+//
+// @brief Obtain response header
+// @param(in) hc Handle of session
+// @param(in) name Name of header (any case)
+// @return Value of header, or NULL if not present
+//
+
+char *httpc_header(HTTPC *hc, char *name) ;
+
+
+//
+// @brief Obtain response body
+// @param(in) hc Handle of session
+// @param(out) len Length of body
+// @return Body, or NULL if the response had none (or was passed to a callback)
+//
+// A Content-Length body which arrives in one piece is returned in
+// place in the connection's receive buffer, rather than being copied.
+// The body is valid until the next httpc_recv or httpc_close.
+//
+
+char *httpc_body(HTTPC *hc, int *len) ;
+
+
+//
+// @brief Pass response bodies to a callback as they arrive, instead of keeping them
+// @param(in) hc Handle of session
+// @param(in) fn Callback, or NULL to keep bodies for httpc_body
+// @param(in) arg Argument passed to callback
+// @return true on success
+//
+
+int httpc_setbodycallback(HTTPC *hc, httpc_body_callback fn, void *arg) ;
+
+
+//
+// @brief Obtain number of requests sent whose responses have not been received
+// @param(in) hc Handle of session
+// @return Number of outstanding requests
+//
+
+int httpc_pending(HTTPC *hc) ;
+
+
+//
+// @brief Obtain file descriptor of session, for select/poll
+// @param(in) hc Handle of session
+// @return File descriptor
+//
+
+int httpc_fd(HTTPC *hc) ;
+
+
+//
+// @brief Determine whether session is waiting to write a request
+// @param(in) hc Handle of session
+// @return True if httpc_recv should be called when httpc_fd is writable
+//
+
+int httpc_wantwrite(HTTPC *hc) ;
+
+
+//
+// @brief Close session, returning the connection to the pool if it is reusable
+// @param(in) hc Handle of session
+// @return true on success
+//
+
+int httpc_close(HTTPC *hc) ;
+
+
+//
+// @brief Download resource to file, using several connections in parallel
+// @param(in) host Name of server
+// @param(in) port Port number on server
+// @param(in) flags Type of connection (OPEN|TLS...)
+// @param(in) path Path of resource on server
+// @param(in) filename File to write, which is created or replaced
+// @param(in) connections Number of connections to use (at most 64)
+// @param(out) stats Statistics of download, or NULL
+// @return true on success
+//
+// The resource is fetched with concurrent Range requests, each part
+// being written to its place in the preallocated file.  Range sizes
+// adapt to each connection's throughput, and failed ranges are
+// retried.  If the server ignores Range, one connection is used.
+//
+
+int httpc_download(char *host, int port, enum netflags flags, char *path,
+                   char *filename, int connections, HTTPCDLSTATS *stats) ;
+
+#endif
@@ -10,27 +10,96 @@
 // Manage httpd server
 //
 //   int httpd_init(int port, int numconnections) ;
+//   int httpd_initopts(int port, NETOPTS *opts) ;
 //   int httpd_listenfd() ;
 //   int httpd_shutdown() ;
 //
+// Manage HTTPS listener
+//
+//   int httpd_tls_init(int port, char *certfile, char *keyfile) ;
+//   int httpd_tls_listenfd() ;
+//   int httpd_tls_stats(long *full, long *resumed, long *failed) ;
+//
+// Manage Unix domain socket listener
+//
+//   int httpd_unix_init(char *path) ;
+//   int httpd_unix_listenfd() ;
+//
+// Manage httpd timers
+//
+//   int httpd_timer_add(int intervalms, int repeat, void (*fn)(void *), void *arg) ;
+//   int httpd_timer_cancel(int id) ;
+//   int httpd_timer_next() ;
+//   int httpd_timer_run() ;
+//
+// Built-in server loop (epoll or io_uring)
+//
+//   int httpd_loop_init(enum httpd_backend backend, void (*handler)(HTTPD *hh, int code)) ;
+//   int httpd_loop_run(int timeoutms) ;
+//   int httpd_loop_stats(long *requests, long *syscalls) ;
+//   int httpd_loop_shutdown() ;
+//
 // Manage HTTPD session
 //
 //   HTTPD *haccept(int listenfd) ;
 //   int hrecv(HTTPD *hh) ;
 //   int hfd(HTTPD *hh) ;
+//   int hsecure(HTTPD *hh) ;
+//   int hfastopen(HTTPD *hh) ;
+//   int hstats(HTTPD *hh, NETSTATS *st) ;
+//   int hpeercred(HTTPD *hh, pid_t *pid, uid_t *uid, gid_t *gid) ;
 //   char *hgeturi(HTTPD *hh) ;
 //   char *hgeturiparam(HTTPD *hh, char *param) ;
+//   char *hgetheader(HTTPD *hh, char *name) ;
 //   char *hgetbody(HTTPD *hh) ;
+//   int hflush(HTTPD *hh) ;
+//   int hpending(HTTPD *hh) ;
 //   int hclose(HTTPD *hh) ;
 //
+// WebSocket sessions
+//
+//   int hws_isupgrade(HTTPD *hh) ;
+//   int hws_accept(HTTPD *hh) ;
+//   int hws_recv(HTTPD *hh) ;
+//   char *hws_getmsg(HTTPD *hh, int *len) ;
+//   int hws_send(HTTPD *hh, int opcode, char *buf, int len) ;
+//   int hws_broadcast(HTTPD **hh, int n, int opcode, char *buf, int len) ;
+//   int hws_close(HTTPD *hh, int status) ;
+//
+// Server-Sent Events (text/event-stream) sessions
+//
+//   int hsse_accept(HTTPD *hh) ;
+//   int hsse_send(HTTPD *hh, char *event, char *data) ;
+//   int hsse_recv(HTTPD *hh) ;
+//   int hsse_heartbeat(int intervalms) ;
+//   HSSETOPIC *hsse_topic_new(enum hsse_policy policy) ;
+//   int hsse_subscribe(HSSETOPIC *topic, HTTPD *hh) ;
+//   int hsse_unsubscribe(HSSETOPIC *topic, HTTPD *hh) ;
+//   int hsse_publish(HSSETOPIC *topic, char *event, char *data) ;
+//   int hsse_topic_free(HSSETOPIC *topic) ;
+//
+// HTTP/2 (h2c) connections
+//
+//   int httpd_h2_enable(int enable) ;
+//   int hh2_isconnection(HTTPD *hh) ;
+//   HTTPD *hh2_getstream(HTTPD *hh) ;
+//
+// link with: -lssl -lcrypto
+//
 
 #ifndef _HTTPD_DEFINED
 #define _HTTPD_DEFINED
 
+#include "net.h"
+
 #ifndef HTTPD
 typedef struct {} HTTPD ;
 #endif
 
+#ifndef HSSETOPIC
+typedef struct {} HSSETOPIC ;
+#endif
+
 ///////////////////////////////////////////////////////////////////////
 //
 // @brief Initialises httpd server
@@ -41,6 +110,25 @@ typedef struct {} HTTPD ;
 int httpd_init(int port) ;
 
 
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Initialises httpd server, applying socket options to its listeners
+// @param[in] port Port number to listen on
+// @param[in] opts Socket options (see net.h), or NULL
+// @return true on success
+//
+// The options are applied to the listener before it listens (and to
+// an HTTPS listener started later with httpd_tls_init).  Accepted
+// sessions inherit them, except TCP_QUICKACK, which is set on each
+// session.  Effective values can be read with netgetfdopts on
+// httpd_listenfd() or hfd(hh).  fastopenqlen enables TCP Fast Open
+// on the listener (server support must also be enabled in the
+// net.ipv4.tcp_fastopen sysctl), see hfastopen.
+//
+
+int httpd_initopts(int port, NETOPTS *opts) ;
+
+
 ///////////////////////////////////////////////////////////////////////
 //
 // @brief Returns httpd server listen handle
@@ -71,6 +159,190 @@ int httpd_shutdown() ;
 
 
 
+///////////////////////////////////////////////////////////////////////
+//
+// HTTPS
+//
+// An HTTPS listener can be run alongside (or instead of) the plain
+// listener.  Sessions accepted from it with haccept are handled in
+// exactly the same way, with the TLS handshake taking place inside
+// hrecv.  All HTTPS sessions share one SSL context, with a session
+// cache and rotating session ticket keys so returning clients can
+// resume without a full handshake.
+//
+
+//
+// @brief Initialises HTTPS listener
+// @param[in] port Port number to listen on
+// @param[in] certfile PEM file containing the certificate chain
+// @param[in] keyfile PEM file containing the private key
+// @return listener handle, or -1 on failure
+//
+
+int httpd_tls_init(int port, char *certfile, char *keyfile) ;
+
+
+//
+// @brief Returns HTTPS listener handle
+// @return listener handle, or -1 if not listening
+//
+
+int httpd_tls_listenfd() ;
+
+
+//
+// @brief Returns HTTPS handshake counters
+// @param[out] full Number of full handshakes completed (may be NULL)
+// @param[out] resumed Number of resumed handshakes completed (may be NULL)
+// @param[out] failed Number of handshakes which failed (may be NULL)
+// @return true
+//
+
+int httpd_tls_stats(long *full, long *resumed, long *failed) ;
+
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// Unix domain sockets
+//
+// A Unix domain socket listener can be run alongside (or instead of)
+// the TCP listener, for clients on the same host.  Sessions accepted
+// from it with haccept are handled in exactly the same way, but have
+// no peer address (hpeeripaddress returns ""), so the client process
+// is identified with hpeercred.  httpd_loop serves the Unix listener
+// if httpd_init has not been called.
+//
+
+//
+// @brief Initialises Unix domain socket listener
+// @param[in] path Path of socket, or "@name" in the abstract namespace
+// @return listener handle, or -1 on failure
+//
+// A socket file left by an earlier server is replaced, and the file
+// is removed by httpd_shutdown.
+//
+
+int httpd_unix_init(char *path) ;
+
+
+//
+// @brief Returns Unix domain socket listener handle
+// @return listener handle, or -1 if not listening
+//
+
+int httpd_unix_listenfd() ;
+
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// Timers
+//
+// Timers are run from the application's select loop: use
+// httpd_timer_next to set the select timeout, and call
+// httpd_timer_run each time round the loop.
+//
+
+//
+// @brief Add timer
+// param[in] intervalms Time in milliseconds until the timer fires
+// param[in] repeat If true, timer fires every intervalms until cancelled
+// param[in] fn Function to call when the timer fires
+// param[in] arg Argument passed to fn
+// @return Timer id, or 0 if no more timers are available
+//
+
+int httpd_timer_add(int intervalms, int repeat, void (*fn)(void *arg), void *arg) ;
+
+
+//
+// @brief Cancel timer
+// param[in] id Timer id returned from httpd_timer_add
+// @return true if the timer was found and cancelled
+//
+
+int httpd_timer_cancel(int id) ;
+
+
+//
+// @brief Get time until the next timer is due
+// @return Milliseconds until the next timer fires (0 if overdue),
+//         or -1 if no timers are active
+//
+
+int httpd_timer_next() ;
+
+
+//
+// @brief Run timers which are due
+// @return Number of timers run
+//
+
+int httpd_timer_run() ;
+
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// Server loop
+//
+// Instead of running its own select loop, an application can let
+// httpd run the plain listener.  Each time a request is complete, the
+// handler is called with the hrecv result code, and responds with
+// hsend / hsendb as usual.  The response is sent and the connection
+// closed by the loop once the handler returns, so the handler must
+// not call hclose.  HTTPS, WebSocket and event-stream sessions are
+// not run by the loop.
+//
+// The io_uring backend needs Linux 5.11 or later.  If it is not
+// available, the loop falls back to epoll.
+//
+
+enum httpd_backend {
+  HTTPD_BACKEND_AUTO=0,   // io_uring if available, otherwise epoll
+  HTTPD_BACKEND_EPOLL=1,
+  HTTPD_BACKEND_URING=2
+} ;
+
+//
+// @brief Start server loop on the httpd listener (call after httpd_init)
+// @param[in] backend Requested backend
+// @param[in] handler Function called with each completed request
+// @return Backend in use, or -1 on failure
+//
+
+int httpd_loop_init(enum httpd_backend backend, void (*handler)(HTTPD *hh, int code)) ;
+
+
+//
+// @brief Run one iteration of the server loop, including due timers
+// @param[in] timeoutms Maximum time to wait in milliseconds (-1 for no limit)
+// @return Number of requests handled, or -1 on error
+//
+
+int httpd_loop_run(int timeoutms) ;
+
+
+//
+// @brief Get server loop counters
+// @param[out] requests Number of requests handled (may be NULL)
+// @param[out] syscalls Number of system calls made by the loop (may be NULL)
+// @return Backend in use, or -1 if the loop is not running
+//
+
+int httpd_loop_stats(long *requests, long *syscalls) ;
+
+
+//
+// @brief Stop server loop (the listener stays open)
+// @return true
+//
+
+int httpd_loop_shutdown() ;
+
+
+
 ///////////////////////////////////////////////////////////////////////
 //
 // @brief Start HTTPD session
@@ -101,6 +373,53 @@ int hconnectiontime(HTTPD *hh) ;
 int hfd(HTTPD *hh) ;
 
 
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Determine if session is using TLS
+// param[in] hh Handle of HTTPD session
+// return true if the session was accepted on the HTTPS listener
+//
+
+int hsecure(HTTPD *hh) ;
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Determine if the request arrived in the SYN (TCP Fast Open)
+// param[in] hh Handle of HTTPD session
+// return 1 if data was received in the SYN, 0 if not, -1 on error
+//
+
+int hfastopen(HTTPD *hh) ;
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Get credentials of peer process (Unix domain sessions only)
+// param[in] hh Handle of HTTPD session
+// param[out] pid Process id of peer (may be NULL)
+// param[out] uid User id of peer (may be NULL)
+// param[out] gid Group id of peer (may be NULL)
+// return true on success, false if not a Unix domain session
+//
+
+int hpeercred(HTTPD *hh, pid_t *pid, uid_t *uid, gid_t *gid) ;
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Get transport statistics of session's connection
+// param[in] hh Handle of HTTPD session
+// param[out] st Statistics (see NETSTATS in net.h)
+// return true on success
+//
+// Calls are the system calls (or io_uring operations) made on the
+// socket.  For an HTTP/2 stream, the statistics are the connection's.
+//
+
+int hstats(HTTPD *hh, NETSTATS *st) ;
+
+
 ///////////////////////////////////////////////////////////////////////
 //
 // @brief Get peer network connection details
@@ -164,6 +483,16 @@ int hgeturiparamfloat(HTTPD *hh, char *param, float *f) ;
 
 
 
+//
+// @brief Returns request header
+// param[in] hh Handle of HTTPD session
+// param[in] name Case insensitive header name to search for
+// @return Transient pointer to header value, or NULL if not found
+//
+
+char *hgetheader(HTTPD *hh, char *name) ;
+
+
 //
 // @brief Returns request body
 // param[in] hh Handle of HTTPD session
@@ -182,6 +511,10 @@ char *hgetbody(HTTPD *hh) ;
 // param[in] contenttype Content-type for response (or NULL if no body)
 // param[in] body Contents for body (or NULL if no body)
 // @return true on success
+//
+// What the non-blocking socket will not take straight away is queued
+// (see hflush), so the response may not have been sent on return.
+// hclose sends what is still queued before closing.
 
 int hsend(HTTPD *hh, int code, char *contenttype, char *body) ;
 
@@ -194,17 +527,335 @@ int hsend(HTTPD *hh, int code, char *contenttype, char *body) ;
 // param[in] contenttype Content-type for response (or NULL if no body)
 // param[in] body Contents for body (or NULL if no body)
 // param[in] bodylen Length of body (or 0 if NULL)
-// @return true on success
+// @return true on success (the response may still be queued, as for hsend)
 
 int hsendb(HTTPD *hh, int code, char *contenttype, char *body, int bodylen) ;
 
 
 
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Send queued output data
+// The socket is non-blocking, so data which cannot be written straight
+// away is queued.  Call hflush when hfd becomes writable.
+// param[in] hh Handle of HTTPD session
+// @return Number of bytes still queued, or -1 on error
+
+int hflush(HTTPD *hh) ;
+
+
+///////////////////////////////////////////////////////////////////////
 //
-// @brief Shutdown httpd server
+// @brief Get amount of output data waiting to be sent
+// param[in] hh Handle of HTTPD session
+// @return Number of bytes queued (add hfd to the write fd_set if non-zero)
+
+int hpending(HTTPD *hh) ;
+
+
+
+//
+// @brief Close HTTPD session
+// Output still queued is sent first, waiting up to 5 seconds for the
+// client to take it.  To avoid blocking, call hflush when hfd becomes
+// writable until hpending returns 0, then hclose.
+// param[in] hh Handle of HTTPD session
 // @return true on success
 //
 
 int hclose(HTTPD *hh) ;
 
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// WebSocket (RFC 6455) sessions
+//
+// Once hrecv has returned 200, a request carrying 'Upgrade: websocket'
+// can be switched to a WebSocket with hws_accept.  From then on, the
+// session stays in the same select loop, with hws_recv used in place
+// of hrecv, and hws_send / hws_broadcast used to push messages.
+//
+
+enum hws_opcode {
+  HWS_CONTINUATION = 0x0,
+  HWS_TEXT = 0x1,
+  HWS_BINARY = 0x2,
+  HWS_CLOSE = 0x8,
+  HWS_PING = 0x9,
+  HWS_PONG = 0xA
+} ;
+
+
+//
+// @brief Determine if request is a WebSocket upgrade request
+// param[in] hh Handle of HTTPD session
+// @return true if the request can be passed to hws_accept
+//
+
+int hws_isupgrade(HTTPD *hh) ;
+
+
+//
+// @brief Accept WebSocket upgrade and switch session to WebSocket mode
+// param[in] hh Handle of HTTPD session
+// @return true on success
+//
+
+int hws_accept(HTTPD *hh) ;
+
+
+//
+// @brief Receive WebSocket data (keep calling until it returns non-zero)
+// Ping and close frames are answered automatically.  As several frames
+// can arrive together, call again after a message is returned until it
+// returns 0, or use hws_haspending.
+// param[in] hh Handle of HTTPD session
+// @return 0 - Still receiving, call back later
+// @return -1 - Connection closed
+// @return HWS_TEXT or HWS_BINARY - Complete message available via hws_getmsg
+//
+// When the client closes, the echoed close frame may still be queued
+// once this returns -1.  hclose sends it, or call hflush while hpending
+// is non-zero before hclose to avoid waiting.
+//
+
+int hws_recv(HTTPD *hh) ;
+
+
+//
+// @brief Determine if a complete frame is already buffered
+// param[in] hh Handle of HTTPD session
+// @return true if hws_recv can make progress without further socket data
+//
+
+int hws_haspending(HTTPD *hh) ;
+
+
+//
+// @brief Returns last message received by hws_recv
+// param[in] hh Handle of HTTPD session
+// param[out] len Length of message (may be NULL)
+// @return Transient, null terminated pointer to message, or NULL if none
+//
+
+char *hws_getmsg(HTTPD *hh, int *len) ;
+
+
+//
+// @brief Send WebSocket message
+// param[in] hh Handle of HTTPD session
+// param[in] opcode Message type (HWS_TEXT, HWS_BINARY, HWS_PING)
+// param[in] buf Message payload
+// param[in] len Length of payload
+// @return true on success (data sent or queued)
+//
+
+int hws_send(HTTPD *hh, int opcode, char *buf, int len) ;
+
+
+//
+// @brief Send the same WebSocket message to many sessions
+// The frame is built once and written to each session in turn.
+// Entries which are NULL or not in WebSocket mode are skipped.
+// param[in] hh Array of HTTPD session handles
+// param[in] n Number of entries in array
+// param[in] opcode Message type (HWS_TEXT, HWS_BINARY)
+// param[in] buf Message payload
+// param[in] len Length of payload
+// @return Number of sessions the message was sent (or queued) to
+//
+
+int hws_broadcast(HTTPD **hh, int n, int opcode, char *buf, int len) ;
+
+
+//
+// @brief Send WebSocket close frame
+// param[in] hh Handle of HTTPD session
+// param[in] status Close status code (e.g. 1000), or 0 for none
+// @return true on success
+//
+
+int hws_close(HTTPD *hh, int status) ;
+
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// Server-Sent Events (text/event-stream)
+//
+// Once hrecv has returned 200, a handler can keep the session open as
+// an event stream with hsse_accept, and push events to it with
+// hsse_send.  Events for many sessions are best sent through a topic,
+// which serializes each event once and writes it to every subscriber.
+//
+// Subscribers whose output queue is backed up (i.e. hpending exceeds
+// an internal high water mark) are handled according to the topic
+// policy: HSSE_DROP discards the event for that subscriber, and
+// HSSE_COALESCE keeps only the most recent event, which is sent once
+// hflush has emptied the queue.
+//
+
+enum hsse_policy {
+  HSSE_DROP = 0,
+  HSSE_COALESCE = 1
+} ;
+
+
+//
+// @brief Switch session to event-stream mode and send the stream headers
+// param[in] hh Handle of HTTPD session
+// @return true on success
+//
+
+int hsse_accept(HTTPD *hh) ;
+
+
+//
+// @brief Send event to session
+// param[in] hh Handle of HTTPD session
+// param[in] event Event name, or NULL for an unnamed (message) event
+// param[in] data Event data.  Multi-line data (lines ending CR, LF or CRLF)
+//                 is split into data: fields
+// @return true if sent or queued, false on error (including an event name
+//         containing a line break) or if the session is backed up
+//
+
+int hsse_send(HTTPD *hh, char *event, char *data) ;
+
+
+//
+// @brief Process data from event-stream client (call when hfd is readable)
+// param[in] hh Handle of HTTPD session
+// @return 0 - Still connected
+// @return -1 - Connection closed
+//
+
+int hsse_recv(HTTPD *hh) ;
+
+
+//
+// @brief Send a comment to idle event-stream sessions at a regular interval
+// The comments are sent from an httpd timer, and keep intermediate
+// proxies from timing out idle streams.  Sessions which have sent or
+// received data within the interval are skipped.
+// param[in] intervalms Interval in milliseconds, or 0 to disable
+// @return true on success
+//
+
+int hsse_heartbeat(int intervalms) ;
+
+
+//
+// @brief Create event topic
+// param[in] policy Policy for subscribers which are backed up
+// @return Handle of topic, or NULL on error
+//
+
+HSSETOPIC *hsse_topic_new(enum hsse_policy policy) ;
+
+
+//
+// @brief Add event-stream session to topic
+// param[in] topic Handle of topic
+// param[in] hh Handle of HTTPD session (in event-stream mode)
+// @return true on success
+//
+
+int hsse_subscribe(HSSETOPIC *topic, HTTPD *hh) ;
+
+
+//
+// @brief Remove session from topic (hclose does this automatically)
+// param[in] topic Handle of topic
+// param[in] hh Handle of HTTPD session
+// @return true if the session was subscribed
+//
+
+int hsse_unsubscribe(HSSETOPIC *topic, HTTPD *hh) ;
+
+
+//
+// @brief Send event to all subscribers of topic
+// param[in] topic Handle of topic
+// param[in] event Event name, or NULL for an unnamed (message) event
+// param[in] data Event data
+// @return Number of subscribers the event was sent (or queued) to
+//
+
+int hsse_publish(HSSETOPIC *topic, char *event, char *data) ;
+
+
+//
+// @brief Get topic statistics
+// param[in] topic Handle of topic
+// param[out] subscribers Number of subscribers (may be NULL)
+// param[out] dropped Number of events dropped for slow subscribers (may be NULL)
+// param[out] coalesced Number of events replaced by a later event (may be NULL)
+// @return true on success
+//
+
+int hsse_topicstats(HSSETOPIC *topic, int *subscribers, int *dropped, int *coalesced) ;
+
+
+//
+// @brief Free topic (sessions stay open)
+// param[in] topic Handle of topic
+// @return true on success
+//
+
+int hsse_topic_free(HSSETOPIC *topic) ;
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// HTTP/2 (h2c) connections
+//
+// Once enabled, a plain connection switches to HTTP/2 inside hrecv,
+// either when it starts with the HTTP/2 preface (prior knowledge), or
+// when a request asks to upgrade with 'Upgrade: h2c'.  From then on,
+// hrecv only returns 0 (continue) or -1 (closed) for the connection,
+// and each request arrives as a separate stream handle:
+//
+//   if (hh2_isconnection(hh)) {
+//     while ((st = hh2_getstream(hh))) {
+//       code = hrecv(st) ;       // 200, or an error code as for HTTP/1.1
+//       ... hgeturi(st), hgetheader(st, ...), hgetbody(st) ...
+//       hsendb(st, 200, "text/plain", body, bodylen) ;
+//       hclose(st) ;
+//     }
+//   }
+//
+// Streams can be answered in any order, and can be held open while a
+// response is prepared.  Responses are sent as flow control allows, so
+// keep calling hflush on the connection while hpending is non-zero.
+// WebSocket and event-stream sessions are not available on streams.
+//
+
+//
+// @brief Enable HTTP/2 on the plain listener
+// @param[in] enable If true, connections may switch to HTTP/2
+// @return true
+//
+
+int httpd_h2_enable(int enable) ;
+
+
+//
+// @brief Determine if session has switched to HTTP/2
+// param[in] hh Handle of HTTPD session
+// @return true if the session is an HTTP/2 connection
+//
+
+int hh2_isconnection(HTTPD *hh) ;
+
+
+//
+// @brief Get next completed request from an HTTP/2 connection
+// param[in] hh Handle of HTTP/2 connection
+// @return Handle of stream (free with hclose), or NULL if none are waiting
+//
+
+HTTPD *hh2_getstream(HTTPD *hh) ;
+
 #endif
@@ -7,29 +7,125 @@
 // Manage Network session
 //
 // int netinit()
+// NET *netconnect_start(char *hostname, int port, net_flags flags)
+// int netconnect_step(NET *sh)
+// int netconnect_wantwrite(NET *sh)
+// int netsetcafile(char *cafile)
+// int netsetciphers(char *ciphers)
+// int netsessionstats(unsigned long *resumed, unsigned long *full)
 // NET *netopen(char *hostname, int port, net_flags flags)
+// NET *netadopt(int fd, enum netflags flags)
+// NET *netconnectopts(char *hostname, int port, enum netflags flags, NETOPTS *opts)
+// NET *netconnect_startopts(char *hostname, int port, enum netflags flags, NETOPTS *opts)
+// int netgetopts(NET *sh, NETOPTS *opts)
+// int netsetfdopts(int fd, NETOPTS *opts)
+// int netgetfdopts(int fd, NETOPTS *opts)
+// int netfastopen(NET *sh)
+// int netfdfastopen(int fd)
+// int netpeercred(NET *sh, pid_t *pid, uid_t *uid, gid_t *gid)
+// int netfdpeercred(int fd, pid_t *pid, uid_t *uid, gid_t *gid)
 // int netcerterror(NET *sh)
 // char *netcerterrorstr(int certerrno)
 // int netfd(NET *sh)
 // char *netpeerip(NET *sh)
 // int netpeerport(NET *sh)
 // int netlocalport(NET *sh)
+// int netsessionreused(NET *sh)
+// int netktls(NET *sh)
 // int netsend(INET *sh, char *buf, int len)
+// int netsendv(NET *sh, struct iovec *iov, int iovcnt)
+// int netsendfile(NET *sh, int fd, off_t offset, int len)
+// int netflush(NET *sh)
+// int netwritebuffer(NET *sh, int size)
+// int netwritestats(NET *sh, unsigned long *writes, unsigned long *bytes,
+//                   unsigned long *records, unsigned long *syscalls)
+// int netstats(NET *sh, NETSTATS *st)
+// int netfdstats(int fd, NETSTATS *st)
 // int netrecv(INET *sh, char *buf, int maxlen)
+// int netreadline(NET *sh, char **line)
+// int netreadn(NET *sh, int n, char **data)
+// int netreaduntil(NET *sh, char *delim, int delimlen, char **data)
+// int netreadsome(NET *sh, int maxlen, char **data)
+// int netpeek(NET *sh, char **data)
+// int netconsume(NET *sh, int n)
+// int netreadbuffer(NET *sh, int size)
+// int netsplice(NET *a, NET *b)
 // int netclose(NET *sh)
 //
-// link with: -lssl -lcrypto 
+// Errors
+//
+// int neterrno()
+// char *netstrerror()
+// char *netstrerrorcontext()
+// int netlasterrno(NET *sh)
+// char *netlaststrerror(NET *sh)
+// char *netlasterrorcontext(NET *sh)
+//
+// Readiness of many connections
+//
+// NETPOLL *netpoll_create()
+// int netpoll_add(NETPOLL *np, NET *sh, void *arg)
+// int netpoll_del(NETPOLL *np, NET *sh)
+// int netpoll_wait(NETPOLL *np, NETPOLLEVENT *events, int maxevents, int timeoutms)
+// int netpoll_fd(NETPOLL *np)
+// void netpoll_free(NETPOLL *np)
+//
+// Keep-alive connection pool
+//
+// NET *netacquire(char *hostname, int port, enum netflags flags)
+// int netrelease(NET *sh)
+// int netpoolconfig(int maxperhost, int idletimeout)
+// int netpoolstats(unsigned long *hits, unsigned long *misses)
+// void netpoolflush()
+//
+// Host name resolution
+//
+// int netresolve_start(char *hostname, netresolve_callback callback, void *arg)
+// int netresolve_srv_start(char *name, netresolve_srv_callback callback, void *arg)
+// int netresolve_cancel(netresolve_callback callback, void *arg)
+// int netresolve_srv_cancel(netresolve_srv_callback callback, void *arg)
+// int netresolve_fd()
+// int netresolve_process()
+// int netresolve(char *hostname, NETADDR *addrs, int maxaddrs)
+// int netresolve_servers(char *servers)
+// int netresolve_timeout(int timeoutms, int attempts)
+// int netresolve_config(int ttl, int negativettl)
+// int netresolve_stats(unsigned long *hits, unsigned long *misses, unsigned long *coalesced)
+// int netresolve_querystats(unsigned long *queries, unsigned long *retries,
+//                           unsigned long *tcp, unsigned long *latencyms)
+//
+// link with: -lssl -lcrypto -lpthread
+//
+// NOTES
+//
+// Connections may be used on separate threads without locking, as
+// long as each connection (or poller) is only used by one thread at
+// a time.  The last error is kept for each thread (neterrno) and
+// for each connection (netlasterrno).  Shared state (TLS contexts and
+// sessions, the connection pool and the resolver) is locked internally.
+//
+// A host name of the form "unix:/path" connects to a Unix domain
+// socket instead (the port is then ignored), and "unix:@name" to a
+// socket in the abstract namespace.  Such connections avoid the TCP
+// stack altogether, and the peer's credentials can be obtained with
+// netpeercred.
 //
 
 #ifndef _NET_DEFINED
 #define _NET_DEFINED
 
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #ifndef NET
 typedef struct {} NET ;
 #endif
 
+#ifndef NETPOLL
+typedef struct {} NETPOLL ;
+#endif
+
 enum netflags {
   OPEN = 0,           // Default (non-SSL/TLS)
   TLS = 1,            // Enables TLS
@@ -38,9 +134,99 @@ enum netflags {
   NOCERTCHAIN = 8,    // Prevents interrogation of certificate chain for SSL
   DEBUGDATADUMP = 16, // Debug data dumped to stdout if flag set and env variable NETDUMPENABLE
   DEBUGKEYDUMP = 32,  // Enables key dump to file in env variable SSLKEYLOGFILE
-  NONBLOCK = 256      // Handles client connection as non-blocking
+  NONBLOCK = 256,     // Handles client connection as non-blocking
+  COALESCE = 512,     // Buffers small writes until netflush (or buffer fills)
+  KTLS = 1024         // Offloads TLS to the kernel after the handshake, if possible
 } ;
 
+// Kernel TLS offload, reported by netktls
+
+#define NET_KTLS_TX 1
+#define NET_KTLS_RX 2
+
+// Connection states, for connections started with netconnect_start
+
+enum netconnectstate {
+  NET_RESOLVING = 0,  // Waiting for host name to be resolved
+  NET_CONNECTING,     // Waiting for socket to connect
+  NET_HANDSHAKING,    // Waiting for TLS handshake to complete
+  NET_CONNECTED,      // Ready for use
+  NET_FAILED          // Connection failed
+} ;
+
+// Resolved address
+
+#define NET_MAXADDRS 16
+
+typedef struct {
+  int family ;                // AF_INET or AF_INET6
+  unsigned char addr[16] ;    // Address, in network byte order
+} NETADDR ;
+
+// Socket options, applied before connecting (or listening).  Zero
+// leaves the system default, so a zeroed structure changes nothing.
+// For on/off options, a positive value turns the option on and a
+// negative value turns it off.
+
+typedef struct {
+  int nodelay ;        // TCP_NODELAY (on disables Nagle's algorithm)
+  int sndbuf ;         // SO_SNDBUF, bytes (the kernel doubles it)
+  int rcvbuf ;         // SO_RCVBUF, bytes (the kernel doubles it)
+  int keepalive ;      // SO_KEEPALIVE
+  int keepidle ;       // TCP_KEEPIDLE, seconds idle before probing
+  int keepintvl ;      // TCP_KEEPINTVL, seconds between probes
+  int keepcnt ;        // TCP_KEEPCNT, probes before dropping
+  int usertimeout ;    // TCP_USER_TIMEOUT, ms data may stay unacknowledged
+  int quickack ;       // TCP_QUICKACK
+  int tos ;            // IP_TOS (or IPV6_TCLASS)
+  int fastopen ;       // TCP_FASTOPEN_CONNECT (on sends first data in the SYN)
+  int fastopenqlen ;   // TCP_FASTOPEN, queue length on a listener
+} NETOPTS ;
+
+// Transport statistics of a connection.  The counters are kept as
+// data is sent and received, and the TCP values are sampled from
+// TCP_INFO when the statistics are obtained (0 if not available).
+
+typedef struct {
+  unsigned long long bytesout ;     // Bytes sent
+  unsigned long long bytesin ;      // Bytes received
+  unsigned long callsout ;          // Send calls (netsend, netsendv...)
+  unsigned long callsin ;           // Receive calls made on the socket
+  long idlems ;                     // Milliseconds since data was sent or received
+  unsigned int rtt ;                // Smoothed round trip time, microseconds
+  unsigned int rttvar ;             // Round trip time variation, microseconds
+  unsigned int retransmits ;        // Segments retransmitted (in total)
+  unsigned int cwnd ;               // Congestion window, segments
+  unsigned long long deliveryrate ; // Most recent delivery rate, bytes per second
+} NETSTATS ;
+
+//
+// @brief Callback reporting result of host name lookup
+// @param(in) arg Argument given to netresolve_start
+// @param(in) addrs Addresses found (only valid during the callback)
+// @param(in) naddrs Number of addresses, 0 if the name could not be resolved
+//
+
+typedef void (*netresolve_callback)(void *arg, NETADDR *addrs, int naddrs) ;
+
+// Resolved service (SRV record)
+
+typedef struct {
+  char target[256] ;          // Host name providing service
+  int port ;                  // Port number of service
+  int priority ;              // Priority (lowest first)
+  int weight ;                // Relative weight within priority
+} NETSRV ;
+
+//
+// @brief Callback reporting result of service lookup
+// @param(in) arg Argument given to netresolve_srv_start
+// @param(in) srv Services found, in priority order (only valid during the callback)
+// @param(in) nsrv Number of services, 0 if none could be found
+//
+
+typedef void (*netresolve_srv_callback)(void *arg, NETSRV *srv, int nsrv) ;
+
 // errno types
 
 enum net_errno_type {
@@ -62,12 +248,53 @@ enum errorcodes {
 } ;
 
 
+//
+// @brief Initialise network subsystem
+// @return true on success
+//
+// TLS contexts (and the CA certificates they load) are built once
+// and shared between connections.  netinit preloads the default
+// TLS context, so that the first connection does not pay for it.
+//
+
 int netinit() ;
 
 
+//
+// @brief Set CA file used to verify servers on subsequent TLS connections
+// @param(in) cafile PEM file of trusted CAs, or NULL for the system default
+// @return true on success
+//
+
+int netsetcafile(char *cafile) ;
+
+
+//
+// @brief Set cipher policy for subsequent TLS connections
+// @param(in) ciphers OpenSSL cipher list, or NULL for the library default
+// @return true on success
+//
+
+int netsetciphers(char *ciphers) ;
+
+
+//
+// @brief Obtain TLS handshake counts for all connections
+// @param(out) resumed Number of handshakes which resumed a session (or NULL)
+// @param(out) full Number of full handshakes (or NULL)
+// @return Number of sessions currently cached
+//
+// TLS sessions are cached per host:port (up to 256 destinations) and
+// offered on the next connection to the same destination, until the
+// session or ticket lifetime expires.
+//
+
+int netsessionstats(unsigned long *resumed, unsigned long *full) ;
+
+
 //
 // @brief Connect to server
-// @param(in) hostname Name of server to connect to
+// @param(in) hostname Name of server to connect to (or "unix:/path")
 // @param(in) port Port number on server
 // @param(in) flags Type of connection to open (OPEN|SSL2|SSL3|NONBLOCK)
 // @return Handle to SSL structure, or NULL on failure (and sets errno)
@@ -76,6 +303,158 @@ int netinit() ;
 NET *netconnect(char *hostname, int port, enum netflags flags) ;
 
 
+//
+// @brief Create handle for a socket which is already connected (e.g. accepted)
+// @param(in) fd Connected socket, which is then closed by netclose
+// @param(in) flags Type of connection (OPEN|NONBLOCK|COALESCE|DEBUGDATADUMP)
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+
+NET *netadopt(int fd, enum netflags flags) ;
+
+
+//
+// @brief Connect to server, applying socket options
+// @param(in) hostname Name of server to connect to
+// @param(in) port Port number on server
+// @param(in) flags Type of connection to open (OPEN|TLS|NONBLOCK...)
+// @param(in) opts Socket options, applied before connecting, or NULL
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+
+NET *netconnectopts(char *hostname, int port, enum netflags flags, NETOPTS *opts) ;
+
+
+//
+// @brief Start connecting to server, without blocking, applying socket options
+// @param(in) hostname Name of server to connect to
+// @param(in) port Port number on server
+// @param(in) flags Type of connection to open (OPEN|TLS|NONBLOCK...)
+// @param(in) opts Socket options, applied before connecting, or NULL
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+
+NET *netconnect_startopts(char *hostname, int port, enum netflags flags, NETOPTS *opts) ;
+
+
+//
+// @brief Obtain effective socket options of connection
+// @param(in) sh Handle of open connection
+// @param(out) opts Options in effect (see netgetfdopts)
+// @return true on success
+//
+
+int netgetopts(NET *sh, NETOPTS *opts) ;
+
+
+//
+// @brief Apply socket options to a socket
+// @param(in) fd Socket
+// @param(in) opts Options to apply
+// @return true on success, false if an option could not be set (setting errno)
+//
+
+int netsetfdopts(int fd, NETOPTS *opts) ;
+
+
+//
+// @brief Obtain effective socket options of a socket
+// @param(in) fd Socket
+// @param(out) opts Options in effect
+// @return true on success
+//
+// Every field is filled in with the value in effect, as reported by
+// the kernel (including system defaults): on/off options are 1 or -1,
+// and buffer sizes are as doubled by the kernel.
+//
+
+int netgetfdopts(int fd, NETOPTS *opts) ;
+
+
+//
+// @brief Determine whether data was carried in the SYN (TCP Fast Open)
+// @param(in) sh Handle of connection
+// @return 1 if the peer acknowledged data sent (or received) in the SYN,
+//         0 if not (or not yet known), -1 on error
+//
+// With NETOPTS fastopen, the connect completes at once and the SYN is
+// sent with the first data written (the TLS ClientHello, or the first
+// netsend).  The first connection to a server only obtains a cookie,
+// so later connections are the ones which can save the round trip.
+// A refused connection is then reported by the first send or receive.
+//
+
+int netfastopen(NET *sh) ;
+
+
+//
+// @brief Determine whether data was carried in the SYN of a socket
+// @param(in) fd Socket
+// @return 1 if data went in the SYN, 0 if not, -1 on error (setting errno)
+//
+
+int netfdfastopen(int fd) ;
+
+
+//
+// @brief Start connecting to server, without blocking
+// @param(in) hostname Name of server to connect to
+// @param(in) port Port number on server
+// @param(in) flags Type of connection to open (OPEN|TLS|SSL2|SSL3|NONBLOCK)
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+// The connection (and TLS handshake) is completed by calling
+// netconnect_step whenever netfd(sh) becomes writable (if
+// netconnect_wantwrite is true) or readable (if not), until it
+// reports success or failure.  This allows many connections to be
+// established in parallel by a single thread.  A failed handle must
+// still be released with netclose.
+//
+// While the host name is being resolved, netfd returns a descriptor
+// for the lookup, which becomes readable when the resolver has work
+// to do (as netresolve_fd does) or the connection's address is known.
+// Each connection only collects its own result, in netconnect_step,
+// but netfd should still be read again after each step, as it changes
+// once the name is resolved.
+//
+// If the host has several addresses, connects to them are started
+// 250ms apart (or as soon as the previous one fails), alternating
+// between IPv4 and IPv6, and the first to connect is kept.  While
+// these are in progress netfd returns a descriptor which becomes
+// readable when there is something for netconnect_step to do.
+//
+
+NET *netconnect_start(char *hostname, int port, enum netflags flags) ;
+
+
+//
+// @brief Progress connection started with netconnect_start
+// @param(in) sh Handle of connection
+// @return 1 - Connected, 0 - In progress, -1 - Failed (and sets errno)
+//
+
+int netconnect_step(NET *sh) ;
+
+
+//
+// @brief Determine whether connection in progress is waiting to write
+// @param(in) sh Handle of connection
+// @return True if netconnect_step should be called when the socket is writable,
+//         false if it should be called when the socket is readable
+//
+
+int netconnect_wantwrite(NET *sh) ;
+
+
+//
+// @brief Obtain socket of connection
+// @param(in) sh Handle of connection
+// @return File descriptor, or -1 if not connected
+//
+
+int netfd(NET *sh) ;
+
+
 // 
 // @brief Obtain SSL certificate status
 // @param(in) Handle of open connection
@@ -96,7 +475,7 @@ char *netcertstatusstr(int sslcertstatus) ;
 
 // 
 // @brief Obtain network connection errno
-// @return Error number
+// @return Error number of the calling thread's last error
 //
 
 int neterrno() ;
@@ -104,7 +483,7 @@ int neterrno() ;
 
 // 
 // @brief Obtain Network connection error status
-// @return Pointer to static string containing last error message
+// @return Message for the calling thread's last error, valid until its next call
 //
 
 char *netstrerror() ;
@@ -116,6 +495,33 @@ char *netstrerror() ;
 char *netstrerrorcontext() ;
 
 
+//
+// @brief Obtain number of last error on connection
+// @param(in) sh Handle of connection
+// @return Error number (as neterrno), or -1 if there has been none
+//
+
+int netlasterrno(NET *sh) ;
+
+
+//
+// @brief Obtain message for last error on connection
+// @param(in) sh Handle of connection
+// @return Error message, valid until the thread's next call
+//
+
+char *netlaststrerror(NET *sh) ;
+
+
+//
+// @brief Obtain context of last error on connection
+// @param(in) sh Handle of connection
+// @return Name of operation which failed, or "" if there has been no error
+//
+
+char *netlasterrorcontext(NET *sh) ;
+
+
 // 
 // @brief Get network connection state
 // @param(in) Handle of open connection
@@ -169,6 +575,85 @@ int netrdfdisset(NET *sh, fd_set *rfds, fd_set *wrfds) ;
 int netwrfdisset(NET *sh, fd_set *wrfds) ;
 
 
+// Connection reported ready by netpoll_wait
+
+typedef struct {
+  NET *sh ;                   // Connection with data (or an error) to read
+  void *arg ;                 // Argument given to netpoll_add
+} NETPOLLEVENT ;
+
+//
+// @brief Create poller, which reports connections that are ready to read
+// @return Handle of poller, or NULL on failure
+//
+// This replaces netrdfdset/netrdfdisset for large numbers of
+// connections: it is based on epoll, so is not limited by
+// FD_SETSIZE, and TLS connections which already hold decrypted data,
+// or whose netrecv is waiting to write, are handled internally.
+// A connection can belong to one poller at a time, and is removed
+// from it when closed or released to the pool.
+//
+
+NETPOLL *netpoll_create() ;
+
+
+//
+// @brief Add connected handle to poller
+// @param(in) np Handle of poller
+// @param(in) sh Handle of connection
+// @param(in) arg Argument returned with the connection's events
+// @return true on success
+//
+
+int netpoll_add(NETPOLL *np, NET *sh, void *arg) ;
+
+
+//
+// @brief Remove handle from poller
+// @param(in) np Handle of poller
+// @param(in) sh Handle of connection
+// @return true on success, false if handle was not registered
+//
+
+int netpoll_del(NETPOLL *np, NET *sh) ;
+
+
+//
+// @brief Wait for connections to become ready
+// @param(in) np Handle of poller
+// @param(out) events Connections which are ready, for netrecv
+// @param(in) maxevents Size of events array
+// @param(in) timeoutms Time to wait, 0 to return immediately, -1 for ever
+// @return Number of events, or -1 on error
+//
+// Readiness is level triggered: a connection is reported by each
+// call until netrecv has taken the data which is waiting.
+//
+
+int netpoll_wait(NETPOLL *np, NETPOLLEVENT *events, int maxevents, int timeoutms) ;
+
+
+//
+// @brief Obtain file descriptor of poller
+// @param(in) np Handle of poller
+// @return File descriptor, which is readable when a socket has an event
+//
+// Decrypted TLS data held by a connection does not make the file
+// descriptor readable, so netpoll_wait should be called with a zero
+// timeout after each round of netrecv calls before waiting on it.
+//
+
+int netpoll_fd(NETPOLL *np) ;
+
+
+//
+// @brief Free poller, removing the handles registered with it
+// @param(in) np Handle of poller
+//
+
+void netpoll_free(NETPOLL *np) ;
+
+
 //
 // @brief Obtain peer IP address
 // @param(in) sh Handle of open connection
@@ -178,6 +663,34 @@ int netwrfdisset(NET *sh, fd_set *wrfds) ;
 char *netpeerip(NET *sh) ;
 
 
+//
+// @brief Obtain credentials of peer process (Unix domain sockets only)
+// @param(in) sh Handle of open connection
+// @param(out) pid Process id of peer, or NULL
+// @param(out) uid User id of peer, or NULL
+// @param(out) gid Group id of peer, or NULL
+// @return true on success
+//
+// The credentials are those of the peer when it connected (or
+// listened).  For Unix domain connections, netpeerip returns the
+// socket path.
+//
+
+int netpeercred(NET *sh, pid_t *pid, uid_t *uid, gid_t *gid) ;
+
+
+//
+// @brief Obtain credentials of peer process of a Unix domain socket
+// @param(in) fd Socket
+// @param(out) pid Process id of peer, or NULL
+// @param(out) uid User id of peer, or NULL
+// @param(out) gid Group id of peer, or NULL
+// @return true on success, false on failure (setting errno)
+//
+
+int netfdpeercred(int fd, pid_t *pid, uid_t *uid, gid_t *gid) ;
+
+
 
 //
 // @brief Provide summary string of read and write socket fd_set info
@@ -204,6 +717,31 @@ int netpeerport(NET *sh) ;
 int netlocalport(NET *sh) ;
 
 
+//
+// @brief Report whether connection resumed a cached TLS session
+// @param(in) sh Handle of open connection
+// @return true if session was resumed, false if a full handshake was done
+//
+
+int netsessionreused(NET *sh) ;
+
+
+//
+// @brief Report whether TLS has been offloaded to the kernel (KTLS)
+// @param(in) sh Handle of open connection
+// @return NET_KTLS_TX if sending is offloaded, plus NET_KTLS_RX if
+//         receiving is, or 0 if neither (or not TLS)
+//
+// Connections opened with KTLS switch the socket to kernel TLS once
+// the handshake completes, if the kernel's tls module is loaded and
+// supports the negotiated cipher.  Otherwise TLS stays in user space,
+// which behaves the same, just using more CPU.  OpenSSL may offload
+// sending but not receiving (e.g. for TLS 1.3).
+//
+
+int netktls(NET *sh) ;
+
+
 //
 // @brief Send data to network interface
 // @param(in) sh Handle of open connection
@@ -215,6 +753,112 @@ int netlocalport(NET *sh) ;
 int netsend(NET *sh, char *buf, int len) ;
 
 
+//
+// @brief Send data gathered from several buffers
+// @param(in) sh Handle of open connection
+// @param(in) iov Buffers to send, in order
+// @param(in) iovcnt Number of buffers
+// @return Number of bytes sent, or -1 on error
+//
+// Blocking connections send everything before returning.
+// Non-blocking connections send as much as the socket will take,
+// and return 0 (with errno EAGAIN) if it will take nothing.  After a
+// partial send, the next call must start with the first unsent
+// byte, and offer at least as much data (TLS requires a write which
+// could not complete to be retried with the same data).
+//
+// Plaintext connections use a single sendmsg.  For TLS, small
+// buffers are packed into full-sized records rather than being
+// sent as one record each.
+//
+
+int netsendv(NET *sh, struct iovec *iov, int iovcnt) ;
+
+
+//
+// @brief Send data from a file
+// @param(in) sh Handle of open connection
+// @param(in) fd File to send from
+// @param(in) offset Position in file of first byte to send
+// @param(in) len Amount of data to send
+// @return Number of bytes sent, or -1 on error
+//
+// Plaintext connections, and TLS connections whose sending has been
+// offloaded to the kernel (see netktls), use sendfile, so the file is
+// never copied to user space.  Otherwise the file is read and sent a
+// record at a time.  Blocking and non-blocking connections behave as
+// for netsendv.
+//
+
+int netsendfile(NET *sh, int fd, off_t offset, int len) ;
+
+
+//
+// @brief Send data held in the write buffer
+// @param(in) sh Handle of open connection
+// @return Number of bytes still buffered (0 once all sent), or -1 on error
+//
+// Connections opened with COALESCE (or given a buffer with
+// netwritebuffer) collect netsend and netsendv data which fits in
+// the buffer, so that small writes share TLS records and system
+// calls.  The buffer is sent when it fills, by netflush, before
+// netrecv reads (so a request is never left waiting for its
+// response), and by netpoll_wait if the connection is registered
+// with a poller.  Non-blocking connections send what the socket will
+// take, and netpoll_wait sends the rest once it becomes writable.
+//
+
+int netflush(NET *sh) ;
+
+
+//
+// @brief Set size of write buffer
+// @param(in) sh Handle of open connection
+// @param(in) size Buffer size, 0 to disable (after sending buffered data)
+// @return true on success
+//
+
+int netwritebuffer(NET *sh, int size) ;
+
+
+//
+// @brief Obtain write statistics of connection
+// @param(in) sh Handle of open connection
+// @param(out) writes Number of netsend and netsendv calls
+// @param(out) bytes Number of bytes accepted by them
+// @param(out) records Number of TLS records sent (0 for plaintext)
+// @param(out) syscalls Number of system calls made to send data
+// @return true on success
+//
+
+int netwritestats(NET *sh, unsigned long *writes, unsigned long *bytes,
+                  unsigned long *records, unsigned long *syscalls) ;
+
+
+//
+// @brief Obtain transport statistics of connection
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics
+// @return true on success
+//
+// This takes one getsockopt, so it is cheap enough to call for every
+// request, e.g. to tell a slow server (long idle time, low RTT) from
+// a lossy path (retransmits, high RTT variation).
+//
+
+int netstats(NET *sh, NETSTATS *st) ;
+
+
+//
+// @brief Sample TCP_INFO of a socket
+// @param(in) fd Socket
+// @param(out) st Statistics, of which the TCP values are filled in
+// @return true on success, false if the socket has no TCP_INFO (setting errno)
+//
+
+int netfdstats(int fd, NETSTATS *st) ;
+
+
 //
 // @brief Receive data from network interface
 // @param(in) sh Handle of open connection
@@ -226,11 +870,122 @@ int netsend(NET *sh, char *buf, int len) ;
 int netrecv(NET *sh, char *buf, int maxlen) ;
 
 
+//
+// @brief Read line from connection
+// @param(in) sh Handle of open connection
+// @param(out) line Start of line in the receive buffer
+// @return Length of line, including its '\n', 0 if a non-blocking
+//         connection has no complete line yet, or -1 on error or close
+//
+// netreadline, netreadn and netreaduntil read through a receive
+// buffer, which is created for the connection the first time one
+// is used.  They return a pointer into the buffer rather than
+// copying the data, which is consumed by the call.  The pointer
+// remains valid until the next read from the connection.  Data is
+// not nul terminated.  A blocking connection waits for the data,
+// and an item larger than the buffer fails with EMSGSIZE.
+//
+// netrecv takes data from the buffer first, so the functions can be
+// mixed.
+//
+
+int netreadline(NET *sh, char **line) ;
+
+
+//
+// @brief Read exactly n bytes from connection
+// @param(in) sh Handle of open connection
+// @param(in) n Number of bytes to read
+// @param(out) data Start of data in the receive buffer
+// @return n, 0 if a non-blocking connection does not have n bytes yet,
+//         or -1 on error or close
+//
+
+int netreadn(NET *sh, int n, char **data) ;
+
+
+//
+// @brief Read from connection up to and including a delimiter
+// @param(in) sh Handle of open connection
+// @param(in) delim Delimiter (e.g. "\r\n\r\n")
+// @param(in) delimlen Length of delimiter
+// @param(out) data Start of data in the receive buffer
+// @return Length of data, including the delimiter, 0 if a non-blocking
+//         connection does not have the delimiter yet, or -1 on error or close
+//
+
+int netreaduntil(NET *sh, char *delim, int delimlen, char **data) ;
+
+
+//
+// @brief Read whatever data is available from connection, up to a limit
+// @param(in) sh Handle of open connection
+// @param(in) maxlen Maximum number of bytes to read
+// @param(out) data Start of data in the receive buffer
+// @return Number of bytes, 0 if a non-blocking connection has none yet,
+//         or -1 on error or close
+//
+
+int netreadsome(NET *sh, int maxlen, char **data) ;
+
+
+//
+// @brief Look at data in the receive buffer, without reading or consuming it
+// @param(in) sh Handle of open connection
+// @param(out) data Start of buffered data
+// @return Number of bytes buffered
+//
+
+int netpeek(NET *sh, char **data) ;
+
+
+//
+// @brief Consume data from the receive buffer, after netpeek
+// @param(in) sh Handle of open connection
+// @param(in) n Number of bytes to consume
+// @return Number of bytes consumed
+//
+
+int netconsume(NET *sh, int n) ;
+
+
+//
+// @brief Set size of receive buffer (default 16KB)
+// @param(in) sh Handle of open connection
+// @param(in) size Buffer size, which limits the length of a line or item
+// @return true on success, false if size is smaller than data buffered
+//
+
+int netreadbuffer(NET *sh, int size) ;
+
+
+//
+// @brief Relay data between two connections, in both directions, until both have closed
+// @param(in) a Handle of open connection
+// @param(in) b Handle of open connection
+// @return true once both directions have finished, false on error
+//
+// Plaintext is moved with splice through a pipe, without being copied
+// to user space (also when the destination's TLS has been offloaded to
+// the kernel).  Otherwise each direction is relayed through a fixed
+// ring buffer.  Reading from one side stops
+// while the other can't keep up.  When one side finishes sending, the
+// other's sending direction is shut down (half-close), and the relay
+// continues until the other side also finishes.  Data already in the
+// receive or write buffers is relayed first.
+//
+
+int netsplice(NET *a, NET *b) ;
+
+
 //
 // @brief Returns true if pending data
 // @param(in) sh Handle of open connection
 // @return true if connection open and has pending data
 //
+// Once a connection has a receive buffer, data in the buffer (or
+// held by TLS) is reported without a system call.
+//
 
 int nethaspending(NET *sh) ;
 
@@ -243,5 +998,190 @@ int nethaspending(NET *sh) ;
 int netclose(NET *sh) ;
 
 
+//
+// @brief Obtain connection to server, reusing an idle pooled connection if possible
+// @param(in) hostname Name of server to connect to
+// @param(in) port Port number on server
+// @param(in) flags Type of connection to open (OPEN|TLS|SSL2|SSL3|NONBLOCK)
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+// Idle connections are checked before reuse, and any which have been
+// closed by the peer, or have unexpected data waiting, are discarded.
+//
+
+NET *netacquire(char *hostname, int port, enum netflags flags) ;
+
+
+//
+// @brief Return connection to the pool for reuse
+// @param(in) sh Handle of connection obtained with netacquire
+// @return true if the connection was pooled, false if it was closed instead
+//
+// The connection must be at a message boundary (no response data
+// left unread).  Connections not obtained with netacquire are closed.
+//
+
+int netrelease(NET *sh) ;
+
+
+//
+// @brief Configure connection pool
+// @param(in) maxperhost Maximum idle connections kept per destination (default 4, 0 disables pooling)
+// @param(in) idletimeout Seconds an idle connection is kept before being closed (default 60)
+// @return true on success
+//
+
+int netpoolconfig(int maxperhost, int idletimeout) ;
+
+
+//
+// @brief Obtain connection pool statistics
+// @param(out) hits Number of netacquire calls which reused a connection (or NULL)
+// @param(out) misses Number of netacquire calls which opened a connection (or NULL)
+// @return Number of idle connections in the pool
+//
+
+int netpoolstats(unsigned long *hits, unsigned long *misses) ;
+
+
+//
+// @brief Close all idle pooled connections
+//
+
+void netpoolflush() ;
+
+
+//
+// @brief Start resolving host name
+// @param(in) hostname Name to resolve
+// @param(in) callback Function to call with result
+// @param(in) arg Argument passed to callback
+// @return 1 - Result already reported (numeric or cached), 0 - In progress, -1 - Error
+//
+// Names are looked up in /etc/hosts, and then queried (A and AAAA)
+// from the name servers in /etc/resolv.conf.  Results are reported by
+// netresolve_process, which should be called when netresolve_fd
+// becomes readable.  Lookups of a name already being resolved share
+// the query in progress.  Results are cached according to the record
+// TTLs, and failures according to the zone's negative caching time.
+//
+
+int netresolve_start(char *hostname, netresolve_callback callback, void *arg) ;
+
+
+//
+// @brief Start looking up service (SRV) records
+// @param(in) name Service name, e.g. "_imaps._tcp.example.com"
+// @param(in) callback Function to call with result
+// @param(in) arg Argument passed to callback
+// @return 1 - Result already reported (cached), 0 - In progress, -1 - Error
+//
+
+int netresolve_srv_start(char *name, netresolve_srv_callback callback, void *arg) ;
+
+
+//
+// @brief Stop reporting lookup result to callback
+// @param(in) callback Callback registered with netresolve_start
+// @param(in) arg Argument registered with netresolve_start
+// @return true if a pending callback was removed
+//
+
+int netresolve_cancel(netresolve_callback callback, void *arg) ;
+
+
+//
+// @brief Stop reporting service lookup result to callback
+// @param(in) callback Callback registered with netresolve_srv_start
+// @param(in) arg Argument registered with netresolve_srv_start
+// @return true if a pending callback was removed
+//
+
+int netresolve_srv_cancel(netresolve_srv_callback callback, void *arg) ;
+
+
+//
+// @brief Obtain file descriptor which becomes readable when lookups need processing
+// @return File descriptor, or -1 on error
+//
+
+int netresolve_fd() ;
+
+
+//
+// @brief Handle socket events and timeouts, and report completed lookups
+// @return Number of lookups still in progress
+//
+
+int netresolve_process() ;
+
+
+//
+// @brief Resolve host name, waiting for the result
+// @param(in) hostname Name to resolve
+// @param(out) addrs Addresses found
+// @param(in) maxaddrs Size of addrs
+// @return Number of addresses found, 0 if the name could not be resolved, or -1 on error
+//
+
+int netresolve(char *hostname, NETADDR *addrs, int maxaddrs) ;
+
+
+//
+// @brief Set name servers, instead of those in resolv.conf
+// @param(in) servers Comma or space separated list of addresses, each
+//            optionally with a port ("1.2.3.4:5353", "[::1]:53"), or NULL
+//            to use resolv.conf
+// @return true on success
+//
+
+int netresolve_servers(char *servers) ;
+
+
+//
+// @brief Set query timeout and retries (default from resolv.conf, or 5s and 2)
+// @param(in) timeoutms Time to wait for each server to reply, in milliseconds
+// @param(in) attempts Number of times each server is tried
+// @return true on success
+//
+
+int netresolve_timeout(int timeoutms, int attempts) ;
+
+
+//
+// @brief Configure address cache
+// @param(in) ttl Maximum seconds to cache any lookup result (default 3600)
+// @param(in) negativettl Seconds to cache failed lookups whose reply had no
+//            SOA record, or which got no reply (default 10)
+// @return true on success
+//
+
+int netresolve_config(int ttl, int negativettl) ;
+
+
+//
+// @brief Obtain resolver cache statistics
+// @param(out) hits Lookups answered from the cache (or NULL)
+// @param(out) misses Lookups which started a query (or NULL)
+// @param(out) coalesced Lookups which joined a query in progress (or NULL)
+// @return Number of names cached
+//
+
+int netresolve_stats(unsigned long *hits, unsigned long *misses, unsigned long *coalesced) ;
+
+
+//
+// @brief Obtain resolver query statistics
+// @param(out) queries Query messages sent over UDP (or NULL)
+// @param(out) retries Lookups retried after a timeout or server failure (or NULL)
+// @param(out) tcp Queries retried over TCP after truncation (or NULL)
+// @param(out) latencyms Total time taken by completed lookups, in ms (or NULL)
+// @return Number of lookups in progress
+//
+
+int netresolve_querystats(unsigned long *queries, unsigned long *retries,
+                          unsigned long *tcp, unsigned long *latencyms) ;
+
+
 #endif
 
@@ -0,0 +1,622 @@
+//
+// httpc.c
+//
+// HTTP/1.1 client, using keep-alive connections from the network
+// connection pool.
+//
+// HTTPC *httpc_open(char *host, int port, enum netflags flags)
+// int httpc_send(HTTPC *hc, char *method, char *path, char *headers, char *body, int bodylen)
+// int httpc_recv(HTTPC *hc)
+// int httpc_status(HTTPC *hc)
+// char *httpc_header(HTTPC *hc, char *name)
+// char *httpc_body(HTTPC *hc, int *len)
+// int httpc_setbodycallback(HTTPC *hc, httpc_body_callback fn, void *arg)
+// int httpc_pending(HTTPC *hc)
+// int httpc_fd(HTTPC *hc)
+// int httpc_wantwrite(HTTPC *hc)
+// int httpc_close(HTTPC *hc)
+//
+// NOTES
+//
+// Responses are parsed incrementally from the connection's receive
+// buffer (netreaduntil, netreadn and netreadsome), so a non-blocking
+// session can call httpc_recv whenever its socket is readable, and a
+// blocking session waits in httpc_recv for the whole response.
+// Bodies are delimited by Content-Length, chunked transfer coding, or
+// the connection closing.
+//
+
+#define _GNU_SOURCE
+
+#include <sys/uio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#define HTTPC_BUFSIZE 65536        // Receive buffer size for connections
+#define HTTPC_MAXPIPELINE 64       // Maximum requests outstanding
+#define HTTPC_MAXHEAD 256          // Maximum number of response headers
+
+enum httpc_state {
+  HC_IDLE=0,       // Waiting for next response to start
+  HC_HEAD,         // Reading status line and headers
+  HC_BODY,         // Reading Content-Length body
+  HC_CHUNKSIZE,    // Reading chunk size line
+  HC_CHUNKDATA,    // Reading chunk data
+  HC_CHUNKEND,     // Reading CRLF after chunk data
+  HC_TRAILER,      // Reading trailer lines after last chunk
+  HC_UNTILCLOSE,   // Reading body until connection closes
+  HC_FAILED        // Connection unusable
+} ;
+
+typedef struct {
+
+  void *sh ;                   // Connection (NET)
+  int flags ;                  // Flags connection was opened with
+  char *host ;                 // Host header value
+
+  // Requests sent, whose responses are still to come
+
+  int ishead[HTTPC_MAXPIPELINE] ; // True for HEAD requests (no body in response)
+  int first ;                  // Index of oldest outstanding request
+  int outstanding ;            // Number of outstanding requests
+
+  // Request data a non-blocking connection could not take yet
+
+  char *out ;
+  int outlen ;
+  int outmax ;
+
+  // Response being received
+
+  enum httpc_state state ;
+  int status ;
+  int keepalive ;              // False if connection closes after response
+  char *head ;                 // Copy of header block, split into strings
+  char *headname[HTTPC_MAXHEAD] ;
+  char *headvalue[HTTPC_MAXHEAD] ;
+  int nhead ;
+  long remaining ;             // Body (or chunk) bytes still to come
+  char *body ;                 // Body, in place or in bodybuf
+  int bodylen ;
+  char *bodybuf ;              // Body assembled from several pieces
+  int bodymax ;
+
+  int (*callback)(void *arg, char *data, int len) ; // Body callback, or NULL
+  void *callbackarg ;
+
+} IHTTPC ;
+
+#define HTTPC IHTTPC
+#include "../httpc.h"
+
+
+//
+// @brief Open client session to server
+// @param(in) host Name of server
+// @param(in) port Port number on server
+// @param(in) flags Type of connection (OPEN|TLS|NONBLOCK...)
+// @return Handle of session, or NULL on failure
+//
+
+IHTTPC *httpc_open(char *host, int port, enum netflags flags)
+{
+  if (!host) return NULL ;
+
+  IHTTPC *hc = malloc(sizeof(IHTTPC)) ;
+  if (!hc) return NULL ;
+  memset(hc, '\0', sizeof(IHTTPC)) ;
+
+  hc->host = malloc(strlen(host)+16) ;
+  if (!hc->host) goto fail ;
+
+  int defport = (flags&TLS) ? 443 : 80 ;
+  if (port==defport) sprintf(hc->host, "%s", host) ;
+  else sprintf(hc->host, "%s:%d", host, port) ;
+
+  hc->flags = flags ;
+  hc->sh = netacquire(host, port, flags) ;
+  if (!hc->sh) goto fail ;
+
+  netreadbuffer(hc->sh, HTTPC_BUFSIZE) ;
+
+  return hc ;
+
+fail:
+  if (hc->host) free(hc->host) ;
+  free(hc) ;
+  return NULL ;
+}
+
+
+//
+// @brief Keep request data which could not be sent yet
+// @param(in) hc Handle of session
+// @param(in) iov Request data
+// @param(in) iovcnt Number of buffers
+// @param(in) skip Number of bytes already sent
+// @return true on success
+//
+
+static int _httpc_keep(IHTTPC *hc, struct iovec *iov, int iovcnt, int skip)
+{
+  for (int i=0; i<iovcnt; i++) {
+
+    int len = iov[i].iov_len ;
+    char *buf = iov[i].iov_base ;
+    if (skip>=len) {
+      skip -= len ;
+      continue ;
+    }
+    buf += skip ;
+    len -= skip ;
+    skip = 0 ;
+
+    if (hc->outlen+len > hc->outmax) {
+      int max = (hc->outlen+len)*2 ;
+      char *out = realloc(hc->out, max) ;
+      if (!out) return 0 ;
+      hc->out = out ;
+      hc->outmax = max ;
+    }
+    memcpy(&hc->out[hc->outlen], buf, len) ;
+    hc->outlen += len ;
+  }
+
+  return 1 ;
+}
+
+
+//
+// @brief Send request data kept by httpc_send
+// @param(in) hc Handle of session
+// @return Number of bytes still to send, or -1 on error
+//
+
+static int _httpc_flush(IHTTPC *hc)
+{
+  if (!hc->outlen) return 0 ;
+
+  struct iovec iov = { hc->out, hc->outlen } ;
+  int r = netsendv(hc->sh, &iov, 1) ;
+  if (r<0) return -1 ;
+
+  memmove(hc->out, &hc->out[r], hc->outlen-r) ;
+  hc->outlen -= r ;
+  return hc->outlen ;
+}
+
+
+//
+// @brief Send request
+// @param(in) hc Handle of session
+// @param(in) method Request method (e.g. "GET")
+// @param(in) path Request target (e.g. "/index.html?a=1")
+// @param(in) headers Additional header lines, each ending "\r\n", or NULL
+// @param(in) body Request body, or NULL
+// @param(in) bodylen Length of body
+// @return true on success
+//
+
+int httpc_send(IHTTPC *hc, char *method, char *path, char *headers, char *body, int bodylen)
+{
+  if (!hc || !method || !path || hc->state==HC_FAILED) return 0 ;
+  if (hc->outstanding>=HTTPC_MAXPIPELINE) return 0 ;
+  if (!body) bodylen=0 ;
+
+  // Request line and headers are formatted together, and sent with
+  // the body in a single netsendv
+
+  char lengthhead[32] = "" ;
+  if (bodylen>0 || (strcmp(method, "POST")==0 || strcmp(method, "PUT")==0)) {
+    sprintf(lengthhead, "Content-Length: %d\r\n", bodylen) ;
+  }
+
+  if (!headers) headers="" ;
+  int len = strlen(method) + strlen(path) + strlen(hc->host) + strlen(headers) + strlen(lengthhead) + 32 ;
+  char *head = malloc(len) ;
+  if (!head) return 0 ;
+
+  len = sprintf(head, "%s %s HTTP/1.1\r\nHost: %s\r\n%s%s\r\n",
+                method, path, hc->host, lengthhead, headers) ;
+
+  struct iovec iov[2] = { { head, len }, { body, bodylen } } ;
+  int iovcnt = bodylen ? 2 : 1 ;
+  int total = len + bodylen ;
+  int ok = 1 ;
+
+  if (hc->outlen) {
+    ok = _httpc_keep(hc, iov, iovcnt, 0) ;
+  } else {
+    int r = netsendv(hc->sh, iov, iovcnt) ;
+    if (r<0) ok = 0 ;
+    else if (r<total) ok = _httpc_keep(hc, iov, iovcnt, r) ;
+  }
+
+  free(head) ;
+
+  if (!ok) {
+    hc->state = HC_FAILED ;
+    return 0 ;
+  }
+
+  int i = (hc->first + hc->outstanding) % HTTPC_MAXPIPELINE ;
+  hc->ishead[i] = (strcmp(method, "HEAD")==0) ;
+  hc->outstanding++ ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Store part of response body
+// @param(in) hc Handle of session
+// @param(in) data Body data, in the receive buffer
+// @param(in) len Length of data
+// @param(in) last True if this is known to be the rest of the body
+// @return true on success
+//
+
+static int _httpc_bodydata(IHTTPC *hc, char *data, int len, int last)
+{
+  if (hc->callback) return hc->callback(hc->callbackarg, data, len) ;
+
+  // A body which arrives in one piece is left where it is
+
+  if (!hc->body && last) {
+    hc->body = data ;
+    hc->bodylen = len ;
+    return 1 ;
+  }
+
+  if (hc->bodylen+len+1 > hc->bodymax) {
+    int max = (hc->bodylen+len+1)*2 ;
+    char *buf = realloc(hc->bodybuf, max) ;
+    if (!buf) return 0 ;
+    hc->bodybuf = buf ;
+    hc->bodymax = max ;
+  }
+
+  memcpy(&hc->bodybuf[hc->bodylen], data, len) ;
+  hc->bodylen += len ;
+  hc->bodybuf[hc->bodylen] = '\0' ;
+  hc->body = hc->bodybuf ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Parse status line and headers, and decide how the body is delimited
+// @param(in) hc Handle of session
+// @param(in) data Header block, ending with a blank line
+// @param(in) len Length of header block
+// @return true on success
+//
+
+static int _httpc_parsehead(IHTTPC *hc, char *data, int len)
+{
+  free(hc->head) ;
+  hc->head = malloc(len+1) ;
+  if (!hc->head) return 0 ;
+  memcpy(hc->head, data, len) ;
+  hc->head[len] = '\0' ;
+  hc->nhead = 0 ;
+
+  // Status line
+
+  char *line = hc->head ;
+  char *next = strstr(line, "\r\n") ;
+  if (!next || strncmp(line, "HTTP/1.", 7)!=0 || !line[7] || line[8]!=' ') return 0 ;
+  *next = '\0' ;
+  hc->status = atoi(&line[9]) ;
+  if (hc->status<100 || hc->status>999) return 0 ;
+  hc->keepalive = (line[7]!='0') ;
+
+  // Header lines, split into name and value
+
+  for (line=next+2; *line && !(line[0]=='\r' && line[1]=='\n'); line=next+2) {
+
+    next = strstr(line, "\r\n") ;
+    if (!next) return 0 ;
+    *next = '\0' ;
+
+    char *colon = strchr(line, ':') ;
+    if (!colon || hc->nhead>=HTTPC_MAXHEAD) continue ;
+    *colon = '\0' ;
+    char *value = colon+1 ;
+    while (*value==' ' || *value=='\t') value++ ;
+    char *end = value+strlen(value) ;
+    while (end>value && (end[-1]==' ' || end[-1]=='\t')) *(--end) = '\0' ;
+
+    hc->headname[hc->nhead] = line ;
+    hc->headvalue[hc->nhead] = value ;
+    hc->nhead++ ;
+  }
+
+  char *connection = httpc_header(hc, "Connection") ;
+  if (connection) {
+    if (strcasestr(connection, "close")) hc->keepalive = 0 ;
+    else if (strcasestr(connection, "keep-alive")) hc->keepalive = 1 ;
+  }
+
+  // Determine how the body is delimited
+
+  char *te = httpc_header(hc, "Transfer-Encoding") ;
+  char *cl = httpc_header(hc, "Content-Length") ;
+
+  if (hc->ishead[hc->first] || hc->status<200 || hc->status==204 || hc->status==304) {
+    hc->state = HC_IDLE ;
+  } else if (te && strcasestr(te, "chunked")) {
+    hc->state = HC_CHUNKSIZE ;
+  } else if (cl) {
+    char *end ;
+    hc->remaining = strtol(cl, &end, 10) ;
+    if (end==cl || hc->remaining<0) return 0 ;
+    hc->state = hc->remaining ? HC_BODY : HC_IDLE ;
+  } else {
+    hc->keepalive = 0 ;
+    hc->state = HC_UNTILCLOSE ;
+  }
+
+  return 1 ;
+}
+
+
+//
+// @brief Receive response to the oldest request still outstanding
+// @param(in) hc Handle of session
+// @return Status code once the response is complete, 0 if a non-blocking
+//         connection is still waiting for it, or -1 on error
+//
+
+int httpc_recv(IHTTPC *hc)
+{
+  if (!hc || hc->state==HC_FAILED) return -1 ;
+
+  if (_httpc_flush(hc)<0) goto fail ;
+
+  char *data ;
+  int r ;
+
+  for (;;) {
+
+    switch (hc->state) {
+
+    case HC_IDLE:
+
+      if (!hc->outstanding) {
+        errno = EINVAL ;
+        return -1 ;
+      }
+
+      // Start of new response
+
+      hc->status = 0 ;
+      hc->nhead = 0 ;
+      hc->body = NULL ;
+      hc->bodylen = 0 ;
+      hc->state = HC_HEAD ;
+      break ;
+
+    case HC_HEAD:
+
+      r = netreaduntil(hc->sh, "\r\n\r\n", 4, &data) ;
+      if (r<=0) goto wait ;
+      if (!_httpc_parsehead(hc, data, r)) goto fail ;
+
+      // Interim responses (100 Continue) are followed by the real one
+
+      if (hc->status<200 && hc->status!=101) {
+        hc->state = HC_HEAD ;
+        break ;
+      }
+
+      if (hc->state==HC_IDLE) goto complete ;
+      break ;
+
+    case HC_BODY:
+
+      r = netreadsome(hc->sh, hc->remaining>HTTPC_BUFSIZE ? HTTPC_BUFSIZE : hc->remaining, &data) ;
+      if (r<=0) goto wait ;
+      hc->remaining -= r ;
+      if (!_httpc_bodydata(hc, data, r, hc->remaining==0)) goto fail ;
+      if (hc->remaining==0) goto complete ;
+      break ;
+
+    case HC_CHUNKSIZE:
+
+      r = netreaduntil(hc->sh, "\r\n", 2, &data) ;
+      if (r<=0) goto wait ;
+      {
+        char *end ;
+        hc->remaining = strtol(data, &end, 16) ;
+        if (end==data || hc->remaining<0) goto fail ;
+      }
+      hc->state = hc->remaining ? HC_CHUNKDATA : HC_TRAILER ;
+      break ;
+
+    case HC_CHUNKDATA:
+
+      r = netreadsome(hc->sh, hc->remaining>HTTPC_BUFSIZE ? HTTPC_BUFSIZE : hc->remaining, &data) ;
+      if (r<=0) goto wait ;
+      hc->remaining -= r ;
+      if (!_httpc_bodydata(hc, data, r, 0)) goto fail ;
+      if (hc->remaining==0) hc->state = HC_CHUNKEND ;
+      break ;
+
+    case HC_CHUNKEND:
+
+      r = netreadn(hc->sh, 2, &data) ;
+      if (r<=0) goto wait ;
+      if (data[0]!='\r' || data[1]!='\n') goto fail ;
+      hc->state = HC_CHUNKSIZE ;
+      break ;
+
+    case HC_TRAILER:
+
+      r = netreaduntil(hc->sh, "\r\n", 2, &data) ;
+      if (r<=0) goto wait ;
+      if (r==2) goto complete ;
+      break ;
+
+    case HC_UNTILCLOSE:
+
+      r = netreadsome(hc->sh, HTTPC_BUFSIZE, &data) ;
+      if (r<0) goto complete ;
+      if (r==0) return 0 ;
+      if (!_httpc_bodydata(hc, data, r, 0)) goto fail ;
+      break ;
+
+    default:
+
+      return -1 ;
+
+    }
+  }
+
+wait:
+  if (r==0) return 0 ;
+
+fail:
+  hc->state = HC_FAILED ;
+  return -1 ;
+
+complete:
+  hc->first = (hc->first+1) % HTTPC_MAXPIPELINE ;
+  hc->outstanding-- ;
+  hc->state = hc->keepalive ? HC_IDLE : HC_FAILED ;
+  return hc->status ;
+}
+
+
+//
+// @brief Obtain status code of response
+// @param(in) hc Handle of session
+// @return Status code, or 0 if no response has been received
+//
+
+int httpc_status(IHTTPC *hc)
+{
+  if (!hc) return 0 ;
+  else return hc->status ;
+}
+
+
+//
+// @brief Obtain response header
+// @param(in) hc Handle of session
+// @param(in) name Name of header (any case)
+// @return Value of header, or NULL if not present
+//
+
+char *httpc_header(IHTTPC *hc, char *name)
+{
+  if (!hc || !name) return NULL ;
+
+  for (int i=0; i<hc->nhead; i++) {
+    if (strcasecmp(hc->headname[i], name)==0) return hc->headvalue[i] ;
+  }
+
+  return NULL ;
+}
+
+
+//
+// @brief Obtain response body
+// @param(in) hc Handle of session
+// @param(out) len Length of body
+// @return Body, or NULL if the response had none (or was passed to a callback)
+//
+
+char *httpc_body(IHTTPC *hc, int *len)
+{
+  if (len) *len = hc ? hc->bodylen : 0 ;
+  if (!hc) return NULL ;
+  else return hc->body ;
+}
+
+
+//
+// @brief Pass response bodies to a callback as they arrive, instead of keeping them
+// @param(in) hc Handle of session
+// @param(in) fn Callback, or NULL to keep bodies for httpc_body
+// @param(in) arg Argument passed to callback
+// @return true on success
+//
+
+int httpc_setbodycallback(IHTTPC *hc, httpc_body_callback fn, void *arg)
+{
+  if (!hc) return 0 ;
+
+  hc->callback = fn ;
+  hc->callbackarg = arg ;
+  return 1 ;
+}
+
+
+//
+// @brief Obtain number of requests sent whose responses have not been received
+// @param(in) hc Handle of session
+// @return Number of outstanding requests
+//
+
+int httpc_pending(IHTTPC *hc)
+{
+  if (!hc) return 0 ;
+  else return hc->outstanding ;
+}
+
+
+//
+// @brief Obtain file descriptor of session, for select/poll
+// @param(in) hc Handle of session
+// @return File descriptor
+//
+
+int httpc_fd(IHTTPC *hc)
+{
+  if (!hc) return -1 ;
+  else return netfd(hc->sh) ;
+}
+
+
+//
+// @brief Determine whether session is waiting to write a request
+// @param(in) hc Handle of session
+// @return True if httpc_recv should be called when httpc_fd is writable
+//
+
+int httpc_wantwrite(IHTTPC *hc)
+{
+  if (!hc) return 0 ;
+  else return (hc->outlen>0) ;
+}
+
+
+//
+// @brief Close session, returning the connection to the pool if it is reusable
+// @param(in) hc Handle of session
+// @return true on success
+//
+
+int httpc_close(IHTTPC *hc)
+{
+  if (!hc) return 0 ;
+
+  // The connection can only be reused if no response is part way
+  // through, or still to come
+
+  if (hc->state==HC_IDLE && !hc->outstanding && !hc->outlen) netrelease(hc->sh) ;
+  else netclose(hc->sh) ;
+
+  free(hc->host) ;
+  free(hc->out) ;
+  free(hc->head) ;
+  free(hc->bodybuf) ;
+  free(hc) ;
+
+  return 1 ;
+}
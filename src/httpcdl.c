@@ -0,0 +1,525 @@
+//
+// httpcdl.c
+//
+// Parallel download of a large resource, using concurrent Range
+// requests over several HTTP client sessions.
+//
+// int httpc_download(char *host, int port, enum netflags flags, char *path,
+//                    char *filename, int connections, HTTPCDLSTATS *stats)
+//
+// NOTES
+//
+// The first range request finds the size of the resource (from its
+// Content-Range), and the file is then preallocated and the rest of
+// the resource split between the connections.  Each part is written
+// to its place in the file with pwrite as it arrives.
+//
+// Range sizes adapt to each connection's measured throughput, aiming
+// for each request to take about HTTPC_DLTARGETMS, and towards the
+// end of the download the remainder is shared between connections
+// in proportion to their throughput, so that they finish together.
+// A range which fails (or stalls) is retried from where it stopped,
+// on a new connection.  If the server ignores Range, the resource
+// is downloaded over a single connection.
+//
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "../httpc.h"
+
+#define HTTPC_DLMAXCONN 64              // Maximum connections
+#define HTTPC_DLFIRST (256*1024)        // Size of first range
+#define HTTPC_DLMINCHUNK (256*1024)     // Smallest range (except the last)
+#define HTTPC_DLMAXCHUNK (64*1024*1024) // Largest range
+#define HTTPC_DLTARGETMS 1000           // Time each range request should take
+#define HTTPC_DLRETRIES 3               // Attempts at a range without progress before giving up
+#define HTTPC_DLTIMEOUTMS 30000         // Time without progress before a range is retried
+
+typedef struct {
+  long long start ;            // First byte of range
+  long long end ;              // Byte after range
+  int attempts ;               // Attempts made at range without progress
+} HTTPC_DLRANGE ;
+
+typedef struct {
+  HTTPC *hc ;                  // Session, or NULL until opened
+  void *dl ;                   // Download (HTTPC_DL)
+  int active ;                 // True while a range is being fetched
+  int checked ;                // True once the response has been checked
+  HTTPC_DLRANGE range ;        // Range being fetched
+  long long pos ;              // Offset of next byte expected
+  double started ;             // Time range was requested
+  double progress ;            // Time data last arrived (or range was requested)
+  double rate ;                // Measured throughput (bytes/s), 0 until known
+} HTTPC_DLCONN ;
+
+typedef struct {
+  char *host ;
+  int port ;
+  enum netflags flags ;
+  char *path ;
+  int fd ;                     // Output file
+  long long total ;            // Size of resource, -1 until known
+  long long next ;             // First byte not yet assigned to a range
+  int full ;                   // True if server ignored Range
+  int failed ;                 // True if download has failed
+  HTTPC_DLRANGE *retry ;       // Ranges to fetch again
+  int nretry ;
+  int maxretry ;
+  HTTPC_DLCONN conn[HTTPC_DLMAXCONN] ;
+  int nconn ;
+  HTTPCDLSTATS stats ;
+} HTTPC_DL ;
+
+
+//
+// @brief Obtain current time
+// @return Time in seconds
+//
+
+static double _httpc_dl_now()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return ts.tv_sec + ts.tv_nsec/1e9 ;
+}
+
+
+//
+// @brief Set size of resource, once known, and preallocate file
+// @param(in) dl Download
+// @param(in) total Size of resource
+// @return true on success
+//
+
+static int _httpc_dl_settotal(HTTPC_DL *dl, long long total)
+{
+  dl->total = total ;
+  if (total<=0) return 1 ;
+
+  if (posix_fallocate(dl->fd, 0, total)!=0 && ftruncate(dl->fd, total)!=0) return 0 ;
+  return 1 ;
+}
+
+
+//
+// @brief Check response to range request, when its body starts to arrive
+// @param(in) c Connection
+// @return true if the body is the range requested
+//
+
+static int _httpc_dl_check(HTTPC_DLCONN *c)
+{
+  HTTPC_DL *dl = c->dl ;
+  int status = httpc_status(c->hc) ;
+
+  if (status==206) {
+
+    char *cr = httpc_header(c->hc, "Content-Range") ;
+    long long first, last, total ;
+    if (!cr || sscanf(cr, "bytes %lld-%lld/%lld", &first, &last, &total)!=3) return 0 ;
+    if (first!=c->range.start || last<first) return 0 ;
+
+    if (dl->total<0) {
+      if (!_httpc_dl_settotal(dl, total)) return 0 ;
+      if (c->range.end > total) c->range.end = total ;
+      dl->next = c->range.end ;
+    }
+
+    if (last+1 != c->range.end) return 0 ;
+
+  } else if (status==200 && dl->total<0 && c->range.start==0) {
+
+    // Range not supported, so the whole resource comes on this connection
+
+    char *cl = httpc_header(c->hc, "Content-Length") ;
+    dl->full = 1 ;
+    if (cl) {
+      if (!_httpc_dl_settotal(dl, atoll(cl))) return 0 ;
+      c->range.end = dl->total ;
+    } else {
+      c->range.end = -1 ;
+    }
+    dl->next = c->range.end ;
+
+  } else {
+
+    return 0 ;
+
+  }
+
+  c->checked = 1 ;
+  return 1 ;
+}
+
+
+//
+// @brief Write body data to its place in the file (httpc body callback)
+// @param(in) arg Connection
+// @param(in) data Body data
+// @param(in) len Length of data
+// @return true to continue, false to abandon the response
+//
+
+static int _httpc_dl_data(void *arg, char *data, int len)
+{
+  HTTPC_DLCONN *c = arg ;
+  HTTPC_DL *dl = c->dl ;
+
+  if (!c->checked && !_httpc_dl_check(c)) return 0 ;
+  if (c->range.end>=0 && c->pos+len > c->range.end) return 0 ;
+
+  while (len>0) {
+    ssize_t r = pwrite(dl->fd, data, len, c->pos) ;
+    if (r<0 && errno==EINTR) continue ;
+    if (r<=0) {
+      dl->failed = 1 ;
+      return 0 ;
+    }
+    data += r ;
+    len -= r ;
+    c->pos += r ;
+    dl->stats.bytes += r ;
+  }
+
+  return 1 ;
+}
+
+
+//
+// @brief Decide size of next range for connection
+// @param(in) dl Download
+// @param(in) c Connection
+// @return Size of range
+//
+
+static long long _httpc_dl_chunk(HTTPC_DL *dl, HTTPC_DLCONN *c)
+{
+  // Aim for the request to take HTTPC_DLTARGETMS at the rate measured
+  // for the connection (or the average rate, for a new connection)
+
+  double rate = c->rate ;
+  double sum=0 ;
+  int nrate=0 ;
+  for (int i=0; i<dl->nconn; i++) {
+    if (dl->conn[i].rate>0) {
+      sum += dl->conn[i].rate ;
+      nrate++ ;
+    }
+  }
+  if (rate<=0 && nrate) rate = sum/nrate ;
+
+  long long chunk = rate>0 ? (long long)(rate * HTTPC_DLTARGETMS / 1000) : HTTPC_DLMINCHUNK*4 ;
+  if (chunk < HTTPC_DLMINCHUNK) chunk = HTTPC_DLMINCHUNK ;
+  if (chunk > HTTPC_DLMAXCHUNK) chunk = HTTPC_DLMAXCHUNK ;
+
+  // Towards the end, give the connection its share of what is left,
+  // in proportion to its throughput, so all connections finish together
+
+  long long left = dl->total - dl->next ;
+  if (rate<=0 || sum<=0) {
+    sum = dl->nconn ;
+    rate = 1 ;
+  } else if (nrate<dl->nconn) {
+    sum += (dl->nconn-nrate) * (sum/nrate) ;
+  }
+
+  long long share = (long long)(left * rate / sum) ;
+  if (share < HTTPC_DLMINCHUNK) share = HTTPC_DLMINCHUNK ;
+  if (chunk > share) chunk = share ;
+
+  return chunk ;
+}
+
+
+//
+// @brief Start fetching the next range on an idle connection
+// @param(in) dl Download
+// @param(in) c Connection
+// @return true if a range was started, false if there is none to fetch now
+//
+
+static int _httpc_dl_assign(HTTPC_DL *dl, HTTPC_DLCONN *c)
+{
+  HTTPC_DLRANGE range ;
+
+  if (dl->nretry) {
+
+    range = dl->retry[--dl->nretry] ;
+
+  } else if (dl->total<0) {
+
+    // Size not known yet, so only one connection asks for the first range
+
+    for (int i=0; i<dl->nconn; i++) {
+      if (dl->conn[i].active) return 0 ;
+    }
+    if (dl->next>0) return 0 ;
+    range.start = 0 ;
+    range.end = HTTPC_DLFIRST ;
+    range.attempts = 0 ;
+
+  } else if (dl->next < dl->total && !dl->full) {
+
+    range.start = dl->next ;
+    range.end = dl->next + _httpc_dl_chunk(dl, c) ;
+    if (range.end > dl->total) range.end = dl->total ;
+    range.attempts = 0 ;
+    dl->next = range.end ;
+
+  } else {
+
+    return 0 ;
+
+  }
+
+  c->range = range ;
+  c->range.attempts++ ;
+  c->pos = range.start ;
+  c->checked = 0 ;
+  c->active = 1 ;
+  c->started = _httpc_dl_now() ;
+  c->progress = c->started ;
+
+  if (!c->hc) {
+    c->hc = httpc_open(dl->host, dl->port, dl->flags|NONBLOCK) ;
+    if (!c->hc) return 0 ;
+    dl->stats.connections++ ;
+    httpc_setbodycallback(c->hc, _httpc_dl_data, c) ;
+  }
+
+  char rangehead[64] ;
+  sprintf(rangehead, "Range: bytes=%lld-%lld\r\n", range.start, range.end-1) ;
+  if (!httpc_send(c->hc, "GET", dl->path, rangehead, NULL, 0)) return 0 ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Abandon range on connection, and queue what is left of it to be retried
+// @param(in) dl Download
+// @param(in) c Connection
+//
+
+static void _httpc_dl_fail(HTTPC_DL *dl, HTTPC_DLCONN *c)
+{
+  c->active = 0 ;
+  if (c->hc) httpc_close(c->hc) ;
+  c->hc = NULL ;
+
+  // Only attempts which made no progress count towards the limit.
+  // Without Range support, a download can't be resumed part way
+
+  int attempts = c->pos > c->range.start ? 0 : c->range.attempts ;
+  if (dl->full || attempts >= HTTPC_DLRETRIES) {
+    dl->failed = 1 ;
+    return ;
+  }
+
+  if (dl->nretry == dl->maxretry) {
+    int max = dl->maxretry*2 + 4 ;
+    HTTPC_DLRANGE *retry = realloc(dl->retry, max*sizeof(HTTPC_DLRANGE)) ;
+    if (!retry) {
+      dl->failed = 1 ;
+      return ;
+    }
+    dl->retry = retry ;
+    dl->maxretry = max ;
+  }
+
+  HTTPC_DLRANGE *r = &dl->retry[dl->nretry++] ;
+  r->start = c->pos ;
+  r->end = c->range.end ;
+  r->attempts = attempts ;
+
+  // The first range may have ended early, if the resource is smaller
+
+  if (dl->total<0) r->end = r->start + HTTPC_DLFIRST ;
+
+  dl->stats.retries++ ;
+}
+
+
+//
+// @brief Handle completed response to range request
+// @param(in) dl Download
+// @param(in) c Connection
+// @param(in) status Status code of response
+//
+
+static void _httpc_dl_complete(HTTPC_DL *dl, HTTPC_DLCONN *c, int status)
+{
+  if (!c->checked) {
+
+    // No body: an empty resource, or an error
+
+    char *cr = httpc_header(c->hc, "Content-Range") ;
+    long long total ;
+    if (dl->total<0 && status==416 && cr && sscanf(cr, "bytes */%lld", &total)==1 && total==0) {
+      _httpc_dl_settotal(dl, 0) ;
+    } else if (dl->total<0 && status==200) {
+      dl->full = 1 ;
+      _httpc_dl_settotal(dl, 0) ;
+    } else if (status!=206 || c->pos!=c->range.end) {
+      _httpc_dl_fail(dl, c) ;
+      return ;
+    }
+
+  } else if (c->range.end<0) {
+
+    // Whole resource, delimited by the connection closing
+
+    _httpc_dl_settotal(dl, c->pos) ;
+
+  } else if (c->pos != c->range.end) {
+
+    _httpc_dl_fail(dl, c) ;
+    return ;
+
+  }
+
+  // Measure throughput of the connection, smoothing out variation
+
+  double elapsed = _httpc_dl_now() - c->started ;
+  long long bytes = c->pos - c->range.start ;
+  if (elapsed>0 && bytes>=HTTPC_DLMINCHUNK) {
+    double rate = bytes / elapsed ;
+    c->rate = c->rate>0 ? (c->rate*0.5 + rate*0.5) : rate ;
+  }
+
+  c->active = 0 ;
+  dl->stats.ranges++ ;
+}
+
+
+//
+// @brief Download resource to file, using several connections in parallel
+// @param(in) host Name of server
+// @param(in) port Port number on server
+// @param(in) flags Type of connection (OPEN|TLS...)
+// @param(in) path Path of resource on server
+// @param(in) filename File to write, which is created or replaced
+// @param(in) connections Number of connections to use
+// @param(out) stats Statistics of download, or NULL
+// @return true on success
+//
+
+int httpc_download(char *host, int port, enum netflags flags, char *path,
+                   char *filename, int connections, HTTPCDLSTATS *stats)
+{
+  if (!host || !path || !filename) return 0 ;
+
+  HTTPC_DL *dl = malloc(sizeof(HTTPC_DL)) ;
+  if (!dl) return 0 ;
+  memset(dl, '\0', sizeof(HTTPC_DL)) ;
+
+  dl->host = host ;
+  dl->port = port ;
+  dl->flags = flags & ~NONBLOCK ;
+  dl->path = path ;
+  dl->total = -1 ;
+  dl->nconn = connections<1 ? 1 : connections>HTTPC_DLMAXCONN ? HTTPC_DLMAXCONN : connections ;
+  for (int i=0; i<dl->nconn; i++) dl->conn[i].dl = dl ;
+
+  double started = _httpc_dl_now() ;
+
+  dl->fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644) ;
+  if (dl->fd<0) {
+    free(dl) ;
+    return 0 ;
+  }
+
+  struct pollfd pfd[HTTPC_DLMAXCONN] ;
+  HTTPC_DLCONN *pconn[HTTPC_DLMAXCONN] ;
+
+  while (!dl->failed) {
+
+    // Give idle connections more work
+
+    int n=0 ;
+    double stall = 0 ;
+    for (int i=0; i<dl->nconn; i++) {
+      HTTPC_DLCONN *c = &dl->conn[i] ;
+      if (!c->active && !_httpc_dl_assign(dl, c) && c->active) _httpc_dl_fail(dl, c) ;
+      if (c->active) {
+        pfd[n].fd = httpc_fd(c->hc) ;
+        pfd[n].events = httpc_wantwrite(c->hc) ? POLLOUT : POLLIN ;
+        pfd[n].revents = 0 ;
+        pconn[n++] = c ;
+        if (n==1 || c->progress < stall) stall = c->progress ;
+      }
+    }
+
+    if (dl->failed) break ;
+    if (!n) break ;
+
+    // Wait no longer than until the connection which has gone longest
+    // without progress stalls
+
+    double now = _httpc_dl_now() ;
+    int timeout = (int)((stall + HTTPC_DLTIMEOUTMS/1000.0 - now)*1000) + 1 ;
+    if (timeout<0) timeout=0 ;
+
+    int r = poll(pfd, n, timeout) ;
+    if (r<0 && errno==EINTR) continue ;
+    if (r<0) {
+      dl->failed = 1 ;
+      break ;
+    }
+
+    now = _httpc_dl_now() ;
+
+    for (int i=0; i<n; i++) {
+
+      HTTPC_DLCONN *c = pconn[i] ;
+
+      // Retry ranges which have stalled, while the others carry on
+
+      if (!pfd[i].revents) {
+        if (now - c->progress >= HTTPC_DLTIMEOUTMS/1000.0) _httpc_dl_fail(dl, c) ;
+        continue ;
+      }
+
+      c->progress = now ;
+      int status = httpc_recv(c->hc) ;
+      if (status>0) _httpc_dl_complete(dl, c, status) ;
+      else if (status<0) _httpc_dl_fail(dl, c) ;
+    }
+  }
+
+  // Finished if every byte has arrived
+
+  int ok = !dl->failed && dl->total>=0 && !dl->nretry ;
+  if (ok) {
+    for (int i=0; i<dl->nconn; i++) {
+      if (dl->conn[i].active) ok=0 ;
+    }
+  }
+  if (ok && !dl->full && dl->next<dl->total) ok=0 ;
+
+  for (int i=0; i<dl->nconn; i++) {
+    if (dl->conn[i].hc) httpc_close(dl->conn[i].hc) ;
+  }
+
+  if (close(dl->fd)!=0) ok=0 ;
+
+  dl->stats.ms = (long)((_httpc_dl_now() - started)*1000) ;
+  if (stats) *stats = dl->stats ;
+
+  free(dl->retry) ;
+  free(dl) ;
+
+  return ok ;
+}
@@ -10,6 +10,7 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
@@ -18,31 +19,16 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <ifaddrs.h>
 
 #include "../log.h"
 #include "../mem.h"
 #include "../str.h"
 
-
-enum estate { URI, HEAD, BODY, COMPLETE, CLOSED, ERROR } ;
-
-typedef struct { 
-  int fd ;
-  enum estate state ;
-  int hasbody ;
-  int bodylen ;
-  int uricount ;
-  mem *uri ;
-  mem *body ;
-  mem *transient ;
-  mem *peeripaddress ;
-  int peerport ;
-  time_t connect_time ;
-} IHTTPD ;
-
-#define HTTPD IHTTPD
-#include "../httpd.h"
+#include "ihttpd.h"
 
 
 
@@ -51,14 +37,39 @@ typedef struct {
 int _httpd_listenport ;
 int _httpd_listenfd ;
 
+// Socket options for listeners (all zero if none)
+
+NETOPTS _httpd_listenopts ;
+
+// Timers
+
+#define HTTPD_MAXTIMERS 32
+
+struct httpd_timer {
+  int id ;
+  int intervalms ;
+  int repeat ;
+  long long due ;
+  void (*fn)(void *arg) ;
+  void *arg ;
+} ;
+
+struct httpd_timer _httpd_timers[HTTPD_MAXTIMERS] ;
+int _httpd_timerid=0 ;
+
 // Local functions
 
 int _httpd_openlistenfd() ;
 int _httpd_closelistenfd() ;
+int _httpd_recvchar(IHTTPD *hh) ;
+int _httpd_setpeer(IHTTPD *hh, struct sockaddr_in *cli_addr) ;
+int _httpd_getpeer(IHTTPD *hh) ;
 
 // Local constants
 
 #define HTTPD_CONCURRENT_CONNECTIONS 16
+#define HTTPD_MAXOUTQUEUE (4*1024*1024)
+#define HTTPD_CLOSEFLUSHMS 5000      // Longest hclose waits to send queued output
 
 ///////////////////////////////////////////////////////////////////////
 //
@@ -75,6 +86,22 @@ int httpd_init(int port)
 }
 
 
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Initialises httpd server, applying socket options to its listeners
+// @param[in] port Port number to listen on
+// @param[in] opts Socket options, or NULL
+// @return true on success
+//
+
+int httpd_initopts(int port, NETOPTS *opts)
+{
+  if (opts) _httpd_listenopts = *opts ;
+  else memset(&_httpd_listenopts, 0, sizeof(_httpd_listenopts)) ;
+  return httpd_init(port) ;
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 //
 // @brief Returns httpd server listen handle
@@ -145,11 +172,130 @@ int httpd_port()
 
 int httpd_shutdown() 
 {
+  _httpd_tls_closelistenfd() ;
+  _httpd_unix_closelistenfd() ;
   return _httpd_closelistenfd() ;
 }
 
 
 
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Add timer
+// param[in] intervalms Time in milliseconds until the timer fires
+// param[in] repeat If true, timer fires every intervalms until cancelled
+// param[in] fn Function to call when the timer fires
+// param[in] arg Argument passed to fn
+// @return Timer id, or 0 if no more timers are available
+//
+
+int httpd_timer_add(int intervalms, int repeat, void (*fn)(void *arg), void *arg)
+{
+  if (!fn || intervalms<0) return 0 ;
+
+  for (int i=0; i<HTTPD_MAXTIMERS; i++) {
+    if (_httpd_timers[i].id==0) {
+      if (++_httpd_timerid<=0) _httpd_timerid=1 ;
+      _httpd_timers[i].id = _httpd_timerid ;
+      _httpd_timers[i].intervalms = intervalms ;
+      _httpd_timers[i].repeat = repeat ;
+      _httpd_timers[i].due = _httpd_now() + intervalms ;
+      _httpd_timers[i].fn = fn ;
+      _httpd_timers[i].arg = arg ;
+      return _httpd_timerid ;
+    }
+  }
+
+  logmsg(LOG_ERR, "httpd_timer_add: no timers available") ;
+  return 0 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Cancel timer
+// param[in] id Timer id returned from httpd_timer_add
+// @return true if the timer was found and cancelled
+//
+
+int httpd_timer_cancel(int id)
+{
+  if (id<=0) return 0 ;
+  for (int i=0; i<HTTPD_MAXTIMERS; i++) {
+    if (_httpd_timers[i].id==id) {
+      _httpd_timers[i].id=0 ;
+      return 1 ;
+    }
+  }
+  return 0 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Get time until the next timer is due
+// @return Milliseconds until the next timer fires (0 if overdue),
+//         or -1 if no timers are active
+//
+
+int httpd_timer_next()
+{
+  long long now = _httpd_now() ;
+  long long next = -1 ;
+
+  for (int i=0; i<HTTPD_MAXTIMERS; i++) {
+    if (_httpd_timers[i].id!=0) {
+      long long ms = _httpd_timers[i].due - now ;
+      if (ms<0) ms=0 ;
+      if (next<0 || ms<next) next=ms ;
+    }
+  }
+
+  return (int)next ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Run timers which are due
+// @return Number of timers run
+//
+
+int httpd_timer_run()
+{
+  long long now = _httpd_now() ;
+  int count=0 ;
+
+  for (int i=0; i<HTTPD_MAXTIMERS; i++) {
+
+    struct httpd_timer *t = &_httpd_timers[i] ;
+
+    if (t->id!=0 && t->due<=now) {
+
+      void (*fn)(void *) = t->fn ;
+      void *arg = t->arg ;
+
+      // Re-arm (or release) before the call, so the function
+      // can safely add or cancel timers itself
+
+      if (t->repeat && t->intervalms>0) {
+        t->due += t->intervalms ;
+        if (t->due<=now) t->due = now + t->intervalms ;
+      } else {
+        t->id = 0 ;
+      }
+
+      fn(arg) ;
+      count++ ;
+
+    }
+
+  }
+
+  return count ;
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 //
 // @brief Start HTTPD session
@@ -176,22 +322,52 @@ IHTTPD *haccept(int listenfd)
   }
   fcntl(sessionfd, F_SETFL, flags | O_NONBLOCK);
 
+  hh = _httpd_newsession(sessionfd, &cli_addr) ;
+  if (!hh) {
+    goto error ;
+  }
+
+  // Attach TLS if accepted from the HTTPS listener
 
-  hh = (HTTPD *)mem_malloc(sizeof(HTTPD)) ;
+  if (!_httpd_tls_accept(hh, listenfd)) {
+    goto error ;
+  }
+
+  return hh ;
+
+error:
+  logmsg(LOG_CRIT, "Unable to accept connection - %s", strerror(errno)) ;
+  if (sessionfd>=0) close(sessionfd) ;
+  if (hh) {
+    hh->fd=-1 ;
+    hclose(hh) ;
+  }
+  return NULL ;
+
+
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Create HTTPD session for an accepted connection
+// param[in] sessionfd File descriptor of accepted connection
+// param[in] cli_addr Peer address, or NULL to look it up when required
+// return Handle of HTTPD session, or NULL on failure
+//
+
+IHTTPD *_httpd_newsession(int sessionfd, struct sockaddr_in *cli_addr)
+{
+  IHTTPD *hh = (HTTPD *)mem_malloc(sizeof(HTTPD)) ;
   if (!hh) {
     goto error ;
   }
 
   // Store connection details
 
-  char *ip = inet_ntoa(cli_addr.sin_addr);
-  hh->peerport = ntohs(cli_addr.sin_port) ;
-  hh->peeripaddress = mem_malloc(strlen(ip)+1) ;
-  if (!hh->peeripaddress) {
+  if (cli_addr && !_httpd_setpeer(hh, cli_addr)) {
     goto error ;
   }
-  strcpy(hh->peeripaddress, ip) ;
-
 
   hh->transient = mem_malloc(BUFLEN) ;
   if (!hh->transient) {
@@ -201,22 +377,30 @@ IHTTPD *haccept(int listenfd)
   hh->fd = sessionfd ;
   hh->state = URI ;
   hh->connect_time = time(NULL) ;
+  hh->lastactive = _httpd_now() ;
+
+  // TCP_QUICKACK is not inherited from the listener
+
+  if (_httpd_listenopts.quickack) {
+    NETOPTS opts ;
+    memset(&opts, 0, sizeof(opts)) ;
+    opts.quickack = _httpd_listenopts.quickack ;
+    netsetfdopts(sessionfd, &opts) ;
+  }
 
   return hh ;
 
 error:
-  logmsg(LOG_CRIT, "Unable to accept connection - %s", strerror(errno)) ;
-  if (sessionfd>=0) close(sessionfd) ;
   if (hh && hh->peeripaddress) mem_free((mem *)hh->peeripaddress) ;
   if (hh && hh->transient) mem_free((mem *)hh->transient) ;
   if (hh) mem_free((mem *)hh) ;
   return NULL ;
-
-
 }
 
+
 int hconnectiontime(IHTTPD *hh)
 {
+  if (hh && hh->mode==H2STREAM) hh=hh->h2parent ;
   if (!hh || hh->fd<0) return -1 ;
   return ((int)time(NULL)-hh->connect_time) ;
 }
@@ -231,14 +415,19 @@ int hconnectiontime(IHTTPD *hh)
 
 char *hpeeripaddress(IHTTPD *hh) 
 {
+  if (hh && hh->mode==H2STREAM) hh=hh->h2parent ;
   if (!hh) return "" ;
+  if (!hh->peeripaddress) _httpd_getpeer(hh) ;
+  if (!hh->peeripaddress) return "" ;
   else return hh->peeripaddress ;
 }
 
 int hpeerport(IHTTPD *hh) 
 {
+  if (hh && hh->mode==H2STREAM) hh=hh->h2parent ;
   if (!hh) return 0 ;
-  else hh->peerport ;
+  if (!hh->peeripaddress) _httpd_getpeer(hh) ;
+  return hh->peerport ;
 }
 
 
@@ -252,11 +441,54 @@ int hpeerport(IHTTPD *hh)
 
 int hfd(IHTTPD *hh)
 {
+  if (hh && hh->mode==H2STREAM) hh=hh->h2parent ;
   if (hh==NULL) return -1 ;
   else return (hh->fd) ;
 }
 
 
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Determine if the request arrived in the SYN (TCP Fast Open)
+// param[in] hh Handle of HTTPD session
+// return 1 if data was received in the SYN, 0 if not, -1 on error
+//
+
+int hfastopen(IHTTPD *hh)
+{
+  if (hh && hh->mode==H2STREAM) hh=hh->h2parent ;
+  if (!hh || hh->fd<0) return -1 ;
+  return netfdfastopen(hh->fd) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Get transport statistics of session's connection
+// param[in] hh Handle of HTTPD session
+// param[out] st Statistics (see NETSTATS in net.h)
+// return true on success
+//
+
+int hstats(IHTTPD *hh, NETSTATS *st)
+{
+  if (hh && hh->mode==H2STREAM) hh=hh->h2parent ;
+  if (!hh || hh->fd<0 || !st) return 0 ;
+
+  memset(st, 0, sizeof(NETSTATS)) ;
+
+  st->bytesout = hh->statbytesout ;
+  st->bytesin = hh->statbytesin ;
+  st->callsout = hh->statcallsout ;
+  st->callsin = hh->statcallsin ;
+  st->idlems = (long)(_httpd_now() - hh->lastactive) ;
+
+  netfdstats(hh->fd, st) ;
+
+  return 1 ;
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 //
 // @brief Receive data
@@ -268,9 +500,53 @@ int hfd(IHTTPD *hh)
 int hrecv(IHTTPD *hh)
 {
   if (hh==NULL || hh->state==CLOSED) return -1 ;
-  
+
+  // HTTP/2 requests are complete when the stream is handed out
+
+  if (hh->mode==H2STREAM) return hh->h2code ;
+
+  // TLS sessions complete their handshake before any request data
+
+  if (hh->ssl && !hh->sslready) {
+    if (_httpd_tls_handshake(hh)<0) {
+      hh->state=ERROR ;
+      return -1 ; // -1:Terminated
+    }
+    return 0 ; // 0:Continue
+  }
+
+  // SSL_read buffers whole records, so the socket won't necessarily
+  // become readable again while decrypted data is still waiting
+
+  if (hh->mode==H2) return _hh2_recv(hh) ;
+
+  int r ;
+  do {
+    r = _httpd_recvchar(hh) ;
+  } while (r==0 && hh->mode==HTTP && hh->ssl && SSL_pending(hh->ssl)>0) ;
+
+  // The prior knowledge preface may already be followed by frames
+
+  if (r==0 && hh->mode==H2) return _hh2_recv(hh) ;
+
+  // A completed request may ask to upgrade to HTTP/2
+
+  if (r==200) r = _hh2_upgrade(hh) ;
+
+  return r ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Receive and process a single character of the request
+// param[in] hh Handle of HTTPD session
+// @return As hrecv
+
+int _httpd_recvchar(IHTTPD *hh)
+{
   char ch[2] ; ch[1]='\0' ;
-  switch (recv(hh->fd, ch, 1, 0)) {
+  switch (_httpd_read(hh, ch, 1)) {
 
   case 0:  // connection closed
 
@@ -278,8 +554,9 @@ int hrecv(IHTTPD *hh)
     return -1 ; // -1:Terminated
     break ;
 
-  case -1: // connection terminated
+  case -1: // connection terminated, or nothing available yet
 
+    if (errno==EAGAIN || errno==EWOULDBLOCK) return 0 ; // 0:Continue
     hh->state=ERROR ;
     return -1 ; // -1:Terminated
     break ;
@@ -310,6 +587,12 @@ int hrecv(IHTTPD *hh)
 
         if (*ch=='\n') {
 
+          // HTTP/2 with prior knowledge starts with a fixed preface
+
+          if (strcmp(hh->transient, "PRI * HTTP/2.0\n")==0 && _hh2_start(hh)) {
+            return 0 ; // 0:Continue
+          }
+
           int urioffset = str_offseti(hh->transient, " ") ;
           if (urioffset<0) {
             hh->state=ERROR ;
@@ -325,30 +608,8 @@ int hrecv(IHTTPD *hh)
 
           hh->hasbody = (tolower(*(hh->transient))=='p') ;
 
-          str_replaceall(hh->transient, "\r", "") ;
-          str_replaceall(hh->transient, "?", "\n") ;
-          str_replaceall(hh->transient, "&", "\n") ;
-
-          str_decode(hh->transient) ;
-
           str_insert(hh->transient, 0, urioffset+1, "") ;
-          hh->uri = mem_malloc(strlen(hh->transient)+1) ;
-          if (!hh->uri) return 500 ; // 500:InternalServerError
-
-          if (!str_strcpy(hh->uri, hh->transient)) {
-            logmsg(LOG_CRIT, "strcpy failed for some reason") ;
-          }
-
-          // Replace all \n with \0 and count number of params
-          // which is number of \n + 1
-          hh->uricount=1 ;
-          int len=strlen(hh->uri) ;
-          for (int i=0; i<len; i++) {
-            if (hh->uri[i]=='\n') {
-              hh->uri[i]='\0' ;
-              hh->uricount++ ;
-            }
-          }
+          if (!_httpd_seturi(hh, hh->transient)) return 500 ; // 500:InternalServerError
 
           hh->state=HEAD ;
           *(hh->transient) = '\0' ;
@@ -361,6 +622,11 @@ int hrecv(IHTTPD *hh)
 
         if (str_offset(hh->transient, "\n\n")>0) {
 
+          if (!_httpd_storehead(hh, hh->transient)) {
+            hh->state=ERROR ;
+            return 500 ; // 500:InternalServerError
+          }
+
           if (hh->hasbody) {
 
             int lo = str_offseti(hh->transient, "Content-Length:") ;
@@ -538,6 +804,41 @@ char *hgetbody(IHTTPD *hh)
 }
 
 
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Returns request header
+// param[in] hh Handle of HTTPD session
+// param[in] name Case insensitive header name to search for
+// @return Transient pointer to header value, or NULL if not found
+//
+
+char *hgetheader(IHTTPD *hh, char *name)
+{
+  if (!hh || !hh->head || !name || hh->state==ERROR) return NULL ;
+
+  int p=0 ;
+  int lenname=strlen(name) ;
+
+  for (int index=0; index<hh->headcount; index++) {
+
+    if ( strncasecmp( &(hh->head[p]), name, lenname ) == 0 &&
+         hh->head[p+lenname]==':' ) {
+
+      p+=lenname+1 ;
+      while (hh->head[p]==' ' || hh->head[p]=='\t') p++ ;
+      return &(hh->head[p]) ;
+
+    }
+
+    while (hh->head[p]!='\0') p++ ;
+    p++ ;
+
+  }
+
+  return NULL ;
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 //
 // @brief Send response message
@@ -565,6 +866,7 @@ int hsend(IHTTPD *hh, int code, char *contenttype, char *body)
 int hsendb(IHTTPD *hh, int code, char *contenttype, char *body, int bodylen) 
 {
 
+  if ( hh && hh->mode==H2STREAM ) return _hh2_send(hh, code, contenttype, body, bodylen) ;
   if ( !hh || hh->fd < 0 ) return 0 ;
 
   int success=0 ;
@@ -600,8 +902,8 @@ int hsendb(IHTTPD *hh, int code, char *contenttype, char *body, int bodylen)
 
   headlen = strlen(head) ;
 
-  success = ( write(hh->fd, head, headlen)==headlen &&
-              write(hh->fd, body, bodylen)==bodylen ) ;
+  success = ( _httpd_write(hh, head, headlen) &&
+              _httpd_write(hh, body, bodylen) ) ;
 
 fail:
 
@@ -614,17 +916,108 @@ fail:
 
 ///////////////////////////////////////////////////////////////////////
 //
-// @brief Shutdown httpd server
+// @brief Send queued output data
+// param[in] hh Handle of HTTPD session
+// @return Number of bytes still queued, or -1 on error
+//
+
+int hflush(IHTTPD *hh)
+{
+  if (hh && hh->mode==H2STREAM) hh=hh->h2parent ;
+  if (!hh || hh->fd<0) return -1 ;
+
+  // Handshake may be waiting for the socket to become writable
+
+  if (hh->ssl && !hh->sslready) {
+    if (_httpd_tls_handshake(hh)<0) {
+      hh->state=ERROR ;
+      return -1 ;
+    }
+    return hpending(hh) ;
+  }
+
+  if (hh->outlen==0) return 0 ;
+
+  int r = _httpd_rawwrite(hh, hh->out, hh->outlen) ;
+
+  if (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+    return hh->outlen ;
+  } else if (r<0) {
+    hh->state=ERROR ;
+    return -1 ;
+  }
+
+  memmove(hh->out, &(hh->out[r]), hh->outlen-r) ;
+  hh->outlen-=r ;
+
+  // Event-stream sessions may have events held back, waiting for space
+
+  if (hh->outlen==0 && hh->mode==SSE) _hsse_drained(hh) ;
+
+  // HTTP/2 responses may be waiting for space in the output queue
+
+  if (hh->mode==H2) _hh2_drained(hh) ;
+
+  return hh->outlen ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Get amount of output data waiting to be sent
+// param[in] hh Handle of HTTPD session
+// @return Number of bytes queued (add hfd to the write fd_set if non-zero)
+//
+
+int hpending(IHTTPD *hh)
+{
+  if (hh && hh->mode==H2STREAM) hh=hh->h2parent ;
+  if (!hh) return 0 ;
+  if (hh->ssl && !hh->sslready && hh->sslwantwrite) return 1 ;
+  return hh->outlen ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Close HTTPD session, first sending output still queued
+// @param[in] hh Handle of HTTPD session
 // @return true on success
 //
 
 int hclose(IHTTPD *hh)
 {
 
-  if (!hh || !mem_free(hh->transient)) return 0 ;
+  if (hh && hh->mode==H2STREAM) return _hh2_close(hh) ;
+  if (!hh || !mem_length(hh->transient)) return 0 ;
+  if (hh->mode==SSE) _hsse_release(hh) ;
+  if (hh->mode==H2) _hh2_close(hh) ;
+
+  // Send output still queued (such as the rest of a response which the
+  // non-blocking socket would not take), waiting a limited time for the
+  // client.  Sessions run by httpd_loop are only closed once sent.
+
+  if (hh->fd>=0 && !hh->in && hh->state!=ERROR) {
+    long long deadline = _httpd_now() + HTTPD_CLOSEFLUSHMS ;
+    while (hflush(hh)>0) {
+      long long left = deadline - _httpd_now() ;
+      int wantread = hh->ssl && !hh->sslready && !hh->sslwantwrite ;
+      struct pollfd pfd = { hh->fd, wantread ? POLLIN : POLLOUT, 0 } ;
+      if (left<=0 || poll(&pfd, 1, (int)left)<=0) break ;
+    }
+  }
+
+  mem_free(hh->transient) ;
   mem_free(hh->peeripaddress) ;
   mem_free(hh->uri) ;
   mem_free(hh->body) ;
+  mem_free(hh->head) ;
+  mem_free(hh->out) ;
+  mem_free(hh->wsrx) ;
+  mem_free(hh->wsmsg) ;
+  mem_free(hh->in) ;
+  mem_free(hh->loopout) ;
+  _httpd_tls_close(hh) ;
   close(hh->fd) ;
   return mem_free((mem *)hh) ;
 
@@ -647,53 +1040,149 @@ int hclose(IHTTPD *hh)
 
 int _httpd_openlistenfd()
 {
-  struct sockaddr_in srv;
-
   _httpd_closelistenfd() ;
+  _httpd_listenfd = _httpd_listen(_httpd_listenport) ;
+  return _httpd_listenfd ; 
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Create non-blocking listener socket
+// @param[in] port Port number to listen on
+// return File descriptor for listener, or -1 on failure
+//
+
+int _httpd_listen(int port)
+{
+  struct sockaddr_in srv;
+  int listenfd ;
 
   // Create socket
 
-  if ( (_httpd_listenfd = socket(AF_INET , SOCK_STREAM , 0)) < 0 ){
+  if ( (listenfd = socket(AF_INET , SOCK_STREAM , 0)) < 0 ){
     perror("_httpd_openlistenfd: error creating socket");
-    _httpd_listenfd=-1 ;
     return -1 ;
   }
   int flag_on = 1;
-  setsockopt(_httpd_listenfd, SOL_SOCKET, SO_REUSEADDR, &flag_on, sizeof(flag_on));
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &flag_on, sizeof(flag_on));
+
+  // Apply options before listening, so accepted sessions inherit them
+  // (buffer sizes in particular must be set before the handshake)
+
+  if (!netsetfdopts(listenfd, &_httpd_listenopts)) {
+    perror("_httpd_openlistenfd: error setting socket options");
+    close(listenfd);
+    return -1 ;
+  }
 
   // Server (input) settings
 
   memset(&srv, 0, sizeof(srv));
   srv.sin_family = AF_INET;
-  srv.sin_port = htons(_httpd_listenport);
+  srv.sin_port = htons(port);
   srv.sin_addr.s_addr = htons(INADDR_ANY) ;
 
   // Bind server to port
 
-  if( bind(_httpd_listenfd, (struct sockaddr*) &srv, sizeof(srv)) < 0 ) {
+  if( bind(listenfd, (struct sockaddr*) &srv, sizeof(srv)) < 0 ) {
 
     perror("_httpd_openlistenfd: error binding to socket");
-    close(_httpd_listenfd);
-    _httpd_listenfd=-1 ;
+    close(listenfd);
     return -1 ;
 
   }
 
   // Set non-blocking
 
-  int flags = fcntl(_httpd_listenfd,F_GETFL,0);
+  int flags = fcntl(listenfd,F_GETFL,0);
   assert(flags != -1);
-  fcntl(_httpd_listenfd, F_SETFL, flags | O_NONBLOCK);
+  fcntl(listenfd, F_SETFL, flags | O_NONBLOCK);
 
-  listen(_httpd_listenfd, HTTPD_CONCURRENT_CONNECTIONS) ;
+  listen(listenfd, HTTPD_CONCURRENT_CONNECTIONS) ;
 
   // And return handle
 
-  return _httpd_listenfd ; 
+  return listenfd ; 
 }
 
 
 
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Create non-blocking Unix domain socket listener
+// @param[in] path Path of socket, or "@name" in the abstract namespace
+// return File descriptor for listener, or -1 on failure
+//
+
+int _httpd_unixlisten(char *path)
+{
+  struct sockaddr_un srv ;
+  int listenfd ;
+
+  size_t len = strlen(path) ;
+  if (len==0 || len>=sizeof(srv.sun_path)) {
+    errno = len ? ENAMETOOLONG : EINVAL ;
+    perror("_httpd_unixlisten: invalid socket path") ;
+    return -1 ;
+  }
+
+  memset(&srv, 0, sizeof(srv)) ;
+  srv.sun_family = AF_UNIX ;
+  memcpy(srv.sun_path, path, len) ;
+
+  // Abstract names aren't nul terminated, so the length must be exact
+
+  socklen_t srvlen = offsetof(struct sockaddr_un, sun_path) + len + 1 ;
+  if (path[0]=='@') {
+    srv.sun_path[0] = '\0' ;
+    srvlen-- ;
+  }
+
+  if ( (listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ) {
+    perror("_httpd_unixlisten: error creating socket") ;
+    return -1 ;
+  }
+
+  // Only the buffer sizes apply to Unix domain sockets
+
+  if (!netsetfdopts(listenfd, &_httpd_listenopts)) {
+    perror("_httpd_unixlisten: error setting socket options") ;
+    close(listenfd) ;
+    return -1 ;
+  }
+
+  // Remove a socket left behind by an earlier server (but nothing else).
+  // A server still listening accepts (or queues) a connection, so is
+  // left alone
+
+  struct stat st ;
+  if (path[0]!='@' && lstat(path, &st)==0 && S_ISSOCK(st.st_mode)) {
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0) ;
+    if (fd>=0) {
+      if (connect(fd, (struct sockaddr *)&srv, srvlen)<0 && errno==ECONNREFUSED) unlink(path) ;
+      close(fd) ;
+    }
+  }
+
+  if (bind(listenfd, (struct sockaddr *)&srv, srvlen) < 0) {
+    perror("_httpd_unixlisten: error binding to socket") ;
+    close(listenfd) ;
+    return -1 ;
+  }
+
+  // Set non-blocking
+
+  int flags = fcntl(listenfd,F_GETFL,0);
+  assert(flags != -1);
+  fcntl(listenfd, F_SETFL, flags | O_NONBLOCK);
+
+  listen(listenfd, HTTPD_CONCURRENT_CONNECTIONS) ;
+
+  return listenfd ;
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 //
 // @brief Close listener network connection
@@ -708,3 +1197,280 @@ int _httpd_closelistenfd()
 }
 
 
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Write data to session, queueing anything the socket won't take
+// @param[in] hh Handle of HTTPD session
+// @param[in] buf Data to write
+// @param[in] len Length of data
+// @return true on success (data written or queued), false on error
+//
+
+int _httpd_write(IHTTPD *hh, char *buf, int len)
+{
+  if (!hh || hh->fd<0 || len<0) return 0 ;
+  if (len==0) return 1 ;
+
+  int r=0 ;
+
+  // Only write directly if nothing is already waiting, so
+  // that the output stays in order
+
+  // Sessions run by httpd_loop always queue, and the loop sends
+
+  if (hh->outlen==0 && !hh->in && (!hh->ssl || hh->sslready)) {
+    r = _httpd_rawwrite(hh, buf, len) ;
+    if (r<0 && errno!=EAGAIN && errno!=EWOULDBLOCK) {
+      hh->state=ERROR ;
+      return 0 ;
+    }
+    if (r<0) r=0 ;
+    if (r==len) return 1 ;
+  }
+
+  // Queue the remainder
+
+  int need = hh->outlen + (len-r) ;
+  if (need > HTTPD_MAXOUTQUEUE) {
+    logmsg(LOG_WARNING, "httpd output queue overflow for %s", hpeeripaddress(hh)) ;
+    hh->state=ERROR ;
+    return 0 ;
+  }
+
+  if (mem_length(hh->out) < need) {
+    mem *out = mem_realloc(hh->out, need) ;
+    if (!out) {
+      hh->state=ERROR ;
+      return 0 ;
+    }
+    hh->out = out ;
+  }
+
+  memcpy(&(hh->out[hh->outlen]), &buf[r], len-r) ;
+  hh->outlen = need ;
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Read from session socket (via TLS if enabled)
+// @param[in] hh Handle of HTTPD session
+// @param[out] buf Buffer for data
+// @param[in] len Maximum amount of data to read
+// @return As recv: bytes read, 0 if closed, or -1 (errno EAGAIN if no data)
+//
+
+int _httpd_read(IHTTPD *hh, char *buf, int len)
+{
+  // Sessions run by httpd_loop are fed from their input buffer
+
+  if (hh->in) {
+    int avail = hh->inlen - hh->inpos ;
+    if (avail<=0) {
+      errno=EAGAIN ;
+      return -1 ;
+    }
+    if (len>avail) len=avail ;
+    memcpy(buf, &(hh->in[hh->inpos]), len) ;
+    hh->inpos+=len ;
+    return len ;
+  }
+
+  if (!hh->ssl) {
+    int r = recv(hh->fd, buf, len, 0) ;
+    _httpd_count(hh, 1, r) ;
+    return r ;
+  }
+
+  int r = SSL_read(hh->ssl, buf, len) ;
+  _httpd_count(hh, 1, r) ;
+  if (r>0) return r ;
+
+  switch (SSL_get_error(hh->ssl, r)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno=EAGAIN ;
+    return -1 ;
+  case SSL_ERROR_ZERO_RETURN:
+    return 0 ;
+  default:
+    if (errno==0 || errno==EAGAIN) errno=EIO ;
+    return -1 ;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Write to session socket (via TLS if enabled), without queueing
+// @param[in] hh Handle of HTTPD session
+// @param[in] buf Data to write
+// @param[in] len Length of data
+// @return As write: bytes written, or -1 (errno EAGAIN if socket is full)
+//
+
+int _httpd_rawwrite(IHTTPD *hh, char *buf, int len)
+{
+  if (!hh->ssl) {
+    int r = write(hh->fd, buf, len) ;
+    _httpd_count(hh, 0, r) ;
+    return r ;
+  }
+
+  int r = SSL_write(hh->ssl, buf, len) ;
+  _httpd_count(hh, 0, r) ;
+  if (r>0) return r ;
+
+  switch (SSL_get_error(hh->ssl, r)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno=EAGAIN ;
+    return -1 ;
+  default:
+    if (errno==0 || errno==EAGAIN) errno=EIO ;
+    return -1 ;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Count send or receive call made on session socket
+// @param[in] hh Handle of HTTPD session
+// @param[in] in True for a receive, false for a send
+// @param[in] n Result of call (bytes transferred if positive)
+//
+
+void _httpd_count(IHTTPD *hh, int in, long n)
+{
+  if (in) hh->statcallsin++ ;
+  else hh->statcallsout++ ;
+
+  if (n<=0) return ;
+
+  if (in) hh->statbytesin += n ;
+  else hh->statbytesout += n ;
+  hh->lastactive = _httpd_now() ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Store peer address details in session
+// @param[in] hh Handle of HTTPD session
+// @param[in] cli_addr Peer address
+// @return true on success
+//
+
+int _httpd_setpeer(IHTTPD *hh, struct sockaddr_in *cli_addr)
+{
+  // Unix domain sessions have no address (see hpeercred)
+
+  int isunix = (cli_addr->sin_family==AF_UNIX) ;
+  char *ip = isunix ? "" : inet_ntoa(cli_addr->sin_addr);
+  hh->peerport = isunix ? 0 : ntohs(cli_addr->sin_port) ;
+  hh->peeripaddress = mem_malloc(strlen(ip)+1) ;
+  if (!hh->peeripaddress) return 0 ;
+  strcpy(hh->peeripaddress, ip) ;
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Look up peer address for sessions accepted without one
+// @param[in] hh Handle of HTTPD session
+// @return true on success
+//
+
+int _httpd_getpeer(IHTTPD *hh)
+{
+  struct sockaddr_in cli_addr ;
+  socklen_t clilen = sizeof(cli_addr) ;
+  if (hh->fd<0 || getpeername(hh->fd, (struct sockaddr *)&cli_addr, &clilen)<0) return 0 ;
+  return _httpd_setpeer(hh, &cli_addr) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Store decoded request URI and split out its parameters
+// @param[in] hh Handle of HTTPD session
+// @param[inout] uri Working copy of URI (without method), which is modified
+// @return true on success
+//
+
+int _httpd_seturi(IHTTPD *hh, mem *uri)
+{
+  str_replaceall(uri, "\r", "") ;
+  str_replaceall(uri, "?", "\n") ;
+  str_replaceall(uri, "&", "\n") ;
+
+  str_decode(uri) ;
+
+  hh->uri = mem_malloc(strlen(uri)+1) ;
+  if (!hh->uri) return 0 ;
+
+  if (!str_strcpy(hh->uri, uri)) {
+    logmsg(LOG_CRIT, "strcpy failed for some reason") ;
+  }
+
+  // Replace all \n with \0 and count number of params
+  // which is number of \n + 1
+  hh->uricount=1 ;
+  int len=strlen(hh->uri) ;
+  for (int i=0; i<len; i++) {
+    if (hh->uri[i]=='\n') {
+      hh->uri[i]='\0' ;
+      hh->uricount++ ;
+    }
+  }
+
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Keep a copy of the request headers, one per line
+// @param[in] hh Handle of HTTPD session
+// @param[in] text Header lines, each terminated with '\n'
+// @return true on success
+//
+
+int _httpd_storehead(IHTTPD *hh, char *text)
+{
+  hh->head = mem_malloc(strlen(text)+1) ;
+  if (!hh->head) return 0 ;
+
+  str_strcpy(hh->head, text) ;
+
+  // Replace all \n with \0 and count number of lines
+
+  hh->headcount=0 ;
+  int len=strlen(hh->head) ;
+  for (int i=0; i<len; i++) {
+    if (hh->head[i]=='\n') {
+      hh->head[i]='\0' ;
+      hh->headcount++ ;
+    }
+  }
+
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Get monotonic time
+// @return Current time in milliseconds
+//
+
+long long _httpd_now()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000 ;
+}
@@ -0,0 +1,1907 @@
+//
+// httpdh2.c
+//
+// HTTP/2 over cleartext TCP (h2c) for httpd sessions
+//
+//   int httpd_h2_enable(int enable) ;
+//   int hh2_isconnection(HTTPD *hh) ;
+//   HTTPD *hh2_getstream(HTTPD *hh) ;
+//
+// NOTES
+//
+// A connection becomes HTTP/2 either by starting with the prior
+// knowledge preface, or by asking to upgrade (Upgrade: h2c) in an
+// ordinary HTTP/1.1 request.  Both are detected inside hrecv, which
+// from then on reads and processes HTTP/2 frames.
+//
+// Each request stream is presented as a separate HTTPD session, with
+// mode H2STREAM, linked to the connection through h2parent / h2next.
+// Streams are handed to the application by hh2_getstream once the
+// request is complete, and hgeturi / hgetheader / hgetbody / hsendb /
+// hclose then work on them just as they do for HTTP/1.1 sessions.
+//
+// Response data is sent as flow control allows, one frame per stream
+// in turn, and only while the connection's output queue is below
+// HH2_HIGHWATER.  hflush tops the queue up again as it drains.  A
+// stream closed by the application is kept until its response has
+// been sent.  Streams still held by the application when the
+// connection closes are detached from it, and stay valid until the
+// application calls hclose.
+//
+// Header compression (RFC 7541) uses the static table and a dynamic
+// table in each direction, with Huffman coding used for any string
+// which it makes shorter.  The Huffman code is canonical, so the
+// codes are rebuilt from the table of code lengths on first use.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <openssl/evp.h>
+
+#include "../log.h"
+#include "../mem.h"
+#include "../str.h"
+
+#include "ihttpd.h"
+
+
+// Local constants
+
+#define HH2_FRAMEMAX 16384           // Largest frame accepted (SETTINGS_MAX_FRAME_SIZE)
+#define HH2_RXBUF (4*(HH2_FRAMEMAX+9))
+#define HH2_WINDOW (1024*1024)       // Receive window for connection and each stream
+#define HH2_DEFAULTWINDOW 65535
+#define HH2_MAXSTREAMS 100
+#define HH2_MAXBODY (4*1024*1024)
+#define HH2_MAXHEADERBLOCK (4*HH2_FRAMEMAX)  // Largest header block, across CONTINUATION frames
+#define HH2_HIGHWATER (64*1024)
+#define HH2_TABLESIZE 4096
+#define HH2_MAXWINDOW 0x7fffffffLL
+
+// Frame types
+
+#define HH2_DATA 0x0
+#define HH2_HEADERS 0x1
+#define HH2_PRIORITY 0x2
+#define HH2_RST_STREAM 0x3
+#define HH2_SETTINGS 0x4
+#define HH2_PUSH_PROMISE 0x5
+#define HH2_PING 0x6
+#define HH2_GOAWAY 0x7
+#define HH2_WINDOW_UPDATE 0x8
+#define HH2_CONTINUATION 0x9
+
+// Frame flags
+
+#define HH2_END_STREAM 0x1
+#define HH2_ACK 0x1
+#define HH2_END_HEADERS 0x4
+#define HH2_PADDED 0x8
+#define HH2_PRIORITY_FLAG 0x20
+
+// Error codes
+
+#define HH2_NO_ERROR 0x0
+#define HH2_PROTOCOL_ERROR 0x1
+#define HH2_INTERNAL_ERROR 0x2
+#define HH2_FLOW_CONTROL_ERROR 0x3
+#define HH2_STREAM_CLOSED 0x5
+#define HH2_FRAME_SIZE_ERROR 0x6
+#define HH2_REFUSED_STREAM 0x7
+#define HH2_COMPRESSION_ERROR 0x9
+#define HH2_ENHANCE_YOUR_CALM 0xb
+
+// Stream flags
+
+#define HH2S_REMOTECLOSED 0x01  // END_STREAM received from client
+#define HH2S_READY 0x02         // Request complete
+#define HH2S_RETURNED 0x04      // Handed to application by hh2_getstream
+#define HH2S_RESPONDED 0x08     // Response headers sent
+#define HH2S_SENT 0x10          // Response completely sent
+#define HH2S_APPCLOSED 0x20     // Closed by application
+#define HH2S_RESET 0x40         // Reset by either end
+
+// HPACK header table
+
+struct hh2_table {
+  char **entries ;     // Newest first, each "name\0value\0"
+  int count ;
+  int size ;
+  int maxsize ;
+} ;
+
+// Pseudo headers and status of a request being decoded
+
+struct hh2_request {
+  mem *path ;
+  int method ;
+  int regular ;        // True once a regular header has been seen
+  int malformed ;
+  int overflow ;       // Headers did not fit in the transient buffer
+} ;
+
+// Connection state
+
+typedef struct {
+  mem *rx ;            // Received data, not yet processed
+  int rxlen ;
+  char *preface ;      // Remainder of the client preface still expected
+  mem *tx ;            // Frames waiting to be written
+  int txlen ;
+  int peermaxframe ;
+  int peerinitwindow ;
+  int sendwindow ;     // Connection flow control window for sending
+  int recvwindow ;     // Connection flow control window for receiving
+  int laststream ;
+  int numstreams ;
+  int goaway ;         // True once the client has sent GOAWAY
+  int error ;          // True once a connection error has been sent
+  mem *hblock ;        // Header block waiting for CONTINUATION frames
+  int hblocklen ;
+  int hblockid ;
+  int hblockflags ;
+  struct hh2_table dec ;
+  struct hh2_table enc ;
+  int encupdate ;      // Dynamic table size update due in next header block
+  IHTTPD *streams ;
+} IHH2 ;
+
+// HPACK static table (RFC 7541 Appendix A)
+
+#define HH2_STATICSIZE 61
+
+static const char *_hh2_static[HH2_STATICSIZE][2] = {
+  { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+  { ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+  { ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+  { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+  { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+  { "accept-ranges", "" }, { "accept", "" },
+  { "access-control-allow-origin", "" }, { "age", "" }, { "allow", "" },
+  { "authorization", "" }, { "cache-control", "" },
+  { "content-disposition", "" }, { "content-encoding", "" },
+  { "content-language", "" }, { "content-length", "" },
+  { "content-location", "" }, { "content-range", "" },
+  { "content-type", "" }, { "cookie", "" }, { "date", "" }, { "etag", "" },
+  { "expect", "" }, { "expires", "" }, { "from", "" }, { "host", "" },
+  { "if-match", "" }, { "if-modified-since", "" }, { "if-none-match", "" },
+  { "if-range", "" }, { "if-unmodified-since", "" },
+  { "last-modified", "" }, { "link", "" }, { "location", "" },
+  { "max-forwards", "" }, { "proxy-authenticate", "" },
+  { "proxy-authorization", "" }, { "range", "" }, { "referer", "" },
+  { "refresh", "" }, { "retry-after", "" }, { "server", "" },
+  { "set-cookie", "" }, { "strict-transport-security", "" },
+  { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" },
+  { "via", "" }, { "www-authenticate", "" }
+} ;
+
+// HPACK Huffman code lengths for symbols 0-255 and EOS (RFC 7541 Appendix B)
+
+#define HH2_EOS 256
+
+static const unsigned char _hh2_hufflen[257] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30
+} ;
+
+// Local data
+
+int _hh2_enabled=0 ;
+
+int _hh2_huffready=0 ;
+unsigned _hh2_huffcode[257] ;
+unsigned _hh2_hufffirst[31] ;
+int _hh2_huffcount[31] ;
+int _hh2_huffoffset[31] ;
+short _hh2_huffsorted[257] ;
+
+// Local functions
+
+int _hh2_init(IHTTPD *hh, char *preface) ;
+int _hh2_parse(IHTTPD *hh) ;
+int _hh2_frame(IHTTPD *hh, int type, int flags, int id, int len, unsigned char *payload) ;
+int _hh2_process(IHTTPD *hh, int type, int flags, int id, unsigned char *payload, int len) ;
+int _hh2_headers(IHTTPD *hh, int id, int flags, unsigned char *block, int len) ;
+int _hh2_data(IHTTPD *hh, int id, int flags, unsigned char *data, int datalen, int len) ;
+int _hh2_settings(IHTTPD *hh, unsigned char *payload, int len) ;
+int _hh2_windowupdate(IHTTPD *hh, int id, unsigned char *payload, int len) ;
+int _hh2_send_frame(IHTTPD *hh, int type, int flags, int id, void *payload, int len) ;
+int _hh2_send_u32(IHTTPD *hh, int type, int id, unsigned v) ;
+int _hh2_goaway(IHTTPD *hh, int code) ;
+int _hh2_output(IHTTPD *hh) ;
+int _hh2_pump(IHTTPD *hh) ;
+IHTTPD *_hh2_newstream(IHTTPD *hh, int id) ;
+IHTTPD *_hh2_findstream(IHTTPD *hh, int id) ;
+void _hh2_ready(IHTTPD *st) ;
+void _hh2_sent(IHTTPD *st) ;
+void _hh2_reset(IHTTPD *st, int code) ;
+void _hh2_freestream(IHTTPD *st) ;
+int _hh2_append(mem **buf, int *len, void *data, int n) ;
+void _hh2_huffinit() ;
+int _hh2_huffdecode(unsigned char *in, int len, char *out) ;
+int _hh2_huffencode(unsigned char *in, int len, unsigned char *out) ;
+int _hh2_hufflength(unsigned char *in, int len) ;
+int _hh2_getint(unsigned char *buf, int len, int *pos, int prefix, unsigned *value) ;
+mem *_hh2_getstr(unsigned char *buf, int len, int *pos) ;
+int _hh2_putint(mem **buf, int *len, int first, int prefix, unsigned value) ;
+int _hh2_putstr(mem **buf, int *len, char *str) ;
+int _hh2_decode(IHTTPD *hh, unsigned char *block, int len, struct hh2_request *req) ;
+int _hh2_emit(IHTTPD *hh, struct hh2_request *req, char *name, char *value) ;
+int _hh2_encode(mem **buf, int *len, struct hh2_table *t, char *name, char *value, int index) ;
+int _hh2_table_init(struct hh2_table *t) ;
+int _hh2_table_add(struct hh2_table *t, char *name, char *value) ;
+int _hh2_table_get(struct hh2_table *t, unsigned index, char **name, char **value) ;
+void _hh2_table_resize(struct hh2_table *t, int maxsize) ;
+void _hh2_table_evict(struct hh2_table *t, int size) ;
+void _hh2_table_free(struct hh2_table *t) ;
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Enable HTTP/2 (h2c) on the plain listener
+// @param[in] enable If true, prior knowledge connections and Upgrade: h2c
+//                   requests are switched to HTTP/2
+// @return true
+//
+
+int httpd_h2_enable(int enable)
+{
+  _hh2_enabled = enable ;
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Determine if session has switched to HTTP/2
+// @param[in] hh Handle of HTTPD session
+// @return true if the session is an HTTP/2 connection
+//
+
+int hh2_isconnection(IHTTPD *hh)
+{
+  return (hh && hh->mode==H2) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Get next completed request stream from an HTTP/2 connection
+// @param[in] hh Handle of HTTP/2 connection
+// @return Handle of stream, or NULL if none are waiting
+//
+
+IHTTPD *hh2_getstream(IHTTPD *hh)
+{
+  if (!hh || hh->mode!=H2 || !hh->h2) return NULL ;
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+
+  for (IHTTPD *st=h2->streams; st; st=st->h2next) {
+    if ( (st->h2flags & HH2S_READY) && !(st->h2flags & HH2S_RETURNED) ) {
+      st->h2flags |= HH2S_RETURNED ;
+      return st ;
+    }
+  }
+
+  return NULL ;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+//
+// Internal Functions (ihttpd.h)
+//
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Switch session to HTTP/2 after the prior knowledge preface
+// @param[in] hh Handle of HTTPD session, which has received "PRI * HTTP/2.0"
+// @return true on success
+//
+
+int _hh2_start(IHTTPD *hh)
+{
+  if (!_hh2_enabled || hh->ssl || hh->mode!=HTTP) return 0 ;
+
+  // The request line has been consumed, leaving the rest of the preface
+
+  if (!_hh2_init(hh, "\r\nSM\r\n\r\n")) return 0 ;
+  *(hh->transient) = '\0' ;
+
+  return _hh2_output(hh) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Switch session to HTTP/2 if a completed request asks to upgrade
+// @param[in] hh Handle of HTTPD session, after hrecv has returned 200
+// @return 0 - Switched to HTTP/2, or original hrecv result code
+//
+
+int _hh2_upgrade(IHTTPD *hh)
+{
+  if (!_hh2_enabled || hh->ssl || hh->mode!=HTTP) return 200 ;
+
+  char *upgrade = hgetheader(hh, "Upgrade") ;
+  char *settings = hgetheader(hh, "HTTP2-Settings") ;
+  if (!upgrade || !settings || str_offseti(upgrade, "h2c")<0) return 200 ;
+
+  // HTTP2-Settings is a base64url encoded SETTINGS payload
+
+  int slen = strlen(settings) ;
+  mem *b64 = mem_malloc(slen+4) ;
+  mem *payload = mem_malloc(slen+4) ;
+  if (!b64 || !payload) {
+    mem_free(b64) ;
+    mem_free(payload) ;
+    return 200 ;
+  }
+
+  for (int i=0; i<slen; i++) {
+    if (settings[i]=='-') b64[i]='+' ;
+    else if (settings[i]=='_') b64[i]='/' ;
+    else b64[i]=settings[i] ;
+  }
+  while (slen%4) b64[slen++]='=' ;
+
+  int plen = EVP_DecodeBlock((unsigned char *)payload, (unsigned char *)b64, slen) ;
+  if (plen>=0) {
+    int pad=0 ;
+    while (pad<2 && slen-pad>0 && b64[slen-pad-1]=='=') pad++ ;
+    plen -= pad ;
+  }
+  mem_free(b64) ;
+
+  if (plen<0 || plen%6) {
+    mem_free(payload) ;
+    return 200 ;
+  }
+
+  char *switching = "HTTP/1.1 101 Switching Protocols\r\n"
+                    "Connection: Upgrade\r\n"
+                    "Upgrade: h2c\r\n\r\n" ;
+
+  if (!_httpd_write(hh, switching, strlen(switching)) || !_hh2_init(hh, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n")) {
+    mem_free(payload) ;
+    hh->state=ERROR ;
+    return -1 ;
+  }
+
+  int ok = ( _hh2_settings(hh, (unsigned char *)payload, plen)==0 ) ;
+  mem_free(payload) ;
+
+  // The request becomes stream 1, which is already half closed
+
+  IHTTPD *st = ok ? _hh2_newstream(hh, 1) : NULL ;
+  if (!st) {
+    _hh2_goaway(hh, ok ? HH2_INTERNAL_ERROR : HH2_PROTOCOL_ERROR) ;
+    _hh2_output(hh) ;
+    hh->state=ERROR ;
+    return -1 ;
+  }
+
+  ((IHH2 *)hh->h2)->laststream = 1 ;
+
+  st->uri = hh->uri ; hh->uri = NULL ;
+  st->uricount = hh->uricount ;
+  st->head = hh->head ; hh->head = NULL ;
+  st->headcount = hh->headcount ;
+  st->body = hh->body ; hh->body = NULL ;
+  st->h2code = 200 ;
+  st->h2flags |= HH2S_REMOTECLOSED ;
+  _hh2_ready(st) ;
+
+  return _hh2_output(hh) ? 0 : -1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Receive and process HTTP/2 frames
+// @param[in] hh Handle of HTTP/2 connection
+// @return 0 - Continue, -1 - Connection closed
+//
+
+int _hh2_recv(IHTTPD *hh)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+  if (!h2 || h2->error || hh->state==ERROR) return -1 ;
+
+  for (;;) {
+
+    int r = _httpd_read(hh, &(h2->rx[h2->rxlen]), mem_length(h2->rx)-h2->rxlen) ;
+
+    if (r==0) {
+      hh->state=CLOSED ;
+      return -1 ;
+    } else if (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+      break ;
+    } else if (r<0) {
+      hh->state=ERROR ;
+      return -1 ;
+    }
+
+    h2->rxlen += r ;
+
+    if (_hh2_parse(hh)<0) {
+      _hh2_output(hh) ;
+      hh->state=ERROR ;
+      return -1 ;
+    }
+
+  }
+
+  if (!_hh2_output(hh)) return -1 ;
+  return 0 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Send response on HTTP/2 stream
+// @param[in] hh Handle of stream
+// @return true on success
+//
+
+int _hh2_send(IHTTPD *hh, int code, char *contenttype, char *body, int bodylen)
+{
+  IHTTPD *conn = (IHTTPD *)hh->h2parent ;
+  if (!conn || (hh->h2flags & (HH2S_RESPONDED|HH2S_RESET))) return 0 ;
+  IHH2 *h2 = (IHH2 *)conn->h2 ;
+
+  if (!body) bodylen=0 ;
+
+  // Build header block
+
+  mem *block = NULL ;
+  int blocklen = 0 ;
+  int ok = 1 ;
+  char num[16] ;
+
+  if (h2->encupdate) {
+    ok = _hh2_putint(&block, &blocklen, 0x20, 5, h2->enc.maxsize) ;
+    h2->encupdate = 0 ;
+  }
+
+  snprintf(num, sizeof(num), "%d", code) ;
+  ok = ok && _hh2_encode(&block, &blocklen, &(h2->enc), ":status", num, 1) ;
+
+  if (body && contenttype) {
+    snprintf(num, sizeof(num), "%d", bodylen) ;
+    ok = ok && _hh2_encode(&block, &blocklen, &(h2->enc), "content-type", contenttype, 1) ;
+    ok = ok && _hh2_encode(&block, &blocklen, &(h2->enc), "content-length", num, 0) ;
+#ifndef NOCORS
+    ok = ok && _hh2_encode(&block, &blocklen, &(h2->enc), "access-control-allow-origin", "*", 1) ;
+    ok = ok && _hh2_encode(&block, &blocklen, &(h2->enc), "access-control-allow-headers", "*", 1) ;
+    ok = ok && _hh2_encode(&block, &blocklen, &(h2->enc), "access-control-allow-methods", "*", 1) ;
+#endif
+  }
+
+  if (ok && bodylen>0) {
+    hh->out = mem_malloc(bodylen) ;
+    if (hh->out) memcpy(hh->out, body, bodylen) ;
+    ok = (hh->out!=NULL) ;
+  }
+
+  if (!ok) {
+
+    // The encoder table may now differ from the client's copy
+
+    mem_free(block) ;
+    _hh2_goaway(conn, HH2_INTERNAL_ERROR) ;
+    _hh2_output(conn) ;
+    return 0 ;
+
+  }
+
+  // Send header block, split into CONTINUATION frames if necessary
+
+  int pos=0 ;
+  int type=HH2_HEADERS ;
+  do {
+    int n = blocklen-pos ;
+    if (n > h2->peermaxframe) n = h2->peermaxframe ;
+    int flags = (pos+n==blocklen) ? HH2_END_HEADERS : 0 ;
+    if (type==HH2_HEADERS && bodylen==0) flags |= HH2_END_STREAM ;
+    _hh2_send_frame(conn, type, flags, hh->h2id, &block[pos], n) ;
+    type = HH2_CONTINUATION ;
+    pos += n ;
+  } while (pos<blocklen) ;
+
+  mem_free(block) ;
+
+  hh->outlen = bodylen ;
+  hh->h2outpos = 0 ;
+  hh->h2flags |= HH2S_RESPONDED ;
+
+  // Body is sent as flow control allows
+
+  if (bodylen==0) {
+    hh->h2flags |= HH2S_SENT ;
+    _hh2_sent(hh) ;
+  }
+
+  return _hh2_output(conn) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Close HTTP/2 stream, or release all streams of a closing connection
+// @param[in] hh Handle of stream or connection
+// @return true on success
+//
+
+int _hh2_close(IHTTPD *hh)
+{
+  if (hh->mode==H2STREAM) {
+
+    IHTTPD *conn = (IHTTPD *)hh->h2parent ;
+
+    if (!conn) {
+      _hh2_freestream(hh) ;
+      return 1 ;
+    }
+
+    hh->h2flags |= HH2S_APPCLOSED ;
+
+    // Closing without a response resets (and frees) the stream
+
+    if ( !(hh->h2flags & (HH2S_RESPONDED|HH2S_RESET)) ) {
+      _hh2_reset(hh, HH2_INTERNAL_ERROR) ;
+      _hh2_output(conn) ;
+      return 1 ;
+    }
+
+    // Otherwise keep the stream until its response has been sent
+
+    if (hh->h2flags & (HH2S_SENT|HH2S_RESET)) _hh2_freestream(hh) ;
+    return 1 ;
+
+  }
+
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+  if (!h2) return 1 ;
+
+  // Streams held by the application outlive the connection
+
+  IHTTPD *st = h2->streams ;
+  while (st) {
+    IHTTPD *next = st->h2next ;
+    if ( (st->h2flags & HH2S_RETURNED) && !(st->h2flags & HH2S_APPCLOSED) ) {
+      st->h2parent = NULL ;
+      st->h2next = NULL ;
+    } else {
+      st->h2parent = NULL ;
+      _hh2_freestream(st) ;
+    }
+    st = next ;
+  }
+
+  _hh2_table_free(&(h2->dec)) ;
+  _hh2_table_free(&(h2->enc)) ;
+  mem_free(h2->rx) ;
+  mem_free(h2->tx) ;
+  mem_free(h2->hblock) ;
+  mem_free((mem *)h2) ;
+  hh->h2 = NULL ;
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Send response data held back by flow control or a full output queue
+// @param[in] hh Handle of HTTP/2 connection whose output queue has emptied
+//
+
+void _hh2_drained(IHTTPD *hh)
+{
+  if (hh->h2 && hh->outlen < HH2_HIGHWATER) _hh2_output(hh) ;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+//
+// Local Functions - connection and streams
+//
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Set up HTTP/2 connection state and queue the server preface
+// @param[in] hh Handle of HTTPD session
+// @param[in] preface Client preface still expected
+// @return true on success
+//
+
+int _hh2_init(IHTTPD *hh, char *preface)
+{
+  IHH2 *h2 = (IHH2 *)mem_malloc(sizeof(IHH2)) ;
+  if (!h2) return 0 ;
+
+  h2->rx = mem_malloc(HH2_RXBUF) ;
+  h2->tx = mem_malloc(HH2_FRAMEMAX+9) ;
+  if (!h2->rx || !h2->tx || !_hh2_table_init(&(h2->dec)) || !_hh2_table_init(&(h2->enc))) {
+    mem_free(h2->rx) ;
+    mem_free(h2->tx) ;
+    _hh2_table_free(&(h2->dec)) ;
+    _hh2_table_free(&(h2->enc)) ;
+    mem_free((mem *)h2) ;
+    return 0 ;
+  }
+
+  h2->preface = preface ;
+  h2->peermaxframe = HH2_FRAMEMAX ;
+  h2->peerinitwindow = HH2_DEFAULTWINDOW ;
+  h2->sendwindow = HH2_DEFAULTWINDOW ;
+  h2->recvwindow = HH2_WINDOW ;
+
+  hh->h2 = h2 ;
+  hh->mode = H2 ;
+
+  // Server preface is a SETTINGS frame, followed here by an
+  // increase in the connection receive window
+
+  unsigned char settings[12] = {
+    0x00, 0x03, 0, 0, 0, HH2_MAXSTREAMS,
+    0x00, 0x04, (HH2_WINDOW>>24)&0xff, (HH2_WINDOW>>16)&0xff, (HH2_WINDOW>>8)&0xff, HH2_WINDOW&0xff
+  } ;
+
+  return ( _hh2_send_frame(hh, HH2_SETTINGS, 0, 0, settings, sizeof(settings)) &&
+           _hh2_send_u32(hh, HH2_WINDOW_UPDATE, 0, HH2_WINDOW-HH2_DEFAULTWINDOW) ) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Process complete frames in the receive buffer
+// @param[in] hh Handle of HTTP/2 connection
+// @return 0 on success, -1 on connection error
+//
+
+int _hh2_parse(IHTTPD *hh)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+  unsigned char *rx = (unsigned char *)h2->rx ;
+  int pos=0 ;
+  int r=0 ;
+
+  // Check client preface
+
+  while (*(h2->preface) && pos<h2->rxlen) {
+    if (rx[pos]!=(unsigned char)*(h2->preface)) {
+      _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+      return -1 ;
+    }
+    pos++ ;
+    h2->preface++ ;
+  }
+
+  while (r==0 && h2->rxlen-pos >= 9) {
+
+    int len = (rx[pos]<<16) | (rx[pos+1]<<8) | rx[pos+2] ;
+    int type = rx[pos+3] ;
+    int flags = rx[pos+4] ;
+    int id = ((rx[pos+5]&0x7f)<<24) | (rx[pos+6]<<16) | (rx[pos+7]<<8) | rx[pos+8] ;
+
+    if (len > HH2_FRAMEMAX) {
+      _hh2_goaway(hh, HH2_FRAME_SIZE_ERROR) ;
+      return -1 ;
+    }
+
+    if (h2->rxlen-pos < 9+len) break ;
+
+    r = _hh2_process(hh, type, flags, id, &rx[pos+9], len) ;
+    pos += 9+len ;
+
+  }
+
+  memmove(rx, &rx[pos], h2->rxlen-pos) ;
+  h2->rxlen -= pos ;
+
+  return r ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Process received frame
+// @param[in] hh Handle of HTTP/2 connection
+// @return 0 on success, -1 on connection error
+//
+
+int _hh2_process(IHTTPD *hh, int type, int flags, int id, unsigned char *payload, int len)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+
+  // A header block must be completed before anything else
+
+  if (h2->hblockid) {
+
+    if (type!=HH2_CONTINUATION || id!=h2->hblockid) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+
+    // An endless run of CONTINUATION frames mustn't grow the block
+    // without limit
+
+    if (len > HH2_MAXHEADERBLOCK-h2->hblocklen) return _hh2_goaway(hh, HH2_ENHANCE_YOUR_CALM) ;
+
+    if (!_hh2_append(&(h2->hblock), &(h2->hblocklen), payload, len)) return _hh2_goaway(hh, HH2_INTERNAL_ERROR) ;
+    if (!(flags & HH2_END_HEADERS)) return 0 ;
+
+    h2->hblockid = 0 ;
+    return _hh2_headers(hh, id, h2->hblockflags, (unsigned char *)h2->hblock, h2->hblocklen) ;
+
+  }
+
+  // Find the content of DATA and HEADERS frames, skipping the pad
+  // length, priority and padding
+
+  int skip=0, padlen=0 ;
+
+  if ( (type==HH2_DATA || type==HH2_HEADERS) && (flags & HH2_PADDED) ) {
+    if (len<1) return _hh2_goaway(hh, HH2_FRAME_SIZE_ERROR) ;
+    padlen = payload[0] ;
+    skip = 1 ;
+  }
+  if (type==HH2_HEADERS && (flags & HH2_PRIORITY_FLAG)) skip += 5 ;
+  if (skip+padlen > len) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+
+  unsigned char *content = &payload[skip] ;
+  int contentlen = len-skip-padlen ;
+
+  switch (type) {
+
+  case HH2_DATA:
+
+    if (id==0) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+
+    // Padding counts towards flow control
+
+    return _hh2_data(hh, id, flags, content, contentlen, len) ;
+
+  case HH2_HEADERS:
+
+    if (id==0) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+
+    if (!(flags & HH2_END_HEADERS)) {
+      h2->hblocklen = 0 ;
+      if (!_hh2_append(&(h2->hblock), &(h2->hblocklen), content, contentlen)) return _hh2_goaway(hh, HH2_INTERNAL_ERROR) ;
+      h2->hblockid = id ;
+      h2->hblockflags = flags ;
+      return 0 ;
+    }
+
+    return _hh2_headers(hh, id, flags, content, contentlen) ;
+
+  case HH2_PRIORITY:
+
+    if (id==0) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+    return 0 ;
+
+  case HH2_RST_STREAM:
+
+    if (id==0) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+    if (len!=4) return _hh2_goaway(hh, HH2_FRAME_SIZE_ERROR) ;
+
+    {
+      IHTTPD *st = _hh2_findstream(hh, id) ;
+      if (st) {
+        st->h2flags |= HH2S_RESET | HH2S_REMOTECLOSED ;
+        if ( !(st->h2flags & HH2S_RETURNED) || (st->h2flags & HH2S_APPCLOSED) ) _hh2_freestream(st) ;
+      }
+    }
+    return 0 ;
+
+  case HH2_SETTINGS:
+
+    if (id!=0) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+    if (flags & HH2_ACK) return (len==0) ? 0 : _hh2_goaway(hh, HH2_FRAME_SIZE_ERROR) ;
+    if (len%6) return _hh2_goaway(hh, HH2_FRAME_SIZE_ERROR) ;
+    if (_hh2_settings(hh, payload, len)<0) return -1 ;
+    return _hh2_send_frame(hh, HH2_SETTINGS, HH2_ACK, 0, NULL, 0) ? 0 : -1 ;
+
+  case HH2_PING:
+
+    if (id!=0) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+    if (len!=8) return _hh2_goaway(hh, HH2_FRAME_SIZE_ERROR) ;
+    if (flags & HH2_ACK) return 0 ;
+    return _hh2_send_frame(hh, HH2_PING, HH2_ACK, 0, payload, 8) ? 0 : -1 ;
+
+  case HH2_GOAWAY:
+
+    // Requests already received are still answered
+
+    h2->goaway = 1 ;
+    return 0 ;
+
+  case HH2_WINDOW_UPDATE:
+
+    return _hh2_windowupdate(hh, id, payload, len) ;
+
+  case HH2_PUSH_PROMISE:
+  case HH2_CONTINUATION:
+
+    return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+
+  default:
+
+    // Unknown frame types are ignored
+    return 0 ;
+
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Process complete header block, starting a new request stream
+// @return 0 on success, -1 on connection error
+//
+
+int _hh2_headers(IHTTPD *hh, int id, int flags, unsigned char *block, int len)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+  IHTTPD *st = _hh2_findstream(hh, id) ;
+
+  if (st || id<=h2->laststream) {
+
+    // Trailers are decoded to keep the header table in step, then ignored
+
+    if (!_hh2_decode(hh, block, len, NULL)) return _hh2_goaway(hh, HH2_COMPRESSION_ERROR) ;
+    if (!st && id%2==0) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+    if (!st) return _hh2_send_u32(hh, HH2_RST_STREAM, id, HH2_STREAM_CLOSED) ? 0 : -1 ;
+
+    if ( (st->h2flags & HH2S_REMOTECLOSED) || !(flags & HH2_END_STREAM) ) {
+      _hh2_reset(st, (st->h2flags & HH2S_REMOTECLOSED) ? HH2_STREAM_CLOSED : HH2_PROTOCOL_ERROR) ;
+      return 0 ;
+    }
+
+    st->h2flags |= HH2S_REMOTECLOSED ;
+    _hh2_ready(st) ;
+    return 0 ;
+
+  }
+
+  if (id%2==0) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+  h2->laststream = id ;
+
+  // Decode the request headers into the connection's transient buffer
+
+  int refuse = (h2->numstreams >= HH2_MAXSTREAMS) ;
+  struct hh2_request req ;
+  memset(&req, 0, sizeof(req)) ;
+  *(hh->transient) = '\0' ;
+
+  int ok = _hh2_decode(hh, block, len, refuse ? NULL : &req) ;
+  if (!ok) {
+    mem_free(req.path) ;
+    return _hh2_goaway(hh, HH2_COMPRESSION_ERROR) ;
+  }
+
+  if (refuse) {
+    return _hh2_send_u32(hh, HH2_RST_STREAM, id, HH2_REFUSED_STREAM) ? 0 : -1 ;
+  }
+
+  if (req.malformed || !req.method || !req.path) {
+    mem_free(req.path) ;
+    return _hh2_send_u32(hh, HH2_RST_STREAM, id, HH2_PROTOCOL_ERROR) ? 0 : -1 ;
+  }
+
+  st = _hh2_newstream(hh, id) ;
+  if (!st) {
+    mem_free(req.path) ;
+    return _hh2_send_u32(hh, HH2_RST_STREAM, id, HH2_REFUSED_STREAM) ? 0 : -1 ;
+  }
+
+  if (req.overflow) {
+    st->h2code = 431 ; // 431:HeaderOverflow
+  } else if (!_httpd_storehead(st, hh->transient)) {
+    st->h2code = 500 ; // 500:InternalServerError
+  } else if (strlen(req.path) >= mem_length(hh->transient)) {
+    st->h2code = 414 ; // 414:BadURI
+  } else if (!str_strcpy(hh->transient, req.path) || !_httpd_seturi(st, hh->transient)) {
+    st->h2code = 500 ; // 500:InternalServerError
+  } else {
+    st->h2code = 200 ; // 200:OK
+  }
+  mem_free(req.path) ;
+  *(hh->transient) = '\0' ;
+
+  if (flags & HH2_END_STREAM) st->h2flags |= HH2S_REMOTECLOSED ;
+
+  // Requests which have failed are answered without waiting for the body
+
+  if ( (flags & HH2_END_STREAM) || st->h2code!=200 ) _hh2_ready(st) ;
+
+  return 0 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Process DATA frame, adding to the request body
+// @param[in] data Frame content, without padding
+// @param[in] datalen Length of content
+// @param[in] len Length of frame payload, including any padding
+// @return 0 on success, -1 on connection error
+//
+
+int _hh2_data(IHTTPD *hh, int id, int flags, unsigned char *data, int datalen, int len)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+
+  // Connection window is replenished as data is consumed
+
+  h2->recvwindow -= len ;
+  if (h2->recvwindow < 0) return _hh2_goaway(hh, HH2_FLOW_CONTROL_ERROR) ;
+  if (h2->recvwindow < HH2_WINDOW/2) {
+    if (!_hh2_send_u32(hh, HH2_WINDOW_UPDATE, 0, HH2_WINDOW-h2->recvwindow)) return -1 ;
+    h2->recvwindow = HH2_WINDOW ;
+  }
+
+  IHTTPD *st = _hh2_findstream(hh, id) ;
+  if (!st || (st->h2flags & HH2S_REMOTECLOSED)) {
+    if (id > h2->laststream) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+    if (st) _hh2_reset(st, HH2_STREAM_CLOSED) ;
+    else _hh2_send_u32(hh, HH2_RST_STREAM, id, HH2_STREAM_CLOSED) ;
+    return 0 ;
+  }
+
+  st->h2recvwindow -= len ;
+  if (st->h2recvwindow < 0) {
+    _hh2_reset(st, HH2_FLOW_CONTROL_ERROR) ;
+    return 0 ;
+  }
+
+  if (st->h2code==200 && datalen>0) {
+
+    if (st->bodylen+datalen > HH2_MAXBODY) {
+
+      mem_free(st->body) ;
+      st->body = NULL ;
+      st->bodylen = 0 ;
+      st->h2code = 413 ; // 413:ContentTooLarge
+      _hh2_ready(st) ;
+
+    } else {
+
+      if (mem_length(st->body) < st->bodylen+datalen+1) {
+        int size = mem_length(st->body) ;
+        if (size<4096) size=4096 ;
+        while (size < st->bodylen+datalen+1) size*=2 ;
+        mem *body = mem_realloc(st->body, size) ;
+        if (!body) {
+          _hh2_reset(st, HH2_INTERNAL_ERROR) ;
+          return 0 ;
+        }
+        st->body = body ;
+      }
+      memcpy(&(st->body[st->bodylen]), data, datalen) ;
+      st->bodylen += datalen ;
+      st->body[st->bodylen] = '\0' ;
+
+    }
+
+  }
+
+  if (flags & HH2_END_STREAM) {
+    st->h2flags |= HH2S_REMOTECLOSED ;
+    _hh2_ready(st) ;
+  } else if (st->h2recvwindow < HH2_WINDOW/2) {
+    if (!_hh2_send_u32(hh, HH2_WINDOW_UPDATE, id, HH2_WINDOW-st->h2recvwindow)) return -1 ;
+    st->h2recvwindow = HH2_WINDOW ;
+  }
+
+  return 0 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Apply SETTINGS payload from client
+// @return 0 on success, -1 on connection error
+//
+
+int _hh2_settings(IHTTPD *hh, unsigned char *payload, int len)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+
+  for (int i=0; i+6<=len; i+=6) {
+
+    int id = (payload[i]<<8) | payload[i+1] ;
+    unsigned v = ((unsigned)payload[i+2]<<24) | (payload[i+3]<<16) | (payload[i+4]<<8) | payload[i+5] ;
+
+    switch (id) {
+
+    case 0x1: // SETTINGS_HEADER_TABLE_SIZE
+
+      if (v > HH2_TABLESIZE) v = HH2_TABLESIZE ;
+      if (v != h2->enc.maxsize) {
+        _hh2_table_resize(&(h2->enc), v) ;
+        h2->encupdate = 1 ;
+      }
+      break ;
+
+    case 0x2: // SETTINGS_ENABLE_PUSH
+
+      if (v>1) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+      break ;
+
+    case 0x4: // SETTINGS_INITIAL_WINDOW_SIZE
+
+      if (v > HH2_MAXWINDOW) return _hh2_goaway(hh, HH2_FLOW_CONTROL_ERROR) ;
+      for (IHTTPD *st=h2->streams; st; st=st->h2next) {
+        long long w = (long long)st->h2sendwindow + (long long)v - h2->peerinitwindow ;
+        if (w > HH2_MAXWINDOW) return _hh2_goaway(hh, HH2_FLOW_CONTROL_ERROR) ;
+        st->h2sendwindow = (int)w ;
+      }
+      h2->peerinitwindow = v ;
+      break ;
+
+    case 0x5: // SETTINGS_MAX_FRAME_SIZE
+
+      if (v < 16384 || v > 16777215) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+      h2->peermaxframe = v ;
+      break ;
+
+    default:
+      break ;
+
+    }
+
+  }
+
+  return 0 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Process WINDOW_UPDATE frame
+// @return 0 on success, -1 on connection error
+//
+
+int _hh2_windowupdate(IHTTPD *hh, int id, unsigned char *payload, int len)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+
+  if (len!=4) return _hh2_goaway(hh, HH2_FRAME_SIZE_ERROR) ;
+  int inc = ((payload[0]&0x7f)<<24) | (payload[1]<<16) | (payload[2]<<8) | payload[3] ;
+
+  if (id==0) {
+    if (inc==0) return _hh2_goaway(hh, HH2_PROTOCOL_ERROR) ;
+    if ((long long)h2->sendwindow+inc > HH2_MAXWINDOW) return _hh2_goaway(hh, HH2_FLOW_CONTROL_ERROR) ;
+    h2->sendwindow += inc ;
+    return 0 ;
+  }
+
+  IHTTPD *st = _hh2_findstream(hh, id) ;
+  if (!st) return 0 ;
+
+  if (inc==0) {
+    _hh2_reset(st, HH2_PROTOCOL_ERROR) ;
+  } else if ((long long)st->h2sendwindow+inc > HH2_MAXWINDOW) {
+    _hh2_reset(st, HH2_FLOW_CONTROL_ERROR) ;
+  } else {
+    st->h2sendwindow += inc ;
+  }
+
+  return 0 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Queue frame for sending
+// @return true on success
+//
+
+int _hh2_send_frame(IHTTPD *hh, int type, int flags, int id, void *payload, int len)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+
+  unsigned char head[9] = {
+    (len>>16)&0xff, (len>>8)&0xff, len&0xff,
+    type, flags,
+    (id>>24)&0x7f, (id>>16)&0xff, (id>>8)&0xff, id&0xff
+  } ;
+
+  return ( _hh2_append(&(h2->tx), &(h2->txlen), head, 9) &&
+           _hh2_append(&(h2->tx), &(h2->txlen), payload, len) ) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Queue frame carrying a single 32-bit value (RST_STREAM / WINDOW_UPDATE)
+// @return true on success
+//
+
+int _hh2_send_u32(IHTTPD *hh, int type, int id, unsigned v)
+{
+  unsigned char payload[4] = { (v>>24)&0xff, (v>>16)&0xff, (v>>8)&0xff, v&0xff } ;
+  return _hh2_send_frame(hh, type, 0, id, payload, 4) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Queue GOAWAY, after which the connection is closed
+// @return -1
+//
+
+int _hh2_goaway(IHTTPD *hh, int code)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+  if (h2->error) return -1 ;
+
+  unsigned char payload[8] = {
+    (h2->laststream>>24)&0x7f, (h2->laststream>>16)&0xff, (h2->laststream>>8)&0xff, h2->laststream&0xff,
+    (code>>24)&0xff, (code>>16)&0xff, (code>>8)&0xff, code&0xff
+  } ;
+
+  logmsg(LOG_INFO, "httpd: HTTP/2 connection error %d from %s", code, hpeeripaddress(hh)) ;
+  _hh2_send_frame(hh, HH2_GOAWAY, 0, 0, payload, 8) ;
+  h2->error = 1 ;
+  return -1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Write queued frames, and as much response data as the
+//        output queue and flow control allow
+// @param[in] hh Handle of HTTP/2 connection
+// @return true on success
+//
+
+int _hh2_output(IHTTPD *hh)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+  int more ;
+
+  do {
+
+    more = _hh2_pump(hh) ;
+
+    if (h2->txlen>0) {
+      int ok = _httpd_write(hh, h2->tx, h2->txlen) ;
+      h2->txlen = 0 ;
+      if (!ok) return 0 ;
+    }
+
+    // Keep going while the socket is taking everything
+
+  } while (more && hh->outlen==0) ;
+
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Queue DATA frames for streams with response data waiting
+// @param[in] hh Handle of HTTP/2 connection
+// @return true if any data was queued
+//
+
+int _hh2_pump(IHTTPD *hh)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+  int queued=0 ;
+  int progress=1 ;
+
+  // One frame per stream in turn, so responses are interleaved
+
+  while (progress && h2->sendwindow>0 && !h2->error && hh->outlen+h2->txlen < HH2_HIGHWATER) {
+
+    progress=0 ;
+
+    IHTTPD *st = h2->streams ;
+    while (st && h2->sendwindow>0 && hh->outlen+h2->txlen < HH2_HIGHWATER) {
+
+      IHTTPD *next = st->h2next ;
+      int left = st->outlen - st->h2outpos ;
+
+      if ( (st->h2flags & HH2S_RESPONDED) && !(st->h2flags & (HH2S_SENT|HH2S_RESET)) &&
+           left>0 && st->h2sendwindow>0 ) {
+
+        int n = left ;
+        if (n > st->h2sendwindow) n = st->h2sendwindow ;
+        if (n > h2->sendwindow) n = h2->sendwindow ;
+        if (n > h2->peermaxframe) n = h2->peermaxframe ;
+
+        if (!_hh2_send_frame(hh, HH2_DATA, (n==left) ? HH2_END_STREAM : 0, st->h2id, &(st->out[st->h2outpos]), n)) {
+          _hh2_reset(st, HH2_INTERNAL_ERROR) ;
+          st = next ;
+          continue ;
+        }
+
+        st->h2outpos += n ;
+        st->h2sendwindow -= n ;
+        h2->sendwindow -= n ;
+        queued += n ;
+        progress = 1 ;
+
+        if (n==left) {
+          st->h2flags |= HH2S_SENT ;
+          _hh2_sent(st) ;
+        }
+
+      }
+
+      st = next ;
+
+    }
+
+  }
+
+  return queued>0 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Create stream session on connection
+// @param[in] hh Handle of HTTP/2 connection
+// @param[in] id Stream identifier
+// @return Handle of stream, or NULL on failure
+//
+
+IHTTPD *_hh2_newstream(IHTTPD *hh, int id)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+
+  IHTTPD *st = (IHTTPD *)mem_malloc(sizeof(IHTTPD)) ;
+  if (!st) return NULL ;
+
+  st->fd = -1 ;
+  st->mode = H2STREAM ;
+  st->state = HEAD ;
+  st->connect_time = time(NULL) ;
+  st->h2parent = hh ;
+  st->h2id = id ;
+  st->h2sendwindow = h2->peerinitwindow ;
+  st->h2recvwindow = HH2_WINDOW ;
+
+  // Streams are kept in the order they were opened
+
+  IHTTPD **last = &(h2->streams) ;
+  while (*last) last = (IHTTPD **)&((*last)->h2next) ;
+  *last = st ;
+  h2->numstreams++ ;
+
+  return st ;
+}
+
+
+IHTTPD *_hh2_findstream(IHTTPD *hh, int id)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+  for (IHTTPD *st=h2->streams; st; st=st->h2next) {
+    if (st->h2id==id) return st ;
+  }
+  return NULL ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Mark stream request as complete, ready for hh2_getstream
+//
+
+void _hh2_ready(IHTTPD *st)
+{
+  st->h2flags |= HH2S_READY ;
+  st->state = COMPLETE ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Tidy up once a stream's response has been completely sent
+//
+
+void _hh2_sent(IHTTPD *st)
+{
+  mem_free(st->out) ;
+  st->out = NULL ;
+  st->outlen = 0 ;
+  st->h2outpos = 0 ;
+
+  // A client still sending the request body is told to stop
+
+  if ( !(st->h2flags & HH2S_REMOTECLOSED) ) {
+    _hh2_send_u32(st->h2parent, HH2_RST_STREAM, st->h2id, HH2_NO_ERROR) ;
+    st->h2flags |= HH2S_RESET | HH2S_REMOTECLOSED ;
+  }
+
+  if (st->h2flags & HH2S_APPCLOSED) _hh2_freestream(st) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Reset stream, freeing it unless the application holds it
+//
+
+void _hh2_reset(IHTTPD *st, int code)
+{
+  if (st->h2flags & HH2S_RESET) return ;
+
+  _hh2_send_u32(st->h2parent, HH2_RST_STREAM, st->h2id, code) ;
+  st->h2flags |= HH2S_RESET | HH2S_REMOTECLOSED ;
+
+  if ( !(st->h2flags & HH2S_RETURNED) || (st->h2flags & HH2S_APPCLOSED) ) _hh2_freestream(st) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Remove stream from its connection, and free it
+//
+
+void _hh2_freestream(IHTTPD *st)
+{
+  IHTTPD *conn = (IHTTPD *)st->h2parent ;
+
+  if (conn && conn->h2) {
+    IHH2 *h2 = (IHH2 *)conn->h2 ;
+    IHTTPD **p = &(h2->streams) ;
+    while (*p && *p!=st) p = (IHTTPD **)&((*p)->h2next) ;
+    if (*p) {
+      *p = st->h2next ;
+      h2->numstreams-- ;
+    }
+  }
+
+  mem_free(st->uri) ;
+  mem_free(st->head) ;
+  mem_free(st->body) ;
+  mem_free(st->out) ;
+  mem_free((mem *)st) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Append data to buffer, growing it as required
+// @param[inout] buf Buffer (may be NULL)
+// @param[inout] len Length of data in buffer
+// @return true on success
+//
+
+int _hh2_append(mem **buf, int *len, void *data, int n)
+{
+  if (n<=0) return 1 ;
+  if ((*len) > INT_MAX-n) return 0 ;
+
+  if (mem_length(*buf) < (*len)+n) {
+    int size = mem_length(*buf) ;
+    if (size<256) size=256 ;
+    while (size < (*len)+n) size = (size > INT_MAX/2) ? (*len)+n : size*2 ;
+    mem *b = mem_realloc(*buf, size) ;
+    if (!b) return 0 ;
+    *buf = b ;
+  }
+
+  memcpy(&((*buf)[*len]), data, n) ;
+  (*len) += n ;
+  return 1 ;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+//
+// Local Functions - HPACK
+//
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Decode header block
+// @param[in] hh Handle of HTTP/2 connection
+// @param[out] req Request details, or NULL to discard headers
+// @return true on success, false on compression error
+//
+
+int _hh2_decode(IHTTPD *hh, unsigned char *block, int len, struct hh2_request *req)
+{
+  IHH2 *h2 = (IHH2 *)hh->h2 ;
+  int pos=0 ;
+
+  while (pos<len) {
+
+    unsigned char b = block[pos] ;
+    unsigned index ;
+    char *name=NULL, *value=NULL ;
+    mem *lname=NULL, *lvalue=NULL ;
+
+    if (b & 0x80) {
+
+      // Indexed header field
+
+      if (!_hh2_getint(block, len, &pos, 7, &index) ||
+          !_hh2_table_get(&(h2->dec), index, &name, &value)) return 0 ;
+
+      if (req && !_hh2_emit(hh, req, name, value)) return 0 ;
+
+    } else if ((b & 0xe0) == 0x20) {
+
+      // Dynamic table size update
+
+      if (!_hh2_getint(block, len, &pos, 5, &index) || index > HH2_TABLESIZE) return 0 ;
+      _hh2_table_resize(&(h2->dec), index) ;
+
+    } else {
+
+      // Literal, with incremental indexing (01xxxxxx), without
+      // indexing (0000xxxx) or never indexed (0001xxxx)
+
+      int incremental = ((b & 0xc0) == 0x40) ;
+      if (!_hh2_getint(block, len, &pos, incremental ? 6 : 4, &index)) return 0 ;
+
+      if (index==0) {
+        lname = _hh2_getstr(block, len, &pos) ;
+        name = lname ;
+      } else if (!_hh2_table_get(&(h2->dec), index, &name, &value)) {
+        return 0 ;
+      }
+
+      if (name) lvalue = _hh2_getstr(block, len, &pos) ;
+      value = lvalue ;
+
+      int ok = (name && value) ;
+      if (ok && req) ok = _hh2_emit(hh, req, name, value) ;
+      if (ok && incremental) ok = _hh2_table_add(&(h2->dec), name, value) ;
+
+      mem_free(lname) ;
+      mem_free(lvalue) ;
+      if (!ok) return 0 ;
+
+    }
+
+  }
+
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Add decoded header to request
+// @return true on success, false if out of memory
+//
+
+int _hh2_emit(IHTTPD *hh, struct hh2_request *req, char *name, char *value)
+{
+  if (*name==':') {
+
+    if (req->regular) {
+      req->malformed = 1 ;
+    } else if (strcmp(name, ":method")==0) {
+      req->method = 1 ;
+    } else if (strcmp(name, ":path")==0) {
+      if (req->path || !*value) {
+        req->malformed = 1 ;
+        return 1 ;
+      }
+      req->path = mem_malloc(strlen(value)+1) ;
+      if (!req->path) return 0 ;
+      strcpy(req->path, value) ;
+    } else if (strcmp(name, ":authority")==0) {
+      if ( !str_strcat(hh->transient, "host: ") || !str_strcat(hh->transient, value) ||
+           !str_strcat(hh->transient, "\n") ) req->overflow = 1 ;
+    } else if (strcmp(name, ":scheme")!=0) {
+      req->malformed = 1 ;
+    }
+
+  } else {
+
+    // Headers are stored just as they would be from an HTTP/1.1 request
+
+    req->regular = 1 ;
+    if ( !str_strcat(hh->transient, name) || !str_strcat(hh->transient, ": ") ||
+         !str_strcat(hh->transient, value) || !str_strcat(hh->transient, "\n") ) req->overflow = 1 ;
+
+  }
+
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Encode header field, using the header tables where possible
+// @param[in] t Encoder dynamic table
+// @param[in] index If true, add the field to the dynamic table
+// @return true on success
+//
+
+int _hh2_encode(mem **buf, int *len, struct hh2_table *t, char *name, char *value, int index)
+{
+  int nameindex=0 ;
+
+  for (int i=1; i<=HH2_STATICSIZE+t->count; i++) {
+    char *n, *v ;
+    _hh2_table_get(t, i, &n, &v) ;
+    if (strcmp(n, name)!=0) continue ;
+    if (strcmp(v, value)==0) return _hh2_putint(buf, len, 0x80, 7, i) ;
+    if (!nameindex) nameindex=i ;
+  }
+
+  int ok ;
+  if (index) {
+    ok = _hh2_putint(buf, len, 0x40, 6, nameindex) ;
+  } else {
+    ok = _hh2_putint(buf, len, 0x00, 4, nameindex) ;
+  }
+
+  if (ok && !nameindex) ok = _hh2_putstr(buf, len, name) ;
+  if (ok) ok = _hh2_putstr(buf, len, value) ;
+  if (ok && index) _hh2_table_add(t, name, value) ;
+
+  return ok ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Decode prefixed integer
+// @param[inout] pos Position in buf, updated past the integer
+// @return true on success
+//
+
+int _hh2_getint(unsigned char *buf, int len, int *pos, int prefix, unsigned *value)
+{
+  if (*pos>=len) return 0 ;
+
+  unsigned mask = (1<<prefix)-1 ;
+  unsigned v = buf[(*pos)++] & mask ;
+
+  if (v==mask) {
+    int shift=0 ;
+    unsigned char b ;
+    do {
+      if (*pos>=len || shift>21) return 0 ;
+      b = buf[(*pos)++] ;
+      v += (unsigned)(b & 0x7f) << shift ;
+      shift += 7 ;
+    } while (b & 0x80) ;
+  }
+
+  *value = v ;
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Decode string literal
+// @param[inout] pos Position in buf, updated past the string
+// @return Newly allocated string, or NULL on failure
+//
+
+mem *_hh2_getstr(unsigned char *buf, int len, int *pos)
+{
+  if (*pos>=len) return NULL ;
+
+  int huffman = (buf[*pos] & 0x80) ;
+  unsigned slen ;
+  if (!_hh2_getint(buf, len, pos, 7, &slen) || slen > (unsigned)(len-*pos)) return NULL ;
+
+  // Huffman codes are at least 5 bits
+
+  mem *str = mem_malloc(huffman ? (slen*8)/5+1 : slen+1) ;
+  if (!str) return NULL ;
+
+  if (huffman) {
+    int n = _hh2_huffdecode(&buf[*pos], slen, str) ;
+    if (n<0) {
+      mem_free(str) ;
+      return NULL ;
+    }
+    str[n]='\0' ;
+  } else {
+    memcpy(str, &buf[*pos], slen) ;
+    str[slen]='\0' ;
+  }
+
+  (*pos) += slen ;
+  return str ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Encode prefixed integer
+// @param[in] first Bits to set in the first byte above the prefix
+// @return true on success
+//
+
+int _hh2_putint(mem **buf, int *len, int first, int prefix, unsigned value)
+{
+  unsigned char b[8] ;
+  int n=0 ;
+  unsigned mask = (1<<prefix)-1 ;
+
+  if (value<mask) {
+    b[n++] = first | value ;
+  } else {
+    b[n++] = first | mask ;
+    value -= mask ;
+    while (value>=0x80) {
+      b[n++] = (value & 0x7f) | 0x80 ;
+      value >>= 7 ;
+    }
+    b[n++] = value ;
+  }
+
+  return _hh2_append(buf, len, b, n) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Encode string literal, Huffman coded if that makes it shorter
+// @return true on success
+//
+
+int _hh2_putstr(mem **buf, int *len, char *str)
+{
+  int slen = strlen(str) ;
+  int hlen = _hh2_hufflength((unsigned char *)str, slen) ;
+
+  if (hlen >= slen) {
+    return ( _hh2_putint(buf, len, 0x00, 7, slen) &&
+             _hh2_append(buf, len, str, slen) ) ;
+  }
+
+  if (!_hh2_putint(buf, len, 0x80, 7, hlen) ||
+      !_hh2_append(buf, len, str, hlen)) return 0 ;
+
+  // Encode over the space reserved
+
+  _hh2_huffencode((unsigned char *)str, slen, (unsigned char *)&((*buf)[(*len)-hlen])) ;
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Build canonical Huffman codes from the code lengths
+//
+
+void _hh2_huffinit()
+{
+  int n=0 ;
+
+  for (int len=5; len<=30; len++) {
+    for (int sym=0; sym<=HH2_EOS; sym++) {
+      if (_hh2_hufflen[sym]==len) _hh2_huffsorted[n++]=sym ;
+    }
+  }
+
+  unsigned code=0 ;
+  int prevlen=_hh2_hufflen[_hh2_huffsorted[0]] ;
+
+  for (int i=0; i<n; i++) {
+    int sym=_hh2_huffsorted[i] ;
+    int len=_hh2_hufflen[sym] ;
+    if (i>0) code = (code+1) << (len-prevlen) ;
+    prevlen = len ;
+    _hh2_huffcode[sym] = code ;
+    if (_hh2_huffcount[len]==0) {
+      _hh2_hufffirst[len] = code ;
+      _hh2_huffoffset[len] = i ;
+    }
+    _hh2_huffcount[len]++ ;
+  }
+
+  _hh2_huffready=1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Huffman decode string
+// @return Length of decoded string, or -1 if invalid
+//
+
+int _hh2_huffdecode(unsigned char *in, int len, char *out)
+{
+  if (!_hh2_huffready) _hh2_huffinit() ;
+
+  unsigned code=0 ;
+  int bits=0 ;
+  int n=0 ;
+
+  for (int i=0; i<len; i++) {
+    for (int bit=7; bit>=0; bit--) {
+
+      code = (code<<1) | ((in[i]>>bit) & 1) ;
+      bits++ ;
+
+      // With canonical codes, a complete code of this length
+      // falls within the range of codes for the length
+
+      if (code - _hh2_hufffirst[bits] < (unsigned)_hh2_huffcount[bits]) {
+        int sym = _hh2_huffsorted[_hh2_huffoffset[bits] + code - _hh2_hufffirst[bits]] ;
+        if (sym==HH2_EOS) return -1 ;
+        out[n++] = sym ;
+        code=0 ;
+        bits=0 ;
+      } else if (bits>=30) {
+        return -1 ;
+      }
+
+    }
+  }
+
+  // Padding must be fewer than 8 bits, all ones (a prefix of EOS)
+
+  if (bits>7 || code != (1u<<bits)-1) return -1 ;
+
+  return n ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Huffman encode string
+// @param[out] out Buffer of at least _hh2_hufflength bytes
+// @return Length of encoded string
+//
+
+int _hh2_huffencode(unsigned char *in, int len, unsigned char *out)
+{
+  if (!_hh2_huffready) _hh2_huffinit() ;
+
+  uint64_t acc=0 ;
+  int bits=0 ;
+  int n=0 ;
+
+  for (int i=0; i<len; i++) {
+    acc = (acc << _hh2_hufflen[in[i]]) | _hh2_huffcode[in[i]] ;
+    bits += _hh2_hufflen[in[i]] ;
+    while (bits>=8) {
+      out[n++] = (acc >> (bits-8)) & 0xff ;
+      bits -= 8 ;
+    }
+  }
+
+  if (bits>0) out[n++] = ((acc << (8-bits)) | (0xff >> bits)) & 0xff ;
+
+  return n ;
+}
+
+
+int _hh2_hufflength(unsigned char *in, int len)
+{
+  int bits=0 ;
+  for (int i=0; i<len; i++) bits += _hh2_hufflen[in[i]] ;
+  return (bits+7)/8 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Header table management.  Indices 1-61 refer to the static
+//        table, and the dynamic table follows, newest entry first.
+//
+
+int _hh2_table_init(struct hh2_table *t)
+{
+  t->entries = (char **)mem_malloc(sizeof(char *) * (HH2_TABLESIZE/32 + 1)) ;
+  t->count = 0 ;
+  t->size = 0 ;
+  t->maxsize = HH2_TABLESIZE ;
+  return (t->entries!=NULL) ;
+}
+
+
+int _hh2_table_add(struct hh2_table *t, char *name, char *value)
+{
+  int nlen = strlen(name) ;
+  int vlen = strlen(value) ;
+  int esize = nlen + vlen + 32 ;
+
+  // An entry larger than the whole table just empties it
+
+  if (esize > t->maxsize) {
+    _hh2_table_evict(t, 0) ;
+    return 1 ;
+  }
+
+  // Copy the entry before evicting, as its name may refer to an entry
+  // which is evicted (RFC 7541 4.4)
+
+  mem *e = mem_malloc(nlen+vlen+2) ;
+  if (!e) return 0 ;
+  memcpy(e, name, nlen+1) ;
+  memcpy(&e[nlen+1], value, vlen+1) ;
+
+  // Evict oldest entries to make room
+
+  _hh2_table_evict(t, t->maxsize - esize) ;
+
+  memmove(&(t->entries[1]), &(t->entries[0]), t->count*sizeof(char *)) ;
+  t->entries[0] = e ;
+  t->count++ ;
+  t->size += esize ;
+  return 1 ;
+}
+
+
+int _hh2_table_get(struct hh2_table *t, unsigned index, char **name, char **value)
+{
+  if (index<1) {
+    return 0 ;
+  } else if (index<=HH2_STATICSIZE) {
+    *name = (char *)_hh2_static[index-1][0] ;
+    *value = (char *)_hh2_static[index-1][1] ;
+  } else if (index-HH2_STATICSIZE <= (unsigned)t->count) {
+    *name = t->entries[index-HH2_STATICSIZE-1] ;
+    *value = &((*name)[strlen(*name)+1]) ;
+  } else {
+    return 0 ;
+  }
+  return 1 ;
+}
+
+
+void _hh2_table_resize(struct hh2_table *t, int maxsize)
+{
+  _hh2_table_evict(t, maxsize) ;
+  t->maxsize = maxsize ;
+}
+
+
+void _hh2_table_evict(struct hh2_table *t, int size)
+{
+  while (t->count>0 && t->size > size) {
+    char *e = t->entries[--(t->count)] ;
+    t->size -= strlen(e) + strlen(&e[strlen(e)+1]) + 32 ;
+    mem_free(e) ;
+  }
+}
+
+
+void _hh2_table_free(struct hh2_table *t)
+{
+  if (!t->entries) return ;
+  while (t->count>0) mem_free(t->entries[--(t->count)]) ;
+  mem_free((mem *)t->entries) ;
+  t->entries = NULL ;
+}
@@ -0,0 +1,1023 @@
+//
+// httpdloop.c
+//
+// Built-in server loop for the httpd listener
+//
+//   int httpd_loop_init(enum httpd_backend backend, void (*handler)(HTTPD *hh, int code)) ;
+//   int httpd_loop_run(int timeoutms) ;
+//   int httpd_loop_stats(long *requests, long *syscalls) ;
+//   int httpd_loop_shutdown() ;
+//
+// NOTES
+//
+// Rather than driving haccept / hrecv / hsend from its own select loop,
+// an application can hand the plain listener to httpd_loop.  The loop
+// accepts connections, reads requests into a per-session input buffer
+// (which hrecv then parses without further system calls), calls the
+// handler once a request is complete, and sends the queued response
+// before closing the connection.
+//
+// HTTP/2 connections (see httpd_h2_enable) stay open.  The handler is
+// called for each stream in turn, and the connection's output is sent
+// while the loop carries on receiving.  With io_uring, the output
+// queue is handed over to the loop (loopout) while it is being sent,
+// so that responses queued in the meantime can't move it.
+//
+// Two backends are available:
+//
+//  epoll    One epoll_wait per loop, then accept4 / recv / send / close
+//           for each connection.
+//
+//  io_uring One io_uring_enter per loop, which both submits and reaps.
+//           A single multishot accept is armed on the listener, recv
+//           draws on a group of provided buffers, and each response is
+//           sent with a send linked to a close.
+//
+// io_uring is used when requested (or for HTTPD_BACKEND_AUTO) if the
+// kernel supports it, otherwise the loop falls back to epoll.  Define
+// NOURING at compile time to leave io_uring out altogether.
+//
+// Session handles are tagged into the 64-bit io_uring user_data; the
+// mem_malloc header guarantees the bottom 4 bits of the handle are zero.
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+#ifndef NOURING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "../log.h"
+#include "../mem.h"
+
+#include "ihttpd.h"
+
+
+// Local constants
+
+#define HTTPD_LOOP_BUFLEN 4096
+#define HTTPD_LOOP_MAXEVENTS 256
+#define HTTPD_URING_ENTRIES 1024
+#define HTTPD_URING_NUMBUFS 1024
+#define HTTPD_URING_BGID 1
+
+// Session loopflags
+
+#define HTTPD_LOOP_SENDING 1   // Response is being sent, session closing
+#define HTTPD_LOOP_INFLIGHT 2  // HTTP/2 output is being sent (io_uring)
+#define HTTPD_LOOP_CLOSING 4   // Close once output has been sent (io_uring)
+#define HTTPD_LOOP_WANTOUT 8   // Waiting for socket to become writable (epoll)
+
+// io_uring user_data tags
+
+#define TAG_ACCEPT 1
+#define TAG_RECV 2
+#define TAG_SEND 3
+#define TAG_CLOSE 4
+#define TAG_PROVIDE 5
+#define TAG_H2SEND 6
+#define TAG_MASK 0xF
+
+// Local data
+
+int _httpd_loop_backend=-1 ;
+void (*_httpd_loop_handler)(IHTTPD *hh, int code)=NULL ;
+int _httpd_loop_listenfd=-1 ;
+long _httpd_loop_requests=0 ;
+long _httpd_loop_syscalls=0 ;
+
+// Set by tests to have multishot accept refused, as by kernels before 5.19
+int _httpd_loop_nomultishot=0 ;
+
+int _httpd_epfd=-1 ;
+
+#ifndef NOURING
+
+struct httpd_uring {
+  int fd ;
+  void *sqring ;
+  void *cqring ;
+  size_t sqringsz ;
+  size_t cqringsz ;
+  struct io_uring_sqe *sqes ;
+  size_t sqesz ;
+  unsigned *sqhead ;
+  unsigned *sqtail ;
+  unsigned *sqmask ;
+  unsigned *sqarray ;
+  unsigned sqentries ;
+  unsigned sqlocaltail ;
+  unsigned *cqhead ;
+  unsigned *cqtail ;
+  unsigned *cqmask ;
+  struct io_uring_cqe *cqes ;
+  unsigned tosubmit ;
+  int multishot ;
+  char *bufs ;
+} ;
+
+struct httpd_uring _httpd_uring ;
+
+#endif
+
+// Local functions
+
+int _httpd_epoll_init() ;
+int _httpd_epoll_run(int timeoutms) ;
+void _httpd_epoll_send(IHTTPD *hh) ;
+int _httpd_epoll_h2send(IHTTPD *hh) ;
+void _httpd_epoll_shutdown() ;
+int _httpd_loop_process(IHTTPD *hh) ;
+void _httpd_loop_free(IHTTPD *hh) ;
+
+#ifndef NOURING
+int _httpd_uring_init() ;
+int _httpd_uring_run(int timeoutms) ;
+void _httpd_uring_shutdown() ;
+struct io_uring_sqe *_httpd_uring_sqe() ;
+int _httpd_uring_enter(unsigned wait, int timeoutms) ;
+void _httpd_uring_accept() ;
+void _httpd_uring_recv(IHTTPD *hh) ;
+void _httpd_uring_provide(int bid, int count) ;
+void _httpd_uring_close(IHTTPD *hh) ;
+void _httpd_uring_finish(IHTTPD *hh) ;
+void _httpd_uring_h2send(IHTTPD *hh) ;
+void _httpd_uring_complete(struct io_uring_cqe *cqe) ;
+#endif
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Start built-in server loop on the httpd listener
+// @param[in] backend Requested backend
+// @param[in] handler Function called with each completed request, and the
+//                    hrecv result code.  It responds with hsend / hsendb.
+// @return Backend in use, or -1 on failure
+//
+
+int httpd_loop_init(enum httpd_backend backend, void (*handler)(IHTTPD *hh, int code))
+{
+  if (!handler) return -1 ;
+
+  httpd_loop_shutdown() ;
+
+  // The TCP listener is served, or the Unix domain listener if
+  // that has been started without it
+
+  if (httpd_port()==0 && httpd_unix_listenfd()>=0) {
+    _httpd_loop_listenfd = httpd_unix_listenfd() ;
+  } else {
+    _httpd_loop_listenfd = httpd_listenfd() ;
+  }
+  if (_httpd_loop_listenfd<0) return -1 ;
+
+  _httpd_loop_handler = handler ;
+  _httpd_loop_requests = 0 ;
+  _httpd_loop_syscalls = 0 ;
+
+  // Peers closing early mustn't kill the server
+
+  signal(SIGPIPE, SIG_IGN) ;
+
+#ifndef NOURING
+  if (backend!=HTTPD_BACKEND_EPOLL) {
+    if (_httpd_uring_init()) {
+      _httpd_loop_backend = HTTPD_BACKEND_URING ;
+      return _httpd_loop_backend ;
+    }
+    logmsg(LOG_INFO, "httpd: io_uring not available, using epoll") ;
+  }
+#endif
+
+  if (!_httpd_epoll_init()) return -1 ;
+  _httpd_loop_backend = HTTPD_BACKEND_EPOLL ;
+  return _httpd_loop_backend ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Run one iteration of the server loop, including due timers
+// @param[in] timeoutms Maximum time to wait for events (-1 for no limit)
+// @return Number of requests handled, or -1 on error
+//
+
+int httpd_loop_run(int timeoutms)
+{
+  int tm = httpd_timer_next() ;
+  if (tm>=0 && (timeoutms<0 || tm<timeoutms)) timeoutms=tm ;
+
+  int r=-1 ;
+  long before = _httpd_loop_requests ;
+
+  switch (_httpd_loop_backend) {
+  case HTTPD_BACKEND_EPOLL:
+    r = _httpd_epoll_run(timeoutms) ;
+    break ;
+#ifndef NOURING
+  case HTTPD_BACKEND_URING:
+    r = _httpd_uring_run(timeoutms) ;
+    break ;
+#endif
+  default:
+    return -1 ;
+  }
+
+  httpd_timer_run() ;
+
+  if (r<0) return -1 ;
+  return (int)(_httpd_loop_requests-before) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Get server loop counters
+// @param[out] requests Number of requests handled (may be NULL)
+// @param[out] syscalls Number of system calls made by the loop (may be NULL)
+// @return Backend in use, or -1 if the loop is not running
+//
+
+int httpd_loop_stats(long *requests, long *syscalls)
+{
+  if (requests) (*requests) = _httpd_loop_requests ;
+  if (syscalls) (*syscalls) = _httpd_loop_syscalls ;
+  return _httpd_loop_backend ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Stop the server loop (the listener stays open)
+// @return true
+//
+
+int httpd_loop_shutdown()
+{
+  switch (_httpd_loop_backend) {
+  case HTTPD_BACKEND_EPOLL:
+    _httpd_epoll_shutdown() ;
+    break ;
+#ifndef NOURING
+  case HTTPD_BACKEND_URING:
+    _httpd_uring_shutdown() ;
+    break ;
+#endif
+  }
+  _httpd_loop_backend = -1 ;
+  return 1 ;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+//
+// Local Functions - common
+//
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Parse buffered input, and call the handler once complete
+// @param[in] hh Handle of HTTPD session
+// @return 0 - more input required, 1 - response ready to send, -1 - close
+//         2 - HTTP/2 connection, send any output and carry on receiving
+//
+
+int _httpd_loop_process(IHTTPD *hh)
+{
+  while (hh->inpos < hh->inlen) {
+
+    int code = hrecv(hh) ;
+
+    if (code>0) {
+      _httpd_loop_requests++ ;
+      _httpd_loop_handler(hh, code) ;
+      return (hh->outlen>0) ? 1 : -1 ;
+    } else if (code<0) {
+      return -1 ;
+    }
+
+  }
+
+  // Everything so far has been consumed by the parser
+
+  hh->inpos = hh->inlen = 0 ;
+
+  // HTTP/2 requests each arrive on their own stream
+
+  if (hh->mode==H2) {
+    IHTTPD *st ;
+    while ((st=hh2_getstream(hh))) {
+      _httpd_loop_requests++ ;
+      _httpd_loop_handler(st, hrecv(st)) ;
+      hclose(st) ;
+    }
+    return 2 ;
+  }
+
+  return 0 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Free session after its socket has been closed
+// @param[in] hh Handle of HTTPD session
+//
+
+void _httpd_loop_free(IHTTPD *hh)
+{
+  hh->fd=-1 ;
+  hclose(hh) ;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+//
+// Local Functions - epoll backend
+//
+
+
+int _httpd_epoll_init()
+{
+  _httpd_epfd = epoll_create1(0) ;
+  if (_httpd_epfd<0) return 0 ;
+
+  struct epoll_event ev ;
+  memset(&ev, 0, sizeof(ev)) ;
+  ev.events = EPOLLIN ;
+  ev.data.ptr = NULL ;
+
+  if (epoll_ctl(_httpd_epfd, EPOLL_CTL_ADD, _httpd_loop_listenfd, &ev)<0) {
+    close(_httpd_epfd) ;
+    _httpd_epfd=-1 ;
+    return 0 ;
+  }
+
+  return 1 ;
+}
+
+
+int _httpd_epoll_run(int timeoutms)
+{
+  struct epoll_event events[HTTPD_LOOP_MAXEVENTS] ;
+
+  int n = epoll_wait(_httpd_epfd, events, HTTPD_LOOP_MAXEVENTS, timeoutms) ;
+  _httpd_loop_syscalls++ ;
+  if (n<0) return (errno==EINTR) ? 0 : -1 ;
+
+  for (int i=0; i<n; i++) {
+
+    IHTTPD *hh = (IHTTPD *)events[i].data.ptr ;
+
+    if (!hh) {
+
+      // Listener - accept everything waiting
+
+      for (;;) {
+
+        struct sockaddr_in cli_addr ;
+        socklen_t clilen = sizeof(cli_addr) ;
+        int fd = accept4(_httpd_loop_listenfd, (struct sockaddr *)&cli_addr, &clilen, SOCK_NONBLOCK) ;
+        _httpd_loop_syscalls++ ;
+        if (fd<0) break ;
+
+        IHTTPD *nh = _httpd_newsession(fd, &cli_addr) ;
+        if (nh) nh->in = mem_malloc(HTTPD_LOOP_BUFLEN) ;
+        if (!nh || !nh->in) {
+          close(fd) ;
+          if (nh) _httpd_loop_free(nh) ;
+          continue ;
+        }
+
+        struct epoll_event ev ;
+        memset(&ev, 0, sizeof(ev)) ;
+        ev.events = EPOLLIN ;
+        ev.data.ptr = nh ;
+        _httpd_loop_syscalls++ ;
+        if (epoll_ctl(_httpd_epfd, EPOLL_CTL_ADD, fd, &ev)<0) {
+          close(fd) ;
+          _httpd_loop_free(nh) ;
+        }
+
+      }
+
+    } else if (hh->loopflags & HTTPD_LOOP_SENDING) {
+
+      // Writable again - continue sending response
+
+      _httpd_epoll_send(hh) ;
+
+    } else {
+
+      // HTTP/2 connections may also be waiting to send
+
+      if ( (events[i].events & EPOLLOUT) && !_httpd_epoll_h2send(hh) ) continue ;
+      if ( !(events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) ) continue ;
+
+      int r = recv(hh->fd, &(hh->in[hh->inlen]), mem_length(hh->in)-hh->inlen, 0) ;
+      _httpd_loop_syscalls++ ;
+      _httpd_count(hh, 1, r) ;
+
+      if (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) continue ;
+
+      int action = -1 ;
+      if (r>0) {
+        hh->inlen += r ;
+        action = _httpd_loop_process(hh) ;
+      }
+
+      if (action==2) {
+        _httpd_epoll_h2send(hh) ;
+      } else if (action>0) {
+        hh->loopflags |= HTTPD_LOOP_SENDING ;
+        _httpd_epoll_send(hh) ;
+      } else if (action<0) {
+
+        // Best effort to deliver an HTTP/2 GOAWAY
+
+        if (r>0 && hh->mode==H2 && hh->outlen>0) {
+          send(hh->fd, hh->out, hh->outlen, MSG_NOSIGNAL) ;
+          _httpd_loop_syscalls++ ;
+        }
+
+        close(hh->fd) ;
+        _httpd_loop_syscalls++ ;
+        _httpd_loop_free(hh) ;
+      }
+
+    }
+
+  }
+
+  return n ;
+}
+
+
+void _httpd_epoll_send(IHTTPD *hh)
+{
+  while (hh->outlen>0) {
+
+    int r = send(hh->fd, hh->out, hh->outlen, MSG_NOSIGNAL) ;
+    _httpd_loop_syscalls++ ;
+    _httpd_count(hh, 0, r) ;
+
+    if (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+
+      // Wait until writable
+
+      struct epoll_event ev ;
+      memset(&ev, 0, sizeof(ev)) ;
+      ev.events = EPOLLOUT ;
+      ev.data.ptr = hh ;
+      epoll_ctl(_httpd_epfd, EPOLL_CTL_MOD, hh->fd, &ev) ;
+      _httpd_loop_syscalls++ ;
+      return ;
+
+    } else if (r<0) {
+
+      break ;
+
+    }
+
+    memmove(hh->out, &(hh->out[r]), hh->outlen-r) ;
+    hh->outlen -= r ;
+
+  }
+
+  // Response sent (Connection: close), and close removes
+  // the socket from the epoll set
+
+  close(hh->fd) ;
+  _httpd_loop_syscalls++ ;
+  _httpd_loop_free(hh) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Send queued HTTP/2 output, waiting for the socket to become
+//        writable if it won't all go
+// @param[in] hh Handle of HTTP/2 connection
+// @return true, or false if the session has been closed
+//
+
+int _httpd_epoll_h2send(IHTTPD *hh)
+{
+  while (hh->outlen>0) {
+
+    int r = send(hh->fd, hh->out, hh->outlen, MSG_NOSIGNAL) ;
+    _httpd_loop_syscalls++ ;
+    _httpd_count(hh, 0, r) ;
+
+    if (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+      break ;
+    } else if (r<0) {
+      close(hh->fd) ;
+      _httpd_loop_syscalls++ ;
+      _httpd_loop_free(hh) ;
+      return 0 ;
+    }
+
+    memmove(hh->out, &(hh->out[r]), hh->outlen-r) ;
+    hh->outlen -= r ;
+
+    // Responses held back by the output queue limit
+
+    _hh2_drained(hh) ;
+
+  }
+
+  int wantout = (hh->outlen>0) ? HTTPD_LOOP_WANTOUT : 0 ;
+
+  if ( wantout != (hh->loopflags & HTTPD_LOOP_WANTOUT) ) {
+    struct epoll_event ev ;
+    memset(&ev, 0, sizeof(ev)) ;
+    ev.events = EPOLLIN | (wantout ? EPOLLOUT : 0) ;
+    ev.data.ptr = hh ;
+    epoll_ctl(_httpd_epfd, EPOLL_CTL_MOD, hh->fd, &ev) ;
+    _httpd_loop_syscalls++ ;
+    hh->loopflags ^= HTTPD_LOOP_WANTOUT ;
+  }
+
+  return 1 ;
+}
+
+
+void _httpd_epoll_shutdown()
+{
+  // Sessions still open are abandoned with the epoll set
+
+  if (_httpd_epfd>=0) close(_httpd_epfd) ;
+  _httpd_epfd=-1 ;
+}
+
+
+
+#ifndef NOURING
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+//
+// Local Functions - io_uring backend
+//
+
+
+int _httpd_uring_init()
+{
+  struct httpd_uring *u = &_httpd_uring ;
+  struct io_uring_params p ;
+
+  memset(u, 0, sizeof(*u)) ;
+  memset(&p, 0, sizeof(p)) ;
+  u->fd=-1 ;
+
+  u->fd = syscall(__NR_io_uring_setup, HTTPD_URING_ENTRIES, &p) ;
+  if (u->fd<0) return 0 ;
+
+  // Timeouts are passed with io_uring_enter (5.11), and completions
+  // must never be dropped
+
+  if ( !(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP) ) {
+    goto fail ;
+  }
+
+  // Check the required operations are supported
+
+  int probesz = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op) ;
+  struct io_uring_probe *probe = calloc(1, probesz) ;
+  if (!probe) goto fail ;
+
+  int supported = ( syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, 256) >= 0 ) ;
+  int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_CLOSE, IORING_OP_PROVIDE_BUFFERS } ;
+  for (int i=0; supported && i<sizeof(ops)/sizeof(ops[0]); i++) {
+    supported = ( ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) ) ;
+  }
+  free(probe) ;
+  if (!supported) goto fail ;
+
+  // Map the rings
+
+  u->sqringsz = p.sq_off.array + p.sq_entries*sizeof(unsigned) ;
+  u->cqringsz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe) ;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cqringsz > u->sqringsz) u->sqringsz = u->cqringsz ;
+    u->cqringsz = u->sqringsz ;
+  }
+
+  u->sqring = mmap(NULL, u->sqringsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING) ;
+  if (u->sqring==MAP_FAILED) { u->sqring=NULL ; goto fail ; }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    u->cqring = u->sqring ;
+  } else {
+    u->cqring = mmap(NULL, u->cqringsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING) ;
+    if (u->cqring==MAP_FAILED) { u->cqring=NULL ; goto fail ; }
+  }
+
+  u->sqesz = p.sq_entries*sizeof(struct io_uring_sqe) ;
+  u->sqes = mmap(NULL, u->sqesz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES) ;
+  if (u->sqes==MAP_FAILED) { u->sqes=NULL ; goto fail ; }
+
+  u->sqhead = (unsigned *)((char *)u->sqring + p.sq_off.head) ;
+  u->sqtail = (unsigned *)((char *)u->sqring + p.sq_off.tail) ;
+  u->sqmask = (unsigned *)((char *)u->sqring + p.sq_off.ring_mask) ;
+  u->sqarray = (unsigned *)((char *)u->sqring + p.sq_off.array) ;
+  u->sqentries = p.sq_entries ;
+  u->sqlocaltail = *(u->sqtail) ;
+
+  u->cqhead = (unsigned *)((char *)u->cqring + p.cq_off.head) ;
+  u->cqtail = (unsigned *)((char *)u->cqring + p.cq_off.tail) ;
+  u->cqmask = (unsigned *)((char *)u->cqring + p.cq_off.ring_mask) ;
+  u->cqes = (struct io_uring_cqe *)((char *)u->cqring + p.cq_off.cqes) ;
+
+  // Provide receive buffers, and start accepting
+
+  u->bufs = malloc(HTTPD_URING_NUMBUFS*HTTPD_LOOP_BUFLEN) ;
+  if (!u->bufs) goto fail ;
+
+  u->multishot = 1 ;
+  _httpd_uring_provide(0, HTTPD_URING_NUMBUFS) ;
+  _httpd_uring_accept() ;
+  if (_httpd_uring_enter(0, -1)<0) goto fail ;
+
+  return 1 ;
+
+fail:
+  _httpd_uring_shutdown() ;
+  return 0 ;
+}
+
+
+int _httpd_uring_run(int timeoutms)
+{
+  struct httpd_uring *u = &_httpd_uring ;
+
+  if (_httpd_uring_enter(1, timeoutms)<0) return -1 ;
+
+  int n=0 ;
+  unsigned head = *(u->cqhead) ;
+
+  while (head != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+
+    struct io_uring_cqe cqe = u->cqes[head & *(u->cqmask)] ;
+    head++ ;
+    __atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE) ;
+
+    _httpd_uring_complete(&cqe) ;
+    n++ ;
+
+  }
+
+  return n ;
+}
+
+
+void _httpd_uring_complete(struct io_uring_cqe *cqe)
+{
+  IHTTPD *hh = (IHTTPD *)(uintptr_t)(cqe->user_data & ~(uint64_t)TAG_MASK) ;
+  int res = cqe->res ;
+
+  switch (cqe->user_data & TAG_MASK) {
+
+  case TAG_ACCEPT:
+
+    if (res>=0) {
+
+      IHTTPD *nh = _httpd_newsession(res, NULL) ;
+      if (nh) nh->in = mem_malloc(HTTPD_LOOP_BUFLEN) ;
+      if (nh && nh->in) {
+        _httpd_uring_recv(nh) ;
+      } else {
+        close(res) ;
+        if (nh) _httpd_loop_free(nh) ;
+      }
+
+    }
+
+    if (res==-EINVAL && _httpd_uring.multishot) {
+
+      // Kernel doesn't support multishot accept - re-arm for each connection
+
+      _httpd_uring.multishot=0 ;
+      _httpd_uring_accept() ;
+
+    } else if (!(cqe->flags & IORING_CQE_F_MORE)) {
+
+      _httpd_uring_accept() ;
+
+    }
+    break ;
+
+  case TAG_RECV:
+
+    _httpd_count(hh, 1, res) ;
+
+    if (res>0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+
+      int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT ;
+      int space = mem_length(hh->in) - hh->inlen ;
+      int len = (res<space) ? res : space ;
+      memcpy(&(hh->in[hh->inlen]), &(_httpd_uring.bufs[bid*HTTPD_LOOP_BUFLEN]), len) ;
+      hh->inlen += len ;
+      _httpd_uring_provide(bid, 1) ;
+
+      // A failed HTTP/2 send leaves the session in the error state
+
+      int action = -1 ;
+      if (hh->state!=ERROR) {
+        action = _httpd_loop_process(hh) ;
+      } else {
+        hh->outlen=0 ;
+      }
+
+      if (action==0) {
+        _httpd_uring_recv(hh) ;
+      } else if (action==2) {
+        _httpd_uring_recv(hh) ;
+        _httpd_uring_h2send(hh) ;
+      } else if (action>0) {
+        hh->loopflags |= HTTPD_LOOP_SENDING ;
+        _httpd_uring_close(hh) ;
+      } else {
+        _httpd_uring_finish(hh) ;
+      }
+
+    } else if (res==-ENOBUFS) {
+
+      // All buffers in use - they are returned as sessions are processed
+
+      _httpd_uring_recv(hh) ;
+
+    } else {
+
+      hh->outlen=0 ;
+      _httpd_uring_finish(hh) ;
+
+    }
+    break ;
+
+  case TAG_H2SEND:
+
+    hh->loopflags &= ~HTTPD_LOOP_INFLIGHT ;
+    _httpd_count(hh, 0, res) ;
+
+    if (res<0) {
+
+      // The pending recv will fail too, and close the session
+
+      hh->loopoutlen=0 ;
+      hh->state=ERROR ;
+      if (hh->loopflags & HTTPD_LOOP_CLOSING) {
+        hh->outlen=0 ;
+        _httpd_uring_close(hh) ;
+      }
+
+    } else if (res < hh->loopoutlen) {
+
+      memmove(hh->loopout, &(hh->loopout[res]), hh->loopoutlen-res) ;
+      hh->loopoutlen -= res ;
+      _httpd_uring_h2send(hh) ;
+
+    } else {
+
+      hh->loopoutlen=0 ;
+      if (hh->loopflags & HTTPD_LOOP_CLOSING) {
+        _httpd_uring_close(hh) ;
+      } else {
+        _hh2_drained(hh) ;
+        _httpd_uring_h2send(hh) ;
+      }
+
+    }
+    break ;
+
+  case TAG_SEND:
+
+    _httpd_count(hh, 0, res) ;
+
+    // Failure (or short send) cancels the linked close, which is
+    // dealt with when its completion arrives
+
+    break ;
+
+  case TAG_CLOSE:
+
+    if (res==-ECANCELED) {
+      hh->outlen=0 ;
+      _httpd_uring_close(hh) ;
+    } else {
+      _httpd_loop_free(hh) ;
+    }
+    break ;
+
+  case TAG_PROVIDE:
+
+    if (res<0) logmsg(LOG_ERR, "httpd: io_uring provide buffers failed - %s", strerror(-res)) ;
+    break ;
+
+  }
+}
+
+
+struct io_uring_sqe *_httpd_uring_sqe()
+{
+  struct httpd_uring *u = &_httpd_uring ;
+
+  if (u->sqlocaltail - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE) >= u->sqentries) {
+    _httpd_uring_enter(0, -1) ;
+  }
+
+  unsigned idx = u->sqlocaltail & *(u->sqmask) ;
+  struct io_uring_sqe *sqe = &(u->sqes[idx]) ;
+  memset(sqe, 0, sizeof(*sqe)) ;
+  u->sqarray[idx] = idx ;
+  u->sqlocaltail++ ;
+  u->tosubmit++ ;
+  return sqe ;
+}
+
+
+int _httpd_uring_enter(unsigned wait, int timeoutms)
+{
+  struct httpd_uring *u = &_httpd_uring ;
+
+  __atomic_store_n(u->sqtail, u->sqlocaltail, __ATOMIC_RELEASE) ;
+
+  struct __kernel_timespec ts ;
+  struct io_uring_getevents_arg arg ;
+  memset(&arg, 0, sizeof(arg)) ;
+
+  unsigned flags = IORING_ENTER_EXT_ARG ;
+  if (wait) flags |= IORING_ENTER_GETEVENTS ;
+  if (wait && timeoutms>=0) {
+    ts.tv_sec = timeoutms/1000 ;
+    ts.tv_nsec = (timeoutms%1000)*1000000LL ;
+    arg.ts = (uint64_t)(uintptr_t)&ts ;
+  }
+
+  int r = syscall(__NR_io_uring_enter, u->fd, u->tosubmit, wait, flags, &arg, sizeof(arg)) ;
+  _httpd_loop_syscalls++ ;
+
+  if (r>=0) {
+    u->tosubmit -= r ;
+  } else if (errno==ETIME || errno==EINTR || errno==EBUSY) {
+    r=0 ;
+  }
+
+  return r ;
+}
+
+
+void _httpd_uring_accept()
+{
+  struct io_uring_sqe *sqe = _httpd_uring_sqe() ;
+  sqe->opcode = IORING_OP_ACCEPT ;
+  sqe->fd = _httpd_loop_listenfd ;
+  sqe->ioprio = _httpd_uring.multishot ? IORING_ACCEPT_MULTISHOT : 0 ;
+  if (_httpd_uring.multishot && _httpd_loop_nomultishot) sqe->ioprio |= 0x8000 ;
+  sqe->user_data = TAG_ACCEPT ;
+}
+
+
+void _httpd_uring_recv(IHTTPD *hh)
+{
+  struct io_uring_sqe *sqe = _httpd_uring_sqe() ;
+  sqe->opcode = IORING_OP_RECV ;
+  sqe->fd = hh->fd ;
+  sqe->len = HTTPD_LOOP_BUFLEN ;
+  sqe->flags = IOSQE_BUFFER_SELECT ;
+  sqe->buf_group = HTTPD_URING_BGID ;
+  sqe->user_data = (uint64_t)(uintptr_t)hh | TAG_RECV ;
+}
+
+
+void _httpd_uring_provide(int bid, int count)
+{
+  struct io_uring_sqe *sqe = _httpd_uring_sqe() ;
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS ;
+  sqe->fd = count ;
+  sqe->addr = (uint64_t)(uintptr_t)&(_httpd_uring.bufs[bid*HTTPD_LOOP_BUFLEN]) ;
+  sqe->len = HTTPD_LOOP_BUFLEN ;
+  sqe->off = bid ;
+  sqe->buf_group = HTTPD_URING_BGID ;
+  sqe->user_data = TAG_PROVIDE ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Send any queued response, and close the session socket
+// @param[in] hh Handle of HTTPD session
+//
+
+void _httpd_uring_close(IHTTPD *hh)
+{
+  struct io_uring_sqe *sqe ;
+
+  if (hh->outlen>0) {
+
+    // MSG_WAITALL makes a short send fail, which cancels the link
+
+    sqe = _httpd_uring_sqe() ;
+    sqe->opcode = IORING_OP_SEND ;
+    sqe->fd = hh->fd ;
+    sqe->addr = (uint64_t)(uintptr_t)hh->out ;
+    sqe->len = hh->outlen ;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL ;
+    sqe->flags = IOSQE_IO_LINK ;
+    sqe->user_data = (uint64_t)(uintptr_t)hh | TAG_SEND ;
+
+  }
+
+  sqe = _httpd_uring_sqe() ;
+  sqe->opcode = IORING_OP_CLOSE ;
+  sqe->fd = hh->fd ;
+  sqe->user_data = (uint64_t)(uintptr_t)hh | TAG_CLOSE ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Close session socket once no HTTP/2 send is in flight
+// @param[in] hh Handle of HTTPD session
+//
+
+void _httpd_uring_finish(IHTTPD *hh)
+{
+  if (hh->loopflags & HTTPD_LOOP_INFLIGHT) {
+    hh->loopflags |= HTTPD_LOOP_CLOSING ;
+  } else {
+    _httpd_uring_close(hh) ;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Send HTTP/2 output, unless a send is already in flight
+// @param[in] hh Handle of HTTP/2 connection
+//
+
+void _httpd_uring_h2send(IHTTPD *hh)
+{
+  if (hh->loopflags & HTTPD_LOOP_INFLIGHT) return ;
+
+  // Partly sent output is finished first
+
+  if (hh->loopoutlen==0) {
+    if (hh->outlen==0) return ;
+    mem *m = hh->loopout ;
+    hh->loopout = hh->out ;
+    hh->loopoutlen = hh->outlen ;
+    hh->out = m ;
+    hh->outlen = 0 ;
+  }
+
+  struct io_uring_sqe *sqe = _httpd_uring_sqe() ;
+  sqe->opcode = IORING_OP_SEND ;
+  sqe->fd = hh->fd ;
+  sqe->addr = (uint64_t)(uintptr_t)hh->loopout ;
+  sqe->len = hh->loopoutlen ;
+  sqe->msg_flags = MSG_NOSIGNAL ;
+  sqe->user_data = (uint64_t)(uintptr_t)hh | TAG_H2SEND ;
+  hh->loopflags |= HTTPD_LOOP_INFLIGHT ;
+}
+
+
+void _httpd_uring_shutdown()
+{
+  struct httpd_uring *u = &_httpd_uring ;
+
+  // Sessions still open are abandoned with the ring
+
+  if (u->sqes) munmap(u->sqes, u->sqesz) ;
+  if (u->cqring && u->cqring!=u->sqring) munmap(u->cqring, u->cqringsz) ;
+  if (u->sqring) munmap(u->sqring, u->sqringsz) ;
+  if (u->fd>=0) close(u->fd) ;
+  if (u->bufs) free(u->bufs) ;
+
+  memset(u, 0, sizeof(*u)) ;
+  u->fd=-1 ;
+}
+
+#endif
@@ -0,0 +1,511 @@
+//
+// httpdsse.c
+//
+// Server-Sent Events (text/event-stream) support for httpd sessions
+//
+//   int hsse_accept(HTTPD *hh) ;
+//   int hsse_send(HTTPD *hh, char *event, char *data) ;
+//   int hsse_recv(HTTPD *hh) ;
+//   int hsse_heartbeat(int intervalms) ;
+//   HSSETOPIC *hsse_topic_new(enum hsse_policy policy) ;
+//   int hsse_subscribe(HSSETOPIC *topic, HTTPD *hh) ;
+//   int hsse_unsubscribe(HSSETOPIC *topic, HTTPD *hh) ;
+//   int hsse_publish(HSSETOPIC *topic, char *event, char *data) ;
+//   int hsse_topicstats(HSSETOPIC *topic, int *subscribers, int *dropped, int *coalesced) ;
+//   int hsse_topic_free(HSSETOPIC *topic) ;
+//
+// NOTES
+//
+// All event-stream sessions are kept in a list (linked through
+// hh->ssenext) so that the heartbeat timer can reach them, and all
+// topics are kept in a list so that hclose can remove a session from
+// every topic it subscribed to.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "../log.h"
+#include "../mem.h"
+#include "../str.h"
+
+
+// Topic subscriber
+
+typedef struct {
+  void *hh ;           // Subscribed session
+  mem *held ;          // Coalesced event waiting for the output queue to empty
+  int heldlen ;        // Length of held event
+} hsse_sub ;
+
+// Topic
+
+typedef struct ihssetopic {
+  int policy ;
+  hsse_sub *subs ;
+  int numsubs ;
+  int dropped ;
+  int coalesced ;
+  struct ihssetopic *next ;
+} IHSSETOPIC ;
+
+#define HSSETOPIC IHSSETOPIC
+#include "ihttpd.h"
+
+
+// Local constants
+
+#define HSSE_HIGHWATER (64*1024)
+#define HSSE_COMMENT ":\n\n"
+
+// Local data
+
+IHTTPD *_hsse_sessions=NULL ;
+IHSSETOPIC *_hsse_topics=NULL ;
+int _hsse_heartbeatid=0 ;
+
+// Local functions
+
+mem *_hsse_event(char *event, char *data, int *eventlen) ;
+int _hsse_deliver(IHSSETOPIC *topic, hsse_sub *sub, mem *ev, int evlen) ;
+void _hsse_heartbeat(void *arg) ;
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Switch session to event-stream mode and send the stream headers
+// param[in] hh Handle of HTTPD session
+// @return true on success
+//
+
+int hsse_accept(IHTTPD *hh)
+{
+  if (!hh || hh->state!=COMPLETE || hh->mode!=HTTP) return 0 ;
+
+  char *head =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+#ifndef NOCORS
+        "Access-Control-Allow-Origin: *\r\n"
+#endif
+        "Connection: keep-alive\r\n"
+        "\r\n" ;
+
+  if (!_httpd_write(hh, head, strlen(head))) return 0 ;
+
+  hh->mode = SSE ;
+  hh->ssenext = _hsse_sessions ;
+  _hsse_sessions = hh ;
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Send event to session
+// param[in] hh Handle of HTTPD session
+// param[in] event Event name, or NULL for an unnamed (message) event
+// param[in] data Event data.  Multi-line data is split into data: fields
+// @return true if sent or queued, false on error or if the session is backed up
+//
+
+int hsse_send(IHTTPD *hh, char *event, char *data)
+{
+  if (!hh || hh->mode!=SSE) return 0 ;
+  if (hh->state==CLOSED || hh->state==ERROR) return 0 ;
+  if (hh->outlen > HSSE_HIGHWATER) return 0 ;
+
+  int evlen=0 ;
+  mem *ev = _hsse_event(event, data, &evlen) ;
+  if (!ev) return 0 ;
+
+  int success = _httpd_write(hh, ev, evlen) ;
+  mem_free(ev) ;
+  return success ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Process data from event-stream client (call when hfd is readable)
+// param[in] hh Handle of HTTPD session
+// @return 0 - Still connected
+// @return -1 - Connection closed
+//
+
+int hsse_recv(IHTTPD *hh)
+{
+  if (!hh || hh->mode!=SSE) return -1 ;
+  if (hh->state==CLOSED || hh->state==ERROR) return -1 ;
+
+  // Clients don't send anything after the request, so
+  // anything received is discarded
+
+  char buf[256] ;
+  int r = _httpd_read(hh, buf, sizeof(buf)) ;
+
+  if (r==0) {
+    hh->state=CLOSED ;
+    return -1 ;
+  } else if (r<0 && errno!=EAGAIN && errno!=EWOULDBLOCK) {
+    hh->state=ERROR ;
+    return -1 ;
+  }
+
+  return 0 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Send a comment to all event-stream sessions at a regular interval
+// param[in] intervalms Interval in milliseconds, or 0 to disable
+// @return true on success
+//
+
+int hsse_heartbeat(int intervalms)
+{
+  if (_hsse_heartbeatid) {
+    httpd_timer_cancel(_hsse_heartbeatid) ;
+    _hsse_heartbeatid=0 ;
+  }
+
+  if (intervalms<=0) return 1 ;
+
+  _hsse_heartbeatid = httpd_timer_add(intervalms, 1, _hsse_heartbeat, (void *)(intptr_t)intervalms) ;
+  return (_hsse_heartbeatid!=0) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Create event topic
+// param[in] policy Policy for subscribers which are backed up
+// @return Handle of topic, or NULL on error
+//
+
+IHSSETOPIC *hsse_topic_new(enum hsse_policy policy)
+{
+  IHSSETOPIC *topic = (IHSSETOPIC *)mem_malloc(sizeof(IHSSETOPIC)) ;
+  if (!topic) return NULL ;
+
+  topic->policy = policy ;
+  topic->next = _hsse_topics ;
+  _hsse_topics = topic ;
+  return topic ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Add event-stream session to topic
+// param[in] topic Handle of topic
+// param[in] hh Handle of HTTPD session (in event-stream mode)
+// @return true on success
+//
+
+int hsse_subscribe(IHSSETOPIC *topic, IHTTPD *hh)
+{
+  if (!topic || !hh || hh->mode!=SSE) return 0 ;
+
+  for (int i=0; i<topic->numsubs; i++) {
+    if (topic->subs[i].hh==hh) return 1 ;
+  }
+
+  int need = (topic->numsubs+1)*sizeof(hsse_sub) ;
+  if (mem_length((mem *)topic->subs) < need) {
+    mem *subs = mem_realloc((mem *)topic->subs, need*2) ;
+    if (!subs) return 0 ;
+    topic->subs = (hsse_sub *)subs ;
+  }
+
+  hsse_sub *sub = &(topic->subs[topic->numsubs++]) ;
+  sub->hh = hh ;
+  sub->held = NULL ;
+  sub->heldlen = 0 ;
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Remove session from topic
+// param[in] topic Handle of topic
+// param[in] hh Handle of HTTPD session
+// @return true if the session was subscribed
+//
+
+int hsse_unsubscribe(IHSSETOPIC *topic, IHTTPD *hh)
+{
+  if (!topic || !hh) return 0 ;
+
+  for (int i=0; i<topic->numsubs; i++) {
+    if (topic->subs[i].hh==hh) {
+      mem_free(topic->subs[i].held) ;
+      topic->subs[i] = topic->subs[--topic->numsubs] ;
+      return 1 ;
+    }
+  }
+
+  return 0 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Send event to all subscribers of topic
+// param[in] topic Handle of topic
+// param[in] event Event name, or NULL for an unnamed (message) event
+// param[in] data Event data
+// @return Number of subscribers the event was sent (or queued) to
+//
+
+int hsse_publish(IHSSETOPIC *topic, char *event, char *data)
+{
+  if (!topic || topic->numsubs==0) return 0 ;
+
+  int evlen=0 ;
+  mem *ev = _hsse_event(event, data, &evlen) ;
+  if (!ev) return 0 ;
+
+  int sent=0 ;
+  for (int i=0; i<topic->numsubs; i++) {
+    sent += _hsse_deliver(topic, &(topic->subs[i]), ev, evlen) ;
+  }
+
+  mem_free(ev) ;
+  return sent ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Get topic statistics
+// param[in] topic Handle of topic
+// param[out] subscribers Number of subscribers (may be NULL)
+// param[out] dropped Number of events dropped for slow subscribers (may be NULL)
+// param[out] coalesced Number of events replaced by a later event (may be NULL)
+// @return true on success
+//
+
+int hsse_topicstats(IHSSETOPIC *topic, int *subscribers, int *dropped, int *coalesced)
+{
+  if (!topic) return 0 ;
+  if (subscribers) (*subscribers) = topic->numsubs ;
+  if (dropped) (*dropped) = topic->dropped ;
+  if (coalesced) (*coalesced) = topic->coalesced ;
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Free topic (sessions stay open)
+// param[in] topic Handle of topic
+// @return true on success
+//
+
+int hsse_topic_free(IHSSETOPIC *topic)
+{
+  if (!topic) return 0 ;
+
+  for (IHSSETOPIC **t=&_hsse_topics; *t; t=&((*t)->next)) {
+    if (*t==topic) {
+      *t = topic->next ;
+      break ;
+    }
+  }
+
+  for (int i=0; i<topic->numsubs; i++) mem_free(topic->subs[i].held) ;
+  mem_free((mem *)topic->subs) ;
+  return mem_free((mem *)topic) ;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+//
+// Internal Functions
+//
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Remove event-stream session from the subscriber lists
+// @param[in] hh Handle of HTTPD session being closed
+//
+
+void _hsse_release(IHTTPD *hh)
+{
+  for (IHTTPD **s=&_hsse_sessions; *s; s=(IHTTPD **)&((*s)->ssenext)) {
+    if (*s==hh) {
+      *s = hh->ssenext ;
+      break ;
+    }
+  }
+
+  for (IHSSETOPIC *t=_hsse_topics; t; t=t->next) {
+    hsse_unsubscribe(t, hh) ;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Send events held back while session's output queue was full
+// @param[in] hh Handle of HTTPD session whose output queue has emptied
+//
+
+void _hsse_drained(IHTTPD *hh)
+{
+  for (IHSSETOPIC *t=_hsse_topics; t; t=t->next) {
+    for (int i=0; i<t->numsubs; i++) {
+      hsse_sub *sub = &(t->subs[i]) ;
+      if (sub->hh==hh && sub->held) {
+        _httpd_write(hh, sub->held, sub->heldlen) ;
+        mem_free(sub->held) ;
+        sub->held = NULL ;
+      }
+    }
+  }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+//
+// Local Functions
+//
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Write event to subscriber, applying the topic policy if it is backed up
+// @param[in] topic Handle of topic
+// @param[in] sub Subscriber
+// @param[in] ev Serialized event
+// @param[in] evlen Length of event
+// @return 1 if the event was sent, queued or held, 0 if it was dropped
+//
+
+int _hsse_deliver(IHSSETOPIC *topic, hsse_sub *sub, mem *ev, int evlen)
+{
+  IHTTPD *hh = (IHTTPD *)sub->hh ;
+
+  if (hh->state==CLOSED || hh->state==ERROR) return 0 ;
+
+  if (hh->outlen <= HSSE_HIGHWATER) {
+
+    // Anything held back is older than this event, so replace it
+
+    if (sub->held) {
+      mem_free(sub->held) ;
+      sub->held = NULL ;
+      topic->coalesced++ ;
+    }
+
+    return _httpd_write(hh, ev, evlen) ;
+
+  } else if (topic->policy==HSSE_COALESCE) {
+
+    if (sub->held) {
+      mem_free(sub->held) ;
+      topic->coalesced++ ;
+    }
+
+    sub->held = mem_malloc(evlen) ;
+    if (!sub->held) return 0 ;
+    memcpy(sub->held, ev, evlen) ;
+    sub->heldlen = evlen ;
+    return 1 ;
+
+  } else {
+
+    topic->dropped++ ;
+    return 0 ;
+
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Serialize event
+// @param[in] event Event name, or NULL
+// @param[in] data Event data, or NULL
+// @param[out] eventlen Length of serialized event
+// @return Newly allocated event, or NULL on error
+//
+
+mem *_hsse_event(char *event, char *data, int *eventlen)
+{
+  if (!data) data="" ;
+
+  // A line break in the name would start another field
+
+  if (event && event[strcspn(event, "\r\n")]) return NULL ;
+
+  // Lines end with CR, LF or CRLF, as a client would split them
+
+  int lines=1 ;
+  for (char *p=data; *p; p++) {
+    if (*p=='\n' || (*p=='\r' && p[1]!='\n')) lines++ ;
+  }
+
+  int len = (event?strlen(event)+8:0) + strlen(data) + lines*7 + 2 ;
+  mem *ev = mem_malloc(len) ;
+  if (!ev) return NULL ;
+
+  int p=0 ;
+
+  if (event) p += sprintf(&ev[p], "event: %s\n", event) ;
+
+  // Each line of data becomes its own data: field
+
+  char *line = data ;
+  for (;;) {
+    int ll = strcspn(line, "\r\n") ;
+    memcpy(&ev[p], "data: ", 6) ; p+=6 ;
+    memcpy(&ev[p], line, ll) ; p+=ll ;
+    ev[p++]='\n' ;
+    line += ll ;
+    if (!*line) break ;
+    if (line[0]=='\r' && line[1]=='\n') line++ ;
+    line++ ;
+  }
+
+  ev[p++]='\n' ;
+  ev[p]='\0' ;
+
+  (*eventlen)=p ;
+  return ev ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Heartbeat timer - send a comment to idle event-stream sessions
+// @param[in] arg Heartbeat interval in milliseconds
+//
+
+void _hsse_heartbeat(void *arg)
+{
+  long long idle = _httpd_now() - (intptr_t)arg ;
+
+  // Sessions which have sent something within the interval, or are
+  // still sending, don't need one
+
+  for (IHTTPD *hh=_hsse_sessions; hh; hh=hh->ssenext) {
+    if (hh->outlen==0 && hh->lastactive<=idle && hh->state!=CLOSED && hh->state!=ERROR) {
+      _httpd_write(hh, HSSE_COMMENT, strlen(HSSE_COMMENT)) ;
+    }
+  }
+}
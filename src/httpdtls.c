@@ -0,0 +1,401 @@
+//
+// httpdtls.c
+//
+// HTTPS (TLS termination) support for the httpd server
+//
+//   int httpd_tls_init(int port, char *certfile, char *keyfile) ;
+//   int httpd_tls_listenfd() ;
+//   int httpd_tls_stats(long *full, long *resumed, long *failed) ;
+//   int hsecure(HTTPD *hh) ;
+//
+// link with: -lssl -lcrypto
+//
+// NOTES
+//
+// All HTTPS sessions share one SSL_CTX.  Sessions accepted from the
+// HTTPS listener carry an SSL object, and hrecv drives the handshake
+// with SSL_accept before any request data is read.  From then on,
+// all session reads and writes go through SSL_read and SSL_write
+// (see _httpd_read and _httpd_rawwrite in httpd.c).
+//
+// Returning clients can resume without a full handshake, either from
+// the server-side session cache (session ids), or with a session
+// ticket.  Tickets are protected with keys generated here, which are
+// rotated every HTTPD_TLS_TICKETROTATE seconds.  The previous key is
+// still accepted (and the ticket renewed) for one further period, so
+// a rotation doesn't force every client through a full handshake.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+#include "../log.h"
+#include "../mem.h"
+
+#include "ihttpd.h"
+
+
+// Local constants
+
+#define HTTPD_TLS_SESSIONCACHESIZE 4096
+#define HTTPD_TLS_SESSIONTIMEOUT 7200
+#define HTTPD_TLS_TICKETROTATE 3600
+#define HTTPD_TLS_SESSIONIDCONTEXT "libtools-httpd"
+
+// Session ticket keys - [0] is current, [1] is previous
+
+struct httpd_ticketkey {
+  unsigned char name[16] ;
+  unsigned char aeskey[32] ;
+  unsigned char hmackey[32] ;
+  time_t created ;
+} ;
+
+// Local data
+
+SSL_CTX *_httpd_tlsctx=NULL ;
+int _httpd_tlslistenfd=-1 ;
+int _httpd_tlslistenport=0 ;
+
+struct httpd_ticketkey _httpd_ticketkeys[2] ;
+int _httpd_numticketkeys=0 ;
+
+long _httpd_tls_full=0 ;
+long _httpd_tls_resumed=0 ;
+long _httpd_tls_failed=0 ;
+
+// Local functions
+
+int _httpd_tls_rotatekeys() ;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int _httpd_tls_ticketcb(SSL *ssl, unsigned char *keyname, unsigned char *iv,
+                        EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc) ;
+#endif
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Initialises HTTPS listener
+// @param[in] port Port number to listen on
+// @param[in] certfile PEM file containing the certificate chain
+// @param[in] keyfile PEM file containing the private key
+// @return listener handle, or -1 on failure
+//
+
+int httpd_tls_init(int port, char *certfile, char *keyfile)
+{
+  if (!certfile || !keyfile) return -1 ;
+
+  _httpd_tls_closelistenfd() ;
+  if (_httpd_tlsctx) SSL_CTX_free(_httpd_tlsctx) ;
+
+  _httpd_tlsctx = SSL_CTX_new(TLS_server_method()) ;
+  if (!_httpd_tlsctx) {
+    logmsg(LOG_ERR, "httpd_tls_init: unable to create SSL context") ;
+    return -1 ;
+  }
+
+  SSL_CTX_set_min_proto_version(_httpd_tlsctx, TLS1_2_VERSION) ;
+
+  // Partial writes and moving buffers let SSL_write work directly
+  // from the session output queue
+
+  SSL_CTX_set_mode(_httpd_tlsctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER) ;
+
+  if ( SSL_CTX_use_certificate_chain_file(_httpd_tlsctx, certfile) != 1 ||
+       SSL_CTX_use_PrivateKey_file(_httpd_tlsctx, keyfile, SSL_FILETYPE_PEM) != 1 ||
+       SSL_CTX_check_private_key(_httpd_tlsctx) != 1 ) {
+    logmsg(LOG_ERR, "httpd_tls_init: unable to load certificate %s / key %s", certfile, keyfile) ;
+    goto fail ;
+  }
+
+  // Server side session cache, for clients resuming by session id
+
+  SSL_CTX_set_session_cache_mode(_httpd_tlsctx, SSL_SESS_CACHE_SERVER) ;
+  SSL_CTX_sess_set_cache_size(_httpd_tlsctx, HTTPD_TLS_SESSIONCACHESIZE) ;
+  SSL_CTX_set_timeout(_httpd_tlsctx, HTTPD_TLS_SESSIONTIMEOUT) ;
+  SSL_CTX_set_session_id_context(_httpd_tlsctx,
+        (unsigned char *)HTTPD_TLS_SESSIONIDCONTEXT, strlen(HTTPD_TLS_SESSIONIDCONTEXT)) ;
+
+  // Session tickets, with rotating keys
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  _httpd_numticketkeys=0 ;
+  if (!_httpd_tls_rotatekeys()) goto fail ;
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(_httpd_tlsctx, _httpd_tls_ticketcb) ;
+#endif
+
+  _httpd_tlslistenport = port ;
+  _httpd_tlslistenfd = _httpd_listen(port) ;
+  if (_httpd_tlslistenfd<0) goto fail ;
+
+  return _httpd_tlslistenfd ;
+
+fail:
+  SSL_CTX_free(_httpd_tlsctx) ;
+  _httpd_tlsctx=NULL ;
+  return -1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Returns HTTPS listener handle
+// @return listener handle, or -1 if not listening
+//
+
+int httpd_tls_listenfd()
+{
+  return _httpd_tlslistenfd ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Returns HTTPS handshake counters
+// @param[out] full Number of full handshakes completed (may be NULL)
+// @param[out] resumed Number of resumed handshakes completed (may be NULL)
+// @param[out] failed Number of handshakes which failed (may be NULL)
+// @return true
+//
+
+int httpd_tls_stats(long *full, long *resumed, long *failed)
+{
+  if (full) (*full) = _httpd_tls_full ;
+  if (resumed) (*resumed) = _httpd_tls_resumed ;
+  if (failed) (*failed) = _httpd_tls_failed ;
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Determine if session is using TLS
+// param[in] hh Handle of HTTPD session
+// @return true if the session was accepted on the HTTPS listener
+//
+
+int hsecure(IHTTPD *hh)
+{
+  return (hh && hh->ssl) ;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+//
+// Internal Functions
+//
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Attach TLS to a newly accepted session if it came from the HTTPS listener
+// @param[in] hh Handle of HTTPD session
+// @param[in] listenfd Listener the session was accepted from
+// @return true on success
+//
+
+int _httpd_tls_accept(IHTTPD *hh, int listenfd)
+{
+  if (listenfd<0 || listenfd!=_httpd_tlslistenfd || !_httpd_tlsctx) return 1 ;
+
+  hh->ssl = SSL_new(_httpd_tlsctx) ;
+  if (!hh->ssl) return 0 ;
+
+  if (!SSL_set_fd(hh->ssl, hh->fd)) {
+    SSL_free(hh->ssl) ;
+    hh->ssl=NULL ;
+    return 0 ;
+  }
+
+  SSL_set_accept_state(hh->ssl) ;
+  hh->sslready=0 ;
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Progress the non-blocking TLS handshake
+// @param[in] hh Handle of HTTPD session
+// @return 1 - Handshake complete, 0 - In progress, -1 - Failed
+//
+
+int _httpd_tls_handshake(IHTTPD *hh)
+{
+  if (!hh->ssl) return -1 ;
+  if (hh->sslready) return 1 ;
+
+  hh->sslwantwrite=0 ;
+
+  int r = SSL_accept(hh->ssl) ;
+
+  if (r==1) {
+
+    hh->sslready=1 ;
+    if (SSL_session_reused(hh->ssl)) _httpd_tls_resumed++ ;
+    else _httpd_tls_full++ ;
+    return 1 ;
+
+  }
+
+  switch (SSL_get_error(hh->ssl, r)) {
+
+  case SSL_ERROR_WANT_READ:
+    return 0 ;
+
+  case SSL_ERROR_WANT_WRITE:
+    hh->sslwantwrite=1 ;
+    return 0 ;
+
+  default:
+    _httpd_tls_failed++ ;
+    logmsg(LOG_INFO, "TLS handshake with %s failed - %s", hpeeripaddress(hh),
+           ERR_reason_error_string(ERR_peek_last_error())) ;
+    ERR_clear_error() ;
+    return -1 ;
+
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Shut down and free session TLS state
+// @param[in] hh Handle of HTTPD session
+//
+
+void _httpd_tls_close(IHTTPD *hh)
+{
+  if (!hh->ssl) return ;
+
+  // Best effort close_notify - the socket is non-blocking, and a
+  // session which was never established can't be cached
+
+  if (hh->sslready) SSL_shutdown(hh->ssl) ;
+  SSL_free(hh->ssl) ;
+  hh->ssl=NULL ;
+  hh->sslready=0 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Close HTTPS listener
+//
+
+void _httpd_tls_closelistenfd()
+{
+  if (_httpd_tlslistenfd>=0) close(_httpd_tlslistenfd) ;
+  _httpd_tlslistenfd=-1 ;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+//
+// Local Functions
+//
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Generate a new ticket key, keeping the current one as previous
+// @return true on success
+//
+
+int _httpd_tls_rotatekeys()
+{
+  struct httpd_ticketkey k ;
+
+  if ( RAND_bytes(k.name, sizeof(k.name)) != 1 ||
+       RAND_bytes(k.aeskey, sizeof(k.aeskey)) != 1 ||
+       RAND_bytes(k.hmackey, sizeof(k.hmackey)) != 1 ) {
+    logmsg(LOG_ERR, "httpd: unable to generate session ticket key") ;
+    return 0 ;
+  }
+  k.created = time(NULL) ;
+
+  if (_httpd_numticketkeys>0) _httpd_ticketkeys[1] = _httpd_ticketkeys[0] ;
+  _httpd_ticketkeys[0] = k ;
+  if (_httpd_numticketkeys<2) _httpd_numticketkeys++ ;
+
+  return 1 ;
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Session ticket key callback
+// @param[in] ssl SSL connection
+// @param[inout] keyname Ticket key name (set when encrypting)
+// @param[inout] iv Initialisation vector (set when encrypting)
+// @param[in] cctx Cipher context to initialise
+// @param[in] hctx MAC context to initialise
+// @param[in] enc True when issuing a ticket, false when decrypting one
+// @return 1 - ok, 2 - ok but renew ticket, 0 - unknown key, -1 - error
+//
+
+int _httpd_tls_ticketcb(SSL *ssl, unsigned char *keyname, unsigned char *iv,
+                        EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+{
+  // Keys are rotated lazily, when they are next needed
+
+  if (time(NULL) - _httpd_ticketkeys[0].created >= HTTPD_TLS_TICKETROTATE) {
+    _httpd_tls_rotatekeys() ;
+  }
+
+  struct httpd_ticketkey *k = NULL ;
+  int renew = 0 ;
+
+  if (enc) {
+
+    k = &_httpd_ticketkeys[0] ;
+    memcpy(keyname, k->name, sizeof(k->name)) ;
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) return -1 ;
+    if (!EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, k->aeskey, iv)) return -1 ;
+
+  } else {
+
+    for (int i=0; i<_httpd_numticketkeys && !k; i++) {
+      if (memcmp(keyname, _httpd_ticketkeys[i].name, sizeof(k->name))==0) {
+        k = &_httpd_ticketkeys[i] ;
+        renew = (i>0) ;
+      }
+    }
+
+    // Unknown (or expired) key - fall back to a full handshake
+
+    if (!k) return 0 ;
+
+    if (!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, k->aeskey, iv)) return -1 ;
+
+  }
+
+  OSSL_PARAM params[3] ;
+  params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, k->hmackey, sizeof(k->hmackey)) ;
+  params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "sha256", 0) ;
+  params[2] = OSSL_PARAM_construct_end() ;
+  if (!EVP_MAC_CTX_set_params(hctx, params)) return -1 ;
+
+  return renew ? 2 : 1 ;
+}
+
+#endif
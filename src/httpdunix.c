@@ -0,0 +1,108 @@
+//
+// httpdunix.c
+//
+// Unix domain socket listener for the httpd server
+//
+//   int httpd_unix_init(char *path) ;
+//   int httpd_unix_listenfd() ;
+//   int hpeercred(HTTPD *hh, pid_t *pid, uid_t *uid, gid_t *gid) ;
+//
+// NOTES
+//
+// Clients on the same host can connect through a Unix domain socket
+// rather than loopback TCP, avoiding checksums, Nagle and ephemeral
+// ports.  Sessions accepted from the Unix listener with haccept (or by
+// httpd_loop) are handled exactly as TCP sessions.  They have no peer
+// IP address, so hpeeripaddress returns "" and the client process is
+// identified by hpeercred (SO_PEERCRED) instead.
+//
+// A path starting '@' names a socket in the abstract namespace, which
+// has no file and disappears with the listener.  A socket file left
+// behind by an earlier server, which refuses connections, is removed
+// before binding, and the file is removed again by httpd_shutdown.
+// The file of a server still listening is left, so binding fails.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../mem.h"
+
+#include "ihttpd.h"
+
+
+// Local data
+
+int _httpd_unixlistenfd=-1 ;
+char _httpd_unixpath[sizeof(((struct sockaddr_un *)0)->sun_path)] ;
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Initialises Unix domain socket listener
+// @param[in] path Path of socket, or "@name" in the abstract namespace
+// @return listener handle, or -1 on failure
+//
+
+int httpd_unix_init(char *path)
+{
+  _httpd_unix_closelistenfd() ;
+
+  if (!path || strlen(path)>=sizeof(_httpd_unixpath)) return -1 ;
+
+  _httpd_unixlistenfd = _httpd_unixlisten(path) ;
+  if (_httpd_unixlistenfd>=0) strcpy(_httpd_unixpath, path) ;
+
+  return _httpd_unixlistenfd ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Returns Unix domain socket listener handle
+// @return listener handle, or -1 if not listening
+//
+
+int httpd_unix_listenfd()
+{
+  return _httpd_unixlistenfd ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Close Unix domain socket listener, removing its socket file
+//
+
+void _httpd_unix_closelistenfd()
+{
+  if (_httpd_unixlistenfd<0) return ;
+
+  close(_httpd_unixlistenfd) ;
+  _httpd_unixlistenfd=-1 ;
+
+  if (_httpd_unixpath[0] && _httpd_unixpath[0]!='@') unlink(_httpd_unixpath) ;
+  _httpd_unixpath[0]='\0' ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Get credentials of peer process (Unix domain sessions only)
+// @param[in] hh Handle of HTTPD session
+// @param[out] pid Process id of peer (may be NULL)
+// @param[out] uid User id of peer (may be NULL)
+// @param[out] gid Group id of peer (may be NULL)
+// @return true on success, false if not a Unix domain session
+//
+
+int hpeercred(IHTTPD *hh, pid_t *pid, uid_t *uid, gid_t *gid)
+{
+  if (hh && hh->mode==H2STREAM) hh=hh->h2parent ;
+  if (!hh || hh->fd<0) return 0 ;
+  return netfdpeercred(hh->fd, pid, uid, gid) ;
+}
@@ -0,0 +1,542 @@
+//
+// httpdws.c
+//
+// WebSocket (RFC 6455) support for httpd sessions
+//
+//   int hws_isupgrade(HTTPD *hh) ;
+//   int hws_accept(HTTPD *hh) ;
+//   int hws_recv(HTTPD *hh) ;
+//   int hws_haspending(HTTPD *hh) ;
+//   char *hws_getmsg(HTTPD *hh, int *len) ;
+//   int hws_send(HTTPD *hh, int opcode, char *buf, int len) ;
+//   int hws_broadcast(HTTPD **hh, int n, int opcode, char *buf, int len) ;
+//   int hws_close(HTTPD *hh, int status) ;
+//
+// link with: -lcrypto
+//
+// NOTES
+//
+// Frames received from the client are read in blocks into hh->wsrx, and
+// unmasked in place before being appended to the message in hh->wsmsg.
+// Frames sent by the server are never masked, so a frame can be built
+// once and written to any number of sessions (see hws_broadcast).
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#include "../log.h"
+#include "../mem.h"
+#include "../str.h"
+
+#include "ihttpd.h"
+
+
+// Local constants
+
+#define HWS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define HWS_RXBUFLEN 4096
+#define HWS_MAXMESSAGE (1024*1024)
+#define HWS_MAXHEADLEN 14
+
+// Close status codes
+
+#define HWS_STATUS_NORMAL 1000
+#define HWS_STATUS_PROTOCOL 1002
+#define HWS_STATUS_TOOBIG 1009
+
+// Return codes from _hws_parseframe
+
+#define HWS_INCOMPLETE -2
+#define HWS_CLOSED -1
+#define HWS_CONSUMED 0
+
+// Local functions
+
+int _hws_parseframe(IHTTPD *hh) ;
+int _hws_fail(IHTTPD *hh, int status) ;
+mem *_hws_frame(int opcode, char *buf, int len, int *framelen) ;
+void _hws_mask(unsigned char *buf, size_t len, unsigned char *key) ;
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Determine if request is a WebSocket upgrade request
+// param[in] hh Handle of HTTPD session
+// @return true if the request can be passed to hws_accept
+//
+
+int hws_isupgrade(IHTTPD *hh)
+{
+  if (!hh || hh->state!=COMPLETE || hh->mode!=HTTP) return 0 ;
+
+  char *upgrade = hgetheader(hh, "Upgrade") ;
+  char *connection = hgetheader(hh, "Connection") ;
+  char *key = hgetheader(hh, "Sec-WebSocket-Key") ;
+
+  return ( upgrade && str_offseti(upgrade, "websocket")>=0 &&
+           connection && str_offseti(connection, "upgrade")>=0 &&
+           key && *key ) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Accept WebSocket upgrade and switch session to WebSocket mode
+// param[in] hh Handle of HTTPD session
+// @return true on success
+//
+
+int hws_accept(IHTTPD *hh)
+{
+  if (!hws_isupgrade(hh)) return 0 ;
+
+  // Accept key is base64(sha1(key+GUID))
+
+  char keyguid[128] ;
+  char *key = hgetheader(hh, "Sec-WebSocket-Key") ;
+  int keylen = strlen(key) ;
+  while (keylen>0 && (key[keylen-1]==' ' || key[keylen-1]=='\t')) keylen-- ;
+  if (keylen+sizeof(HWS_GUID) > sizeof(keyguid)) return 0 ;
+
+  memcpy(keyguid, key, keylen) ;
+  strcpy(&keyguid[keylen], HWS_GUID) ;
+
+  unsigned char digest[SHA_DIGEST_LENGTH] ;
+  char accept[4*((SHA_DIGEST_LENGTH+2)/3)+1] ;
+  SHA1((unsigned char *)keyguid, strlen(keyguid), digest) ;
+  EVP_EncodeBlock((unsigned char *)accept, digest, SHA_DIGEST_LENGTH) ;
+
+  hh->wsrx = mem_malloc(HWS_RXBUFLEN) ;
+  if (!hh->wsrx) return 0 ;
+
+  char head[256] ;
+  int headlen = snprintf(head, sizeof(head),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n"
+        "\r\n", accept) ;
+
+  if (!_httpd_write(hh, head, headlen)) return 0 ;
+
+  hh->mode = WEBSOCKET ;
+  return 1 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Receive WebSocket data (keep calling until it returns non-zero)
+// param[in] hh Handle of HTTPD session
+// @return 0 - Still receiving, call back later
+// @return -1 - Connection closed
+// @return HWS_TEXT or HWS_BINARY - Complete message available via hws_getmsg
+//
+
+int hws_recv(IHTTPD *hh)
+{
+  if (!hh || hh->mode!=WEBSOCKET) return -1 ;
+  if (hh->state==CLOSED || hh->state==ERROR) return -1 ;
+
+  // Discard the message returned by the previous call
+
+  if (hh->wsmsgready) {
+    hh->wsmsglen=0 ;
+    hh->wsmsgopcode=0 ;
+    hh->wsmsgready=0 ;
+  }
+
+  int hasread=0 ;
+
+  for (;;) {
+
+    // Process any complete frames already buffered
+
+    int r ;
+    while ( (r=_hws_parseframe(hh)) == HWS_CONSUMED ) ;
+    if (r!=HWS_INCOMPLETE) return r ;
+
+    // Only one socket read per call, so that one busy client
+    // can't monopolise the caller's select loop
+
+    if (hasread) return 0 ;
+
+    // Compact buffer, and grow it if it is full
+
+    if (hh->wsrxpos>0) {
+      memmove(hh->wsrx, &(hh->wsrx[hh->wsrxpos]), hh->wsrxlen-hh->wsrxpos) ;
+      hh->wsrxlen-=hh->wsrxpos ;
+      hh->wsrxpos=0 ;
+    }
+
+    int rxsize = mem_length(hh->wsrx) ;
+    if (hh->wsrxlen==rxsize) {
+      mem *rx = mem_realloc(hh->wsrx, rxsize*2) ;
+      if (!rx) return _hws_fail(hh, HWS_STATUS_TOOBIG) ;
+      hh->wsrx = rx ;
+      rxsize = mem_length(rx) ;
+    }
+
+    int n = _httpd_read(hh, &(hh->wsrx[hh->wsrxlen]), rxsize-hh->wsrxlen) ;
+    hasread=1 ;
+
+    if (n==0) {
+      hh->state=CLOSED ;
+      return -1 ;
+    } else if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+      return 0 ;
+    } else if (n<0) {
+      hh->state=ERROR ;
+      return -1 ;
+    }
+
+    hh->wsrxlen+=n ;
+
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Determine if a complete frame is already buffered
+// param[in] hh Handle of HTTPD session
+// @return true if hws_recv can make progress without further socket data
+//
+
+int hws_haspending(IHTTPD *hh)
+{
+  if (!hh || hh->mode!=WEBSOCKET) return 0 ;
+
+  // Decrypted data waiting in the TLS layer won't wake up select
+
+  if (hh->ssl && SSL_pending(hh->ssl)>0) return 1 ;
+
+  unsigned char *b = &(hh->wsrx[hh->wsrxpos]) ;
+  int avail = hh->wsrxlen - hh->wsrxpos ;
+  if (avail<2) return 0 ;
+
+  uint64_t plen = b[1]&0x7F ;
+  int hl = 2 + ((b[1]&0x80)?4:0) ;
+  if (plen==126) { hl+=2 ; if (avail<4) return 0 ; plen = (b[2]<<8) | b[3] ; }
+  else if (plen==127) {
+    hl+=8 ;
+    if (avail<10) return 0 ;
+    plen=0 ;
+    for (int i=2; i<10; i++) plen = (plen<<8) | b[i] ;
+  }
+
+  // Compared without adding, so a huge length can't wrap
+
+  return ( avail >= hl && plen <= (uint64_t)(avail-hl) ) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Returns last message received by hws_recv
+// param[in] hh Handle of HTTPD session
+// param[out] len Length of message (may be NULL)
+// @return Transient, null terminated pointer to message, or NULL if none
+//
+
+char *hws_getmsg(IHTTPD *hh, int *len)
+{
+  if (!hh || !hh->wsmsgready) return NULL ;
+  if (len) (*len) = hh->wsmsglen ;
+  return hh->wsmsg ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Send WebSocket message
+// param[in] hh Handle of HTTPD session
+// param[in] opcode Message type (HWS_TEXT, HWS_BINARY, HWS_PING)
+// param[in] buf Message payload
+// param[in] len Length of payload
+// @return true on success (data sent or queued)
+//
+
+int hws_send(IHTTPD *hh, int opcode, char *buf, int len)
+{
+  if (!hh || hh->mode!=WEBSOCKET || hh->wsclosesent) return 0 ;
+
+  int framelen=0 ;
+  mem *frame = _hws_frame(opcode, buf, len, &framelen) ;
+  if (!frame) return 0 ;
+
+  int success = _httpd_write(hh, frame, framelen) ;
+  mem_free(frame) ;
+  return success ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Send the same WebSocket message to many sessions
+// param[in] hh Array of HTTPD session handles
+// param[in] n Number of entries in array
+// param[in] opcode Message type (HWS_TEXT, HWS_BINARY)
+// param[in] buf Message payload
+// param[in] len Length of payload
+// @return Number of sessions the message was sent (or queued) to
+//
+
+int hws_broadcast(IHTTPD **hh, int n, int opcode, char *buf, int len)
+{
+  if (!hh || n<=0) return 0 ;
+
+  int framelen=0 ;
+  mem *frame = _hws_frame(opcode, buf, len, &framelen) ;
+  if (!frame) return 0 ;
+
+  int sent=0 ;
+  for (int i=0; i<n; i++) {
+    if (!hh[i] || hh[i]->mode!=WEBSOCKET || hh[i]->wsclosesent) continue ;
+    if (hh[i]->state==CLOSED || hh[i]->state==ERROR) continue ;
+    if (_httpd_write(hh[i], frame, framelen)) sent++ ;
+  }
+
+  mem_free(frame) ;
+  return sent ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Send WebSocket close frame
+// param[in] hh Handle of HTTPD session
+// param[in] status Close status code (e.g. 1000), or 0 for none
+// @return true on success
+//
+
+int hws_close(IHTTPD *hh, int status)
+{
+  if (!hh || hh->mode!=WEBSOCKET) return 0 ;
+  if (hh->wsclosesent) return 1 ;
+
+  char payload[2] ;
+  payload[0] = (status>>8)&0xFF ;
+  payload[1] = status&0xFF ;
+
+  int success = hws_send(hh, HWS_CLOSE, payload, status?2:0) ;
+  hh->wsclosesent = 1 ;
+  return success ;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+//
+// Local Functions
+//
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Process one frame from the receive buffer
+// @param[in] hh Handle of HTTPD session
+// @return HWS_INCOMPLETE - More data required
+// @return HWS_CONSUMED - Frame processed, but message not yet complete
+// @return HWS_CLOSED - Connection closed
+// @return HWS_TEXT or HWS_BINARY - Message complete
+//
+
+int _hws_parseframe(IHTTPD *hh)
+{
+  unsigned char *b = &(hh->wsrx[hh->wsrxpos]) ;
+  int avail = hh->wsrxlen - hh->wsrxpos ;
+
+  if (avail<2) return HWS_INCOMPLETE ;
+
+  int fin = (b[0]&0x80) ;
+  int opcode = (b[0]&0x0F) ;
+  uint64_t plen = (b[1]&0x7F) ;
+  int hl=2 ;
+
+  if (plen==126) {
+    if (avail<4) return HWS_INCOMPLETE ;
+    plen = (b[2]<<8) | b[3] ;
+    hl=4 ;
+  } else if (plen==127) {
+    if (avail<10) return HWS_INCOMPLETE ;
+    plen=0 ;
+    for (int i=2; i<10; i++) plen = (plen<<8) | b[i] ;
+    hl=10 ;
+  }
+
+  // Client frames must be masked, and extensions are not negotiated
+
+  if ( !(b[1]&0x80) || (b[0]&0x70) ) return _hws_fail(hh, HWS_STATUS_PROTOCOL) ;
+  if ( plen > HWS_MAXMESSAGE ) return _hws_fail(hh, HWS_STATUS_TOOBIG) ;
+
+  hl+=4 ;
+  if ( avail < hl || plen > (uint64_t)(avail-hl) ) return HWS_INCOMPLETE ;
+
+  unsigned char *payload = &b[hl] ;
+  _hws_mask(payload, plen, &b[hl-4]) ;
+  hh->wsrxpos += hl+plen ;
+
+  if (opcode>=HWS_CLOSE) {
+
+    // Control frames
+
+    if (!fin || plen>125) return _hws_fail(hh, HWS_STATUS_PROTOCOL) ;
+
+    switch (opcode) {
+
+    case HWS_PING:
+      hws_send(hh, HWS_PONG, payload, plen) ;
+      return HWS_CONSUMED ;
+
+    case HWS_PONG:
+      return HWS_CONSUMED ;
+
+    case HWS_CLOSE:
+      if (!hh->wsclosesent) {
+        hws_send(hh, HWS_CLOSE, payload, (plen>=2)?2:0) ;
+        hh->wsclosesent=1 ;
+      }
+
+      // Try to get the echoed close frame out now.  Whatever the socket
+      // won't take stays queued (hpending) for the caller to flush
+
+      hflush(hh) ;
+      hh->state=CLOSED ;
+      return HWS_CLOSED ;
+
+    default:
+      return _hws_fail(hh, HWS_STATUS_PROTOCOL) ;
+
+    }
+
+  }
+
+  // Data frames
+
+  if (opcode==HWS_CONTINUATION) {
+    if (hh->wsmsgopcode==0) return _hws_fail(hh, HWS_STATUS_PROTOCOL) ;
+  } else if (opcode==HWS_TEXT || opcode==HWS_BINARY) {
+    if (hh->wsmsgopcode!=0) return _hws_fail(hh, HWS_STATUS_PROTOCOL) ;
+    hh->wsmsgopcode=opcode ;
+  } else {
+    return _hws_fail(hh, HWS_STATUS_PROTOCOL) ;
+  }
+
+  if ( (uint64_t)hh->wsmsglen+plen > HWS_MAXMESSAGE ) return _hws_fail(hh, HWS_STATUS_TOOBIG) ;
+
+  if ( (uint64_t)mem_length(hh->wsmsg) < (uint64_t)hh->wsmsglen+plen+1 ) {
+    mem *msg = mem_realloc(hh->wsmsg, hh->wsmsglen+plen+1) ;
+    if (!msg) return _hws_fail(hh, HWS_STATUS_TOOBIG) ;
+    hh->wsmsg = msg ;
+  }
+
+  memcpy(&(hh->wsmsg[hh->wsmsglen]), payload, plen) ;
+  hh->wsmsglen += plen ;
+  hh->wsmsg[hh->wsmsglen] = '\0' ;
+
+  if (!fin) return HWS_CONSUMED ;
+
+  hh->wsmsgready=1 ;
+  return hh->wsmsgopcode ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Fail the WebSocket connection
+// @param[in] hh Handle of HTTPD session
+// @param[in] status Close status code to send
+// @return HWS_CLOSED
+//
+
+int _hws_fail(IHTTPD *hh, int status)
+{
+  logmsg(LOG_WARNING, "websocket %s:%d failed with status %d",
+         hpeeripaddress(hh), hpeerport(hh), status) ;
+  hws_close(hh, status) ;
+  hflush(hh) ;
+  hh->state=ERROR ;
+  return HWS_CLOSED ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Build an unmasked server frame
+// @param[in] opcode Frame opcode
+// @param[in] buf Payload
+// @param[in] len Length of payload
+// @param[out] framelen Length of frame
+// @return Newly allocated frame, or NULL on error
+//
+
+mem *_hws_frame(int opcode, char *buf, int len, int *framelen)
+{
+  if (len<0 || (len>0 && !buf)) return NULL ;
+
+  mem *frame = mem_malloc(HWS_MAXHEADLEN+len) ;
+  if (!frame) return NULL ;
+
+  int hl=2 ;
+  frame[0] = 0x80 | (opcode&0x0F) ;
+
+  if (len<126) {
+    frame[1] = len ;
+  } else if (len<65536) {
+    frame[1] = 126 ;
+    frame[2] = (len>>8)&0xFF ;
+    frame[3] = len&0xFF ;
+    hl=4 ;
+  } else {
+    frame[1] = 127 ;
+    uint64_t l = len ;
+    for (int i=9; i>=2; i--) { frame[i] = l&0xFF ; l>>=8 ; }
+    hl=10 ;
+  }
+
+  if (len>0) memcpy(&frame[hl], buf, len) ;
+  (*framelen) = hl+len ;
+  return frame ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Apply (or remove) a WebSocket mask, a 64-bit word at a time
+// @param[inout] buf Data to mask
+// @param[in] len Length of data
+// @param[in] key 4 byte masking key
+//
+
+void _hws_mask(unsigned char *buf, size_t len, unsigned char *key)
+{
+  unsigned char k8[8] ;
+  uint64_t k64 ;
+  size_t i=0 ;
+
+  for (int j=0; j<8; j++) k8[j] = key[j&3] ;
+  memcpy(&k64, k8, sizeof(k64)) ;
+
+  // memcpy keeps the word accesses safe on unaligned buffers,
+  // and compiles to plain loads and stores
+
+  for (; i+8<=len; i+=8) {
+    uint64_t w ;
+    memcpy(&w, &buf[i], sizeof(w)) ;
+    w ^= k64 ;
+    memcpy(&buf[i], &w, sizeof(w)) ;
+  }
+
+  for (; i<len; i++) buf[i] ^= key[i&3] ;
+}
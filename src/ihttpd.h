@@ -0,0 +1,309 @@
+//
+// ihttpd.h
+//
+// Internal definition of the HTTPD session, shared between the
+// httpd source files.  Applications use httpd.h, which only
+// exposes the opaque HTTPD handle.
+//
+
+#ifndef _IHTTPD_DEFINED
+#define _IHTTPD_DEFINED
+
+#include <time.h>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+
+#include "../mem.h"
+
+enum estate { URI, HEAD, BODY, COMPLETE, CLOSED, ERROR } ;
+
+enum emode { HTTP, WEBSOCKET, SSE, H2, H2STREAM } ;
+
+typedef struct {
+  int fd ;
+  enum estate state ;
+  enum emode mode ;
+  int hasbody ;
+  int bodylen ;
+  int uricount ;
+  int headcount ;
+  mem *uri ;
+  mem *head ;
+  mem *body ;
+  mem *transient ;
+  mem *peeripaddress ;
+  int peerport ;
+  time_t connect_time ;
+
+  // Transport statistics (see hstats)
+
+  unsigned long long statbytesin ;  // Bytes received
+  unsigned long long statbytesout ; // Bytes sent
+  unsigned long statcallsin ;       // Receive calls made on the socket
+  unsigned long statcallsout ;      // Send calls made on the socket
+  long long lastactive ;            // Time data was last sent or received (ms)
+
+  // TLS session management (ssl is NULL for plaintext sessions)
+
+  SSL *ssl ;
+  int sslready ;       // True once the TLS handshake has completed
+  int sslwantwrite ;   // True if the handshake is waiting to write
+
+  // Input buffer, for sessions run by httpd_loop (NULL otherwise)
+
+  mem *in ;
+  int inpos ;
+  int inlen ;
+  int loopflags ;      // Loop backend state for session
+  mem *loopout ;       // Output being sent by the loop backend
+  int loopoutlen ;
+
+  // Output queue, holding data which could not be written
+  // immediately to the non-blocking socket
+
+  mem *out ;
+  int outlen ;
+
+  // WebSocket receive management
+
+  mem *wsrx ;          // Raw frames received from socket
+  int wsrxpos ;        // Start of unprocessed data in wsrx
+  int wsrxlen ;        // End of data in wsrx
+  mem *wsmsg ;         // Reassembled message payload
+  int wsmsglen ;       // Length of reassembled message
+  int wsmsgopcode ;    // Opcode of first frame in message (0 if none)
+  int wsmsgready ;     // True once message has been returned by hws_recv
+  int wsclosesent ;    // True once a close frame has been sent
+
+  // Server-Sent Events management
+
+  void *ssenext ;      // Next session in list of event-stream sessions
+
+  // HTTP/2 management.  A connection holds its protocol state in h2,
+  // and each request is a separate H2STREAM session linked to it.
+
+  void *h2 ;           // Connection state (H2 connections only)
+  void *h2parent ;     // Connection carrying the stream (NULL once closed)
+  void *h2next ;       // Next stream on connection
+  int h2id ;           // Stream identifier
+  int h2flags ;        // Stream state flags
+  int h2code ;         // Result code returned by hrecv for the stream
+  int h2sendwindow ;   // Flow control window for sending on stream
+  int h2recvwindow ;   // Flow control window for receiving on stream
+  int h2outpos ;       // Start of unsent response data in out
+
+} IHTTPD ;
+
+#define HTTPD IHTTPD
+#include "../httpd.h"
+
+
+//
+// @brief Write data to session, queueing anything the socket won't take
+// @param[in] hh Handle of HTTPD session
+// @param[in] buf Data to write
+// @param[in] len Length of data
+// @return true on success (data written or queued), false on error
+//
+
+int _httpd_write(IHTTPD *hh, char *buf, int len) ;
+
+
+//
+// @brief Create HTTPD session for an accepted connection
+// param[in] sessionfd File descriptor of accepted connection
+// param[in] cli_addr Peer address, or NULL to look it up when required
+// return Handle of HTTPD session, or NULL on failure
+//
+
+IHTTPD *_httpd_newsession(int sessionfd, struct sockaddr_in *cli_addr) ;
+
+
+//
+// @brief Read from session socket (via TLS if enabled)
+// @param[in] hh Handle of HTTPD session
+// @param[out] buf Buffer for data
+// @param[in] len Maximum amount of data to read
+// @return As recv: bytes read, 0 if closed, or -1 (errno EAGAIN if no data)
+//
+
+int _httpd_read(IHTTPD *hh, char *buf, int len) ;
+
+
+//
+// @brief Write to session socket (via TLS if enabled), without queueing
+// @param[in] hh Handle of HTTPD session
+// @param[in] buf Data to write
+// @param[in] len Length of data
+// @return As write: bytes written, or -1 (errno EAGAIN if socket is full)
+//
+
+int _httpd_rawwrite(IHTTPD *hh, char *buf, int len) ;
+
+
+//
+// @brief Count send or receive call made on session socket
+// @param[in] hh Handle of HTTPD session
+// @param[in] in True for a receive, false for a send
+// @param[in] n Result of call (bytes transferred if positive)
+//
+
+void _httpd_count(IHTTPD *hh, int in, long n) ;
+
+
+//
+// @brief Get monotonic time
+// @return Current time in milliseconds
+//
+
+long long _httpd_now() ;
+
+
+//
+// @brief Store decoded request URI and split out its parameters
+// @param[in] hh Handle of HTTPD session
+// @param[inout] uri Working copy of URI (without method), which is modified
+// @return true on success
+//
+
+int _httpd_seturi(IHTTPD *hh, mem *uri) ;
+
+
+//
+// @brief Keep a copy of the request headers, one per line
+// @param[in] hh Handle of HTTPD session
+// @param[in] text Header lines, each terminated with '\n'
+// @return true on success
+//
+
+int _httpd_storehead(IHTTPD *hh, char *text) ;
+
+
+//
+// @brief Create non-blocking listener socket
+// @param[in] port Port number to listen on
+// return File descriptor for listener, or -1 on failure
+//
+
+int _httpd_listen(int port) ;
+
+
+//
+// @brief Attach TLS to a newly accepted session if it came from the HTTPS listener
+// @param[in] hh Handle of HTTPD session
+// @param[in] listenfd Listener the session was accepted from
+// @return true on success
+//
+
+int _httpd_tls_accept(IHTTPD *hh, int listenfd) ;
+
+
+//
+// @brief Progress the non-blocking TLS handshake
+// @param[in] hh Handle of HTTPD session
+// @return 1 - Handshake complete, 0 - In progress, -1 - Failed
+//
+
+int _httpd_tls_handshake(IHTTPD *hh) ;
+
+
+//
+// @brief Shut down and free session TLS state
+// @param[in] hh Handle of HTTPD session
+//
+
+void _httpd_tls_close(IHTTPD *hh) ;
+
+
+//
+// @brief Close HTTPS listener
+//
+
+void _httpd_tls_closelistenfd() ;
+
+
+//
+// @brief Create non-blocking Unix domain socket listener
+// @param[in] path Path of socket, or "@name" in the abstract namespace
+// @return File descriptor for listener, or -1 on failure
+//
+
+int _httpd_unixlisten(char *path) ;
+
+
+//
+// @brief Close Unix domain socket listener, removing its socket file
+//
+
+void _httpd_unix_closelistenfd() ;
+
+
+//
+// @brief Remove event-stream session from the subscriber lists
+// @param[in] hh Handle of HTTPD session being closed
+//
+
+void _hsse_release(IHTTPD *hh) ;
+
+
+//
+// @brief Send events held back while session's output queue was full
+// @param[in] hh Handle of HTTPD session whose output queue has emptied
+//
+
+void _hsse_drained(IHTTPD *hh) ;
+
+
+//
+// @brief Switch session to HTTP/2 if a completed request asks to upgrade
+// @param[in] hh Handle of HTTPD session, after hrecv has returned 200
+// @return 0 - Switched to HTTP/2, or original hrecv result code
+//
+
+int _hh2_upgrade(IHTTPD *hh) ;
+
+
+//
+// @brief Switch session to HTTP/2 after the prior knowledge preface
+// @param[in] hh Handle of HTTPD session, which has received "PRI * HTTP/2.0"
+// @return true on success
+//
+
+int _hh2_start(IHTTPD *hh) ;
+
+
+//
+// @brief Receive and process HTTP/2 frames
+// @param[in] hh Handle of HTTP/2 connection
+// @return 0 - Continue, -1 - Connection closed
+//
+
+int _hh2_recv(IHTTPD *hh) ;
+
+
+//
+// @brief Send response on HTTP/2 stream
+// @param[in] hh Handle of stream
+// @return true on success
+//
+
+int _hh2_send(IHTTPD *hh, int code, char *contenttype, char *body, int bodylen) ;
+
+
+//
+// @brief Close HTTP/2 stream, or release all streams of a closing connection
+// @param[in] hh Handle of stream or connection
+// @return true on success
+//
+
+int _hh2_close(IHTTPD *hh) ;
+
+
+//
+// @brief Send response data held back by flow control or a full output queue
+// @param[in] hh Handle of HTTP/2 connection whose output queue has emptied
+//
+
+void _hh2_drained(IHTTPD *hh) ;
+
+#endif
@@ -7,20 +7,75 @@
 // Manage Network session
 //
 // int netinit()
+// NET *netconnect_start(char *hostname, int port, net_flags flags)
+// int netconnect_step(NET *sh)
+// int netconnect_wantwrite(NET *sh)
+// int netsetcafile(char *cafile)
+// int netsetciphers(char *ciphers)
+// int netsessionstats(unsigned long *resumed, unsigned long *full)
 // NET *netopen(char *hostname, int port, net_flags flags)
+// NET *netadopt(int fd, enum netflags flags)
+// NET *netconnectopts(char *hostname, int port, enum netflags flags, NETOPTS *opts)
+// NET *netconnect_startopts(char *hostname, int port, enum netflags flags, NETOPTS *opts)
+// int netgetopts(NET *sh, NETOPTS *opts)
+// int netsetfdopts(int fd, NETOPTS *opts)
+// int netgetfdopts(int fd, NETOPTS *opts)
+// int netfastopen(NET *sh)
+// int netfdfastopen(int fd)
+// int netpeercred(NET *sh, pid_t *pid, uid_t *uid, gid_t *gid)
+// int netfdpeercred(int fd, pid_t *pid, uid_t *uid, gid_t *gid)
 // int netcerterror(NET *sh)
 // char *netcerterrorstr(int certerrno)
+// int netfd(NET *sh)
 // char *netpeerip(NET *sh)
 // int netpeerport(NET *sh)
 // int netlocalport(NET *sh)
+// int netsessionreused(NET *sh)
+// int netktls(NET *sh)
 //
 // int netrdfdset(INET *sh, fd_set *rdfds, fd_set *wrfds, int *l)
 // int netrdfdisset(INET *sh, fd_set *rfds, fd_set *wfds)
 // int netsend(INET *sh, char *buf, int len)
+// int netsendv(NET *sh, struct iovec *iov, int iovcnt)
+// int netsendfile(NET *sh, int fd, off_t offset, int len)
+// int netflush(NET *sh)
+// int netwritebuffer(NET *sh, int size)
+// int netwritestats(NET *sh, unsigned long *writes, unsigned long *bytes,
+//                   unsigned long *records, unsigned long *syscalls)
+// int netstats(NET *sh, NETSTATS *st)
+// int netfdstats(int fd, NETSTATS *st)
 // int netrecv(INET *sh, char *buf, int maxlen)
+// int netreadline(NET *sh, char **line)
+// int netreadn(NET *sh, int n, char **data)
+// int netreaduntil(NET *sh, char *delim, int delimlen, char **data)
+// int netreadsome(NET *sh, int maxlen, char **data)
+// int netpeek(NET *sh, char **data)
+// int netconsume(NET *sh, int n)
+// int netreadbuffer(NET *sh, int size)
+// int netsplice(NET *a, NET *b)
 // int netclose(NET *sh)
 //
-// link with: -lssl -lcrypto 
+// int neterrno()
+// char *netstrerror()
+// char *netstrerrorcontext()
+// int netlasterrno(NET *sh)
+// char *netlaststrerror(NET *sh)
+// char *netlasterrorcontext(NET *sh)
+//
+// NETPOLL *netpoll_create()
+// int netpoll_add(NETPOLL *np, NET *sh, void *arg)
+// int netpoll_del(NETPOLL *np, NET *sh)
+// int netpoll_wait(NETPOLL *np, NETPOLLEVENT *events, int maxevents, int timeoutms)
+// int netpoll_fd(NETPOLL *np)
+// void netpoll_free(NETPOLL *np)
+//
+// NET *netacquire(char *hostname, int port, enum netflags flags)
+// int netrelease(NET *sh)
+// int netpoolconfig(int maxperhost, int idletimeout)
+// int netpoolstats(unsigned long *hits, unsigned long *misses)
+// void netpoolflush()
+//
+// link with: -lssl -lcrypto -lpthread
 //
 // NOTES
 //
@@ -33,15 +88,18 @@
 // As SSL_read caches data from the socket, the underlying socket cannot be
 // used in select to determine if more data is available.  The netrdfdset
 // therefore checks for this, and adds /dev/null file descriptor to the 
-// fd_set as and when necessary.
+// fd_set as and when necessary.  netpoll does the same for many
+// connections using epoll, without the FD_SETSIZE limit.
 //
 
 #define _GNU_SOURCE 
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <resolv.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <linux/tcp.h>        // Rather than netinet/tcp.h, for tcpi_delivery_rate
 #include <arpa/inet.h>
 #include <string.h>
 #include <fcntl.h>
@@ -49,6 +107,15 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <limits.h>
+#include <stddef.h>
 
 //#include <openssl/bio.h>
 #include <openssl/ssl.h>
@@ -62,22 +129,86 @@ typedef struct {
 
   // Network socket management
 
+  int state ;          // Connection state (enum netconnectstate)
+  void *lookup ;       // Host name lookup in progress (netdns)
+  int flags ;          // Flags connection was opened with
+  int fdoptions ;      // Original socket options, restored if blocking
+  int wantwrite ;      // Connection in progress is waiting to write
   int isblocking ;     // True if connection is blocking
   int fd ;             // Socket file descriptor
   char *ipaddress ;    // Connected IP address
   int localport ;      // Local port number for connection
   int peerport ;       // Remote port number for connection
+  void *opts ;         // Socket options (NETOPTS), applied before connecting
 
   // SSL connection management
 
   SSL *ssl;            // SSL object
   int certstatus ;     // SSL Connection status
   SSL_CTX *ctx;        // SSL Context
+  char *sessionkey ;   // Session cache key (host:port)
+  int sessionreused ;  // True if handshake resumed a cached session
+
+  // Connection pool management
+
+  char *poolkey ;      // Destination (host:port:flags) if from netacquire
+  time_t idlesince ;   // Time connection was returned to the pool
+  void *poolnext ;     // Next idle connection in pool
+
+  // Parallel connection attempts, when the host has several addresses
+
+  struct _net_attempt *attempts ; // Addresses being tried, NULL if only one
+  int nattempts ;      // Number of addresses
+  int nextattempt ;    // Index of next address to try
+  int attemptepfd ;    // epoll fd watching attempts and stagger timer
+  int attempttimerfd ; // Timer for starting next attempt
+
+  // Poller management
+
+  void *poll ;         // Poller handle is registered with (INETPOLL)
+  void *pollarg ;      // Argument returned with handle's events
+  int pollevents ;     // Events registered with epoll
+  unsigned long pollround ; // Last netpoll_wait which reported handle
+  void *pollprev ;     // Previous/next handle registered with poller
+  void *pollnext ;
+  int pollcheck ;      // True if on poller's list of handles to check
+  void *pollchecknext ;
+  int pollflush ;      // True if on poller's list of handles to flush
+  void *pollflushnext ;
 
   // Non-blocking data stream management
 
   int sslwantwrite ;   // Flag so SSL_read can request write in select
   int sslhaspending ;  // Flag indicating SSL read can supply more data
+  int sslwritelen ;    // Length of SSL_write to be retried, or 0 if none
+
+  // Write coalescing
+
+  char *wbuf ;         // Data waiting to be sent (allocated when first used)
+  int wbuflen ;        // Amount of data in wbuf
+  int wbufmax ;        // Size of wbuf, 0 if writes are not buffered
+
+  // Receive buffer, for netreadline, netreadn and netreaduntil
+
+  char *rbuf ;         // Data received (allocated when first used)
+  int rbufpos ;        // Start of unconsumed data in rbuf
+  int rbuflen ;        // End of data in rbuf
+  int rbufmax ;        // Size of rbuf
+
+  // Statistics
+
+  unsigned long statwrites ;   // netsend/netsendv calls
+  unsigned long statbytes ;    // Bytes accepted by them
+  unsigned long statrecords ;  // TLS records sent
+  unsigned long statsyscalls ; // System calls made to send data
+  unsigned long statreads ;    // Receive calls made on the socket
+  unsigned long statbytesin ;  // Bytes received
+  long long lastactive ;       // Time data was last sent or received (ms)
+
+  // Last error on this connection (see also the thread's last error)
+
+  int err ;            // Error number (as neterrno)
+  char errcontext[64] ; // Operation which failed
 
   // Debug
 
@@ -86,654 +217,4002 @@ typedef struct {
 
 } INET ;
 
-//
-static int _net_errno=-1 ;
-static char _net_errcontext[64] ;
+// Last error of each thread, so that connections can be used on
+// separate threads without locking.  Each connection also keeps its
+// own last error.
+
+static __thread int _net_errno=-1 ;
+static __thread char _net_errcontext[64] ;
+static __thread char _net_strerrbuf[128] ;
+
+// /dev/null is opened once, when first needed, and kept open
 
 #define DEVNULL "/dev/null"
 static int _net_devnull=-1 ;
-static int _net_numconnections=0 ;
+static pthread_once_t _net_devnullonce = PTHREAD_ONCE_INIT ;
+static int _net_numconnections=0 ;   // Updated atomically
+
+static pthread_once_t _net_sslonce = PTHREAD_ONCE_INIT ;
+static int _net_sslinitialised=0 ;
+
+// Poller for many connections.  Sockets are watched with epoll, and
+// TLS or buffered handles which have been read from since the last
+// wait are kept on a check list, as they may hold data which epoll
+// can't see, or be waiting for the socket to become writable.  Handles with
+// buffered writes are kept on a flush list, and sent before waiting.
+
+#define NETPOLL_BATCH 256
+
+typedef struct {
+  int epfd ;                   // epoll fd watching registered sockets
+  void *handles ;              // Registered handles (INET)
+  void *check ;                // Handles to check before waiting (INET)
+  void *flush ;                // Handles to flush before waiting (INET)
+  unsigned long round ;        // Count of netpoll_wait calls
+} INETPOLL ;
 
 #define NET INET
+#define NETPOLL INETPOLL
 #include "../net.h"
 
 int _net_seterrno(INET *sh, char *context, enum net_errno_type type, int errcode) ;
+static char *_net_strerror(int err) ;
 int _net_disconnect(INET *sh) ;
+int _net_recv(INET *sh, char *buf, int maxlen) ;
 void _net_commsdump(INET *sh, char *prefix, char *buf, int buflen) ;
 
 typedef void (*SSL_CTX_keylog_cb_func)(const SSL *ssl, const char *line);
 void _net_ssl_keylog(const SSL *ssl, const char *line);
 
 
-//
-// @brief Initialise network subsystem this only needs to be called once
-// @return true on success
-//
+// Shared SSL contexts.  Building a context loads and parses the
+// system CA bundle, so contexts are built once for each combination
+// of flags, CA file and cipher policy, and shared (reference counted
+// by OpenSSL) between all connections which use it.
 
-int _net_ssl_init()
-{
-  static int success=0 ;
-  if (!success) {
-    OpenSSL_add_all_algorithms();
-    ERR_load_crypto_strings();
-    SSL_load_error_strings();
-    success = SSL_library_init();
-  }
-  return success ;
-}
+#define NET_CTXFLAGS (SSL2|SSL3|NOCERTCHAIN|DEBUGKEYDUMP)
 
-//
-// @brief Connect to server
-// @param(in) hostname Name of server to connect to - note 011 represents octal -> 9
-// @param(in) port Port number on server
-// @param(in) flags Type of connection to open (OPEN|TLS|SSL2|SSL3|NONBLOCK)
-// @return Handle to NET structure, or NULL on failure (and sets errno)
-//
+typedef struct _net_ctxentry {
+  int flags ;                  // Flags used to build context (NET_CTXFLAGS)
+  char *cafile ;               // CA file, or NULL for system default
+  char *ciphers ;              // Cipher list, or NULL for library default
+  SSL_CTX *ctx ;               // Context, holding the cache's reference
+  struct _net_ctxentry *next ;
+} NET_CTXENTRY ;
 
-INET *netconnect(char *hostname, int port, enum netflags flags)
-{
-  struct hostent *host;
+static NET_CTXENTRY *_net_ctxcache=NULL ;
+static char *_net_cafile=NULL ;
+static char *_net_ciphers=NULL ;
+static pthread_mutex_t _net_ctxmutex = PTHREAD_MUTEX_INITIALIZER ;
 
-  if (!hostname) {
-    // Unable to set sh->errno
-    return NULL ;
-  }
+SSL_CTX *_net_ctx_get(INET *sh, enum netflags flags) ;
+static SSL_CTX *_net_ctx_find(INET *sh, enum netflags flags) ;
 
-  INET *sh = malloc(sizeof(INET)) ;
-  if (!sh) {
-    // Unable to set sh->errno
-    return NULL ;
-  }
-  memset(sh, '\0', sizeof(INET)) ;
 
-  sh->fd=-1 ;
-  sh->localport=-1 ;
-  sh->peerport=-1 ;
-  sh->certstatus=X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT ; 
-  sh->isblocking = !(flags&NONBLOCK) ;
+// TLS client session cache.  Sessions (and TLS 1.3 tickets) are
+// saved per destination and offered on the next connection to the
+// same host:port, avoiding a full handshake.  The cache is shared by
+// all threads, so is protected by a mutex.
 
-  // Create underlying connection
+#define NET_SESSIONMAX 256
 
-  host = gethostbyname(hostname) ;
-  if ( host == NULL ) {
-    _net_seterrno(sh, "gethost", NET_ERR_INT, NET_ERR_BADA) ;
-    goto fail ;
-  }
+typedef struct _net_sessentry {
+  char *key ;                  // Destination (host:port)
+  SSL_CTX *ctx ;               // Context session was established with
+  SSL_SESSION *session ;       // Session, holding the cache's reference
+  struct _net_sessentry *next ;
+} NET_SESSENTRY ;
 
-  sh->fd = socket(AF_INET, SOCK_STREAM, 0);
-  if ( sh->fd <= 0 ) {
-    _net_seterrno(sh, "socket", NET_ERR_ERRNO, 0) ;
-    goto fail ;
-  }
+static NET_SESSENTRY *_net_sesscache=NULL ;
+static int _net_sesscount=0 ;
+static unsigned long _net_sessresumed=0 ;
+static unsigned long _net_sessfull=0 ;
+static pthread_mutex_t _net_sessmutex = PTHREAD_MUTEX_INITIALIZER ;
 
-  if (port<=0) {
-    _net_seterrno(sh, "port", NET_ERR_INT, NET_ERR_BADP) ;
-    goto fail ;
-  }
+int _net_sess_new(SSL *ssl, SSL_SESSION *session) ;
+SSL_SESSION *_net_sess_get(INET *sh) ;
+void _net_sess_remove(INET *sh) ;
 
-  sh->peerport = port ;
 
-  struct sockaddr_in dest_addr;
-  memset(&dest_addr, 0, sizeof(struct sockaddr_in));
-  dest_addr.sin_family=AF_INET;
-  dest_addr.sin_port=htons(sh->peerport);
-  dest_addr.sin_addr.s_addr = *(unsigned long*)(host->h_addr);
+// Keep-alive connection pool.  Connections released with netrelease
+// are kept idle, and handed out again by netacquire for the same
+// destination if they are still alive.
 
+static INET *_net_pool=NULL ;
+static int _net_poolmaxperhost=4 ;
+static int _net_poolidletimeout=60 ;
+static unsigned long _net_poolhits=0 ;
+static unsigned long _net_poolmisses=0 ;
+static pthread_mutex_t _net_poolmutex = PTHREAD_MUTEX_INITIALIZER ;
 
-  // Store resolved IP address
+int _net_pool_isalive(INET *sh) ;
 
-  char *i = inet_ntoa(dest_addr.sin_addr);
-  if (!i) {
-    _net_seterrno(sh, "ntoa", NET_ERR_INT, NET_ERR_BADA) ;
-    goto fail ;
-  }
+void _net_poll_touch(INET *sh) ;
+void _net_poll_flushlater(INET *sh) ;
 
-  sh->ipaddress = malloc(strlen(i)+1) ;
-  if (!sh->ipaddress) {
-    _net_seterrno(sh, "ipaddress", NET_ERR_ERRNO, 0) ;
-    goto fail ;
-  }
-  strcpy(sh->ipaddress, i) ;
 
-  // Set non-blocking and connect to destination
+// Relay between two connections (netsplice).  Each direction moves
+// plaintext through a pipe with splice (which the kernel encrypts, if
+// the destination's TLS has been offloaded), or, if TLS must be done
+// in user space, through a ring buffer allocated once for the relay.
 
-  int fdoptions = fcntl(sh->fd,F_GETFL,0);
+#define NET_RELAYPIPE (1024*1024)
+#define NET_RELAYRING (256*1024)
 
-  if (fdoptions<0) {
-    _net_seterrno(sh, "fcntl", NET_ERR_ERRNO, 0) ;
-    goto fail ;
-  }
-  fcntl(sh->fd, F_SETFL, fdoptions | O_NONBLOCK);
+struct _net_relay {
+  INET *src ;                  // Connection data is read from
+  INET *dst ;                  // Connection data is written to
+  int pipe[2] ;                // Pipe for splice, or -1 if using ring
+  int pipesize ;               // Capacity of pipe
+  int inpipe ;                 // Bytes in pipe
+  char *ring ;                 // Ring buffer, or NULL if using pipe
+  size_t head ;                // Total bytes put into ring
+  size_t tail ;                // Total bytes taken from ring
+  int writelen ;               // Length of SSL_write to be retried, or 0
+  int readwant ;               // Poll event last SSL_read waited for, or 0
+  int writewant ;              // Poll event last SSL_write waited for, or 0
+  int eof ;                    // True once source has finished sending
+  int done ;                   // True once destination has been shut down
+} ;
 
-  if ( connect(sh->fd, (struct sockaddr *) &dest_addr, sizeof(struct sockaddr)) < 0 ) {
 
-    int r=0, connected=0 ;
+// Write buffer size for connections opened with COALESCE, which
+// fills one TLS record
 
-    if (errno!=EINPROGRESS) {
+#define NET_WBUFSIZE SSL3_RT_MAX_PLAIN_LENGTH
 
-      _net_seterrno(sh, "connect", NET_ERR_ERRNO, 0) ; 
-      goto fail ;
+// Default receive buffer size
 
-    } else do { 
+#define NET_RBUFSIZE 16384
 
-      fd_set myset ;
-      struct timeval tv ;
-      tv.tv_sec = 2; 
-      tv.tv_usec = 0; 
-      FD_ZERO(&myset); 
-      FD_SET(sh->fd, &myset); 
 
-      r = select((sh->fd)+1, NULL, &myset, NULL, &tv); 
+// Connection attempts.  When a host has several addresses, a new
+// attempt is started every NET_ATTEMPTDELAY ms (or as soon as the
+// previous one fails), alternating between address families, and
+// the first socket to connect is kept (RFC 8305 "happy eyeballs").
 
-      if (r < 0 && errno != EINPROGRESS) {
+#define NET_ATTEMPTDELAY 250
 
-        _net_seterrno(sh, "connect", NET_ERR_ERRNO, 0) ;
-        goto fail ;
+struct _net_attempt {
+  NETADDR addr ;               // Address being tried
+  int fd ;                     // Socket, or -1 if not started or failed
+} ;
 
-      } else if (r > 0) { 
+// Host name prefix for Unix domain sockets ("unix:/path", or
+// "unix:@name" for the abstract namespace)
 
-        int valopt ;
-        int lon = sizeof(int); 
-        if (getsockopt(sh->fd, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0) { 
-   
-          _net_seterrno(sh, "getsockopt", NET_ERR_ERRNO, 0) ;
-          goto fail ;
+#define NET_UNIXPREFIX "unix:"
 
-        }
+void _net_resolved(void *arg, NETADDR *addrs, int naddrs) ;
+void *_netdns_lookup_start(char *hostname) ;
+int _netdns_lookup_collect(void *lookup, NETADDR *addrs, int *naddrs) ;
+void _netdns_lookup_abandon(void *lookup) ;
+int _netdns_lookup_fd(void *lookup) ;
+int _net_startconnect(INET *sh, NETADDR *addr) ;
+int _net_unixconnect(INET *sh, char *path) ;
+static int _net_setpath(INET *sh, struct sockaddr_un *sa, socklen_t len) ;
+int _net_attempt_start(INET *sh, NETADDR *addrs, int naddrs) ;
+int _net_attempt_step(INET *sh) ;
+void _net_attempt_free(INET *sh) ;
+int _net_connected(INET *sh) ;
+int _net_handshake(INET *sh) ;
+int _net_ready(INET *sh) ;
 
-        if (valopt) { 
 
-          _net_seterrno(sh, "getsockopt", NET_ERR_ERRNO, valopt) ;
-          goto fail ;
- 
-        } else {
+//
+// @brief Initialise SSL library (pthread_once routine)
+//
 
-          connected=1 ;
+static void _net_ssl_once()
+{
+  OpenSSL_add_all_algorithms();
+  ERR_load_crypto_strings();
+  SSL_load_error_strings();
+  _net_sslinitialised = SSL_library_init();
+}
 
-        }
 
-      } else {
+//
+// @brief Initialise network subsystem this only needs to be called once
+// @return true on success
+//
 
-        _net_seterrno(sh, "connect", NET_ERR_INT, NET_ERR_TIMEOUT) ;
-        goto fail ;
+int _net_ssl_init()
+{
+  pthread_once(&_net_sslonce, _net_ssl_once) ;
+  return _net_sslinitialised ;
+}
 
-      }
 
-    } while (!connected);
+//
+// @brief Open /dev/null (pthread_once routine)
+//
 
-  }
+static void _net_devnull_open()
+{
+  _net_devnull = open(DEVNULL, O_RDWR|O_NONBLOCK|O_CLOEXEC) ;
+}
 
- // Get local port
 
-  struct sockaddr_in local_addr;
-  int local_addr_len = sizeof(local_addr) ;
-  memset(&local_addr, 0, sizeof(struct sockaddr_in));
-  if (getsockname(sh->fd, (struct sockaddr *) &local_addr, &local_addr_len) < 0 ) {
-    _net_seterrno(sh, "getsockname", NET_ERR_ERRNO, 0) ; 
-     goto fail ;
-  }
-  sh->localport = ntohs(local_addr.sin_port) ;
+//
+// @brief Obtain descriptor of /dev/null, which is always ready, for select
+// @return File descriptor, or -1 if it could not be opened
+//
 
+static int _net_devnull_fd()
+{
+  pthread_once(&_net_devnullonce, _net_devnull_open) ;
+  return _net_devnull ;
+}
 
-  // Now establish SSL connection if required
 
-  if (flags&TLS || flags&SSL2 || flags&SSL3) {
+//
+// @brief Obtain monotonic time
+// @return Current time in milliseconds
+//
 
-    // Initialise SSL
+static long long _net_now()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000 ;
+}
 
-    _net_ssl_init() ;
 
-    // Set client hello and announce SSLv3 & TLSv1
+//
+// @brief Count data sent on connection
+// @param(in) sh Handle of connection
+// @param(in) n Number of bytes sent
+//
 
-    const SSL_METHOD *method;
-    method = SSLv23_client_method();
-    if (!method) { 
-      _net_seterrno(sh, "client_method", NET_ERR_SSL, 0) ;
-      goto fail ; 
-    }
+static void _net_countout(INET *sh, long n)
+{
+  if (n<=0) return ;
+  sh->statbytes += n ;
+  sh->lastactive = _net_now() ;
+}
 
-    sh->ctx = SSL_CTX_new(method) ;
-    if ( !sh->ctx ) { 
-      _net_seterrno(sh, "ctx_new", NET_ERR_SSL, 0) ; 
-      goto fail ; 
-    }
 
-    // Enable verification of full certificate chain
+//
+// @brief Count receive call made on connection's socket
+// @param(in) sh Handle of connection
+// @param(in) n Result of call (bytes received if positive)
+//
 
-    if (!(flags&NOCERTCHAIN))
-      SSL_CTX_set_default_verify_paths(sh->ctx) ;
+static void _net_countin(INET *sh, long n)
+{
+  sh->statreads++ ;
+  if (n<=0) return ;
+  sh->statbytesin += n ;
+  sh->lastactive = _net_now() ;
+}
 
-    // Disable SSL if requested
 
-    if (! (flags&SSL2) ) {
-      SSL_CTX_set_options(sh->ctx, SSL_OP_NO_SSLv2);
-    }
+//
+// @brief Compare optional strings, where NULL is only equal to NULL
+//
 
-    if (! (flags&SSL3) ) {
-      SSL_CTX_set_options(sh->ctx, SSL_OP_NO_SSLv3);
-    }
+static int _net_streq(char *a, char *b)
+{
+  if (!a || !b) return (a==b) ;
+  else return (strcmp(a, b)==0) ;
+}
 
-    // XXXXXX May not be needed ...
 
-//    if ( ! (flags&NONBLOCK) ) { 
-//      SSL_CTX_set_mode(sh->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE) ;
-//  }
+//
+// @brief Set a copy of an optional string setting
+// @param(inout) setting Setting to be replaced
+// @param(in) value New value, or NULL to use the default
+// @return true on success
+//
 
-   // Enable key logging
+static int _net_setstr(char **setting, char *value)
+{
+  char *copy=NULL ;
+  if (value) {
+    copy = malloc(strlen(value)+1) ;
+    if (!copy) return 0 ;
+    strcpy(copy, value) ;
+  }
+  if (*setting) free(*setting) ;
+  *setting = copy ;
+  return 1 ;
+}
 
-   if (flags&DEBUGKEYDUMP) {
-     sh->keydumpenable=1 ;
-     SSL_CTX_set_keylog_callback(sh->ctx, _net_ssl_keylog);
-   }
 
-    // Create connection state object
+//
+// @brief Obtain shared SSL context for a connection, building it if required
+// @param(in) sh Handle of connection (for error reporting)
+// @param(in) flags Connection flags
+// @return Context with a reference held for the caller, or NULL on failure
+//
 
-    sh->ssl = SSL_new(sh->ctx);
-    if (!sh->ssl) {
-      _net_seterrno(sh, "ssl_new", NET_ERR_ERRNO, 0) ;
-      goto fail ;
-    }
+SSL_CTX *_net_ctx_get(INET *sh, enum netflags flags)
+{
+  flags &= NET_CTXFLAGS ;
 
-    SSL_set_connect_state(sh->ssl); 
+  _net_ssl_init() ;
 
-    // Attach SSL server to the socket
+  pthread_mutex_lock(&_net_ctxmutex) ;
+  SSL_CTX *ctx = _net_ctx_find(sh, flags) ;
+  pthread_mutex_unlock(&_net_ctxmutex) ;
 
-    SSL_set_fd(sh->ssl, sh->fd);
+  return ctx ;
+}
 
 
-    // Establish SSL protocol connection
+//
+// @brief Find shared SSL context, or build it (with _net_ctxmutex held)
+// @param(in) sh Handle of connection (for error reporting)
+// @param(in) flags Connection flags (NET_CTXFLAGS)
+// @return Context with a reference held for the caller, or NULL on failure
+//
 
-    int r ;
-    while ( (r=SSL_connect(sh->ssl)) < 0 ) {
+static SSL_CTX *_net_ctx_find(INET *sh, enum netflags flags)
+{
+  // Return existing context if there is one
 
-      fd_set fds;
-      FD_ZERO(&fds);
-      FD_SET(sh->fd, &fds);
+  for (NET_CTXENTRY *e=_net_ctxcache; e; e=e->next) {
+    if (e->flags==flags && _net_streq(e->cafile, _net_cafile) &&
+        _net_streq(e->ciphers, _net_ciphers)) {
+      SSL_CTX_up_ref(e->ctx) ;
+      return e->ctx ;
+    }
+  }
 
-      int e=SSL_get_error(sh->ssl, r) ;
+  // Set client hello and announce SSLv3 & TLSv1
 
-      switch (e) {
+  const SSL_METHOD *method;
+  method = SSLv23_client_method();
+  if (!method) { 
+    _net_seterrno(sh, "client_method", NET_ERR_SSL, 0) ;
+    return NULL ;
+  }
 
-      case SSL_ERROR_WANT_READ:
-         select(sh->fd + 1, &fds, NULL, NULL, NULL);
-         break;
+  NET_CTXENTRY *e = malloc(sizeof(NET_CTXENTRY)) ;
+  if (!e) {
+    _net_seterrno(sh, "ctx_cache", NET_ERR_ERRNO, 0) ;
+    return NULL ;
+  }
+  memset(e, '\0', sizeof(NET_CTXENTRY)) ;
+  e->flags = flags ;
 
-      case SSL_ERROR_WANT_WRITE:
-         select(sh->fd + 1, NULL, &fds, NULL, NULL);
-         break;
+  e->ctx = SSL_CTX_new(method) ;
+  if ( !e->ctx ) { 
+    _net_seterrno(sh, "ctx_new", NET_ERR_SSL, 0) ; 
+    goto fail ;
+  }
 
-      default:
-         _net_seterrno(sh, "ssl_connect", NET_ERR_SSL, r) ;
-         goto fail ;
-         break ;
-      }
+  // Enable verification of full certificate chain
 
+  if (!(flags&NOCERTCHAIN)) {
+    if (_net_cafile) {
+      if (!SSL_CTX_load_verify_locations(e->ctx, _net_cafile, NULL)) {
+        _net_seterrno(sh, "ctx_cafile", NET_ERR_INT, NET_ERR_UNK) ;
+        goto fail ;
+      }
+    } else {
+      SSL_CTX_set_default_verify_paths(e->ctx) ;
     }
+  }
 
+  // Disable SSL if requested
 
-    // Open /dev/null, which is used for select
+  if (! (flags&SSL2) ) {
+    SSL_CTX_set_options(e->ctx, SSL_OP_NO_SSLv2);
+  }
 
-    if ( !sh->isblocking && _net_devnull<0) {
-      _net_devnull = open(DEVNULL, O_RDWR|O_NONBLOCK) ;
-    }
+  if (! (flags&SSL3) ) {
+    SSL_CTX_set_options(e->ctx, SSL_OP_NO_SSLv3);
+  }
 
+  // Apply cipher policy
 
+  if (_net_ciphers && !SSL_CTX_set_cipher_list(e->ctx, _net_ciphers)) {
+    _net_seterrno(sh, "ctx_ciphers", NET_ERR_INT, NET_ERR_UNK) ;
+    goto fail ;
   }
 
-  // Restore blocking if required
+  // Enable key logging
 
-  if ( ! (flags&NONBLOCK) ) {
+  if (flags&DEBUGKEYDUMP) {
+    SSL_CTX_set_keylog_callback(e->ctx, _net_ssl_keylog);
+  }
+
+  // Hand new sessions to the session cache
 
-    fcntl(sh->fd, F_SETFL, fdoptions);
+  SSL_CTX_set_session_cache_mode(e->ctx, SSL_SESS_CACHE_CLIENT |
+                                 SSL_SESS_CACHE_NO_INTERNAL_STORE) ;
+  SSL_CTX_sess_set_new_cb(e->ctx, _net_sess_new) ;
 
+  if ( !_net_setstr(&e->cafile, _net_cafile) ||
+       !_net_setstr(&e->ciphers, _net_ciphers) ) {
+    _net_seterrno(sh, "ctx_cache", NET_ERR_ERRNO, 0) ;
+    goto fail ;
   }
 
-   if (flags&DEBUGDATADUMP && getenv("NETDUMPENABLE")) {
-     sh->datadumpenable=1 ;
-   }
-  
-  _net_numconnections++ ;
+  e->next = _net_ctxcache ;
+  _net_ctxcache = e ;
 
-  return sh ;
+  SSL_CTX_up_ref(e->ctx) ;
+  return e->ctx ;
 
-fail: 
-  _net_disconnect(sh) ;
-  errno=EHOSTUNREACH ;
+fail:
+  if (e->ctx) SSL_CTX_free(e->ctx) ;
+  if (e->cafile) free(e->cafile) ;
+  if (e->ciphers) free(e->ciphers) ;
+  free(e) ;
   return NULL ;
- 
 }
 
 
-// 
-// @brief Obtain SSL certificate status
-// @param(in) Handle of open connection
-// @return Non-zero certificate status code or zero if ok
+//
+// @brief Initialise network subsystem, preloading the default TLS context
+// @return true on success
 //
 
-int netcertstatus(INET *sh)
+int netinit()
 {
-  // Get peer certificate
+  if (!_net_ssl_init()) return 0 ;
 
-  X509 *cert = SSL_get_peer_certificate(sh->ssl);
-  if (cert) {
-    sh->certstatus = SSL_get_verify_result(sh->ssl);
-    X509_free(cert) ;
-  } else {
-    sh->certstatus = -1 ;
-  }
+  SSL_CTX *ctx = _net_ctx_get(NULL, TLS) ;
+  if (!ctx) return 0 ;
+  SSL_CTX_free(ctx) ;
 
-  return (sh->certstatus) ;
+  return 1 ;
 }
 
 
-// 
-// @brief Get network connection state
-// @param(in) Handle of open connection
-// @return Returns true if network connection is connected
+//
+// @brief Set CA file used to verify servers on subsequent TLS connections
+// @param(in) cafile PEM file of trusted CAs, or NULL for the system default
+// @return true on success
 //
 
-int netisconnected(INET *sh)
+int netsetcafile(char *cafile)
 {
-  if (!sh) return 0 ;
-  return ( sh->fd >= 0 ) ;
+  pthread_mutex_lock(&_net_ctxmutex) ;
+  int r = _net_setstr(&_net_cafile, cafile) ;
+  pthread_mutex_unlock(&_net_ctxmutex) ;
+  return r ;
 }
 
+
 //
-// @brief Determine if connection is ready for reading
-// @param(in) sh Handle of network connection
-// @param(in) rfds Read fd set
-// @param(in) wrds Write fd set - only required for SSL
-// @return True if connection has pending data
+// @brief Set cipher policy for subsequent TLS connections
+// @param(in) ciphers OpenSSL cipher list, or NULL for the library default
+// @return true on success
 //
-int netrdfdisset(INET *sh, fd_set *rfds, fd_set *wfds)
-{
-  if (!sh || !rfds) {
-
-    return 0 ;
-
-  } else if (!sh->ssl) {
 
-    return FD_ISSET(sh->fd, rfds) ;
-
-  } else {
-
-    // Return true if there is data left in the SSL_read
-    // Or the SSL_read needs a write
-    // Or the SSL_read needs a read
+int netsetciphers(char *ciphers)
+{
+  pthread_mutex_lock(&_net_ctxmutex) ;
+  int r = _net_setstr(&_net_ciphers, ciphers) ;
+  pthread_mutex_unlock(&_net_ctxmutex) ;
+  return r ;
+}
 
-    return ( ( sh->sslhaspending ) || 
-             ( sh->sslwantwrite && FD_ISSET(sh->fd, wfds) ) ||
-             ( FD_ISSET(sh->fd, rfds) ) ) ;
 
-  }
+//
+// @brief Free session cache entry
+//
 
+static void _net_sess_free(NET_SESSENTRY *e)
+{
+  SSL_SESSION_free(e->session) ;
+  free(e->key) ;
+  free(e) ;
+  _net_sesscount-- ;
 }
 
 
-
 //
-// @brief Add connection to fd_set if active
-// @param(in) sh Handle of network connection
-// @param(in) fds FD Set for select()
-// @param(inout) l pointer to largest fd found
-// @return number of connections added
+// @brief Save new session for connection (OpenSSL new session callback)
+// @param(in) ssl Connection the session was established on
+// @param(in) session New session
+// @return 1 if the cache has taken the session reference, or 0 if not
 //
 
-int netrdfdset(INET *sh, fd_set *rdfds, fd_set *wrfds, int *l)
+int _net_sess_new(SSL *ssl, SSL_SESSION *session)
 {
-  int newfds=0 ;
+  INET *sh = SSL_get_app_data(ssl) ;
+  if (!sh || !sh->sessionkey || !SSL_SESSION_is_resumable(session)) return 0 ;
 
-  if (!sh || !rdfds || !l) return 0 ;
+  pthread_mutex_lock(&_net_sessmutex) ;
 
-  if (!sh->ssl) {
+  // Replace existing session for destination, otherwise add a new entry
 
-    // Add non-ssl fd
+  NET_SESSENTRY *e, **prev ;
+  for (prev=&_net_sesscache; (e=*prev); prev=&e->next) {
+    if (e->ctx==sh->ctx && strcmp(e->key, sh->sessionkey)==0) break ;
+  }
 
-    if (sh->fd>=0) {
+  if (e) {
 
-      FD_SET(sh->fd, rdfds) ;
-      if ( sh->fd > (*l) ) { (*l) = sh->fd ; }
-    }
+    *prev = e->next ;
+    SSL_SESSION_free(e->session) ;
 
   } else {
 
-    // Add DEVNULL if ssl has more data available
+    e = malloc(sizeof(NET_SESSENTRY)) ;
+    if (e) e->key = malloc(strlen(sh->sessionkey)+1) ;
+    if (!e || !e->key) {
+      if (e) free(e) ;
+      pthread_mutex_unlock(&_net_sessmutex) ;
+      return 0 ;
+    }
+    strcpy(e->key, sh->sessionkey) ;
+    e->ctx = sh->ctx ;
+    _net_sesscount++ ;
 
-    if ( sh->sslhaspending ) {
+  }
 
-      FD_SET(_net_devnull, wrfds) ;
-      if ( _net_devnull > (*l) ) { (*l) = _net_devnull ; }
+  e->session = session ;
+  e->next = _net_sesscache ;
+  _net_sesscache = e ;
 
-    }
+  // Drop least recently used entry if the cache is full
 
-    // Add ssl socket level fd
+  if (_net_sesscount > NET_SESSIONMAX) {
+    for (prev=&_net_sesscache; (*prev)->next; prev=&(*prev)->next) ;
+    _net_sess_free(*prev) ;
+    *prev = NULL ;
+  }
 
-    if ( sh->fd >= 0 ) {
+  pthread_mutex_unlock(&_net_sessmutex) ;
+  return 1 ;
+}
 
-      FD_SET(sh->fd, rdfds) ; // Socket level fd
+
+//
+// @brief Find cached session for connection, discarding expired sessions
+// @param(in) sh Handle of connection
+// @return Session with a reference held for the caller, or NULL if none
+//
+
+SSL_SESSION *_net_sess_get(INET *sh)
+{
+  SSL_SESSION *session=NULL ;
+  time_t now = time(NULL) ;
+
+  pthread_mutex_lock(&_net_sessmutex) ;
+
+  NET_SESSENTRY *e, **prev=&_net_sesscache ;
+  while ((e=*prev)) {
+
+    if (now >= SSL_SESSION_get_time(e->session)+SSL_SESSION_get_timeout(e->session)) {
+
+      *prev = e->next ;
+      _net_sess_free(e) ;
+
+    } else if (!session && e->ctx==sh->ctx && strcmp(e->key, sh->sessionkey)==0) {
+
+      session = e->session ;
+      SSL_SESSION_up_ref(session) ;
+
+      // Move to front of list
+
+      *prev = e->next ;
+      e->next = _net_sesscache ;
+      _net_sesscache = e ;
+      if (prev==&_net_sesscache) prev=&e->next ;
+
+    } else {
+
+      prev = &e->next ;
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&_net_sessmutex) ;
+  return session ;
+}
+
+
+//
+// @brief Remove cached session for connection (e.g. after failed handshake)
+// @param(in) sh Handle of connection
+//
+
+void _net_sess_remove(INET *sh)
+{
+  pthread_mutex_lock(&_net_sessmutex) ;
+
+  NET_SESSENTRY *e, **prev ;
+  for (prev=&_net_sesscache; (e=*prev); prev=&e->next) {
+    if (e->ctx==sh->ctx && strcmp(e->key, sh->sessionkey)==0) {
+      *prev = e->next ;
+      _net_sess_free(e) ;
+      break ;
+    }
+  }
+
+  pthread_mutex_unlock(&_net_sessmutex) ;
+}
+
+
+//
+// @brief Report whether connection resumed a cached TLS session
+// @param(in) sh Handle of open connection
+// @return true if session was resumed, false if a full handshake was done
+//
+
+int netsessionreused(INET *sh)
+{
+  if (!sh) return 0 ;
+  else return sh->sessionreused ;
+}
+
+
+//
+// @brief Report whether TLS has been offloaded to the kernel (KTLS)
+// @param(in) sh Handle of open connection
+// @return NET_KTLS_TX if sending is offloaded, plus NET_KTLS_RX if
+//         receiving is, or 0 if neither (or not TLS)
+//
+
+int netktls(INET *sh)
+{
+  if (!sh || !sh->ssl) return 0 ;
+
+  int ktls=0 ;
+  if (BIO_get_ktls_send(SSL_get_wbio(sh->ssl))) ktls |= NET_KTLS_TX ;
+  if (BIO_get_ktls_recv(SSL_get_rbio(sh->ssl))) ktls |= NET_KTLS_RX ;
+  return ktls ;
+}
+
+
+//
+// @brief Obtain TLS handshake counts for all connections
+// @param(out) resumed Number of handshakes which resumed a session (or NULL)
+// @param(out) full Number of full handshakes (or NULL)
+// @return Number of sessions currently cached
+//
+
+int netsessionstats(unsigned long *resumed, unsigned long *full)
+{
+  pthread_mutex_lock(&_net_sessmutex) ;
+  if (resumed) *resumed = _net_sessresumed ;
+  if (full) *full = _net_sessfull ;
+  int count = _net_sesscount ;
+  pthread_mutex_unlock(&_net_sessmutex) ;
+  return count ;
+}
+
+//
+// @brief Start connecting to server, without blocking
+// @param(in) hostname Name of server to connect to - note 011 represents octal -> 9
+// @param(in) port Port number on server
+// @param(in) flags Type of connection to open (OPEN|TLS|SSL2|SSL3|NONBLOCK)
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+
+INET *netconnect_start(char *hostname, int port, enum netflags flags)
+{
+  return netconnect_startopts(hostname, port, flags, NULL) ;
+}
+
+
+//
+// @brief Start connecting to server, without blocking, applying socket options
+// @param(in) hostname Name of server to connect to
+// @param(in) port Port number on server
+// @param(in) flags Type of connection to open (OPEN|TLS|SSL2|SSL3|NONBLOCK)
+// @param(in) opts Socket options, applied before connecting, or NULL
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+
+INET *netconnect_startopts(char *hostname, int port, enum netflags flags, NETOPTS *opts)
+{
+  if (!hostname) {
+    // Unable to set sh->errno
+    return NULL ;
+  }
+
+  INET *sh = malloc(sizeof(INET)) ;
+  if (!sh) {
+    // Unable to set sh->errno
+    return NULL ;
+  }
+  memset(sh, '\0', sizeof(INET)) ;
+
+  sh->fd=-1 ;
+  sh->localport=-1 ;
+  sh->peerport=-1 ;
+  sh->certstatus=X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT ; 
+  sh->err=-1 ;
+  sh->isblocking = !(flags&NONBLOCK) ;
+  sh->flags = flags ;
+  sh->state = NET_RESOLVING ;
+  if (flags&COALESCE) sh->wbufmax = NET_WBUFSIZE ;
+
+  __atomic_add_fetch(&_net_numconnections, 1, __ATOMIC_RELAXED) ;
+
+  // Unix domain sockets have no port
+
+  int isunix = strncmp(hostname, NET_UNIXPREFIX, strlen(NET_UNIXPREFIX))==0 ;
+
+  if (isunix) {
+    port = 0 ;
+  } else if (port<=0) {
+    _net_seterrno(sh, "port", NET_ERR_INT, NET_ERR_BADP) ;
+    goto fail ;
+  }
+
+  sh->peerport = port ;
+
+  // Options, kept for each socket created while connecting
+
+  if (opts) {
+    sh->opts = malloc(sizeof(NETOPTS)) ;
+    if (!sh->opts) {
+      _net_seterrno(sh, "opts", NET_ERR_ERRNO, 0) ;
+      goto fail ;
+    }
+    memcpy(sh->opts, opts, sizeof(NETOPTS)) ;
+  }
+
+  // Key for TLS session cache
+
+  if (flags&TLS || flags&SSL2 || flags&SSL3) {
+    sh->sessionkey = malloc(strlen(hostname)+16) ;
+    if (!sh->sessionkey) {
+      _net_seterrno(sh, "sessionkey", NET_ERR_ERRNO, 0) ;
+      goto fail ;
+    }
+    sprintf(sh->sessionkey, "%s:%d", hostname, port) ;
+  }
+
+  // Resolve host name.  The connection is started once its address is
+  // known, straight away for numeric, hosts file and cached names
+
+  if (isunix) {
+    if (_net_unixconnect(sh, &hostname[strlen(NET_UNIXPREFIX)])<0) sh->state = NET_FAILED ;
+  } else if (!(sh->lookup=_netdns_lookup_start(hostname))) {
+    _net_seterrno(sh, "resolve", NET_ERR_INT, NET_ERR_BADA) ;
+    goto fail ;
+  } else {
+    NETADDR addrs[NET_MAXADDRS] ;
+    int naddrs ;
+    if (_netdns_lookup_collect(sh->lookup, addrs, &naddrs)) {
+      sh->lookup = NULL ;
+      _net_resolved(sh, addrs, naddrs) ;
+    }
+  }
+
+  if (sh->state==NET_FAILED) goto fail ;
+
+  return sh ;
+
+fail: 
+  netclose(sh) ;
+  errno=EHOSTUNREACH ;
+  return NULL ;
+}
+
+
+//
+// @brief Host name has been resolved, so start connecting
+// @param(in) arg Handle of connection
+// @param(in) addrs Addresses found
+// @param(in) naddrs Number of addresses, 0 if the name could not be resolved
+//
+
+void _net_resolved(void *arg, NETADDR *addrs, int naddrs)
+{
+  INET *sh = arg ;
+  int r ;
+
+  if (naddrs<1) {
+    _net_seterrno(sh, "gethost", NET_ERR_INT, NET_ERR_BADA) ;
+    sh->state = NET_FAILED ;
+    return ;
+  }
+
+  if (naddrs==1) r = _net_startconnect(sh, &addrs[0]) ;
+  else r = _net_attempt_start(sh, addrs, naddrs) ;
+
+  if (r<0) sh->state = NET_FAILED ;
+}
+
+
+//
+// @brief Create non-blocking socket and start connecting to address
+// @param(in) sh Handle of connection
+// @param(in) addr Address to connect to
+// @param(out) fd Socket, or -1 on failure
+// @return 1 - Connected, 0 - In progress, -1 - Failed
+//
+
+static int _net_socket(INET *sh, NETADDR *addr, int *fd)
+{
+  struct sockaddr_storage dest_addr ;
+  socklen_t dest_addr_len ;
+
+  memset(&dest_addr, 0, sizeof(dest_addr)) ;
+  if (addr->family==AF_INET6) {
+    struct sockaddr_in6 *sa = (struct sockaddr_in6 *)&dest_addr ;
+    sa->sin6_family = AF_INET6 ;
+    sa->sin6_port = htons(sh->peerport) ;
+    memcpy(&sa->sin6_addr, addr->addr, 16) ;
+    dest_addr_len = sizeof(struct sockaddr_in6) ;
+  } else {
+    struct sockaddr_in *sa = (struct sockaddr_in *)&dest_addr ;
+    sa->sin_family = AF_INET ;
+    sa->sin_port = htons(sh->peerport) ;
+    memcpy(&sa->sin_addr, addr->addr, 4) ;
+    dest_addr_len = sizeof(struct sockaddr_in) ;
+  }
+
+  *fd = socket(addr->family, SOCK_STREAM, 0);
+  if ( *fd < 0 ) {
+    _net_seterrno(sh, "socket", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+
+  if (sh->opts && !netsetfdopts(*fd, sh->opts)) {
+    _net_seterrno(sh, "setsockopt", NET_ERR_ERRNO, 0) ;
+    goto fail ;
+  }
+
+  // Set non-blocking and start connecting to destination
+
+  sh->fdoptions = fcntl(*fd,F_GETFL,0);
+
+  if (sh->fdoptions<0) {
+    _net_seterrno(sh, "fcntl", NET_ERR_ERRNO, 0) ;
+    goto fail ;
+  }
+  fcntl(*fd, F_SETFL, sh->fdoptions | O_NONBLOCK);
+
+  if ( connect(*fd, (struct sockaddr *) &dest_addr, dest_addr_len) < 0 ) {
+
+    if (errno!=EINPROGRESS) {
+      _net_seterrno(sh, "connect", NET_ERR_ERRNO, 0) ; 
+      goto fail ;
+    }
+
+    return 0 ;
+
+  } else {
+
+    return 1 ;
+
+  }
+
+fail:
+  close(*fd) ;
+  *fd = -1 ;
+  return -1 ;
+}
+
+
+//
+// @brief Store IP address of connection
+// @param(in) sh Handle of connection
+// @param(in) addr Address connected to
+// @return true on success
+//
+
+static int _net_setpeer(INET *sh, NETADDR *addr)
+{
+  char ip[INET6_ADDRSTRLEN] ;
+
+  if (!inet_ntop(addr->family, addr->addr, ip, sizeof(ip))) {
+    _net_seterrno(sh, "ntoa", NET_ERR_INT, NET_ERR_BADA) ;
+    return 0 ;
+  }
+
+  if (sh->ipaddress) free(sh->ipaddress) ;
+  sh->ipaddress = malloc(strlen(ip)+1) ;
+  if (!sh->ipaddress) {
+    _net_seterrno(sh, "ipaddress", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+  strcpy(sh->ipaddress, ip) ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Create socket and start connecting to address
+// @param(in) sh Handle of connection
+// @param(in) addr Address to connect to
+// @return 1 - Connected, 0 - In progress, -1 - Failed
+//
+
+int _net_startconnect(INET *sh, NETADDR *addr)
+{
+  sh->state = NET_CONNECTING ;
+
+  if (!_net_setpeer(sh, addr)) return -1 ;
+
+  int r = _net_socket(sh, addr, &sh->fd) ;
+  if (r>0) return _net_connected(sh) ;
+
+  if (r==0) sh->wantwrite=1 ;
+  return r ;
+}
+
+
+//
+// @brief Store path of Unix domain socket as the connection's peer address
+// @param(in) sh Handle of connection
+// @param(in) sa Socket address
+// @param(in) len Length of address
+// @return true on success
+//
+
+static int _net_setpath(INET *sh, struct sockaddr_un *sa, socklen_t len)
+{
+  char path[sizeof(sa->sun_path)+1] ;
+  size_t n = 0 ;
+
+  if (len > offsetof(struct sockaddr_un, sun_path)) {
+    n = len - offsetof(struct sockaddr_un, sun_path) ;
+  }
+  if (n > sizeof(sa->sun_path)) n = sizeof(sa->sun_path) ;
+
+  // Abstract namespace addresses start with a nul, shown as '@'
+
+  memcpy(path, sa->sun_path, n) ;
+  path[n] = '\0' ;
+  if (n>0 && path[0]=='\0') path[0] = '@' ;
+
+  if (sh->ipaddress) free(sh->ipaddress) ;
+  sh->ipaddress = malloc(strlen(path)+1) ;
+  if (!sh->ipaddress) {
+    _net_seterrno(sh, "ipaddress", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+  strcpy(sh->ipaddress, path) ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Create Unix domain socket and connect to path
+// @param(in) sh Handle of connection
+// @param(in) path Path of socket, or "@name" in the abstract namespace
+// @return 1 - Connected, 0 - In progress, -1 - Failed
+//
+
+int _net_unixconnect(INET *sh, char *path)
+{
+  struct sockaddr_un sa ;
+  size_t len = strlen(path) ;
+
+  sh->state = NET_CONNECTING ;
+
+  memset(&sa, 0, sizeof(sa)) ;
+  sa.sun_family = AF_UNIX ;
+  if (len==0 || len>=sizeof(sa.sun_path)) {
+    errno = len ? ENAMETOOLONG : EINVAL ;
+    _net_seterrno(sh, "unix", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+  memcpy(sa.sun_path, path, len) ;
+
+  // Abstract names aren't nul terminated, so the length must be exact
+
+  socklen_t salen = offsetof(struct sockaddr_un, sun_path) + len + 1 ;
+  if (path[0]=='@') {
+    sa.sun_path[0] = '\0' ;
+    salen-- ;
+  }
+
+  if (!_net_setpath(sh, &sa, salen)) return -1 ;
+
+  sh->fd = socket(AF_UNIX, SOCK_STREAM, 0) ;
+  if (sh->fd<0) {
+    _net_seterrno(sh, "socket", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+
+  if (sh->opts && !netsetfdopts(sh->fd, sh->opts)) {
+    _net_seterrno(sh, "setsockopt", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+
+  sh->fdoptions = fcntl(sh->fd, F_GETFL, 0) ;
+  if (sh->fdoptions<0) {
+    _net_seterrno(sh, "fcntl", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+  fcntl(sh->fd, F_SETFL, sh->fdoptions | O_NONBLOCK) ;
+
+  // Connecting is immediate, or fails with EAGAIN if the listener's
+  // backlog is full
+
+  if (connect(sh->fd, (struct sockaddr *)&sa, salen)<0) {
+    if (errno!=EINPROGRESS) {
+      _net_seterrno(sh, "connect", NET_ERR_ERRNO, 0) ;
+      return -1 ;
+    }
+    sh->wantwrite=1 ;
+    return 0 ;
+  }
+
+  return _net_connected(sh) ;
+}
+
+
+//
+// @brief Keep attempt which has connected, and cancel the others
+// @param(in) sh Handle of connection
+// @param(in) a Attempt which has connected
+// @return 1 - Connected, -1 - Failed
+//
+
+static int _net_attempt_won(INET *sh, struct _net_attempt *a)
+{
+  sh->fd = a->fd ;
+  a->fd = -1 ;
+
+  int ok = _net_setpeer(sh, &a->addr) ;
+  _net_attempt_free(sh) ;
+
+  return ok ? 1 : -1 ;
+}
+
+
+//
+// @brief Start connecting to next address not yet tried
+// @param(in) sh Handle of connection
+// @return 1 - Connected, 0 - In progress (or no addresses left), -1 - Failed
+//
+
+static int _net_attempt_next(INET *sh)
+{
+  while (sh->nextattempt < sh->nattempts) {
+
+    struct _net_attempt *a = &sh->attempts[sh->nextattempt++] ;
+
+    int r = _net_socket(sh, &a->addr, &a->fd) ;
+    if (r>0) return _net_attempt_won(sh, a) ;
+
+    // Failed straight away (e.g. no route for family), so try next now
+
+    if (r<0) continue ;
+
+    struct epoll_event ev ;
+    ev.events = EPOLLOUT ;
+    ev.data.ptr = a ;
+    if (epoll_ctl(sh->attemptepfd, EPOLL_CTL_ADD, a->fd, &ev)<0) {
+      _net_seterrno(sh, "epoll_ctl", NET_ERR_ERRNO, 0) ;
+      return -1 ;
+    }
+
+    // Start next address if this one has not connected in time
+
+    struct itimerspec its ;
+    memset(&its, 0, sizeof(its)) ;
+    if (sh->nextattempt < sh->nattempts) {
+      its.it_value.tv_nsec = NET_ATTEMPTDELAY * 1000000L ;
+    }
+    timerfd_settime(sh->attempttimerfd, 0, &its, NULL) ;
+
+    return 0 ;
+  }
+
+  return 0 ;
+}
+
+
+//
+// @brief Determine whether all addresses have been tried and failed
+// @param(in) sh Handle of connection
+// @return true if there is nothing left to wait for
+//
+
+static int _net_attempt_exhausted(INET *sh)
+{
+  if (sh->nextattempt < sh->nattempts) return 0 ;
+
+  for (int i=0; i<sh->nattempts; i++) {
+    if (sh->attempts[i].fd>=0) return 0 ;
+  }
+
+  return 1 ;
+}
+
+
+//
+// @brief Start connecting to a host with several addresses
+// @param(in) sh Handle of connection
+// @param(in) addrs Addresses of host, in order of preference
+// @param(in) naddrs Number of addresses
+// @return 1 - Connected, 0 - In progress, -1 - Failed
+//
+
+int _net_attempt_start(INET *sh, NETADDR *addrs, int naddrs)
+{
+  sh->state = NET_CONNECTING ;
+  sh->wantwrite = 0 ;
+
+  sh->attempts = malloc(naddrs*sizeof(struct _net_attempt)) ;
+  if (!sh->attempts) {
+    _net_seterrno(sh, "attempts", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+  sh->attemptepfd = -1 ;
+  sh->attempttimerfd = -1 ;
+
+  // Alternate address families, starting with the preferred one
+
+  int first = addrs[0].family ;
+  int pos[2] = { 0, 0 } ;
+
+  for (int n=0; n<naddrs; n++) {
+    int want = n&1 ;
+    for (int k=0; k<2; k++, want^=1) {
+      while (pos[want]<naddrs && (addrs[pos[want]].family!=first)!=want) pos[want]++ ;
+      if (pos[want]<naddrs) break ;
+    }
+    sh->attempts[n].addr = addrs[pos[want]++] ;
+    sh->attempts[n].fd = -1 ;
+  }
+
+  sh->nattempts = naddrs ;
+  sh->nextattempt = 0 ;
+
+  // Attempt sockets and the stagger timer are watched by a single
+  // epoll fd, which is returned by netfd while connecting
+
+  sh->attemptepfd = epoll_create1(EPOLL_CLOEXEC) ;
+  sh->attempttimerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC) ;
+  if (sh->attemptepfd<0 || sh->attempttimerfd<0) {
+    _net_seterrno(sh, "epoll", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+
+  struct epoll_event ev ;
+  ev.events = EPOLLIN ;
+  ev.data.ptr = NULL ;
+  if (epoll_ctl(sh->attemptepfd, EPOLL_CTL_ADD, sh->attempttimerfd, &ev)<0) {
+    _net_seterrno(sh, "epoll_ctl", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+
+  int r = _net_attempt_next(sh) ;
+  if (r>0) return _net_connected(sh) ;
+  if (r==0 && _net_attempt_exhausted(sh)) r=-1 ;
+
+  return r ;
+}
+
+
+//
+// @brief Check progress of connection attempts, and start more when due
+// @param(in) sh Handle of connection
+// @return 1 - Connected, 0 - In progress, -1 - Failed
+//
+
+int _net_attempt_step(INET *sh)
+{
+  struct epoll_event ev[NET_MAXADDRS+1] ;
+
+  int n = epoll_wait(sh->attemptepfd, ev, NET_MAXADDRS+1, 0) ;
+  if (n<0) {
+    if (errno==EINTR) return 0 ;
+    _net_seterrno(sh, "epoll_wait", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+
+  for (int i=0; i<n; i++) {
+
+    struct _net_attempt *a = ev[i].data.ptr ;
+    int r ;
+
+    if (!a) {
+
+      // Timer has expired (unless rearmed since), so start next address
+
+      uint64_t expiries ;
+      if (read(sh->attempttimerfd, &expiries, sizeof(expiries))!=sizeof(expiries)) continue ;
+      r = _net_attempt_next(sh) ;
+
+    } else {
+
+      if (a->fd<0) continue ;
+
+      int valopt ;
+      socklen_t lon = sizeof(int); 
+      if (getsockopt(a->fd, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0) { 
+        _net_seterrno(sh, "getsockopt", NET_ERR_ERRNO, 0) ;
+        valopt = -1 ;
+      } else if (valopt) {
+        _net_seterrno(sh, "getsockopt", NET_ERR_ERRNO, valopt) ;
+      } else {
+        return _net_attempt_won(sh, a) ;
+      }
+
+      // Connect failed, so start next address without waiting for timer
+
+      close(a->fd) ;
+      a->fd = -1 ;
+      r = _net_attempt_next(sh) ;
+
+    }
+
+    if (r!=0) return r ;
+  }
+
+  return _net_attempt_exhausted(sh) ? -1 : 0 ;
+}
+
+
+//
+// @brief Cancel connection attempts still in progress
+// @param(in) sh Handle of connection
+//
+
+void _net_attempt_free(INET *sh)
+{
+  if (!sh->attempts) return ;
+
+  for (int i=0; i<sh->nattempts; i++) {
+    if (sh->attempts[i].fd>=0) close(sh->attempts[i].fd) ;
+  }
+  if (sh->attemptepfd>=0) close(sh->attemptepfd) ;
+  if (sh->attempttimerfd>=0) close(sh->attempttimerfd) ;
+
+  free(sh->attempts) ;
+  sh->attempts = NULL ;
+  sh->nattempts = 0 ;
+}
+
+
+//
+// @brief Socket has connected, so start TLS handshake if required
+// @param(in) sh Handle of connection
+// @return 1 - Connected, 0 - Handshake started, -1 - Failed
+//
+
+int _net_connected(INET *sh)
+{
+  // Get local port
+
+  struct sockaddr_storage local_addr;
+  socklen_t local_addr_len = sizeof(local_addr) ;
+  memset(&local_addr, 0, sizeof(local_addr));
+  if (getsockname(sh->fd, (struct sockaddr *) &local_addr, &local_addr_len) < 0 ) {
+    _net_seterrno(sh, "getsockname", NET_ERR_ERRNO, 0) ; 
+    return -1 ;
+  }
+  if (local_addr.ss_family==AF_INET6) {
+    sh->localport = ntohs(((struct sockaddr_in6 *)&local_addr)->sin6_port) ;
+  } else if (local_addr.ss_family==AF_INET) {
+    sh->localport = ntohs(((struct sockaddr_in *)&local_addr)->sin_port) ;
+  } else {
+    sh->localport = 0 ;
+  }
+
+  sh->wantwrite=0 ;
+  sh->lastactive = _net_now() ;
+
+  if (!sh->sessionkey) return _net_ready(sh) ;
+
+  // Now establish SSL connection.  Obtain shared context
+
+  sh->ctx = _net_ctx_get(sh, sh->flags) ;
+  if ( !sh->ctx ) { 
+    return -1 ;
+  }
+
+  if (sh->flags&DEBUGKEYDUMP) {
+    sh->keydumpenable=1 ;
+  }
+
+  // Create connection state object
+
+  sh->ssl = SSL_new(sh->ctx);
+  if (!sh->ssl) {
+    _net_seterrno(sh, "ssl_new", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+
+  SSL_set_connect_state(sh->ssl); 
+
+  // Writes which could not complete are retried from a new copy of
+  // the data (netsendv packs records on the stack)
+
+  SSL_set_mode(sh->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER) ;
+
+  // OpenSSL hands the connection to kernel TLS after the handshake,
+  // if the kernel and the negotiated cipher allow it (see netktls)
+
+  if (sh->flags&KTLS) SSL_set_options(sh->ssl, SSL_OP_ENABLE_KTLS) ;
+
+  // Attach SSL server to the socket
+
+  SSL_set_fd(sh->ssl, sh->fd);
+
+  // Offer cached session for destination
+
+  SSL_set_app_data(sh->ssl, sh) ;
+
+  SSL_SESSION *session = _net_sess_get(sh) ;
+  if (session) {
+    SSL_set_session(sh->ssl, session) ;
+    SSL_SESSION_free(session) ;
+  }
+
+  sh->state = NET_HANDSHAKING ;
+  return 0 ;
+}
+
+
+//
+// @brief Progress TLS handshake
+// @param(in) sh Handle of connection
+// @return 1 - Connected, 0 - In progress, -1 - Failed
+//
+
+int _net_handshake(INET *sh)
+{
+  int r = SSL_connect(sh->ssl) ;
+
+  if (r<=0) {
+
+    switch (SSL_get_error(sh->ssl, r)) {
+
+    case SSL_ERROR_WANT_READ:
+      sh->wantwrite=0 ;
+      return 0 ;
+
+    case SSL_ERROR_WANT_WRITE:
+      sh->wantwrite=1 ;
+      return 0 ;
+
+    default:
+      _net_seterrno(sh, "ssl_connect", NET_ERR_SSL, r) ;
+      _net_sess_remove(sh) ;
+      return -1 ;
+
+    }
+
+  }
+
+  // Record whether the handshake was resumed
+
+  sh->sessionreused = SSL_session_reused(sh->ssl) ;
+  pthread_mutex_lock(&_net_sessmutex) ;
+  if (sh->sessionreused) _net_sessresumed++ ;
+  else _net_sessfull++ ;
+  pthread_mutex_unlock(&_net_sessmutex) ;
+
+  // Open /dev/null, which is used for select
+
+  if ( !sh->isblocking ) _net_devnull_fd() ;
+
+  sh->wantwrite=0 ;
+  return _net_ready(sh) ;
+}
+
+
+//
+// @brief Complete connection once established
+// @param(in) sh Handle of connection
+// @return 1 - Connected
+//
+
+int _net_ready(INET *sh)
+{
+  // Restore blocking if required
+
+  if ( ! (sh->flags&NONBLOCK) ) {
+
+    fcntl(sh->fd, F_SETFL, sh->fdoptions);
+
+  }
+
+  if (sh->flags&DEBUGDATADUMP && getenv("NETDUMPENABLE")) {
+    sh->datadumpenable=1 ;
+  }
+
+  sh->state = NET_CONNECTED ;
+  return 1 ;
+}
+
+
+//
+// @brief Progress connection started with netconnect_start
+// @param(in) sh Handle of connection
+// @return 1 - Connected, 0 - In progress, -1 - Failed (and sets errno)
+//
+
+int netconnect_step(INET *sh)
+{
+  if (!sh) return -1 ;
+
+  int r=-1 ;
+
+  switch (sh->state) {
+
+  case NET_RESOLVING:
+
+    // Progress lookups, then collect this connection's result.  Other
+    // connections' results are left for their own threads to collect
+
+    netresolve_process() ;
+    {
+      NETADDR addrs[NET_MAXADDRS] ;
+      int naddrs ;
+      if (!_netdns_lookup_collect(sh->lookup, addrs, &naddrs)) return 0 ;
+      sh->lookup = NULL ;
+      _net_resolved(sh, addrs, naddrs) ;
+    }
+    return netconnect_step(sh) ;
+
+  case NET_CONNECTING:
+
+    if (sh->attempts) {
+
+      // Check attempts on each address, starting more as they fall due
+
+      r = _net_attempt_step(sh) ;
+      if (r<=0) break ;
+
+    } else {
+
+      // Check whether connect has completed, without waiting
+
+      struct pollfd pfd = { sh->fd, POLLOUT, 0 } ;
+      int n = poll(&pfd, 1, 0) ;
+      if (n<0) {
+        _net_seterrno(sh, "connect", NET_ERR_ERRNO, 0) ;
+        break ;
+      } else if (n==0) {
+        return 0 ;
+      }
+
+      int valopt ;
+      socklen_t lon = sizeof(int); 
+      if (getsockopt(sh->fd, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0) { 
+        _net_seterrno(sh, "getsockopt", NET_ERR_ERRNO, 0) ;
+        break ;
+      }
+
+      if (valopt) { 
+        _net_seterrno(sh, "getsockopt", NET_ERR_ERRNO, valopt) ;
+        break ;
+      }
+    }
+
+    r = _net_connected(sh) ;
+    if (r!=0) break ;
+
+    // Fall through to start handshake
+
+  case NET_HANDSHAKING:
+
+    r = _net_handshake(sh) ;
+    break ;
+
+  case NET_CONNECTED:
+
+    return 1 ;
+
+  default:
+
+    return -1 ;
+
+  }
+
+  if (r<0) {
+    sh->state = NET_FAILED ;
+    errno=EHOSTUNREACH ;
+  }
+
+  return r ;
+}
+
+
+//
+// @brief Determine whether connection in progress is waiting to write
+// @param(in) sh Handle of connection
+// @return True if netconnect_step should be called when the socket is writable,
+//         false if it should be called when the socket is readable
+//
+
+int netconnect_wantwrite(INET *sh)
+{
+  if (!sh) return 0 ;
+  else return sh->wantwrite ;
+}
+
+
+//
+// @brief Obtain socket of connection
+// @param(in) sh Handle of connection
+// @return File descriptor, or -1 if not connected
+//
+
+int netfd(INET *sh)
+{
+  if (!sh) {
+    return -1 ;
+  } else if (sh->state==NET_RESOLVING) {
+    return _netdns_lookup_fd(sh->lookup) ;
+  } else if (sh->state==NET_CONNECTING && sh->attempts) {
+    return sh->attemptepfd ;
+  } else if (sh->state==NET_FAILED && sh->fd<0) {
+
+    // Return an fd which is always ready, so that the caller
+    // steps the connection and learns of the failure
+
+    return _net_devnull_fd() ;
+
+  } else {
+    return sh->fd ;
+  }
+}
+
+
+//
+// @brief Connect to server
+// @param(in) hostname Name of server to connect to - note 011 represents octal -> 9
+// @param(in) port Port number on server
+// @param(in) flags Type of connection to open (OPEN|TLS|SSL2|SSL3|NONBLOCK)
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+
+INET *netconnect(char *hostname, int port, enum netflags flags)
+{
+  return netconnectopts(hostname, port, flags, NULL) ;
+}
+
+
+//
+// @brief Connect to server, applying socket options
+// @param(in) hostname Name of server to connect to
+// @param(in) port Port number on server
+// @param(in) flags Type of connection to open (OPEN|TLS|SSL2|SSL3|NONBLOCK)
+// @param(in) opts Socket options, applied before connecting, or NULL
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+
+INET *netconnectopts(char *hostname, int port, enum netflags flags, NETOPTS *opts)
+{
+  INET *sh = netconnect_startopts(hostname, port, flags, opts) ;
+  if (!sh) return NULL ;
+
+  // Wait for connection, allowing 2 seconds for the socket to
+  // connect (after the last address has been tried), and as long
+  // as it takes for the lookup and handshake
+
+  int r ;
+  while ( (r=netconnect_step(sh)) == 0 ) {
+
+    fd_set fds ;
+    struct timeval tv ;
+    tv.tv_sec = 2 ;
+    tv.tv_usec = 0 ;
+
+    int fd = netfd(sh) ;
+    FD_ZERO(&fds) ;
+    FD_SET(fd, &fds) ;
+
+    int n = select(fd+1, sh->wantwrite?NULL:&fds, sh->wantwrite?&fds:NULL,
+                   NULL, (sh->state==NET_CONNECTING)?&tv:NULL) ;
+
+    if (n < 0 && errno != EINTR) {
+      _net_seterrno(sh, "connect", NET_ERR_ERRNO, 0) ;
+      break ;
+    } else if (n == 0) {
+      _net_seterrno(sh, "connect", NET_ERR_INT, NET_ERR_TIMEOUT) ;
+      break ;
+    }
+
+  }
+
+  if (r<=0) {
+    netclose(sh) ;
+    errno=EHOSTUNREACH ;
+    return NULL ;
+  }
+
+  return sh ;
+}
+
+
+//
+// @brief Create handle for a socket which is already connected (e.g. accepted)
+// @param(in) fd Connected socket, which is then closed by netclose
+// @param(in) flags Type of connection (OPEN|NONBLOCK|COALESCE|DEBUGDATADUMP)
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+// TLS is not supported, as handles are only ever TLS clients.
+//
+
+INET *netadopt(int fd, enum netflags flags)
+{
+  if (fd<0 || flags&TLS || flags&SSL2 || flags&SSL3) {
+    errno = EINVAL ;
+    return NULL ;
+  }
+
+  INET *sh = malloc(sizeof(INET)) ;
+  if (!sh) {
+    // Unable to set sh->errno
+    return NULL ;
+  }
+  memset(sh, '\0', sizeof(INET)) ;
+
+  sh->fd=fd ;
+  sh->localport=-1 ;
+  sh->peerport=-1 ;
+  sh->certstatus=X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT ; 
+  sh->err=-1 ;
+  sh->isblocking = !(flags&NONBLOCK) ;
+  sh->flags = flags ;
+  sh->state = NET_CONNECTING ;
+  if (flags&COALESCE) sh->wbufmax = NET_WBUFSIZE ;
+
+  __atomic_add_fetch(&_net_numconnections, 1, __ATOMIC_RELAXED) ;
+
+  // Peer address
+
+  struct sockaddr_storage peer_addr ;
+  socklen_t peer_addr_len = sizeof(peer_addr) ;
+  NETADDR addr ;
+
+  memset(&peer_addr, 0, sizeof(peer_addr)) ;
+  if (getpeername(fd, (struct sockaddr *)&peer_addr, &peer_addr_len)<0) {
+    _net_seterrno(sh, "getpeername", NET_ERR_ERRNO, 0) ;
+    goto fail ;
+  }
+
+  addr.family = peer_addr.ss_family ;
+  if (peer_addr.ss_family==AF_INET6) {
+    struct sockaddr_in6 *sa = (struct sockaddr_in6 *)&peer_addr ;
+    memcpy(addr.addr, &sa->sin6_addr, 16) ;
+    sh->peerport = ntohs(sa->sin6_port) ;
+  } else if (peer_addr.ss_family==AF_INET) {
+    struct sockaddr_in *sa = (struct sockaddr_in *)&peer_addr ;
+    memcpy(addr.addr, &sa->sin_addr, 4) ;
+    sh->peerport = ntohs(sa->sin_port) ;
+  } else if (peer_addr.ss_family==AF_UNIX) {
+    struct sockaddr_un *sa = (struct sockaddr_un *)&peer_addr ;
+    sh->peerport = 0 ;
+    if (!_net_setpath(sh, sa, peer_addr_len)) goto fail ;
+  } else {
+    _net_seterrno(sh, "family", NET_ERR_INT, NET_ERR_BADA) ;
+    goto fail ;
+  }
+
+  if (peer_addr.ss_family!=AF_UNIX && !_net_setpeer(sh, &addr)) goto fail ;
+
+  // Blocking mode follows flags, as for netconnect
+
+  sh->fdoptions = fcntl(fd, F_GETFL) ;
+  if (flags&NONBLOCK) fcntl(fd, F_SETFL, sh->fdoptions|O_NONBLOCK) ;
+
+  if (_net_connected(sh)<0) goto fail ;
+
+  return sh ;
+
+fail:
+  sh->fd = -1 ;
+  int e = errno ;
+  netclose(sh) ;
+  errno = e ;
+  return NULL ;
+}
+
+
+//
+// @brief Obtain effective socket options of connection
+// @param(in) sh Handle of open connection
+// @param(out) opts Options in effect (see netgetfdopts)
+// @return true on success
+//
+
+int netgetopts(INET *sh, NETOPTS *opts)
+{
+  if (!sh || sh->fd<0 || !opts) {
+    errno = EBADF ;
+    if (sh) _net_seterrno(sh, "netgetopts", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+
+  if (!netgetfdopts(sh->fd, opts)) {
+    _net_seterrno(sh, "getsockopt", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+
+  return 1 ;
+}
+
+
+//
+// @brief Set integer socket option, if a value has been given
+// @param(in) fd Socket
+// @param(in) level Protocol level
+// @param(in) name Option
+// @param(in) value Value, 0 to leave unchanged
+// @param(in) onoff True if value is on (positive) or off (negative)
+// @return true on success
+//
+
+static int _net_setopt(int fd, int level, int name, int value, int onoff)
+{
+  if (value==0) return 1 ;
+  if (onoff) value = value>0 ;
+  return setsockopt(fd, level, name, &value, sizeof(value))==0 ;
+}
+
+
+//
+// @brief Apply socket options to a socket
+// @param(in) fd Socket
+// @param(in) opts Options to apply
+// @return true on success, false if an option could not be set (setting errno)
+//
+
+int netsetfdopts(int fd, NETOPTS *opts)
+{
+  if (fd<0 || !opts) {
+    errno = EINVAL ;
+    return 0 ;
+  }
+
+  int domain=AF_INET ;
+  socklen_t len = sizeof(domain) ;
+  getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) ;
+
+  // Only the buffer sizes apply to Unix domain sockets
+
+  if (domain==AF_UNIX) {
+    return _net_setopt(fd, SOL_SOCKET, SO_SNDBUF, opts->sndbuf, 0) &&
+           _net_setopt(fd, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf, 0) ;
+  }
+
+  return _net_setopt(fd, IPPROTO_TCP, TCP_NODELAY, opts->nodelay, 1) &&
+         _net_setopt(fd, SOL_SOCKET, SO_SNDBUF, opts->sndbuf, 0) &&
+         _net_setopt(fd, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf, 0) &&
+         _net_setopt(fd, SOL_SOCKET, SO_KEEPALIVE, opts->keepalive, 1) &&
+         _net_setopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, opts->keepidle, 0) &&
+         _net_setopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, opts->keepintvl, 0) &&
+         _net_setopt(fd, IPPROTO_TCP, TCP_KEEPCNT, opts->keepcnt, 0) &&
+         _net_setopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, opts->usertimeout, 0) &&
+         _net_setopt(fd, IPPROTO_TCP, TCP_QUICKACK, opts->quickack, 1) &&
+         _net_setopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, opts->fastopen, 1) &&
+         _net_setopt(fd, IPPROTO_TCP, TCP_FASTOPEN, opts->fastopenqlen, 0) &&
+         (domain==AF_INET6 ? _net_setopt(fd, IPPROTO_IPV6, IPV6_TCLASS, opts->tos, 0)
+                           : _net_setopt(fd, IPPROTO_IP, IP_TOS, opts->tos, 0)) ;
+}
+
+
+//
+// @brief Obtain integer socket option
+// @param(in) fd Socket
+// @param(in) level Protocol level
+// @param(in) name Option
+// @param(out) value Value, or for on/off options 1 (on) or -1 (off)
+// @param(in) onoff True if option is on/off
+// @return true on success
+//
+
+static int _net_getopt(int fd, int level, int name, int *value, int onoff)
+{
+  socklen_t len = sizeof(*value) ;
+  if (getsockopt(fd, level, name, value, &len)<0) return 0 ;
+  if (onoff) *value = *value ? 1 : -1 ;
+  return 1 ;
+}
+
+
+//
+// @brief Obtain effective socket options of a socket
+// @param(in) fd Socket
+// @param(out) opts Options in effect
+// @return true on success
+//
+
+int netgetfdopts(int fd, NETOPTS *opts)
+{
+  if (fd<0 || !opts) {
+    errno = EINVAL ;
+    return 0 ;
+  }
+
+  memset(opts, 0, sizeof(NETOPTS)) ;
+
+  int domain=AF_INET ;
+  socklen_t len = sizeof(domain) ;
+  getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) ;
+
+  if (domain==AF_UNIX) {
+    return _net_getopt(fd, SOL_SOCKET, SO_SNDBUF, &opts->sndbuf, 0) &&
+           _net_getopt(fd, SOL_SOCKET, SO_RCVBUF, &opts->rcvbuf, 0) ;
+  }
+
+  return _net_getopt(fd, IPPROTO_TCP, TCP_NODELAY, &opts->nodelay, 1) &&
+         _net_getopt(fd, SOL_SOCKET, SO_SNDBUF, &opts->sndbuf, 0) &&
+         _net_getopt(fd, SOL_SOCKET, SO_RCVBUF, &opts->rcvbuf, 0) &&
+         _net_getopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opts->keepalive, 1) &&
+         _net_getopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &opts->keepidle, 0) &&
+         _net_getopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &opts->keepintvl, 0) &&
+         _net_getopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &opts->keepcnt, 0) &&
+         _net_getopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &opts->usertimeout, 0) &&
+         _net_getopt(fd, IPPROTO_TCP, TCP_QUICKACK, &opts->quickack, 1) &&
+         _net_getopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opts->fastopen, 1) &&
+         _net_getopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &opts->fastopenqlen, 0) &&
+         (domain==AF_INET6 ? _net_getopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &opts->tos, 0)
+                           : _net_getopt(fd, IPPROTO_IP, IP_TOS, &opts->tos, 0)) ;
+}
+
+
+//
+// @brief Determine whether data was carried in the SYN (TCP Fast Open)
+// @param(in) sh Handle of connection
+// @return 1 if data went in the SYN, 0 if not (or not yet known), -1 on error
+//
+
+int netfastopen(INET *sh)
+{
+  if (!sh || sh->fd<0) {
+    errno = EBADF ;
+    if (sh) _net_seterrno(sh, "netfastopen", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+
+  int r = netfdfastopen(sh->fd) ;
+  if (r<0) _net_seterrno(sh, "getsockopt", NET_ERR_ERRNO, 0) ;
+  return r ;
+}
+
+
+//
+// @brief Determine whether data was carried in the SYN of a socket
+// @param(in) fd Socket
+// @return 1 if data went in the SYN, 0 if not, -1 on error
+//
+
+int netfdfastopen(int fd)
+{
+  struct tcp_info ti ;
+  socklen_t len = sizeof(ti) ;
+
+  memset(&ti, 0, sizeof(ti)) ;
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len)<0) return -1 ;
+
+  return (ti.tcpi_options & TCPI_OPT_SYN_DATA) ? 1 : 0 ;
+}
+
+
+//
+// @brief Obtain credentials of peer process (Unix domain sockets only)
+// @param(in) sh Handle of open connection
+// @param(out) pid Process id of peer, or NULL
+// @param(out) uid User id of peer, or NULL
+// @param(out) gid Group id of peer, or NULL
+// @return true on success
+//
+
+int netpeercred(INET *sh, pid_t *pid, uid_t *uid, gid_t *gid)
+{
+  if (!sh || sh->fd<0) {
+    errno = EBADF ;
+    if (sh) _net_seterrno(sh, "netpeercred", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+
+  if (!netfdpeercred(sh->fd, pid, uid, gid)) {
+    _net_seterrno(sh, "netpeercred", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+
+  return 1 ;
+}
+
+
+//
+// @brief Obtain credentials of peer process of a Unix domain socket
+// @param(in) fd Socket
+// @param(out) pid Process id of peer, or NULL
+// @param(out) uid User id of peer, or NULL
+// @param(out) gid Group id of peer, or NULL
+// @return true on success
+//
+
+int netfdpeercred(int fd, pid_t *pid, uid_t *uid, gid_t *gid)
+{
+  // Other sockets report no peer (uid -1) rather than failing
+
+  int domain=-1 ;
+  socklen_t len = sizeof(domain) ;
+  if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len)<0) return 0 ;
+  if (domain!=AF_UNIX) {
+    errno = EAFNOSUPPORT ;
+    return 0 ;
+  }
+
+  struct ucred cred ;
+  len = sizeof(cred) ;
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)<0) return 0 ;
+
+  if (pid) *pid = cred.pid ;
+  if (uid) *uid = cred.uid ;
+  if (gid) *gid = cred.gid ;
+
+  return 1 ;
+}
+
+
+// 
+// @brief Obtain SSL certificate status
+// @param(in) Handle of open connection
+// @return Non-zero certificate status code or zero if ok
+//
+
+int netcertstatus(INET *sh)
+{
+  // Get peer certificate
+
+  X509 *cert = SSL_get_peer_certificate(sh->ssl);
+  if (cert) {
+    sh->certstatus = SSL_get_verify_result(sh->ssl);
+    X509_free(cert) ;
+  } else {
+    sh->certstatus = -1 ;
+  }
+
+  return (sh->certstatus) ;
+}
+
+
+// 
+// @brief Get network connection state
+// @param(in) Handle of open connection
+// @return Returns true if network connection is connected
+//
+
+int netisconnected(INET *sh)
+{
+  if (!sh) return 0 ;
+  return ( sh->fd >= 0 ) ;
+}
+
+//
+// @brief Determine if connection is ready for reading
+// @param(in) sh Handle of network connection
+// @param(in) rfds Read fd set
+// @param(in) wrds Write fd set - only required for SSL
+// @return True if connection has pending data
+//
+int netrdfdisset(INET *sh, fd_set *rfds, fd_set *wfds)
+{
+  if (!sh || !rfds) {
+
+    return 0 ;
+
+  } else if (!sh->ssl) {
+
+    return ( ( sh->rbuflen > sh->rbufpos ) ||
+             ( FD_ISSET(sh->fd, rfds) ) ) ;
+
+  } else {
+
+    // Return true if there is data left in the SSL_read
+    // Or the SSL_read needs a write
+    // Or the SSL_read needs a read
+
+    return ( ( sh->sslhaspending ) || 
+             ( sh->rbuflen > sh->rbufpos ) ||
+             ( sh->sslwantwrite && FD_ISSET(sh->fd, wfds) ) ||
+             ( FD_ISSET(sh->fd, rfds) ) ) ;
+
+  }
+
+}
+
+
+
+//
+// @brief Add connection to fd_set if active
+// @param(in) sh Handle of network connection
+// @param(in) fds FD Set for select()
+// @param(inout) l pointer to largest fd found
+// @return number of connections added
+//
+
+int netrdfdset(INET *sh, fd_set *rdfds, fd_set *wrfds, int *l)
+{
+  int newfds=0 ;
+
+  if (!sh || !rdfds || !l) return 0 ;
+
+  if (!sh->ssl) {
+
+    // Add non-ssl fd, and DEVNULL if the receive buffer has data
+
+    if (sh->fd>=0) {
+
+      FD_SET(sh->fd, rdfds) ;
+      if ( sh->fd > (*l) ) { (*l) = sh->fd ; }
+    }
+
+    int devnull = (sh->rbuflen > sh->rbufpos) ? _net_devnull_fd() : -1 ;
+    if ( devnull>=0 && wrfds ) {
+
+      FD_SET(devnull, wrfds) ;
+      if ( devnull > (*l) ) { (*l) = devnull ; }
+
+    }
+
+  } else {
+
+    // Add DEVNULL if ssl has more data available
+
+    int devnull = (sh->sslhaspending || sh->rbuflen > sh->rbufpos) ? _net_devnull_fd() : -1 ;
+    if ( devnull>=0 ) {
+
+      FD_SET(devnull, wrfds) ;
+      if ( devnull > (*l) ) { (*l) = devnull ; }
+
+    }
+
+    // Add ssl socket level fd
+
+    if ( sh->fd >= 0 ) {
+
+      FD_SET(sh->fd, rdfds) ; // Socket level fd
       if ( sh->fd > (*l) ) { (*l) = sh->fd ; }
       newfds++ ;
 
-      if ( sh->sslwantwrite ) {
+      if ( sh->sslwantwrite ) {
+
+        FD_SET(sh->fd, wrfds) ; // Socket level fd
+        if ( sh->fd > (*l) ) { (*l) = sh->fd ; }
+        newfds++ ;
+
+      }
+
+    }
+
+  }
+
+  return (newfds) ;
+
+}
+
+//
+// @brief Provide summary string of read and write socket fd_set info
+//
+
+char *netfdsetinfo(INET *sh, fd_set *rfds, fd_set *wfds)
+{
+  static __thread char str[32] ;
+  sprintf(str, "R: %c%c W: %c",
+        (FD_ISSET(sh->fd, rfds)) ? 'S' : '-',
+        sh->ssl ? sh->sslhaspending ? 'O' : '-' : ' ',
+        (FD_ISSET(sh->fd, wfds)) ? 'S' : '-') ;
+  return str ;
+}
+
+//
+// @brief Create poller, which reports connections that are ready to read
+// @return Handle of poller, or NULL on failure
+//
+
+INETPOLL *netpoll_create()
+{
+  INETPOLL *np = malloc(sizeof(INETPOLL)) ;
+  if (!np) return NULL ;
+  memset(np, '\0', sizeof(INETPOLL)) ;
+
+  np->epfd = epoll_create1(EPOLL_CLOEXEC) ;
+  if (np->epfd<0) {
+    free(np) ;
+    return NULL ;
+  }
+
+  return np ;
+}
+
+
+//
+// @brief Determine which epoll events are needed for handle
+// @param(in) sh Handle of connection
+// @return epoll events
+//
+
+static int _net_poll_events(INET *sh)
+{
+  int events = EPOLLIN | EPOLLRDHUP ;
+  if ((sh->ssl && sh->sslwantwrite) || sh->wbuflen) events |= EPOLLOUT ;
+  return events ;
+}
+
+
+//
+// @brief Update events registered with epoll for handle, if they have changed
+// @param(in) np Handle of poller
+// @param(in) sh Handle of connection
+//
+
+static void _net_poll_sync(INETPOLL *np, INET *sh)
+{
+  int events = _net_poll_events(sh) ;
+  if (events == sh->pollevents) return ;
+
+  struct epoll_event ev ;
+  ev.events = events ;
+  ev.data.ptr = sh ;
+  if (epoll_ctl(np->epfd, EPOLL_CTL_MOD, sh->fd, &ev)==0) {
+    sh->pollevents = events ;
+  }
+}
+
+
+//
+// @brief Add connected handle to poller
+// @param(in) np Handle of poller
+// @param(in) sh Handle of connection
+// @param(in) arg Argument returned with the connection's events
+// @return true on success
+//
+
+int netpoll_add(INETPOLL *np, INET *sh, void *arg)
+{
+  if (!np || !sh) return 0 ;
+
+  if (sh->poll || sh->fd<0 || sh->state!=NET_CONNECTED) {
+    errno = EINVAL ;
+    _net_seterrno(sh, "netpoll_add", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+
+  struct epoll_event ev ;
+  ev.events = _net_poll_events(sh) ;
+  ev.data.ptr = sh ;
+  if (epoll_ctl(np->epfd, EPOLL_CTL_ADD, sh->fd, &ev)<0) {
+    _net_seterrno(sh, "epoll_ctl", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+
+  sh->poll = np ;
+  sh->pollarg = arg ;
+  sh->pollevents = ev.events ;
+  sh->pollround = 0 ;
+  sh->pollprev = NULL ;
+  sh->pollnext = np->handles ;
+  if (np->handles) ((INET *)np->handles)->pollprev = sh ;
+  np->handles = sh ;
+
+  // Data may already have been decrypted, e.g. read with the handshake
+
+  if (sh->ssl || sh->rbuf) _net_poll_touch(sh) ;
+  if (sh->wbuflen) _net_poll_flushlater(sh) ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Remove handle from poller
+// @param(in) np Handle of poller
+// @param(in) sh Handle of connection
+// @return true on success, false if handle was not registered
+//
+
+int netpoll_del(INETPOLL *np, INET *sh)
+{
+  if (!np || !sh || sh->poll!=np) return 0 ;
+
+  if (sh->fd>=0) epoll_ctl(np->epfd, EPOLL_CTL_DEL, sh->fd, NULL) ;
+
+  if (sh->pollprev) ((INET *)sh->pollprev)->pollnext = sh->pollnext ;
+  else np->handles = sh->pollnext ;
+  if (sh->pollnext) ((INET *)sh->pollnext)->pollprev = sh->pollprev ;
+
+  if (sh->pollcheck) {
+    INET **prev = (INET **)&np->check ;
+    while (*prev && *prev!=sh) prev = (INET **)&(*prev)->pollchecknext ;
+    if (*prev) *prev = sh->pollchecknext ;
+  }
+
+  if (sh->pollflush) {
+    INET **prev = (INET **)&np->flush ;
+    while (*prev && *prev!=sh) prev = (INET **)&(*prev)->pollflushnext ;
+    if (*prev) *prev = sh->pollflushnext ;
+  }
+
+  sh->poll = NULL ;
+  sh->pollarg = NULL ;
+  sh->pollprev = NULL ;
+  sh->pollnext = NULL ;
+  sh->pollcheck = 0 ;
+  sh->pollchecknext = NULL ;
+  sh->pollflush = 0 ;
+  sh->pollflushnext = NULL ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Determine whether handle holds data which epoll can't see
+// @param(in) sh Handle of connection
+// @return true if data is waiting in the receive buffer or in TLS
+//
+
+static int _net_poll_haspending(INET *sh)
+{
+  if (sh->rbuflen > sh->rbufpos) return 1 ;
+  if (sh->ssl && (SSL_pending(sh->ssl)>0 || SSL_has_pending(sh->ssl))) return 1 ;
+  return 0 ;
+}
+
+
+//
+// @brief Put handle on its poller's check list, as it is being read
+// @param(in) sh Handle of connection, registered with a poller
+//
+
+void _net_poll_touch(INET *sh)
+{
+  INETPOLL *np = sh->poll ;
+
+  if (sh->pollcheck) return ;
+
+  sh->pollcheck = 1 ;
+  sh->pollchecknext = np->check ;
+  np->check = sh ;
+}
+
+
+//
+// @brief Put handle on its poller's flush list, as it has buffered writes
+// @param(in) sh Handle of connection, registered with a poller
+//
+
+void _net_poll_flushlater(INET *sh)
+{
+  INETPOLL *np = sh->poll ;
+
+  if (sh->pollflush) return ;
+
+  sh->pollflush = 1 ;
+  sh->pollflushnext = np->flush ;
+  np->flush = sh ;
+}
+
+
+//
+// @brief Add event to list returned by netpoll_wait, unless already there
+// @param(in) np Handle of poller
+// @param(in) sh Handle of connection which is ready
+// @param(out) events List of events
+// @param(inout) n Number of events in list
+//
+
+static void _net_poll_report(INETPOLL *np, INET *sh, NETPOLLEVENT *events, int *n)
+{
+  if (sh->pollround==np->round) return ;
+
+  sh->pollround = np->round ;
+  events[*n].sh = sh ;
+  events[*n].arg = sh->pollarg ;
+  (*n)++ ;
+}
+
+
+//
+// @brief Wait for connections to become ready
+// @param(in) np Handle of poller
+// @param(out) events Connections which are ready, for netrecv
+// @param(in) maxevents Size of events array
+// @param(in) timeoutms Time to wait, 0 to return immediately, -1 for ever
+// @return Number of events, or -1 on error
+//
+
+int netpoll_wait(INETPOLL *np, NETPOLLEVENT *events, int maxevents, int timeoutms)
+{
+  if (!np || !events || maxevents<1) return -1 ;
+
+  int n=0 ;
+  np->round++ ;
+
+  // Send writes buffered since the last wait.  Anything the socket
+  // won't take yet is sent when epoll reports it writable.  Handles
+  // which fail are reported, so that netrecv returns the error.
+
+  INET *sh ;
+  while ((sh=np->flush)) {
+    np->flush = sh->pollflushnext ;
+    sh->pollflush = 0 ;
+    sh->pollflushnext = NULL ;
+    if (netflush(sh)<0 && n<maxevents) _net_poll_report(np, sh, events, &n) ;
+    _net_poll_sync(np, sh) ;
+  }
+
+  // Bring epoll up to date for handles which have been read, and
+  // report those which hold data already (in TLS or a receive buffer).  Handles stay on the check
+  // list until their buffered data has been taken.
+
+  INET **prev = (INET **)&np->check ;
+  while ((sh=*prev)) {
+
+    _net_poll_sync(np, sh) ;
+
+    if (_net_poll_haspending(sh)) {
+      if (n<maxevents) _net_poll_report(np, sh, events, &n) ;
+      prev = (INET **)&sh->pollchecknext ;
+    } else {
+      *prev = sh->pollchecknext ;
+      sh->pollcheck = 0 ;
+      sh->pollchecknext = NULL ;
+    }
+
+  }
+
+  if (n>=maxevents) return n ;
+
+  // Wait for sockets, without blocking if there are events already
+
+  struct epoll_event ev[NETPOLL_BATCH] ;
+  int max = maxevents-n ;
+  if (max>NETPOLL_BATCH) max=NETPOLL_BATCH ;
+
+  long long deadline = (timeoutms>0) ? _net_now()+timeoutms : 0 ;
+
+  for (;;) {
+
+    int m = epoll_wait(np->epfd, ev, max, n?0:timeoutms) ;
+    if (m<0) {
+      if (errno==EINTR || n>0) return n ;
+      return -1 ;
+    }
+
+    for (int i=0; i<m; i++) {
+
+      sh = ev[i].data.ptr ;
+
+      // Writable sockets take more buffered data, and are only reported
+      // if netrecv is waiting for them
+
+      if (ev[i].events & EPOLLOUT) {
+        if (sh->wbuflen && netflush(sh)<0) ev[i].events |= EPOLLERR ;
+        _net_poll_sync(np, sh) ;
+        if (!(ev[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR)) && !sh->sslwantwrite) continue ;
+      }
+
+      _net_poll_report(np, sh, events, &n) ;
+    }
+
+    if (n>0 || m==0 || timeoutms==0) return n ;
+
+    // The wakeup was only to send buffered data, so carry on waiting
+    // for whatever remains of the timeout
+
+    if (timeoutms>0) {
+      long long left = deadline-_net_now() ;
+      if (left<=0) return 0 ;
+      timeoutms = (int)left ;
+    }
+
+  }
+}
+
+
+//
+// @brief Obtain file descriptor of poller
+// @param(in) np Handle of poller
+// @return File descriptor, which is readable when a socket has an event
+//
+
+int netpoll_fd(INETPOLL *np)
+{
+  if (!np) return -1 ;
+  else return np->epfd ;
+}
+
+
+//
+// @brief Free poller, removing the handles registered with it
+// @param(in) np Handle of poller
+//
+
+void netpoll_free(INETPOLL *np)
+{
+  if (!np) return ;
+
+  while (np->handles) netpoll_del(np, np->handles) ;
+
+  close(np->epfd) ;
+  free(np) ;
+}
+
+
+//
+// @brief Obtain peer IP address
+// @param(in) sh Handle of open connection
+// @return Pointer to IP address string, or NULL if not connected
+//
+
+char *netpeerip(INET *sh)
+{
+  if (!sh) return NULL ;
+  else return sh->ipaddress ;
+}
+
+//
+// @brief Obtain peer port number
+// @param(in) sh Handle of open connection
+// @return Peer port number, or 0 if not connected
+//
+
+int netpeerport(NET *sh) 
+{
+  if (!sh) return 0 ;
+  else return sh->peerport ;
+}
+
+
+//
+// @brief Obtain local port number
+// @param(in) sh Handle of open connection
+// @return Local port number, or 0 if not connected
+//
+
+int netlocalport(NET *sh)
+{
+  if (!sh) return 0 ;
+  else return sh->localport ;
+}
+
+//
+// @brief Disconnect connection
+// @param(in) Handle of open connection
+// @return true on success, or false on error (setting errno)
+//
+int _net_disconnect(INET *sh)
+{
+  if (!sh) return 0 ;
+
+  // Shut down TLS cleanly, as OpenSSL marks the session as
+  // not resumable if the connection is just dropped
+
+  if (sh->ssl && SSL_is_init_finished(sh->ssl)) SSL_shutdown(sh->ssl) ;
+
+  _net_attempt_free(sh) ;
+
+  if (sh->ssl) SSL_free(sh->ssl);
+  else if (sh->fd >=0 ) close(sh->fd);
+  if (sh->ipaddress) free(sh->ipaddress) ;
+  if (sh->ctx) SSL_CTX_free(sh->ctx);
+  if (sh->sessionkey) free(sh->sessionkey) ;
+  if (sh->poolkey) free(sh->poolkey) ;
+  if (sh->opts) free(sh->opts) ;
+  if (sh->wbuf) free(sh->wbuf) ;
+  if (sh->rbuf) free(sh->rbuf) ;
+
+  sh->ssl = NULL ;
+  sh->fd = -1 ;
+  sh->ipaddress = NULL ;
+  sh->ctx = NULL ;
+  sh->sessionkey = NULL ;
+  sh->poolkey = NULL ;
+  sh->opts = NULL ;
+  sh->wbuf = NULL ;
+  sh->wbuflen = 0 ;
+  sh->rbuf = NULL ;
+  sh->rbufpos = 0 ;
+  sh->rbuflen = 0 ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Close Network connection
+// @param(in) Handle of open connection
+// @return true on success, or false on error (setting errno)
+//
+int netclose(INET *sh)
+{
+  if (!sh) return 0 ;
+
+  if (sh->lookup) _netdns_lookup_abandon(sh->lookup) ;
+  if (sh->poll) netpoll_del(sh->poll, sh) ;
+  if (sh->wbuflen && sh->state==NET_CONNECTED) netflush(sh) ;
+
+  _net_disconnect(sh) ;
+  free(sh) ;
+
+  int remaining = __atomic_sub_fetch(&_net_numconnections, 1, __ATOMIC_RELAXED) ;
+  assert(remaining >= 0) ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Check that an idle connection is still usable
+// @param(in) sh Handle of idle connection
+// @return true if connection is open and has no unexpected data waiting
+//
+
+int _net_pool_isalive(INET *sh)
+{
+  if (sh->fd<0 || sh->sslwantwrite || sh->rbuflen > sh->rbufpos) return 0 ;
+
+  if (sh->ssl) {
+
+    // Let OpenSSL consume any records (e.g. late session tickets)
+    // without blocking.  Application data or a close is not expected
+
+    if (SSL_pending(sh->ssl)>0) return 0 ;
+
+    int fdoptions = fcntl(sh->fd, F_GETFL, 0) ;
+    if (fdoptions<0) return 0 ;
+    fcntl(sh->fd, F_SETFL, fdoptions | O_NONBLOCK) ;
+
+    char ch ;
+    ERR_clear_error() ;
+    int r = SSL_peek(sh->ssl, &ch, 1) ;
+    int e = (r>0) ? SSL_ERROR_NONE : SSL_get_error(sh->ssl, r) ;
+
+    fcntl(sh->fd, F_SETFL, fdoptions) ;
+    return (r<=0 && e==SSL_ERROR_WANT_READ) ;
+
+  } else {
+
+    char ch ;
+    int r = recv(sh->fd, &ch, 1, MSG_PEEK|MSG_DONTWAIT) ;
+    return (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) ;
+
+  }
+}
+
+
+//
+// @brief Close pooled connections which have been idle too long
+// @param(in) all True to close all idle connections
+// Must be called with _net_poolmutex locked
+//
+
+static void _net_pool_expire(int all)
+{
+  time_t now = time(NULL) ;
+  INET *sh, **prev=&_net_pool ;
+  while ((sh=*prev)) {
+    if (all || now - sh->idlesince >= _net_poolidletimeout) {
+      *prev = sh->poolnext ;
+      netclose(sh) ;
+    } else {
+      prev = (INET **)&sh->poolnext ;
+    }
+  }
+}
+
+
+//
+// @brief Obtain connection to server, reusing an idle pooled connection if possible
+// @param(in) hostname Name of server to connect to
+// @param(in) port Port number on server
+// @param(in) flags Type of connection to open (OPEN|TLS|SSL2|SSL3|NONBLOCK)
+// @return Handle to NET structure, or NULL on failure (and sets errno)
+//
+
+INET *netacquire(char *hostname, int port, enum netflags flags)
+{
+  if (!hostname) return NULL ;
+
+  char *key = malloc(strlen(hostname)+32) ;
+  if (!key) return NULL ;
+  sprintf(key, "%s:%d:%d", hostname, port, (int)flags) ;
+
+  pthread_mutex_lock(&_net_poolmutex) ;
+
+  _net_pool_expire(0) ;
+
+  // Take the most recently released live connection for the destination,
+  // closing any dead ones found on the way
+
+  INET *sh, **prev=&_net_pool ;
+  while ((sh=*prev)) {
+    if (strcmp(sh->poolkey, key)!=0) {
+      prev = (INET **)&sh->poolnext ;
+    } else {
+      *prev = sh->poolnext ;
+      sh->poolnext = NULL ;
+      if (_net_pool_isalive(sh)) break ;
+      netclose(sh) ;
+    }
+  }
+
+  if (sh) _net_poolhits++ ;
+  else _net_poolmisses++ ;
+
+  pthread_mutex_unlock(&_net_poolmutex) ;
+
+  if (sh) {
+    free(key) ;
+    return sh ;
+  }
+
+  sh = netconnect(hostname, port, flags) ;
+  if (!sh) {
+    free(key) ;
+    return NULL ;
+  }
+
+  sh->poolkey = key ;
+  return sh ;
+}
+
+
+//
+// @brief Return connection to the pool for reuse
+// @param(in) sh Handle of connection obtained with netacquire
+// @return true if the connection was pooled, false if it was closed instead
+//
+
+int netrelease(INET *sh)
+{
+  if (!sh) return 0 ;
+
+  if (sh->poll) netpoll_del(sh->poll, sh) ;
+
+  if (!sh->poolkey || netflush(sh)!=0 || !_net_pool_isalive(sh)) {
+    netclose(sh) ;
+    return 0 ;
+  }
+
+  pthread_mutex_lock(&_net_poolmutex) ;
+
+  _net_pool_expire(0) ;
+
+  int count=0 ;
+  for (INET *p=_net_pool; p; p=p->poolnext) {
+    if (strcmp(p->poolkey, sh->poolkey)==0) count++ ;
+  }
+
+  int pooled = (count < _net_poolmaxperhost) ;
+  if (pooled) {
+    sh->idlesince = time(NULL) ;
+    sh->poolnext = _net_pool ;
+    _net_pool = sh ;
+  }
+
+  pthread_mutex_unlock(&_net_poolmutex) ;
+
+  if (!pooled) netclose(sh) ;
+  return pooled ;
+}
+
+
+//
+// @brief Configure connection pool
+// @param(in) maxperhost Maximum idle connections kept per destination (0 disables pooling)
+// @param(in) idletimeout Seconds an idle connection is kept before being closed
+// @return true on success
+//
+
+int netpoolconfig(int maxperhost, int idletimeout)
+{
+  if (maxperhost<0 || idletimeout<0) return 0 ;
+
+  pthread_mutex_lock(&_net_poolmutex) ;
+  _net_poolmaxperhost = maxperhost ;
+  _net_poolidletimeout = idletimeout ;
+  _net_pool_expire(maxperhost==0) ;
+  pthread_mutex_unlock(&_net_poolmutex) ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Obtain connection pool statistics
+// @param(out) hits Number of netacquire calls which reused a connection (or NULL)
+// @param(out) misses Number of netacquire calls which opened a connection (or NULL)
+// @return Number of idle connections in the pool
+//
+
+int netpoolstats(unsigned long *hits, unsigned long *misses)
+{
+  pthread_mutex_lock(&_net_poolmutex) ;
+  if (hits) *hits = _net_poolhits ;
+  if (misses) *misses = _net_poolmisses ;
+  int count=0 ;
+  for (INET *p=_net_pool; p; p=p->poolnext) count++ ;
+  pthread_mutex_unlock(&_net_poolmutex) ;
+  return count ;
+}
+
+
+//
+// @brief Close all idle pooled connections
+//
+
+void netpoolflush()
+{
+  pthread_mutex_lock(&_net_poolmutex) ;
+  _net_pool_expire(1) ;
+  pthread_mutex_unlock(&_net_poolmutex) ;
+}
+
+
+//
+// @brief Send data to network interface
+// @param(in) sh Handle of open connection
+// @param(in) buf Data to be sent
+// @param(in) len Amount of data to send
+// @return Number of bytes sent, or -1 on error
+//
+ 
+int netsend(INET *sh, char *buf, int len)
+{
+  if (sh->wbufmax) {
+    struct iovec iov = { buf, len } ;
+    return netsendv(sh, &iov, 1) ;
+  }
+
+  sh->statwrites++ ;
+  sh->statsyscalls++ ;
+
+  if (sh->ssl) {
+    int r = SSL_write(sh->ssl, buf, len) ;
+    _net_commsdump(sh, (r<=0)?">!":"> ", buf, len) ;
+    _net_seterrno(sh, "netsend", NET_ERR_SSL, r) ;
+    if (r>0) {
+      _net_countout(sh, r) ;
+      sh->statrecords += (r+SSL3_RT_MAX_PLAIN_LENGTH-1)/SSL3_RT_MAX_PLAIN_LENGTH ;
+    }
+    return r ;
+  } else if (sh->fd) {
+    int r = send(sh->fd, buf, len, 0) ;
+    _net_commsdump(sh, (r<=0)?">!":"> ", buf, len) ;
+    _net_seterrno(sh, "netsend", NET_ERR_ERRNO, 0) ;
+    if (r>0) _net_countout(sh, r) ;
+    return r ;
+  } else {
+    errno = EBADF ;
+    _net_seterrno(sh, "netsend", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+}
+
+
+//
+// @brief Dump data sent from several buffers
+// @param(in) sh Handle of open connection
+// @param(in) iov Buffers
+// @param(in) iovcnt Number of buffers
+// @param(in) len Number of bytes sent from the buffers
+//
+
+static void _net_commsdumpv(INET *sh, struct iovec *iov, int iovcnt, int len)
+{
+  if (!sh->datadumpenable) return ;
+
+  for (int i=0; i<iovcnt && len>0; i++) {
+    int n = (iov[i].iov_len < (size_t)len) ? (int)iov[i].iov_len : len ;
+    _net_commsdump(sh, "> ", iov[i].iov_base, n) ;
+    len -= n ;
+  }
+}
+
+
+//
+// @brief Send plaintext data gathered from several buffers
+// @param(in) sh Handle of open connection
+// @param(in) iov Buffers to send
+// @param(in) iovcnt Number of buffers
+// @return Number of bytes sent, or -1 on error
+//
+
+static int _net_sendv_plain(INET *sh, struct iovec *iov, int iovcnt)
+{
+  struct iovec local[IOV_MAX] ;
+  int total=0 ;
+  int i=0 ;
+  size_t skip=0 ;
+
+  while (i<iovcnt) {
+
+    // Copy the next batch of descriptors, so partial writes can
+    // be resumed without modifying the caller's array
+
+    int n=0 ;
+    for (int j=i; j<iovcnt && n<IOV_MAX; j++) {
+      local[n].iov_base = (char *)iov[j].iov_base + (j==i ? skip : 0) ;
+      local[n].iov_len = iov[j].iov_len - (j==i ? skip : 0) ;
+      n++ ;
+    }
+
+    struct msghdr msg ;
+    memset(&msg, 0, sizeof(msg)) ;
+    msg.msg_iov = local ;
+    msg.msg_iovlen = n ;
+
+    ssize_t r = sendmsg(sh->fd, &msg, 0) ;
+    sh->statsyscalls++ ;
+
+    if (r<0) {
+      if (errno==EINTR) continue ;
+      if (errno==EAGAIN || errno==EWOULDBLOCK) {
+        if (!sh->isblocking) break ;
+        struct pollfd pfd = { sh->fd, POLLOUT, 0 } ;
+        poll(&pfd, 1, -1) ;
+        continue ;
+      }
+      _net_seterrno(sh, "netsendv", NET_ERR_ERRNO, 0) ;
+      return total ? total : -1 ;
+    }
+
+    _net_commsdumpv(sh, local, n, r) ;
+    total += r ;
+
+    // Step over what was written
+
+    while (i<iovcnt && r>0) {
+      size_t left = iov[i].iov_len - skip ;
+      if ((size_t)r < left) {
+        skip += r ;
+        r = 0 ;
+      } else {
+        r -= left ;
+        skip = 0 ;
+        i++ ;
+      }
+    }
+    while (i<iovcnt && iov[i].iov_len==0) i++ ;
+
+    // Non-blocking sockets return once the socket is full
+
+    if (!sh->isblocking && i<iovcnt) {
+      struct pollfd pfd = { sh->fd, POLLOUT, 0 } ;
+      if (poll(&pfd, 1, 0)<=0) break ;
+    }
+
+  }
+
+  if (total==0 && i<iovcnt) errno=EAGAIN ;
+  return total ;
+}
+
+
+//
+// @brief Send data gathered from several buffers over TLS
+// @param(in) sh Handle of open connection
+// @param(in) iov Buffers to send
+// @param(in) iovcnt Number of buffers
+// @return Number of bytes sent, or -1 on error
+//
+
+static int _net_sendv_ssl(INET *sh, struct iovec *iov, int iovcnt)
+{
+  unsigned char record[SSL3_RT_MAX_PLAIN_LENGTH] ;
+  int total=0 ;
+  int i=0 ;
+  size_t skip=0 ;
+
+  while (i<iovcnt) {
+
+    if (iov[i].iov_len==skip) {
+      i++ ;
+      skip=0 ;
+      continue ;
+    }
+
+    // A write which could not complete is retried with the same length.
+    // Otherwise large buffers are written directly (OpenSSL splits them
+    // into full records), and small ones are packed into a record.
+
+    char *buf ;
+    int len ;
+    size_t first = iov[i].iov_len - skip ;
+
+    if (sh->sslwritelen ? first >= (size_t)sh->sslwritelen : first >= sizeof(record)) {
+
+      buf = (char *)iov[i].iov_base + skip ;
+      len = sh->sslwritelen ? sh->sslwritelen : (first>INT_MAX ? INT_MAX : (int)first) ;
+
+    } else {
+
+      size_t want = sh->sslwritelen ? (size_t)sh->sslwritelen : sizeof(record) ;
+      if (want > sizeof(record)) {
+        errno = EINVAL ;
+        _net_seterrno(sh, "netsendv", NET_ERR_ERRNO, 0) ;
+        return total ? total : -1 ;
+      }
+
+      len=0 ;
+      for (int j=i; j<iovcnt && (size_t)len<want; j++) {
+        size_t off = (j==i) ? skip : 0 ;
+        size_t n = iov[j].iov_len - off ;
+        if (n > want-len) n = want-len ;
+        memcpy(&record[len], (char *)iov[j].iov_base + off, n) ;
+        len += n ;
+      }
+
+      if (sh->sslwritelen && len<sh->sslwritelen) {
+        errno = EINVAL ;
+        _net_seterrno(sh, "netsendv", NET_ERR_ERRNO, 0) ;
+        return total ? total : -1 ;
+      }
+
+      buf = (char *)record ;
+
+    }
+
+    int r = SSL_write(sh->ssl, buf, len) ;
+
+    if (r<=0) {
+      sh->statsyscalls++ ;
+      int err = SSL_get_error(sh->ssl, r) ;
+      if (err==SSL_ERROR_WANT_WRITE || err==SSL_ERROR_WANT_READ) {
+        sh->sslwritelen = len ;
+        if (total==0) errno=EAGAIN ;
+        return total ;
+      }
+      _net_commsdump(sh, ">!", buf, len) ;
+      _net_seterrno(sh, "netsendv", NET_ERR_SSL, r) ;
+      return total ? total : -1 ;
+    }
+
+    _net_commsdump(sh, "> ", buf, r) ;
+    sh->sslwritelen = 0 ;
+    total += r ;
+
+    int records = (r+SSL3_RT_MAX_PLAIN_LENGTH-1)/SSL3_RT_MAX_PLAIN_LENGTH ;
+    sh->statrecords += records ;
+    sh->statsyscalls += records ;
+
+    // Step over what was written
+
+    while (i<iovcnt && r>0) {
+      size_t left = iov[i].iov_len - skip ;
+      if ((size_t)r < left) {
+        skip += r ;
+        r = 0 ;
+      } else {
+        r -= left ;
+        skip = 0 ;
+        i++ ;
+      }
+    }
+
+  }
+
+  return total ;
+}
+
+
+//
+// @brief Send data gathered from several buffers, bypassing write buffer
+// @param(in) sh Handle of open connection
+// @param(in) iov Buffers to send
+// @param(in) iovcnt Number of buffers
+// @return Number of bytes sent, or -1 on error
+//
+
+static int _net_sendv(INET *sh, struct iovec *iov, int iovcnt)
+{
+  if (sh->ssl) return _net_sendv_ssl(sh, iov, iovcnt) ;
+  else return _net_sendv_plain(sh, iov, iovcnt) ;
+}
+
+
+//
+// @brief Copy data into write buffer
+// @param(in) sh Handle of open connection
+// @param(in) iov Buffers to copy from
+// @param(in) iovcnt Number of buffers
+// @param(in) len Amount to copy, which must fit in the buffer
+// @return Number of bytes copied, or -1 on error
+//
+
+static int _net_wbuf_append(INET *sh, struct iovec *iov, int iovcnt, size_t len)
+{
+  if (!sh->wbuf) {
+    sh->wbuf = malloc(sh->wbufmax) ;
+    if (!sh->wbuf) {
+      _net_seterrno(sh, "wbuf", NET_ERR_ERRNO, 0) ;
+      return -1 ;
+    }
+  }
+
+  size_t copied=0 ;
+  for (int i=0; i<iovcnt && copied<len; i++) {
+    size_t n = iov[i].iov_len ;
+    if (n > len-copied) n = len-copied ;
+    memcpy(&sh->wbuf[sh->wbuflen], iov[i].iov_base, n) ;
+    sh->wbuflen += n ;
+    copied += n ;
+  }
+
+  if (sh->poll) _net_poll_flushlater(sh) ;
+
+  return copied ;
+}
+
+
+//
+// @brief Send data gathered from several buffers
+// @param(in) sh Handle of open connection
+// @param(in) iov Buffers to send, in order
+// @param(in) iovcnt Number of buffers
+// @return Number of bytes sent, or -1 on error
+//
+
+int netsendv(INET *sh, struct iovec *iov, int iovcnt)
+{
+  if (!sh || !iov || iovcnt<0 || sh->fd<0) {
+    errno = EBADF ;
+    if (sh) _net_seterrno(sh, "netsendv", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+
+  sh->statwrites++ ;
+
+  int r ;
+
+  if (!sh->wbufmax || (!sh->wbuflen && sh->sslwritelen)) {
+
+    // Not buffered, or retrying a TLS write which bypassed the buffer
+
+    r = _net_sendv(sh, iov, iovcnt) ;
+
+  } else {
+
+    size_t total=0 ;
+    for (int i=0; i<iovcnt; i++) total += iov[i].iov_len ;
+
+    // Send buffer if it can't take the data
+
+    if (sh->wbuflen + total > (size_t)sh->wbufmax && netflush(sh)<0) {
+      return -1 ;
+    }
+
+    if (sh->wbuflen + total <= (size_t)sh->wbufmax) {
+      r = _net_wbuf_append(sh, iov, iovcnt, total) ;
+    } else if (!sh->wbuflen) {
+      r = _net_sendv(sh, iov, iovcnt) ;
+    } else {
+
+      // Non-blocking socket is full, so just take what fits
+
+      r = _net_wbuf_append(sh, iov, iovcnt, sh->wbufmax - sh->wbuflen) ;
+      if (r==0) errno = EAGAIN ;
+
+    }
+
+  }
+
+  if (r>0) _net_countout(sh, r) ;
+  return r ;
+}
+
+
+//
+// @brief Send data from a file
+// @param(in) sh Handle of open connection
+// @param(in) fd File to send from
+// @param(in) offset Position in file of first byte to send
+// @param(in) len Amount of data to send
+// @return Number of bytes sent, or -1 on error
+//
+
+int netsendfile(INET *sh, int fd, off_t offset, int len)
+{
+  if (!sh || sh->fd<0 || fd<0 || len<0) {
+    errno = (sh && len<0) ? EINVAL : EBADF ;
+    if (sh) _net_seterrno(sh, "netsendfile", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+
+  // Keep data in order, by sending anything buffered first
+
+  int r = netflush(sh) ;
+  if (r<0) return -1 ;
+  if (r>0) {
+    errno = EAGAIN ;
+    return 0 ;
+  }
+
+  sh->statwrites++ ;
+
+  int ktls = sh->ssl && BIO_get_ktls_send(SSL_get_wbio(sh->ssl)) ;
+  int total=0 ;
+
+  while (total<len) {
+
+    ssize_t n ;
+
+    if (sh->ssl && !ktls) {
+
+      // Encrypted in user space, so the file is read a record at a
+      // time.  A write which could not complete is retried with the
+      // same length.
+
+      char record[SSL3_RT_MAX_PLAIN_LENGTH] ;
+      int want = sh->sslwritelen ? sh->sslwritelen : len-total ;
+      if (want > (int)sizeof(record)) want = sizeof(record) ;
+
+      n = pread(fd, record, want, offset+total) ;
+      if (n<0 && errno==EINTR) continue ;
+      if (n<=0) {
+        if (n==0) errno = EINVAL ;
+        _net_seterrno(sh, "netsendfile", NET_ERR_ERRNO, 0) ;
+        break ;
+      }
+
+      struct iovec iov = { record, n } ;
+      int sent = _net_sendv(sh, &iov, 1) ;
+      if (sent<0) break ;
+      total += sent ;
+      _net_countout(sh, sent) ;
+      if (sent<n) break ;
+      continue ;
+
+    }
+
+    // Plaintext, or encrypted by the kernel, so the file is not copied
+
+    if (ktls) {
+
+      n = SSL_sendfile(sh->ssl, fd, offset+total, len-total, 0) ;
+      if (n<0) {
+        int e = SSL_get_error(sh->ssl, n) ;
+        if (e==SSL_ERROR_WANT_WRITE) errno = EAGAIN ;
+        else if (e!=SSL_ERROR_SYSCALL) {
+          _net_seterrno(sh, "netsendfile", NET_ERR_SSL, n) ;
+          break ;
+        }
+      } else {
+        sh->statrecords += (n+SSL3_RT_MAX_PLAIN_LENGTH-1)/SSL3_RT_MAX_PLAIN_LENGTH ;
+      }
+
+    } else {
+
+      off_t off = offset+total ;
+      n = sendfile(sh->fd, fd, &off, len-total) ;
+
+    }
+
+    sh->statsyscalls++ ;
+
+    if (n<0) {
+      if (errno==EINTR) continue ;
+      if (errno==EAGAIN || errno==EWOULDBLOCK) {
+        if (!sh->isblocking) break ;
+        struct pollfd pfd = { sh->fd, POLLOUT, 0 } ;
+        poll(&pfd, 1, -1) ;
+        continue ;
+      }
+      _net_seterrno(sh, "netsendfile", NET_ERR_ERRNO, 0) ;
+      break ;
+    }
+
+    // File is shorter than expected
+
+    if (n==0) {
+      errno = EINVAL ;
+      _net_seterrno(sh, "netsendfile", NET_ERR_ERRNO, 0) ;
+      break ;
+    }
+
+    total += n ;
+    _net_countout(sh, n) ;
+
+  }
+
+  if (total==0 && len>0) {
+    if (errno==EAGAIN || errno==EWOULDBLOCK) return 0 ;
+    return -1 ;
+  }
+
+  return total ;
+}
+
+
+//
+// @brief Send data held in the write buffer
+// @param(in) sh Handle of open connection
+// @return Number of bytes still buffered (0 once all sent), or -1 on error
+//
+
+int netflush(INET *sh)
+{
+  if (!sh) return -1 ;
+  if (!sh->wbuflen) return 0 ;
+
+  struct iovec iov = { sh->wbuf, sh->wbuflen } ;
+  int r = _net_sendv(sh, &iov, 1) ;
+  if (r<0) return -1 ;
+
+  memmove(sh->wbuf, &sh->wbuf[r], sh->wbuflen-r) ;
+  sh->wbuflen -= r ;
+
+  return sh->wbuflen ;
+}
+
+
+//
+// @brief Set size of write buffer
+// @param(in) sh Handle of open connection
+// @param(in) size Buffer size, 0 to disable (after sending buffered data)
+// @return true on success
+//
+
+int netwritebuffer(INET *sh, int size)
+{
+  if (!sh) return 0 ;
+
+  if (size<0) {
+    errno = EINVAL ;
+    _net_seterrno(sh, "netwritebuffer", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
+
+  if (sh->wbuflen > size && netflush(sh)!=0) return 0 ;
+
+  if (sh->wbuf) {
+    if (size==0) {
+      free(sh->wbuf) ;
+      sh->wbuf = NULL ;
+    } else {
+      char *wbuf = realloc(sh->wbuf, size) ;
+      if (!wbuf) {
+        _net_seterrno(sh, "wbuf", NET_ERR_ERRNO, 0) ;
+        return 0 ;
+      }
+      sh->wbuf = wbuf ;
+    }
+  }
+
+  sh->wbufmax = size ;
+  return 1 ;
+}
+
+
+//
+// @brief Obtain write statistics of connection
+// @param(in) sh Handle of open connection
+// @param(out) writes Number of netsend and netsendv calls
+// @param(out) bytes Number of bytes accepted by them
+// @param(out) records Number of TLS records sent (0 for plaintext)
+// @param(out) syscalls Number of system calls made to send data
+// @return true on success
+//
+
+int netwritestats(INET *sh, unsigned long *writes, unsigned long *bytes,
+                  unsigned long *records, unsigned long *syscalls)
+{
+  if (!sh) return 0 ;
+
+  if (writes) *writes = sh->statwrites ;
+  if (bytes) *bytes = sh->statbytes ;
+  if (records) *records = sh->statrecords ;
+  if (syscalls) *syscalls = sh->statsyscalls ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Obtain transport statistics of connection
+// @param(in) sh Handle of open connection
+// @param(out) st Statistics
+// @return true on success
+//
+
+int netstats(INET *sh, NETSTATS *st)
+{
+  if (!sh || !st) {
+    errno = EINVAL ;
+    return 0 ;
+  }
+
+  memset(st, 0, sizeof(NETSTATS)) ;
+
+  st->bytesout = sh->statbytes ;
+  st->bytesin = sh->statbytesin ;
+  st->callsout = sh->statwrites ;
+  st->callsin = sh->statreads ;
+  st->idlems = sh->lastactive ? (long)(_net_now() - sh->lastactive) : -1 ;
+
+  // TCP values are left as 0 if they are not available
+
+  if (sh->fd>=0) netfdstats(sh->fd, st) ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Sample TCP_INFO of a socket
+// @param(in) fd Socket
+// @param(out) st Statistics, of which the TCP values are filled in
+// @return true on success
+//
+
+int netfdstats(int fd, NETSTATS *st)
+{
+  struct tcp_info ti ;
+  socklen_t len = sizeof(ti) ;
+
+  // Older kernels return less, leaving the rest zero
+
+  memset(&ti, 0, sizeof(ti)) ;
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len)<0) return 0 ;
+
+  st->rtt = ti.tcpi_rtt ;
+  st->rttvar = ti.tcpi_rttvar ;
+  st->retransmits = ti.tcpi_total_retrans ;
+  st->cwnd = ti.tcpi_snd_cwnd ;
+  st->deliveryrate = ti.tcpi_delivery_rate ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Receive data from network interface
+// @param(in) sh Handle of open connection
+// @param(in) buf Buffer to store response
+// @param(in) maxlen Maximum number of bytes to read
+// @return Number of bytes received, or -1 on error
+//
+
+
+// SSL_read doesn't return properly until entire encrypted chunk has been read
+// so you can't read 4 bytes, then n bytes.  Hence flagging the need for more
+// reads with sh->sslhaspending.
+
+int netrecv(INET *sh, char *buf, int maxlen)
+{
+  // Send any buffered request before waiting for its response
+
+  if (sh->wbuflen) netflush(sh) ;
+
+  // Take data from the receive buffer first
+
+  if (sh->rbuflen > sh->rbufpos) {
+    int n = sh->rbuflen - sh->rbufpos ;
+    if (n > maxlen) n = maxlen ;
+    memcpy(buf, &sh->rbuf[sh->rbufpos], n) ;
+    sh->rbufpos += n ;
+    if (sh->poll) _net_poll_touch(sh) ;
+    return n ;
+  }
+
+  return _net_recv(sh, buf, maxlen) ;
+}
+
+
+//
+// @brief Receive data from socket (or TLS), bypassing the receive buffer
+// @param(in) sh Handle of open connection
+// @param(in) buf Buffer to store response
+// @param(in) maxlen Maximum number of bytes to read
+// @return As netrecv
+//
+
+int _net_recv(INET *sh, char *buf, int maxlen)
+{
+  if (sh->poll && (sh->ssl || sh->rbuf)) _net_poll_touch(sh) ;
+
+  if (sh->ssl && sh->isblocking) {
+
+    int r = SSL_read(sh->ssl, buf, maxlen) ;
+    _net_countin(sh, r) ;
+    _net_commsdump(sh, (r<=0)?"<!":"< ", buf, r) ;
+    return r ;
+
+  } else if (sh->ssl && !sh->isblocking) {
+
+    sh->sslwantwrite=0 ;
+    int r = SSL_read(sh->ssl, buf, maxlen) ;
+    _net_countin(sh, r) ;
+
+    if (r > 0) {
+
+      // Data was returned.  Assert flag if even more available
+
+      sh->sslhaspending = nethaspending(sh) ;
+      _net_commsdump(sh, (r<=0)?"<!":"< ", buf, r) ;
+      return r ;
+
+    } else {
+
+      switch(SSL_get_error(sh->ssl, r)) {
+
+        case SSL_ERROR_WANT_READ:
+
+          // Nothing required, sh->fd is always added to fd_set
+
+          return 0 ;
+          break ;
+
+        case SSL_ERROR_WANT_WRITE:
+
+          // SSL read required, flag to be added to write set
+
+          sh->sslwantwrite=1 ;
+          return 0 ;
+          break ;
+
+        default:
+
+          _net_seterrno(sh, "netrecv", NET_ERR_SSL, r) ;
+          return -1 ;
+          break ;
+
+      }
+
+    }
+
+
+  } else if (sh->fd) {
+
+    int r = recv(sh->fd, buf, maxlen, 0) ;
+    _net_countin(sh, r) ;
+    _net_commsdump(sh, (r<=0)?"<!":"< ", buf, r) ;
+    if (r==0) errno=ENOTCONN ;
+    _net_seterrno(sh, "netrecv", NET_ERR_ERRNO, 0) ;
+    if (r==0) r=-1 ;
+    return r ;
+
+  } else {
+
+    errno= EBADF ;
+    _net_seterrno(sh, "netrecv", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+
+  }
+}
+
+//
+// @brief Read more data into the receive buffer
+// @param(in) sh Handle of open connection
+// @return Number of bytes added, 0 if none available (non-blocking),
+//         or -1 on error, close, or a full buffer (EMSGSIZE)
+//
+
+static int _net_rbuf_fill(INET *sh)
+{
+  if (!sh->rbuf) {
+    if (!sh->rbufmax) sh->rbufmax = NET_RBUFSIZE ;
+    sh->rbuf = malloc(sh->rbufmax) ;
+    if (!sh->rbuf) {
+      _net_seterrno(sh, "rbuf", NET_ERR_ERRNO, 0) ;
+      return -1 ;
+    }
+  }
+
+  // Move unconsumed data to the start, once the space after it runs low
+
+  if (sh->rbufpos == sh->rbuflen) {
+    sh->rbufpos = sh->rbuflen = 0 ;
+  } else if (sh->rbufpos > 0 && sh->rbuflen > sh->rbufmax/2) {
+    memmove(sh->rbuf, &sh->rbuf[sh->rbufpos], sh->rbuflen - sh->rbufpos) ;
+    sh->rbuflen -= sh->rbufpos ;
+    sh->rbufpos = 0 ;
+  }
+
+  if (sh->rbuflen == sh->rbufmax) {
+    errno = EMSGSIZE ;
+    _net_seterrno(sh, "netread", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+
+  // Send any buffered request before waiting for its response
+
+  if (sh->wbuflen) netflush(sh) ;
+
+  int r = _net_recv(sh, &sh->rbuf[sh->rbuflen], sh->rbufmax - sh->rbuflen) ;
+
+  if (r>0) {
+    sh->rbuflen += r ;
+    return r ;
+  } else if (r==0 && sh->ssl && !sh->isblocking) {
+    return 0 ;
+  } else if (r<0 && !sh->ssl && !sh->isblocking && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+    return 0 ;
+  } else {
+    return -1 ;
+  }
+}
+
 
-        FD_SET(sh->fd, wrfds) ; // Socket level fd
-        if ( sh->fd > (*l) ) { (*l) = sh->fd ; }
-        newfds++ ;
+//
+// @brief Read from connection up to and including a delimiter
+// @param(in) sh Handle of open connection
+// @param(in) delim Delimiter (e.g. "\r\n\r\n")
+// @param(in) delimlen Length of delimiter
+// @param(out) data Start of data in the receive buffer
+// @return Length of data, including the delimiter, 0 if a non-blocking
+//         connection does not have the delimiter yet, or -1 on error or close
+//
 
+int netreaduntil(INET *sh, char *delim, int delimlen, char **data)
+{
+  if (!sh || !delim || delimlen<1 || !data) return -1 ;
+
+  int scanned=0 ;
+
+  for (;;) {
+
+    // Search new data (and the end of the data searched before, in case
+    // the delimiter was split between reads)
+
+    if (sh->rbuf) {
+      int from = scanned>=delimlen ? scanned-delimlen+1 : 0 ;
+      char *start = &sh->rbuf[sh->rbufpos] ;
+      int len = sh->rbuflen - sh->rbufpos ;
+      char *p = memmem(start+from, len-from, delim, delimlen) ;
+      if (p) {
+        int n = (p-start) + delimlen ;
+        *data = start ;
+        sh->rbufpos += n ;
+        if (sh->poll) _net_poll_touch(sh) ;
+        return n ;
       }
-
+      scanned = len ;
     }
 
-  }
-
-  return (newfds) ;
+    int r = _net_rbuf_fill(sh) ;
+    if (r<=0) return r ;
 
+  }
 }
 
+
 //
-// @brief Provide summary string of read and write socket fd_set info
+// @brief Read line from connection
+// @param(in) sh Handle of open connection
+// @param(out) line Start of line in the receive buffer
+// @return Length of line, including its '\n', 0 if a non-blocking
+//         connection has no complete line yet, or -1 on error or close
 //
 
-char *netfdsetinfo(INET *sh, fd_set *rfds, fd_set *wfds)
+int netreadline(INET *sh, char **line)
 {
-  static char str[32] ;
-  sprintf(str, "R: %c%c W: %c",
-        (FD_ISSET(sh->fd, rfds)) ? 'S' : '-',
-        sh->ssl ? sh->sslhaspending ? 'O' : '-' : ' ',
-        (FD_ISSET(sh->fd, wfds)) ? 'S' : '-') ;
-  return str ;
+  return netreaduntil(sh, "\n", 1, line) ;
 }
 
+
 //
-// @brief Obtain peer IP address
+// @brief Read exactly n bytes from connection
 // @param(in) sh Handle of open connection
-// @return Pointer to IP address string, or NULL if not connected
+// @param(in) n Number of bytes to read
+// @param(out) data Start of data in the receive buffer
+// @return n, 0 if a non-blocking connection does not have n bytes yet,
+//         or -1 on error or close
 //
 
-char *netpeerip(INET *sh)
+int netreadn(INET *sh, int n, char **data)
 {
-  if (!sh) return NULL ;
-  else return sh->ipaddress ;
+  if (!sh || n<0 || !data) return -1 ;
+
+  if (!sh->rbufmax) sh->rbufmax = NET_RBUFSIZE ;
+  if (n > sh->rbufmax) {
+    errno = EMSGSIZE ;
+    _net_seterrno(sh, "netreadn", NET_ERR_ERRNO, 0) ;
+    return -1 ;
+  }
+
+  while (sh->rbuflen - sh->rbufpos < n) {
+    int r = _net_rbuf_fill(sh) ;
+    if (r<=0) return r ;
+  }
+
+  *data = &sh->rbuf[sh->rbufpos] ;
+  sh->rbufpos += n ;
+  if (sh->poll) _net_poll_touch(sh) ;
+  return n ;
 }
 
+
 //
-// @brief Obtain peer port number
+// @brief Read whatever data is available from connection, up to a limit
 // @param(in) sh Handle of open connection
-// @return Peer port number, or 0 if not connected
+// @param(in) maxlen Maximum number of bytes to read
+// @param(out) data Start of data in the receive buffer
+// @return Number of bytes, 0 if a non-blocking connection has none yet,
+//         or -1 on error or close
 //
 
-int netpeerport(NET *sh) 
+int netreadsome(INET *sh, int maxlen, char **data)
 {
-  if (!sh) return 0 ;
-  else return sh->peerport ;
+  if (!sh || maxlen<1 || !data) return -1 ;
+
+  if (sh->rbuflen == sh->rbufpos) {
+    int r = _net_rbuf_fill(sh) ;
+    if (r<=0) return r ;
+  }
+
+  int n = sh->rbuflen - sh->rbufpos ;
+  if (n > maxlen) n = maxlen ;
+
+  *data = &sh->rbuf[sh->rbufpos] ;
+  sh->rbufpos += n ;
+  if (sh->poll) _net_poll_touch(sh) ;
+  return n ;
 }
 
 
 //
-// @brief Obtain local port number
+// @brief Look at data in the receive buffer, without reading or consuming it
 // @param(in) sh Handle of open connection
-// @return Local port number, or 0 if not connected
+// @param(out) data Start of buffered data
+// @return Number of bytes buffered
 //
 
-int netlocalport(NET *sh)
+int netpeek(INET *sh, char **data)
 {
-  if (!sh) return 0 ;
-  else return sh->localport ;
+  if (!sh || !data || !sh->rbuf) return 0 ;
+
+  *data = &sh->rbuf[sh->rbufpos] ;
+  return sh->rbuflen - sh->rbufpos ;
 }
 
+
 //
-// @brief Disconnect connection
-// @param(in) Handle of open connection
-// @return true on success, or false on error (setting errno)
+// @brief Consume data from the receive buffer, after netpeek
+// @param(in) sh Handle of open connection
+// @param(in) n Number of bytes to consume
+// @return Number of bytes consumed
 //
-int _net_disconnect(INET *sh)
-{
-  if (!sh) return 0 ;
-
-  if (sh->ssl) SSL_free(sh->ssl);
-  else if (sh->fd >=0 ) close(sh->fd);
-  if (sh->ipaddress) free(sh->ipaddress) ;
-  if (sh->ctx) SSL_CTX_free(sh->ctx);
 
-  sh->ssl = NULL ;
-  sh->fd = -1 ;
-  sh->ipaddress = NULL ;
-  sh->ctx = NULL ;
+int netconsume(INET *sh, int n)
+{
+  if (!sh || n<=0) return 0 ;
 
-  return 1 ;
+  if (n > sh->rbuflen - sh->rbufpos) n = sh->rbuflen - sh->rbufpos ;
+  sh->rbufpos += n ;
+  return n ;
 }
 
 
 //
-// @brief Close Network connection
-// @param(in) Handle of open connection
-// @return true on success, or false on error (setting errno)
+// @brief Set size of receive buffer (default 16KB)
+// @param(in) sh Handle of open connection
+// @param(in) size Buffer size, which limits the length of a line or item
+// @return true on success, false if size is smaller than data buffered
 //
-int netclose(INET *sh)
+
+int netreadbuffer(INET *sh, int size)
 {
   if (!sh) return 0 ;
 
-  _net_disconnect(sh) ;
-  free(sh) ;
+  int buffered = sh->rbuflen - sh->rbufpos ;
+  if (size<1 || size<buffered) {
+    errno = EINVAL ;
+    _net_seterrno(sh, "netreadbuffer", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
 
-  _net_numconnections-- ;
-  assert(_net_numconnections >= 0) ;
-  if (_net_numconnections==0 && _net_devnull>=0) {
-    close(_net_devnull) ;
-    _net_devnull=-1 ;
+  if (sh->rbuf) {
+    memmove(sh->rbuf, &sh->rbuf[sh->rbufpos], buffered) ;
+    char *rbuf = realloc(sh->rbuf, size) ;
+    if (!rbuf) {
+      _net_seterrno(sh, "rbuf", NET_ERR_ERRNO, 0) ;
+      sh->rbuflen = buffered ;
+      sh->rbufpos = 0 ;
+      return 0 ;
+    }
+    sh->rbuf = rbuf ;
+    sh->rbufpos = 0 ;
+    sh->rbuflen = buffered ;
   }
 
+  sh->rbufmax = size ;
   return 1 ;
 }
 
 
 //
-// @brief Send data to network interface
-// @param(in) sh Handle of open connection
-// @param(in) buf Data to be sent
-// @param(in) len Amount of data to send
-// @return Number of bytes sent, or -1 on error
+// @brief Move data from one connection towards the other (netsplice)
+// @param(in) r Direction of relay
+// @param(in) canread True if the source socket is ready
+// @param(in) canwrite True if the destination socket is ready
+// @return 1 - Progress made, 0 - Waiting, -1 - Failed
 //
- 
-int netsend(INET *sh, char *buf, int len)
+
+static int _net_relay_step(struct _net_relay *r, int canread, int canwrite)
 {
-  if (sh->ssl) {
-    int r = SSL_write(sh->ssl, buf, len) ;
-    _net_commsdump(sh, (r<=0)?">!":"> ", buf, len) ;
-    _net_seterrno(sh, "netsend", NET_ERR_SSL, r) ;
-    return r ;
-  } else if (sh->fd) {
-    int r = send(sh->fd, buf, len, 0) ;
-    _net_commsdump(sh, (r<=0)?">!":"> ", buf, len) ;
-    _net_seterrno(sh, "netsend", NET_ERR_ERRNO, 0) ;
-  } else {
-    errno = EBADF ;
-    _net_seterrno(sh, "netsend", NET_ERR_ERRNO, 0) ;
-    return -1 ;
-  }
-}
+  INET *src = r->src ;
+  INET *dst = r->dst ;
+  int progress=0 ;
 
+  // Read while there is room, taking data left in the receive buffer first.
+  // The source isn't read while the destination can't keep up.
 
-//
-// @brief Receive data from network interface
-// @param(in) sh Handle of open connection
-// @param(in) buf Buffer to store response
-// @param(in) maxlen Maximum number of bytes to read
-// @return Number of bytes received, or -1 on error
-//
+  while (!r->eof && (canread || src->rbuflen > src->rbufpos || (src->ssl && SSL_has_pending(src->ssl)))) {
 
+    ssize_t n ;
 
-// SSL_read doesn't return properly until entire encrypted chunk has been read
-// so you can't read 4 bytes, then n bytes.  Hence flagging the need for more
-// reads with sh->sslhaspending.
+    if (r->pipe[1]>=0) {
 
-int netrecv(INET *sh, char *buf, int maxlen)
-{
-  if (sh->ssl && sh->isblocking) {
+      if (r->inpipe >= r->pipesize) break ;
 
-    int r = SSL_read(sh->ssl, buf, maxlen) ;
-    _net_commsdump(sh, (r<=0)?"<!":"< ", buf, r) ;
-    return r ;
+      if (src->rbuflen > src->rbufpos) {
+        n = write(r->pipe[1], &src->rbuf[src->rbufpos], src->rbuflen - src->rbufpos) ;
+        if (n>0) src->rbufpos += n ;
+      } else {
+        n = splice(src->fd, NULL, r->pipe[1], NULL, r->pipesize - r->inpipe,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK) ;
+        _net_countin(src, n) ;
+        if (n==0) r->eof = 1 ;
+      }
+      if (n>0) r->inpipe += n ;
 
-  } else if (sh->ssl && !sh->isblocking) {
+    } else {
 
-    int r = SSL_read(sh->ssl, buf, maxlen) ;
+      size_t space = NET_RELAYRING - (r->head - r->tail) ;
+      size_t at = r->head % NET_RELAYRING ;
+      if (space > NET_RELAYRING - at) space = NET_RELAYRING - at ;
+      if (space==0) break ;
+
+      if (src->rbuflen > src->rbufpos) {
+        n = src->rbuflen - src->rbufpos ;
+        if ((size_t)n > space) n = space ;
+        memcpy(&r->ring[at], &src->rbuf[src->rbufpos], n) ;
+        src->rbufpos += n ;
+      } else if (src->ssl) {
+        int len = space>INT_MAX ? INT_MAX : (int)space ;
+        n = SSL_read(src->ssl, &r->ring[at], len) ;
+        _net_countin(src, n) ;
+        r->readwant = 0 ;
+        if (n<=0) {
+          // Many servers close without close_notify, which is taken
+          // as the end of the stream, as it is for plaintext
+
+          int e = SSL_get_error(src->ssl, n) ;
+          unsigned long err = ERR_peek_error() ;
+          if (e==SSL_ERROR_ZERO_RETURN || (e==SSL_ERROR_SYSCALL && !err) ||
+              (e==SSL_ERROR_SSL && ERR_GET_REASON(err)==SSL_R_UNEXPECTED_EOF_WHILE_READING)) {
+            ERR_clear_error() ;
+            r->eof = 1 ;
+            n = 0 ;
+          } else if (e==SSL_ERROR_WANT_READ || e==SSL_ERROR_WANT_WRITE) {
+            r->readwant = (e==SSL_ERROR_WANT_WRITE) ? POLLOUT : POLLIN ;
+            errno = EAGAIN ;
+            n = -1 ;
+          } else {
+            _net_seterrno(src, "netsplice", NET_ERR_SSL, n) ;
+            return -1 ;
+          }
+        }
+      } else {
+        n = recv(src->fd, &r->ring[at], space, 0) ;
+        _net_countin(src, n) ;
+        if (n==0) r->eof = 1 ;
+      }
+      if (n>0) r->head += n ;
 
-    if (r > 0) {
+    }
 
-      // Data was returned.  Assert flag if even more available
+    if (n<0) {
+      if (errno==EINTR) continue ;
+      if (errno==EAGAIN || errno==EWOULDBLOCK) break ;
+      _net_seterrno(src, "netsplice", NET_ERR_ERRNO, 0) ;
+      return -1 ;
+    }
+    if (n>0) {
+      progress = 1 ;
+      canwrite = 1 ;
+    }
+    canread = 0 ;
+  }
 
-      sh->sslhaspending = nethaspending(sh) ;
-      _net_commsdump(sh, (r<=0)?"<!":"< ", buf, r) ;
-      return r ;
+  // Write what has been read
+
+  while (canwrite && (r->inpipe || r->head > r->tail)) {
+
+    ssize_t n ;
+
+    if (r->pipe[0]>=0) {
+
+      n = splice(r->pipe[0], NULL, dst->fd, NULL, r->inpipe, SPLICE_F_MOVE|SPLICE_F_NONBLOCK) ;
+      if (n>0) r->inpipe -= n ;
 
     } else {
 
-      switch(SSL_get_error(sh->ssl, r)) {
+      // A TLS write which could not complete is retried with the same length
+
+      size_t at = r->tail % NET_RELAYRING ;
+      size_t len = r->head - r->tail ;
+      if (len > NET_RELAYRING - at) len = NET_RELAYRING - at ;
+
+      if (dst->ssl) {
+        if (r->writelen) len = r->writelen ;
+        if (len > INT_MAX) len = INT_MAX ;
+        n = SSL_write(dst->ssl, &r->ring[at], (int)len) ;
+        r->writewant = 0 ;
+        if (n<=0) {
+          int e = SSL_get_error(dst->ssl, n) ;
+          if (e==SSL_ERROR_WANT_READ || e==SSL_ERROR_WANT_WRITE) {
+            r->writelen = (int)len ;
+            r->writewant = (e==SSL_ERROR_WANT_READ) ? POLLIN : POLLOUT ;
+            errno = EAGAIN ;
+            n = -1 ;
+          } else {
+            _net_seterrno(dst, "netsplice", NET_ERR_SSL, n) ;
+            return -1 ;
+          }
+        } else {
+          r->writelen = 0 ;
+          dst->statrecords += (n+SSL3_RT_MAX_PLAIN_LENGTH-1)/SSL3_RT_MAX_PLAIN_LENGTH ;
+        }
+      } else {
+        n = send(dst->fd, &r->ring[at], len, MSG_NOSIGNAL) ;
+      }
+      if (n>0) r->tail += n ;
 
-        case SSL_ERROR_WANT_READ:
+    }
 
-          // Nothing required, sh->fd is always added to fd_set
+    dst->statsyscalls++ ;
 
-          return 0 ;
-          break ;
+    if (n<0) {
+      if (errno==EINTR) continue ;
+      if (errno==EAGAIN || errno==EWOULDBLOCK) break ;
+      _net_seterrno(dst, "netsplice", NET_ERR_ERRNO, 0) ;
+      return -1 ;
+    }
+    _net_countout(dst, n) ;
+    progress = 1 ;
+  }
 
-        case SSL_ERROR_WANT_WRITE:
+  // Once the source has finished and everything has been passed on,
+  // tell the destination there is no more (half-close)
 
-          // SSL read required, flag to be added to write set
+  if (r->eof && !r->done && !r->inpipe && r->head==r->tail) {
+    if (dst->ssl) SSL_shutdown(dst->ssl) ;
+    shutdown(dst->fd, SHUT_WR) ;
+    r->done = 1 ;
+    progress = 1 ;
+  }
 
-          sh->sslwantwrite=1 ;
-          return 0 ;
-          break ;
+  return progress ;
+}
 
-        default:
 
-          _net_seterrno(sh, "netrecv", NET_ERR_SSL, r) ;
-          return -1 ;
-          break ;
+//
+// @brief Relay data between two connections, in both directions, until both have closed
+// @param(in) a Handle of open connection
+// @param(in) b Handle of open connection
+// @return true once both directions have finished, false on error
+//
+// Plaintext data is moved with splice through a pipe, without being
+// copied to user space, including to a TLS connection whose sending
+// has been offloaded to the kernel (KTLS).  Otherwise data is relayed
+// through a fixed ring buffer for each direction.  When one side
+// finishes sending, the other side's sending direction is shut down,
+// and the relay continues until the other side also finishes.
+// As with netsend, writing to a connection closed by its peer raises
+// SIGPIPE, unless it is ignored.
+//
 
-      }
+int netsplice(INET *a, INET *b)
+{
+  if (!a || !b) return 0 ;
+
+  if (a==b || a->fd<0 || b->fd<0 || a->state!=NET_CONNECTED || b->state!=NET_CONNECTED) {
+    errno = EINVAL ;
+    _net_seterrno(a, "netsplice", NET_ERR_ERRNO, 0) ;
+    return 0 ;
+  }
 
+  // Send anything buffered before relaying
+
+  INET *sh[2] = { a, b } ;
+  for (int i=0; i<2; i++) {
+    int r ;
+    while ((r=netflush(sh[i]))>0) {
+      struct pollfd pfd = { sh[i]->fd, POLLOUT, 0 } ;
+      poll(&pfd, 1, -1) ;
     }
+    if (r<0) return 0 ;
+  }
 
+  struct _net_relay relay[2] ;
+  memset(relay, 0, sizeof(relay)) ;
+  relay[0].src = a ;
+  relay[0].dst = b ;
+  relay[1].src = b ;
+  relay[1].dst = a ;
+
+  int ok = 1 ;
+  for (int i=0; i<2; i++) {
+    struct _net_relay *r = &relay[i] ;
+    r->pipe[0] = r->pipe[1] = -1 ;
+    if (!r->src->ssl && (!r->dst->ssl || netktls(r->dst)&NET_KTLS_TX)) {
+      if (pipe2(r->pipe, O_NONBLOCK|O_CLOEXEC)<0) {
+        r->pipe[0] = r->pipe[1] = -1 ;
+        ok = 0 ;
+        continue ;
+      }
+      fcntl(r->pipe[1], F_SETPIPE_SZ, NET_RELAYPIPE) ;
+      r->pipesize = fcntl(r->pipe[1], F_GETPIPE_SZ) ;
+      if (r->pipesize<=0) r->pipesize = 65536 ;
+    } else {
+      r->ring = malloc(NET_RELAYRING) ;
+      if (!r->ring) ok = 0 ;
+    }
+  }
 
-  } else if (sh->fd) {
+  // Relay with the sockets non-blocking, restoring them afterwards
 
-    int r = recv(sh->fd, buf, maxlen, 0) ;
-    _net_commsdump(sh, (r<=0)?"<!":"< ", buf, r) ;
-    _net_seterrno(sh, "netrecv", NET_ERR_ERRNO, 0) ;
-    if (r==0) r=-1 ;
-    return r ;
+  int fdoptions[2] ;
+  for (int i=0; i<2; i++) {
+    fdoptions[i] = fcntl(sh[i]->fd, F_GETFL) ;
+    fcntl(sh[i]->fd, F_SETFL, fdoptions[i]|O_NONBLOCK) ;
+  }
 
-  } else {
+  int wait=0 ;
+
+  while (ok && !(relay[0].done && relay[1].done)) {
+
+    // Watch a source while its buffer has room, and a destination while
+    // it has data waiting.  TLS may need to write in order to read, or
+    // read in order to write, so it is watched for whichever the last
+    // SSL_read or SSL_write asked for.  Sockets are only waited for once
+    // a pass over both directions has made no progress, and not while
+    // TLS holds decrypted data which there is room for.
+
+    struct pollfd pfd[2] ;
+    for (int i=0; i<2; i++) {
+      struct _net_relay *in = &relay[i] ;
+      struct _net_relay *out = &relay[1-i] ;
+      pfd[i].fd = sh[i]->fd ;
+      pfd[i].events = 0 ;
+      pfd[i].revents = 0 ;
+      if (!in->eof && (in->pipe[1]>=0 ? in->inpipe < in->pipesize : in->head - in->tail < NET_RELAYRING)) {
+        pfd[i].events |= in->readwant ? in->readwant : POLLIN ;
+        if (sh[i]->ssl && SSL_has_pending(sh[i]->ssl)) wait = 0 ;
+      }
+      if (out->inpipe || out->head > out->tail) {
+        pfd[i].events |= out->writewant ? out->writewant : POLLOUT ;
+      }
 
-    errno= EBADF ;
-    _net_seterrno(sh, "netrecv", NET_ERR_ERRNO, 0) ;
-    return -1 ;
+      // POLLERR and POLLHUP are reported even for no events, so a side
+      // with nothing to do (such as one reset after it finished
+      // sending) is left out, rather than waking poll for ever
+
+      if (!pfd[i].events) pfd[i].fd = -1 ;
+    }
 
+    if (poll(pfd, 2, wait ? -1 : 0)<0) {
+      if (errno==EINTR) continue ;
+      _net_seterrno(a, "netsplice", NET_ERR_ERRNO, 0) ;
+      ok = 0 ;
+      break ;
+    }
+
+    wait = 1 ;
+    for (int i=0; i<2; i++) {
+      int r = _net_relay_step(&relay[i], pfd[i].revents!=0, pfd[1-i].revents!=0) ;
+      if (r<0) ok = 0 ;
+      if (r>0) wait = 0 ;
+    }
+  }
+
+  for (int i=0; i<2; i++) {
+    fcntl(sh[i]->fd, F_SETFL, fdoptions[i]) ;
+    if (relay[i].pipe[0]>=0) close(relay[i].pipe[0]) ;
+    if (relay[i].pipe[1]>=0) close(relay[i].pipe[1]) ;
+    free(relay[i].ring) ;
+    if (sh[i]->poll) _net_poll_touch(sh[i]) ;
   }
+
+  return ok ;
 }
 
+
 //
 // @brief Returns true if pending data
 // @param(in) sh Handle of open connection
@@ -744,10 +4223,16 @@ int nethaspending(NET *sh)
 {
   if (sh->ssl) {
 
+    if (sh->rbuflen > sh->rbufpos) return 1 ;
+
     int r = SSL_pending(sh->ssl) ;
     _net_seterrno(sh, "nethaspending", NET_ERR_SSL, r) ;
     return (r > 0) ;
 
+  } else if (sh->rbuf) {
+
+    return ( sh->rbuflen > sh->rbufpos ) ;
+
   } else if (sh->fd) {
 
     char ch ;
@@ -756,7 +4241,8 @@ int nethaspending(NET *sh)
     return ( r > 0 ) ;
 
   }
- 
+
+  return 0 ;
 }
 
 
@@ -767,6 +4253,45 @@ int neterrno()
 }
 
 
+//
+// @brief Obtain number of last error on connection
+// @param(in) sh Handle of connection
+// @return Error number (as neterrno), or -1 if there has been none
+//
+
+int netlasterrno(INET *sh)
+{
+  if (!sh) return -1 ;
+  return sh->err ;
+}
+
+
+//
+// @brief Obtain message for last error on connection
+// @param(in) sh Handle of connection
+// @return Error message, valid until the thread's next call
+//
+
+char *netlaststrerror(INET *sh)
+{
+  if (!sh || sh->err<0) return "" ;
+  return _net_strerror(sh->err) ;
+}
+
+
+//
+// @brief Obtain context of last error on connection
+// @param(in) sh Handle of connection
+// @return Name of operation which failed, or "" if there has been no error
+//
+
+char *netlasterrorcontext(INET *sh)
+{
+  if (!sh || sh->err<0) return "" ;
+  return sh->errcontext ;
+}
+
+
 char *netcertstatusstr(int statusno)
 {
   switch(statusno) {
@@ -814,15 +4339,27 @@ char *netstrerrorcontext()
 }
 
 char *netstrerror()
+{
+  return _net_strerror(_net_errno) ;
+}
+
+
+//
+// @brief Obtain message for error number
+// @param(in) err Error number (as neterrno)
+// @return Error message, valid until the thread's next call
+//
+
+static char *_net_strerror(int err)
 {
 
-  if (_net_errno<1000) {
+  if (err<1000) {
 
-    return strerror(_net_errno) ;
+    return strerror_r(err, _net_strerrbuf, sizeof(_net_strerrbuf)) ;
 
-  } else if ( _net_errno >= NET_ERR_INT && _net_errno < NET_ERR_INT+1000 ) {
+  } else if ( err >= NET_ERR_INT && err < NET_ERR_INT+1000 ) {
 
-    switch (_net_errno-NET_ERR_INT) {
+    switch (err-NET_ERR_INT) {
     case NET_ERR_OK: return "OK" ;
     case NET_ERR_PTR: return "invalid pointer" ;
     case NET_ERR_BADP: return "invalid port number" ;
@@ -831,15 +4368,15 @@ char *netstrerror()
     default: return "unknown error" ;
     }
 
-  } else if ( _net_errno >= NET_ERR_SSL && _net_errno < NET_ERR_SSL+1000 ) {
+  } else if ( err >= NET_ERR_SSL && err < NET_ERR_SSL+1000 ) {
 
-    switch (_net_errno-NET_ERR_SSL) {
+    switch (err-NET_ERR_SSL) {
     case SSL_ERROR_NONE: return "OK" ; 
     case SSL_ERROR_SSL: return "non-recoverable fatal error in SSL library" ;
     case SSL_ERROR_WANT_READ: return "want read: insufficient data available at this time" ;
     case SSL_ERROR_WANT_WRITE: return "want write: was unable to send all data at this time" ;
     case SSL_ERROR_WANT_X509_LOOKUP: return "want x509 lookup: operation did not complete, try after lookup" ;
-    case SSL_ERROR_SYSCALL: return strerror(errno) ;
+    case SSL_ERROR_SYSCALL: return strerror_r(errno, _net_strerrbuf, sizeof(_net_strerrbuf)) ;
     case SSL_ERROR_ZERO_RETURN: return "zero return: peer has closed the connection" ;
     case SSL_ERROR_WANT_CONNECT: return "want connect: operation did not complete, try again" ;
     case SSL_ERROR_WANT_ACCEPT: return "want accept: operation did not complete, try again" ;
@@ -858,40 +4395,48 @@ char *netstrerror()
 
 int _net_seterrno(INET *sh, char *context, enum net_errno_type type, int errcode) 
 {
-  if (!sh) return 0 ;
-
-  _net_errcontext[0]='\0' ;
-  if (context && strlen(context)<sizeof(_net_errcontext)-1) {
-    strcpy(_net_errcontext, context) ;
-  }
+  int err ;
 
   if (type == NET_ERR_ERRNO && errcode>0) { 
 
-    _net_errno = errcode ;
+    err = errcode ;
 
   } else if (type == NET_ERR_ERRNO) {
 
-    _net_errno = errno ;
+    err = errno ;
 
   } else if (type == NET_ERR_INT) {
 
-    _net_errno = NET_ERR_INT + errcode ;
+    err = NET_ERR_INT + errcode ;
 
-  } else if (!sh->ssl) {
+  } else if (!sh || !sh->ssl) {
 
-    _net_errno = NET_ERR_INT + NET_ERR_PTR ; 
+    err = NET_ERR_INT + NET_ERR_PTR ; 
 
   } else if (type == NET_ERR_SSL) { 
 
-    _net_errno = NET_ERR_SSL + SSL_get_error(sh->ssl, errcode) ;
-    if (_net_errno == NET_ERR_SSL) _net_errno=errno ;
+    err = NET_ERR_SSL + SSL_get_error(sh->ssl, errcode) ;
+    if (err == NET_ERR_SSL) err=errno ;
 
   } else {
 
-    _net_errno = NET_ERR_INT + NET_ERR_UNK ;
+    err = NET_ERR_INT + NET_ERR_UNK ;
+
+  }
+
+  // Record as the thread's last error, and the connection's
 
+  _net_errno = err ;
+  _net_errcontext[0]='\0' ;
+  if (context && strlen(context)<sizeof(_net_errcontext)-1) {
+    strcpy(_net_errcontext, context) ;
   }
 
+  if (!sh) return 0 ;
+
+  sh->err = err ;
+  strcpy(sh->errcontext, _net_errcontext) ;
+
   return 1 ;
 
 }
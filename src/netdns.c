@@ -0,0 +1,1640 @@
+//
+// netdns.c
+//
+// Non-blocking host name resolution for the network client, with
+// an address cache.
+//
+// int netresolve_start(char *hostname, netresolve_callback callback, void *arg)
+// int netresolve_srv_start(char *name, netresolve_srv_callback callback, void *arg)
+// int netresolve_cancel(netresolve_callback callback, void *arg)
+// int netresolve_srv_cancel(netresolve_srv_callback callback, void *arg)
+// int netresolve_fd()
+// int netresolve_process()
+// int netresolve(char *hostname, NETADDR *addrs, int maxaddrs)
+// int netresolve_servers(char *servers)
+// int netresolve_timeout(int timeoutms, int attempts)
+// int netresolve_config(int ttl, int negativettl)
+// int netresolve_stats(unsigned long *hits, unsigned long *misses, unsigned long *coalesced)
+// int netresolve_querystats(unsigned long *queries, unsigned long *retries,
+//                           unsigned long *tcp, unsigned long *latencyms)
+//
+// NOTES
+//
+// This is a stub resolver.  Names are looked up in /etc/hosts, and
+// then by sending A and AAAA (or SRV) queries over UDP to the servers
+// listed in /etc/resolv.conf, retrying over TCP if a reply is
+// truncated.  Replies are parsed with the mdns/rdata wire format
+// functions.  Search domains are not applied, so names are treated
+// as fully qualified.
+//
+// Each query has its own connected UDP socket (and so a random source
+// port), and all sockets, plus a timer for retransmissions, are
+// gathered in an epoll instance whose file descriptor (netresolve_fd)
+// becomes readable when there is work for netresolve_process.
+// Completed lookups are reported to their callbacks by
+// netresolve_process, in the thread which calls it.  Simultaneous
+// lookups of the same name share a single query.
+//
+// Connections started by netconnect_start don't use a callback, as
+// the thread which completes their lookup may not be the one which
+// owns them.  Their result is stored in the lookup's waiter by
+// netresolve_process, and collected by the owner's netconnect_step
+// (_netdns_lookup_collect).  Each such lookup has its own epoll
+// instance (_netdns_lookup_fd), watching the resolver's epoll instance
+// and an eventfd signalled once the result is stored, so only its
+// owner is woken for the result.
+//
+// Results are cached for the smallest TTL of the records used, and
+// failures for the negative TTL given by the zone's SOA record.
+//
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../net.h"
+#include "../mdns.h"
+#include "../rdata.h"
+
+#define NETDNS_CACHEMAX 256
+#define NETDNS_MAXSERVERS 3
+#define NETDNS_MAXCHAIN 8          // Maximum CNAME chain followed
+#define NETDNS_MAXMSG 65535
+#define NETDNS_UDPSIZE 1232        // EDNS0 UDP payload size advertised
+#define NETDNS_SLACK 16            // Zeroed space after messages for the parsers
+
+#define NETDNS_A 1
+#define NETDNS_CNAME 5
+#define NETDNS_SOA 6
+#define NETDNS_AAAA 28
+#define NETDNS_SRV 33
+#define NETDNS_OPT 41
+
+#define NETDNS_RESOLVCONF "/etc/resolv.conf"
+#define NETDNS_HOSTS "/etc/hosts"
+
+// Callback registered for a lookup in progress, or (with no callback)
+// a lookup whose result is collected by its owner
+
+typedef struct _netdns_waiter {
+  netresolve_callback callback ;
+  netresolve_srv_callback srvcallback ;
+  void *arg ;
+  int done ;                   // True once result is stored, for collection
+  int eventfd ;                // Signalled once result is stored, or -1
+  int epollfd ;                // Resolver's epoll instance and eventfd, or -1
+  NETADDR addrs[NET_MAXADDRS] ; // Result stored for collection
+  int naddrs ;
+  struct _netdns_waiter *next ;
+} NETDNS_WAITER ;
+
+// Single DNS transaction (one question) of a lookup
+
+typedef struct {
+  unsigned short id ;          // Transaction ID
+  unsigned short qtype ;       // Record type requested
+  int done ;                   // True once answered, or abandoned
+  int tcpfd ;                  // TCP socket if retrying over TCP, or -1
+  int tcpsent ;                // True once query has been sent over TCP
+  mem *tcpbuf ;                // TCP reply buffer
+  int tcplen ;
+} NETDNS_TX ;
+
+// Lookup in progress
+
+typedef struct _netdns_query {
+  char *name ;                 // Name being resolved
+  int qtype ;                  // NETDNS_A for addresses, or NETDNS_SRV
+  NETDNS_TX tx[2] ;            // Transactions (A and AAAA, or SRV)
+  int ntx ;
+  int fd ;                     // UDP socket, connected to current server
+  int server ;                 // Index of current server
+  int attempt ;                // Number of attempts made
+  long long started ;          // Time lookup started (ms)
+  long long deadline ;         // Time to retry (ms)
+  NETADDR addrs[NET_MAXADDRS] ; // Result, as it is collected
+  int naddrs ;
+  NETSRV srv[NET_MAXADDRS] ;
+  int nsrv ;
+  unsigned int ttl ;           // Smallest TTL of records used
+  int negativettl ;            // Negative TTL from SOA, or -1 if none seen
+  NETDNS_WAITER *waiters ;     // Callbacks to report result to
+  struct _netdns_query *next ;
+} NETDNS_QUERY ;
+
+// Cached result
+
+typedef struct _netdns_entry {
+  char *name ;
+  int qtype ;
+  NETADDR addrs[NET_MAXADDRS] ;
+  int naddrs ;                 // Number of addresses, 0 for failed lookup
+  NETSRV *srv ;
+  int nsrv ;
+  time_t expires ;
+  struct _netdns_entry *next ;
+} NETDNS_ENTRY ;
+
+static NETDNS_QUERY *_netdns_queries=NULL ;
+static NETDNS_ENTRY *_netdns_cache=NULL ;
+static int _netdns_cachecount=0 ;
+static int _netdns_ttl=3600 ;
+static int _netdns_negativettl=10 ;
+static unsigned long _netdns_hits=0 ;
+static unsigned long _netdns_misses=0 ;
+static unsigned long _netdns_coalesced=0 ;
+static unsigned long _netdns_sent=0 ;
+static unsigned long _netdns_retries=0 ;
+static unsigned long _netdns_tcp=0 ;
+static unsigned long _netdns_latency=0 ;
+static int _netdns_epollfd=-1 ;
+static int _netdns_timerfd=-1 ;
+static pthread_mutex_t _netdns_mutex = PTHREAD_MUTEX_INITIALIZER ;
+
+// Name servers
+
+static struct sockaddr_storage _netdns_servers[NETDNS_MAXSERVERS] ;
+static socklen_t _netdns_serverlen[NETDNS_MAXSERVERS] ;
+static int _netdns_nservers=-1 ;   // -1 until configured
+static int _netdns_timeout=5000 ;
+static int _netdns_attempts=2 ;
+
+static void _netdns_report(NETDNS_QUERY *done) ;
+
+
+//
+// @brief Obtain monotonic time in milliseconds
+//
+
+static long long _netdns_now()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000 ;
+}
+
+
+//
+// @brief Parse numeric address, which needs no lookup
+// @param(in) hostname Name to parse - note 011 represents octal -> 9
+// @param(out) addr Parsed address
+// @return true if hostname is a numeric address
+//
+
+static int _netdns_numeric(char *hostname, NETADDR *addr)
+{
+  memset(addr, '\0', sizeof(NETADDR)) ;
+  if (inet_aton(hostname, (struct in_addr *)addr->addr)) {
+    addr->family = AF_INET ;
+    return 1 ;
+  } else if (inet_pton(AF_INET6, hostname, addr->addr)==1) {
+    addr->family = AF_INET6 ;
+    return 1 ;
+  } else {
+    return 0 ;
+  }
+}
+
+
+//
+// @brief Add address to list, IPv4 addresses first, ignoring duplicates
+// @param(inout) addrs Address list
+// @param(inout) naddrs Number of addresses in list
+// @param(in) family AF_INET or AF_INET6
+// @param(in) addr Address in network byte order
+//
+
+static void _netdns_addaddr(NETADDR *addrs, int *naddrs, int family, unsigned char *addr)
+{
+  NETADDR a ;
+  memset(&a, '\0', sizeof(a)) ;
+  a.family = family ;
+  memcpy(a.addr, addr, (family==AF_INET)?4:16) ;
+
+  int pos=*naddrs ;
+  for (int i=0; i<*naddrs; i++) {
+    if (memcmp(&addrs[i], &a, sizeof(a))==0) return ;
+    if (family==AF_INET && addrs[i].family!=AF_INET && pos==*naddrs) pos=i ;
+  }
+
+  if (*naddrs>=NET_MAXADDRS) return ;
+  memmove(&addrs[pos+1], &addrs[pos], (*naddrs-pos)*sizeof(NETADDR)) ;
+  addrs[pos] = a ;
+  (*naddrs)++ ;
+}
+
+
+//
+// @brief Look up host name in the hosts file
+// @param(in) hostname Name to find
+// @param(out) addrs Addresses found
+// @return Number of addresses found
+//
+
+static int _netdns_hosts(char *hostname, NETADDR *addrs)
+{
+  char line[512] ;
+  int naddrs=0 ;
+
+  FILE *fp = fopen(NETDNS_HOSTS, "r") ;
+  if (!fp) return 0 ;
+
+  while (fgets(line, sizeof(line), fp)) {
+
+    char *hash = strchr(line, '#') ;
+    if (hash) *hash='\0' ;
+
+    char *save=NULL ;
+    char *ip = strtok_r(line, " \t\r\n", &save) ;
+    if (!ip) continue ;
+
+    char *name ;
+    while ((name=strtok_r(NULL, " \t\r\n", &save))) {
+      if (strcasecmp(name, hostname)==0) {
+        unsigned char addr[16] ;
+        if (inet_pton(AF_INET, ip, addr)==1) _netdns_addaddr(addrs, &naddrs, AF_INET, addr) ;
+        else if (inet_pton(AF_INET6, ip, addr)==1) _netdns_addaddr(addrs, &naddrs, AF_INET6, addr) ;
+        break ;
+      }
+    }
+
+  }
+
+  fclose(fp) ;
+  return naddrs ;
+}
+
+
+//
+// @brief Add name server to list
+// @param(in) server Address, optionally with port ("1.2.3.4", "1.2.3.4:53", "[::1]:53")
+// @return true on success
+// Must be called with _netdns_mutex locked
+//
+
+static int _netdns_addserver(char *server)
+{
+  char host[INET6_ADDRSTRLEN+8] ;
+  int port=53 ;
+
+  if (_netdns_nservers>=NETDNS_MAXSERVERS || strlen(server)>=sizeof(host)) return 0 ;
+
+  strcpy(host, server) ;
+  char *colon = strrchr(host, ':') ;
+  if (host[0]=='[') {
+    char *close = strchr(host, ']') ;
+    if (!close) return 0 ;
+    *close='\0' ;
+    if (close[1]==':') port=atoi(&close[2]) ;
+    memmove(host, &host[1], strlen(&host[1])+1) ;
+  } else if (colon && colon==strchr(host, ':')) {
+    *colon='\0' ;
+    port=atoi(&colon[1]) ;
+  }
+
+  if (port<=0 || port>65535) return 0 ;
+
+  struct sockaddr_storage *sa = &_netdns_servers[_netdns_nservers] ;
+  memset(sa, '\0', sizeof(*sa)) ;
+
+  struct sockaddr_in *sa4 = (struct sockaddr_in *)sa ;
+  struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)sa ;
+
+  if (inet_pton(AF_INET, host, &sa4->sin_addr)==1) {
+    sa4->sin_family = AF_INET ;
+    sa4->sin_port = htons(port) ;
+    _netdns_serverlen[_netdns_nservers] = sizeof(struct sockaddr_in) ;
+  } else if (inet_pton(AF_INET6, host, &sa6->sin6_addr)==1) {
+    sa6->sin6_family = AF_INET6 ;
+    sa6->sin6_port = htons(port) ;
+    _netdns_serverlen[_netdns_nservers] = sizeof(struct sockaddr_in6) ;
+  } else {
+    return 0 ;
+  }
+
+  _netdns_nservers++ ;
+  return 1 ;
+}
+
+
+//
+// @brief Load name servers and options from resolv.conf, if not yet configured
+// Must be called with _netdns_mutex locked
+//
+
+static void _netdns_loadconf()
+{
+  char line[512] ;
+
+  if (_netdns_nservers>=0) return ;
+  _netdns_nservers=0 ;
+
+  FILE *fp = fopen(NETDNS_RESOLVCONF, "r") ;
+
+  while (fp && fgets(line, sizeof(line), fp)) {
+
+    char *save=NULL ;
+    char *key = strtok_r(line, " \t\r\n", &save) ;
+    if (!key) continue ;
+
+    if (strcmp(key, "nameserver")==0) {
+
+      char *server = strtok_r(NULL, " \t\r\n", &save) ;
+      if (server && !strchr(server, '%')) _netdns_addserver(server) ;
+
+    } else if (strcmp(key, "options")==0) {
+
+      char *opt ;
+      while ((opt=strtok_r(NULL, " \t\r\n", &save))) {
+        if (strncmp(opt, "timeout:", 8)==0 && atoi(&opt[8])>0) _netdns_timeout=atoi(&opt[8])*1000 ;
+        if (strncmp(opt, "attempts:", 9)==0 && atoi(&opt[9])>0) _netdns_attempts=atoi(&opt[9]) ;
+      }
+
+    }
+
+  }
+
+  if (fp) fclose(fp) ;
+
+  // Default to local server, as libc does
+
+  if (_netdns_nservers==0) _netdns_addserver("127.0.0.1") ;
+}
+
+
+//
+// @brief Create epoll instance and retransmission timer, if not yet done
+// @return true on success
+// Must be called with _netdns_mutex locked
+//
+
+static int _netdns_init()
+{
+  if (_netdns_epollfd>=0) return 1 ;
+
+  _netdns_epollfd = epoll_create1(EPOLL_CLOEXEC) ;
+  if (_netdns_epollfd<0) return 0 ;
+
+  _netdns_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC) ;
+  if (_netdns_timerfd<0) {
+    close(_netdns_epollfd) ;
+    _netdns_epollfd=-1 ;
+    return 0 ;
+  }
+
+  struct epoll_event ev = { EPOLLIN, { .fd=_netdns_timerfd } } ;
+  epoll_ctl(_netdns_epollfd, EPOLL_CTL_ADD, _netdns_timerfd, &ev) ;
+
+  return 1 ;
+}
+
+
+//
+// @brief Set retransmission timer for the earliest query deadline
+// Must be called with _netdns_mutex locked
+//
+
+static void _netdns_settimer()
+{
+  struct itimerspec its ;
+  memset(&its, '\0', sizeof(its)) ;
+
+  long long deadline=0 ;
+  for (NETDNS_QUERY *q=_netdns_queries; q; q=q->next) {
+    if (q==_netdns_queries || q->deadline<deadline) deadline=q->deadline ;
+  }
+
+  if (_netdns_queries) {
+    long long ms = deadline - _netdns_now() ;
+    if (ms<1) ms=1 ;
+    its.it_value.tv_sec = ms/1000 ;
+    its.it_value.tv_nsec = (ms%1000)*1000000 ;
+  }
+
+  timerfd_settime(_netdns_timerfd, 0, &its, NULL) ;
+}
+
+
+//
+// @brief Close socket, removing it from the epoll instance
+//
+
+static void _netdns_closefd(int *fd)
+{
+  if (*fd<0) return ;
+  epoll_ctl(_netdns_epollfd, EPOLL_CTL_DEL, *fd, NULL) ;
+  close(*fd) ;
+  *fd=-1 ;
+}
+
+
+//
+// @brief Build query message
+// @param(in) q Lookup
+// @param(in) tx Transaction
+// @param(out) buf Message buffer (at least 512 bytes)
+// @return Length of message, or 0 if name is invalid
+//
+
+static int _netdns_build(NETDNS_QUERY *q, NETDNS_TX *tx, unsigned char *buf)
+{
+  int p=12 ;
+
+  memset(buf, '\0', 12) ;
+  buf[0] = tx->id>>8 ;
+  buf[1] = tx->id&0xFF ;
+  buf[2] = 0x01 ;              // Recursion desired
+  buf[5] = 1 ;                 // One question
+  buf[11] = 1 ;                // One additional record (OPT)
+
+  // Name, as a sequence of labels
+
+  char *label = q->name ;
+  while (*label) {
+    char *dot = strchr(label, '.') ;
+    int len = dot ? (dot-label) : strlen(label) ;
+    if (len<1 || len>63 || p+len+1>12+255) return 0 ;
+    buf[p++] = len ;
+    memcpy(&buf[p], label, len) ;
+    p+=len ;
+    label+=len ;
+    if (*label=='.') label++ ;
+  }
+  buf[p++] = 0 ;
+
+  // Type and class
+
+  buf[p++] = tx->qtype>>8 ;
+  buf[p++] = tx->qtype&0xFF ;
+  buf[p++] = 0 ;
+  buf[p++] = 1 ;
+
+  // EDNS0 OPT record, advertising larger UDP payload
+
+  buf[p++] = 0 ;
+  buf[p++] = NETDNS_OPT>>8 ;
+  buf[p++] = NETDNS_OPT&0xFF ;
+  buf[p++] = NETDNS_UDPSIZE>>8 ;
+  buf[p++] = NETDNS_UDPSIZE&0xFF ;
+  memset(&buf[p], '\0', 6) ;
+  p+=6 ;
+
+  return p ;
+}
+
+
+//
+// @brief Send outstanding questions of lookup to its current server over UDP
+// @param(in) q Lookup
+// Must be called with _netdns_mutex locked
+//
+
+static void _netdns_send(NETDNS_QUERY *q)
+{
+  unsigned char buf[512] ;
+
+  q->deadline = _netdns_now() + _netdns_timeout ;
+
+  // Each attempt uses a new socket, and so a new source port
+
+  _netdns_closefd(&q->fd) ;
+
+  struct sockaddr *sa = (struct sockaddr *)&_netdns_servers[q->server] ;
+  q->fd = socket(sa->sa_family, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0) ;
+  if (q->fd<0) return ;
+
+  if (connect(q->fd, sa, _netdns_serverlen[q->server])<0) {
+    _netdns_closefd(&q->fd) ;
+    return ;
+  }
+
+  struct epoll_event ev = { EPOLLIN, { .fd=q->fd } } ;
+  epoll_ctl(_netdns_epollfd, EPOLL_CTL_ADD, q->fd, &ev) ;
+
+  for (int i=0; i<q->ntx; i++) {
+    NETDNS_TX *tx = &q->tx[i] ;
+    if (tx->done) continue ;
+    _netdns_closefd(&tx->tcpfd) ;
+    if (getrandom(&tx->id, sizeof(tx->id), GRND_NONBLOCK)!=sizeof(tx->id)) tx->id=rand() ;
+    int len = _netdns_build(q, tx, buf) ;
+    if (len==0) {
+      // Invalid name, so give up on it straight away
+      tx->done=1 ;
+      q->deadline=0 ;
+    } else if (send(q->fd, buf, len, 0)==len) {
+      _netdns_sent++ ;
+    }
+  }
+}
+
+
+//
+// @brief Retry question over TCP, after a truncated UDP reply
+// @param(in) q Lookup
+// @param(in) tx Transaction
+// Must be called with _netdns_mutex locked
+//
+
+static void _netdns_tcpstart(NETDNS_QUERY *q, NETDNS_TX *tx)
+{
+  struct sockaddr *sa = (struct sockaddr *)&_netdns_servers[q->server] ;
+
+  tx->tcpfd = socket(sa->sa_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0) ;
+  if (tx->tcpfd<0) {
+    tx->done=1 ;
+    return ;
+  }
+
+  if (connect(tx->tcpfd, sa, _netdns_serverlen[q->server])<0 && errno!=EINPROGRESS) {
+    _netdns_closefd(&tx->tcpfd) ;
+    tx->done=1 ;
+    return ;
+  }
+
+  tx->tcpsent=0 ;
+  tx->tcplen=0 ;
+  _netdns_tcp++ ;
+
+  struct epoll_event ev = { EPOLLOUT, { .fd=tx->tcpfd } } ;
+  epoll_ctl(_netdns_epollfd, EPOLL_CTL_ADD, tx->tcpfd, &ev) ;
+}
+
+
+//
+// @brief Compare record owner with the names being resolved
+// @return true if name is the query name, or a CNAME alias of it
+//
+
+static int _netdns_inchain(char chain[][256], int nchain, char *name)
+{
+  for (int i=0; i<nchain; i++) {
+    if (strcasecmp(chain[i], name)==0) return 1 ;
+  }
+  return 0 ;
+}
+
+
+//
+// @brief Process reply message
+// @param(in) q Lookup
+// @param(in) buf Message
+// @param(in) len Length of message
+// @param(in) viatcp True if message was received over TCP
+// Must be called with _netdns_mutex locked
+//
+
+static void _netdns_reply(NETDNS_QUERY *q, unsigned char *buf, int len, int viatcp)
+{
+  if (len<12) return ;
+
+  // Find transaction the reply is for
+
+  unsigned short id = (buf[0]<<8) | buf[1] ;
+  NETDNS_TX *tx=NULL ;
+  for (int i=0; i<q->ntx && !tx; i++) {
+    if (!q->tx[i].done && q->tx[i].id==id) tx=&q->tx[i] ;
+  }
+  if (!tx) return ;
+
+  // Copy message to a zeroed buffer, for the parsers
+
+  mem *msg = mem_malloc(len+NETDNS_SLACK) ;
+  mem *name = mem_malloc(len+NETDNS_SLACK) ;
+  mem *target = mem_malloc(len+NETDNS_SLACK) ;
+  if (!msg || !name || !target) goto finish ;
+  memcpy(msg, buf, len) ;
+
+  int flags, qdcount, ancount, nscount, arcount ;
+  int p = mdns_get_packethead(msg, &flags, &qdcount, &ancount, &nscount, &arcount) ;
+
+  if (!(flags&0x8000) || qdcount!=1) goto finish ;
+
+  // Check question matches
+
+  int hl = rdata_extract(name, msg, p, len-p) ;
+  if (hl<1 || p+hl+4>len) goto finish ;
+  if (strcasecmp(rdata_toname(name, '.'), q->name)!=0) goto finish ;
+  if (((msg[p+hl]<<8) | msg[p+hl+1]) != tx->qtype) goto finish ;
+  p+=hl+4 ;
+
+  // Retry truncated replies over TCP
+
+  if ((flags&0x0200) && !viatcp) {
+    if (tx->tcpfd<0) _netdns_tcpstart(q, tx) ;
+    goto finish ;
+  }
+
+  // Try the next server if this one can't answer
+
+  int rcode = flags&0x0F ;
+  if (rcode!=0 && rcode!=3) {
+    q->deadline = 0 ;
+    goto finish ;
+  }
+
+  // Collect answers for the name, and any CNAME aliases of it
+
+  char chain[NETDNS_MAXCHAIN][256] ;
+  int nchain=1 ;
+  strcpy(chain[0], q->name) ;
+
+  for (int i=0; i<ancount+nscount; i++) {
+
+    unsigned short type, class, rlen ;
+    unsigned int ttl ;
+
+    int r = mdns_get_recordhead(msg, p, name, &type, &class, &ttl, &rlen) ;
+    if (r<0 || p+r+rlen>len) break ;
+    int d = p+r ;
+    p = d+rlen ;
+
+    if (ttl>0x7FFFFFFF) ttl=0 ;
+
+    if (i>=ancount) {
+
+      // Negative caching time from SOA in authority section
+
+      if (type==NETDNS_SOA && rlen>=22) {
+        unsigned int minimum = (msg[d+rlen-4]<<24) | (msg[d+rlen-3]<<16) |
+                               (msg[d+rlen-2]<<8) | msg[d+rlen-1] ;
+        if (minimum<ttl) ttl=minimum ;
+        if (q->negativettl<0 || ttl<q->negativettl) q->negativettl=ttl ;
+      }
+
+    } else if (_netdns_inchain(chain, nchain, name)) {
+
+      if (type==NETDNS_CNAME && nchain<NETDNS_MAXCHAIN) {
+
+        if (mdns_get_rdatanameptr(target, msg, d, rlen) && strlen(target)<256) {
+          strcpy(chain[nchain++], target) ;
+          if (ttl<q->ttl) q->ttl=ttl ;
+        }
+
+      } else if (type==NETDNS_A && tx->qtype==NETDNS_A && rlen==4) {
+
+        _netdns_addaddr(q->addrs, &q->naddrs, AF_INET, &msg[d]) ;
+        if (ttl<q->ttl) q->ttl=ttl ;
+
+      } else if (type==NETDNS_AAAA && tx->qtype==NETDNS_AAAA && rlen==16) {
+
+        _netdns_addaddr(q->addrs, &q->naddrs, AF_INET6, &msg[d]) ;
+        if (ttl<q->ttl) q->ttl=ttl ;
+
+      } else if (type==NETDNS_SRV && tx->qtype==NETDNS_SRV && rlen>6 && q->nsrv<NET_MAXADDRS) {
+
+        NETSRV *srv = &q->srv[q->nsrv] ;
+        unsigned short port ;
+        if (mdns_get_service(target, &port, msg, d, rlen) && strlen(target)<sizeof(srv->target)) {
+          strcpy(srv->target, target) ;
+          srv->port = port ;
+          srv->priority = (msg[d]<<8) | msg[d+1] ;
+          srv->weight = (msg[d+2]<<8) | msg[d+3] ;
+          q->nsrv++ ;
+          if (ttl<q->ttl) q->ttl=ttl ;
+        }
+
+      }
+
+    }
+
+  }
+
+  tx->done=1 ;
+
+finish:
+  mem_free(msg) ;
+  mem_free(name) ;
+  mem_free(target) ;
+}
+
+
+//
+// @brief Handle readiness of a TCP transaction socket
+// @param(in) q Lookup
+// @param(in) tx Transaction
+// Must be called with _netdns_mutex locked
+//
+
+static void _netdns_tcpevent(NETDNS_QUERY *q, NETDNS_TX *tx)
+{
+  if (!tx->tcpsent) {
+
+    // Connected, so send length prefixed query
+
+    unsigned char buf[514] ;
+    int err=0 ;
+    socklen_t errlen=sizeof(err) ;
+    getsockopt(tx->tcpfd, SOL_SOCKET, SO_ERROR, &err, &errlen) ;
+
+    int len = err ? 0 : _netdns_build(q, tx, &buf[2]) ;
+    buf[0] = len>>8 ;
+    buf[1] = len&0xFF ;
+
+    if (len==0 || send(tx->tcpfd, buf, len+2, MSG_NOSIGNAL)!=len+2) goto fail ;
+
+    if (!tx->tcpbuf) tx->tcpbuf = mem_malloc(NETDNS_MAXMSG+2) ;
+    if (!tx->tcpbuf) goto fail ;
+
+    tx->tcpsent=1 ;
+    struct epoll_event ev = { EPOLLIN, { .fd=tx->tcpfd } } ;
+    epoll_ctl(_netdns_epollfd, EPOLL_CTL_MOD, tx->tcpfd, &ev) ;
+    return ;
+
+  }
+
+  // Collect reply
+
+  int r = recv(tx->tcpfd, &tx->tcpbuf[tx->tcplen], NETDNS_MAXMSG+2-tx->tcplen, 0) ;
+  if (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return ;
+  if (r<=0) goto fail ;
+  tx->tcplen+=r ;
+
+  if (tx->tcplen<2) return ;
+  int len = (tx->tcpbuf[0]<<8) | tx->tcpbuf[1] ;
+  if (tx->tcplen<len+2) return ;
+
+  _netdns_closefd(&tx->tcpfd) ;
+  _netdns_reply(q, &tx->tcpbuf[2], len, 1) ;
+  tx->done=1 ;
+  return ;
+
+fail:
+  _netdns_closefd(&tx->tcpfd) ;
+  tx->done=1 ;
+}
+
+
+//
+// @brief Free lookup
+//
+
+static void _netdns_freequery(NETDNS_QUERY *q)
+{
+  _netdns_closefd(&q->fd) ;
+  for (int i=0; i<q->ntx; i++) {
+    _netdns_closefd(&q->tx[i].tcpfd) ;
+    mem_free(q->tx[i].tcpbuf) ;
+  }
+  while (q->waiters) {
+    NETDNS_WAITER *w = q->waiters ;
+    q->waiters = w->next ;
+    free(w) ;
+  }
+  free(q->name) ;
+  free(q) ;
+}
+
+
+//
+// @brief Find cached result, discarding expired entries
+// @param(in) hostname Name to find
+// @param(in) qtype Type of lookup
+// @return Cache entry, or NULL if none
+// Must be called with _netdns_mutex locked
+//
+
+static NETDNS_ENTRY *_netdns_cache_find(char *hostname, int qtype)
+{
+  time_t now = time(NULL) ;
+  NETDNS_ENTRY *e, **prev=&_netdns_cache, *found=NULL ;
+
+  while ((e=*prev)) {
+    if (now >= e->expires) {
+      *prev = e->next ;
+      free(e->name) ;
+      free(e->srv) ;
+      free(e) ;
+      _netdns_cachecount-- ;
+    } else {
+      if (!found && e->qtype==qtype && strcasecmp(e->name, hostname)==0) found=e ;
+      prev = &e->next ;
+    }
+  }
+
+  return found ;
+}
+
+
+//
+// @brief Add result of lookup to cache, replacing any existing entry
+// @param(in) q Completed lookup
+// @param(in) ttl Time to keep result, in seconds
+// Must be called with _netdns_mutex locked
+//
+
+static void _netdns_cache_add(NETDNS_QUERY *q, int ttl)
+{
+  if (ttl<=0) return ;
+
+  NETDNS_ENTRY *e = _netdns_cache_find(q->name, q->qtype) ;
+
+  if (!e) {
+    e = malloc(sizeof(NETDNS_ENTRY)) ;
+    if (e) {
+      memset(e, '\0', sizeof(NETDNS_ENTRY)) ;
+      e->name = malloc(strlen(q->name)+1) ;
+    }
+    if (!e || !e->name) {
+      if (e) free(e) ;
+      return ;
+    }
+    strcpy(e->name, q->name) ;
+    e->qtype = q->qtype ;
+    e->next = _netdns_cache ;
+    _netdns_cache = e ;
+    _netdns_cachecount++ ;
+  }
+
+  memcpy(e->addrs, q->addrs, q->naddrs*sizeof(NETADDR)) ;
+  e->naddrs = q->naddrs ;
+
+  free(e->srv) ;
+  e->srv = NULL ;
+  e->nsrv = 0 ;
+  if (q->nsrv>0) {
+    e->srv = malloc(q->nsrv*sizeof(NETSRV)) ;
+    if (e->srv) {
+      memcpy(e->srv, q->srv, q->nsrv*sizeof(NETSRV)) ;
+      e->nsrv = q->nsrv ;
+    }
+  }
+
+  e->expires = time(NULL) + ttl ;
+
+  // Drop oldest entry if cache is full
+
+  if (_netdns_cachecount > NETDNS_CACHEMAX) {
+    NETDNS_ENTRY **prev ;
+    for (prev=&_netdns_cache; (*prev)->next; prev=&(*prev)->next) ;
+    free((*prev)->name) ;
+    free((*prev)->srv) ;
+    free(*prev) ;
+    *prev = NULL ;
+    _netdns_cachecount-- ;
+  }
+}
+
+
+//
+// @brief Order SRV records by priority, then by descending weight
+//
+
+static int _netdns_srvcmp(const void *a, const void *b)
+{
+  const NETSRV *sa=a, *sb=b ;
+  if (sa->priority!=sb->priority) return sa->priority - sb->priority ;
+  else return sb->weight - sa->weight ;
+}
+
+
+//
+// @brief Obtain file descriptor which becomes readable when lookups need processing
+// @return File descriptor, or -1 on error
+//
+
+int netresolve_fd()
+{
+  pthread_mutex_lock(&_netdns_mutex) ;
+  int fd = _netdns_init() ? _netdns_epollfd : -1 ;
+  pthread_mutex_unlock(&_netdns_mutex) ;
+  return fd ;
+}
+
+
+//
+// @brief Start lookup
+// @param(in) name Name to resolve
+// @param(in) qtype NETDNS_A or NETDNS_SRV
+// @param(in) w Callback to report to (freed by this function)
+// @return 1 - Result already reported (cached), 0 - In progress, -1 - Error
+//
+
+static int _netdns_start(char *name, int qtype, NETDNS_WAITER *w)
+{
+  pthread_mutex_lock(&_netdns_mutex) ;
+
+  // Report cached result
+
+  NETDNS_ENTRY *e = _netdns_cache_find(name, qtype) ;
+  if (e) {
+    NETADDR addrs[NET_MAXADDRS] ;
+    NETSRV srv[NET_MAXADDRS] ;
+    int naddrs = e->naddrs ;
+    int nsrv = e->nsrv ;
+    memcpy(addrs, e->addrs, naddrs*sizeof(NETADDR)) ;
+    memcpy(srv, e->srv, nsrv*sizeof(NETSRV)) ;
+    _netdns_hits++ ;
+    pthread_mutex_unlock(&_netdns_mutex) ;
+    if (w->callback) {
+      w->callback(w->arg, addrs, naddrs) ;
+    } else if (w->srvcallback) {
+      w->srvcallback(w->arg, srv, nsrv) ;
+    } else {
+      // Kept for the owner to collect
+      memcpy(w->addrs, addrs, naddrs*sizeof(NETADDR)) ;
+      w->naddrs = naddrs ;
+      w->done = 1 ;
+      return 1 ;
+    }
+    free(w) ;
+    return 1 ;
+  }
+
+  if (!_netdns_init()) {
+    pthread_mutex_unlock(&_netdns_mutex) ;
+    free(w) ;
+    return -1 ;
+  }
+
+  // Join query already in progress
+
+  NETDNS_QUERY *q ;
+  for (q=_netdns_queries; q; q=q->next) {
+    if (q->qtype==qtype && strcasecmp(q->name, name)==0) break ;
+  }
+
+  if (q) {
+    w->next = q->waiters ;
+    q->waiters = w ;
+    _netdns_coalesced++ ;
+    pthread_mutex_unlock(&_netdns_mutex) ;
+    return 0 ;
+  }
+
+  // Otherwise, start a new query
+
+  q = malloc(sizeof(NETDNS_QUERY)) ;
+  if (q) {
+    memset(q, '\0', sizeof(NETDNS_QUERY)) ;
+    q->name = malloc(strlen(name)+1) ;
+  }
+  if (!q || !q->name) {
+    if (q) free(q) ;
+    free(w) ;
+    pthread_mutex_unlock(&_netdns_mutex) ;
+    return -1 ;
+  }
+
+  strcpy(q->name, name) ;
+  if (q->name[0] && q->name[strlen(q->name)-1]=='.') q->name[strlen(q->name)-1]='\0' ;
+
+  w->next = NULL ;
+  q->waiters = w ;
+  q->qtype = qtype ;
+  q->fd = -1 ;
+  q->ttl = _netdns_ttl ;
+  q->negativettl = -1 ;
+  q->started = _netdns_now() ;
+
+  if (qtype==NETDNS_SRV) {
+    q->tx[q->ntx++].qtype = NETDNS_SRV ;
+  } else {
+    q->tx[q->ntx++].qtype = NETDNS_A ;
+    q->tx[q->ntx++].qtype = NETDNS_AAAA ;
+  }
+  for (int i=0; i<q->ntx; i++) q->tx[i].tcpfd=-1 ;
+
+  _netdns_loadconf() ;
+  _netdns_misses++ ;
+
+  q->next = _netdns_queries ;
+  _netdns_queries = q ;
+
+  _netdns_send(q) ;
+  _netdns_settimer() ;
+
+  pthread_mutex_unlock(&_netdns_mutex) ;
+  return 0 ;
+}
+
+
+//
+// @brief Start resolving host name
+// @param(in) hostname Name to resolve
+// @param(in) callback Function to call with result
+// @param(in) arg Argument passed to callback
+// @return 1 - Result already reported (numeric, hosts file or cached), 0 - In progress, -1 - Error
+//
+
+int netresolve_start(char *hostname, netresolve_callback callback, void *arg)
+{
+  NETADDR addrs[NET_MAXADDRS] ;
+
+  if (!hostname || !callback) return -1 ;
+
+  // Numeric addresses and hosts file entries need no query
+
+  if (_netdns_numeric(hostname, &addrs[0])) {
+    callback(arg, addrs, 1) ;
+    return 1 ;
+  }
+
+  int naddrs = _netdns_hosts(hostname, addrs) ;
+  if (naddrs>0) {
+    callback(arg, addrs, naddrs) ;
+    return 1 ;
+  }
+
+  NETDNS_WAITER *w = malloc(sizeof(NETDNS_WAITER)) ;
+  if (!w) return -1 ;
+  w->callback = callback ;
+  w->srvcallback = NULL ;
+  w->arg = arg ;
+
+  return _netdns_start(hostname, NETDNS_A, w) ;
+}
+
+
+//
+// @brief Start looking up service (SRV) records
+// @param(in) name Service name, e.g. "_imaps._tcp.example.com"
+// @param(in) callback Function to call with result
+// @param(in) arg Argument passed to callback
+// @return 1 - Result already reported (cached), 0 - In progress, -1 - Error
+//
+
+int netresolve_srv_start(char *name, netresolve_srv_callback callback, void *arg)
+{
+  if (!name || !callback) return -1 ;
+
+  NETDNS_WAITER *w = malloc(sizeof(NETDNS_WAITER)) ;
+  if (!w) return -1 ;
+  w->callback = NULL ;
+  w->srvcallback = callback ;
+  w->arg = arg ;
+
+  return _netdns_start(name, NETDNS_SRV, w) ;
+}
+
+
+//
+// @brief Remove pending callback
+//
+
+static int _netdns_cancel(netresolve_callback callback, netresolve_srv_callback srvcallback, void *arg)
+{
+  int found=0 ;
+
+  pthread_mutex_lock(&_netdns_mutex) ;
+
+  for (NETDNS_QUERY *q=_netdns_queries; q && !found; q=q->next) {
+    NETDNS_WAITER *w, **prev ;
+    for (prev=&q->waiters; (w=*prev); prev=&w->next) {
+      if (w->callback==callback && w->srvcallback==srvcallback && w->arg==arg) {
+        *prev = w->next ;
+        free(w) ;
+        found=1 ;
+        break ;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&_netdns_mutex) ;
+  return found ;
+}
+
+
+//
+// @brief Stop reporting lookup result to callback
+// @param(in) callback Callback registered with netresolve_start
+// @param(in) arg Argument registered with netresolve_start
+// @return true if a pending callback was removed
+//
+
+int netresolve_cancel(netresolve_callback callback, void *arg)
+{
+  return _netdns_cancel(callback, NULL, arg) ;
+}
+
+
+//
+// @brief Stop reporting service lookup result to callback
+// @param(in) callback Callback registered with netresolve_srv_start
+// @param(in) arg Argument registered with netresolve_srv_start
+// @return true if a pending callback was removed
+//
+
+int netresolve_srv_cancel(netresolve_srv_callback callback, void *arg)
+{
+  return _netdns_cancel(NULL, callback, arg) ;
+}
+
+
+//
+// @brief Start resolving host name, for the caller to collect the result
+// @param(in) hostname Name to resolve
+// @return Handle of lookup, or NULL on error
+//
+
+void *_netdns_lookup_start(char *hostname)
+{
+  if (!hostname) return NULL ;
+
+  NETDNS_WAITER *w = malloc(sizeof(NETDNS_WAITER)) ;
+  if (!w) return NULL ;
+  memset(w, '\0', sizeof(NETDNS_WAITER)) ;
+  w->eventfd = -1 ;
+  w->epollfd = -1 ;
+
+  // Numeric addresses and hosts file entries need no query
+
+  if (_netdns_numeric(hostname, &w->addrs[0])) {
+    w->naddrs = 1 ;
+    w->done = 1 ;
+    return w ;
+  }
+
+  w->naddrs = _netdns_hosts(hostname, w->addrs) ;
+  if (w->naddrs>0) {
+    w->done = 1 ;
+    return w ;
+  }
+
+  // Otherwise the owner waits for the resolver to have work, or for
+  // the result to be stored
+
+  pthread_mutex_lock(&_netdns_mutex) ;
+  int ok = _netdns_init() ;
+  pthread_mutex_unlock(&_netdns_mutex) ;
+
+  if (ok) {
+    w->eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC) ;
+    w->epollfd = epoll_create1(EPOLL_CLOEXEC) ;
+    struct epoll_event ev = { EPOLLIN, { .fd=_netdns_epollfd } } ;
+    ok = w->eventfd>=0 && w->epollfd>=0 &&
+         epoll_ctl(w->epollfd, EPOLL_CTL_ADD, _netdns_epollfd, &ev)==0 ;
+    ev.data.fd = w->eventfd ;
+    ok = ok && epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->eventfd, &ev)==0 ;
+  }
+
+  int eventfd=w->eventfd, epollfd=w->epollfd ;
+  if (!ok || _netdns_start(hostname, NETDNS_A, w)<0) {
+    if (eventfd>=0) close(eventfd) ;
+    if (epollfd>=0) close(epollfd) ;
+    if (!ok) free(w) ;
+    return NULL ;
+  }
+  return w ;
+}
+
+
+//
+// @brief Get file descriptor which becomes readable when lookup should
+//        be progressed (netresolve_process) or collected
+// @param(in) lookup Handle of lookup
+// @return File descriptor, or -1 if the lookup is already complete
+//
+
+int _netdns_lookup_fd(void *lookup)
+{
+  NETDNS_WAITER *w = lookup ;
+  return w ? w->epollfd : -1 ;
+}
+
+
+//
+// @brief Free lookup, with its wakeup
+//
+
+static void _netdns_lookup_free(NETDNS_WAITER *w)
+{
+  if (w->eventfd>=0) close(w->eventfd) ;
+  if (w->epollfd>=0) close(w->epollfd) ;
+  free(w) ;
+}
+
+
+//
+// @brief Collect result of lookup, freeing it once complete
+// @param(in) lookup Handle of lookup
+// @param(out) addrs Addresses found (NET_MAXADDRS)
+// @param(out) naddrs Number of addresses, 0 if the name could not be resolved
+// @return 1 - Complete (and lookup freed), 0 - In progress
+//
+
+int _netdns_lookup_collect(void *lookup, NETADDR *addrs, int *naddrs)
+{
+  NETDNS_WAITER *w = lookup ;
+
+  pthread_mutex_lock(&_netdns_mutex) ;
+
+  if (!w->done) {
+    pthread_mutex_unlock(&_netdns_mutex) ;
+    return 0 ;
+  }
+
+  memcpy(addrs, w->addrs, w->naddrs*sizeof(NETADDR)) ;
+  *naddrs = w->naddrs ;
+
+  pthread_mutex_unlock(&_netdns_mutex) ;
+
+  _netdns_lookup_free(w) ;
+  return 1 ;
+}
+
+
+//
+// @brief Abandon lookup, whether or not it is complete
+// @param(in) lookup Handle of lookup
+//
+
+void _netdns_lookup_abandon(void *lookup)
+{
+  NETADDR addrs[NET_MAXADDRS] ;
+  int naddrs ;
+  NETDNS_WAITER *w = lookup ;
+
+  if (!w || _netdns_lookup_collect(w, addrs, &naddrs)) return ;
+
+  // Still waiting, so remove it from its query
+
+  pthread_mutex_lock(&_netdns_mutex) ;
+
+  int found=0 ;
+  for (NETDNS_QUERY *q=_netdns_queries; q && !found; q=q->next) {
+    NETDNS_WAITER **prev ;
+    for (prev=&q->waiters; *prev; prev=&(*prev)->next) {
+      if (*prev==w) {
+        *prev = w->next ;
+        found=1 ;
+        break ;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&_netdns_mutex) ;
+
+  _netdns_lookup_free(w) ;
+}
+
+
+//
+// @brief Handle socket events and timeouts, and report completed lookups
+// @return Number of lookups still in progress
+//
+
+int netresolve_process()
+{
+  NETDNS_QUERY *done=NULL ;
+  int pending=0 ;
+
+  pthread_mutex_lock(&_netdns_mutex) ;
+
+  if (_netdns_epollfd<0) {
+    pthread_mutex_unlock(&_netdns_mutex) ;
+    return 0 ;
+  }
+
+  // Handle ready sockets
+
+  struct epoll_event evs[64] ;
+  int n ;
+  do {
+
+    n = epoll_wait(_netdns_epollfd, evs, 64, 0) ;
+
+    for (int i=0; i<n; i++) {
+
+      int fd = evs[i].data.fd ;
+
+      if (fd==_netdns_timerfd) {
+        unsigned long long expirations ;
+        if (read(fd, &expirations, sizeof(expirations))<0) {
+          // Timer not expired
+        }
+        continue ;
+      }
+
+      for (NETDNS_QUERY *q=_netdns_queries; q; q=q->next) {
+
+        if (fd==q->fd) {
+
+          unsigned char buf[NETDNS_UDPSIZE+512] ;
+          int r ;
+          while ((r=recv(q->fd, buf, sizeof(buf), 0))>0) {
+            _netdns_reply(q, buf, r, 0) ;
+          }
+          if (r<0 && errno!=EAGAIN && errno!=EWOULDBLOCK) {
+            // e.g. ICMP port unreachable, so try next server
+            q->deadline=0 ;
+          }
+          break ;
+
+        }
+
+        int j ;
+        for (j=0; j<q->ntx && q->tx[j].tcpfd!=fd; j++) ;
+        if (j<q->ntx) {
+          _netdns_tcpevent(q, &q->tx[j]) ;
+          break ;
+        }
+
+      }
+
+    }
+
+  } while (n==64) ;
+
+  // Retry lookups which have timed out, and collect completed ones
+
+  long long now = _netdns_now() ;
+  NETDNS_QUERY *q, **prev=&_netdns_queries ;
+
+  while ((q=*prev)) {
+
+    int complete=1 ;
+    for (int i=0; i<q->ntx; i++) complete = complete && q->tx[i].done ;
+
+    if (!complete && now>=q->deadline) {
+      q->attempt++ ;
+      if (q->attempt >= _netdns_attempts*_netdns_nservers) {
+        complete=1 ;
+      } else {
+        q->server = (q->server+1) % _netdns_nservers ;
+        _netdns_retries++ ;
+        _netdns_send(q) ;
+      }
+    }
+
+    if (!complete) {
+      prev = &q->next ;
+      pending++ ;
+      continue ;
+    }
+
+    *prev = q->next ;
+    q->next = done ;
+    done = q ;
+
+    _netdns_latency += now - q->started ;
+
+    if (q->qtype==NETDNS_SRV) qsort(q->srv, q->nsrv, sizeof(NETSRV), _netdns_srvcmp) ;
+
+    if (q->naddrs>0 || q->nsrv>0) {
+      _netdns_cache_add(q, q->ttl) ;
+    } else if (q->negativettl>=0) {
+      _netdns_cache_add(q, (q->negativettl<_netdns_ttl) ? q->negativettl : _netdns_ttl) ;
+    } else {
+      _netdns_cache_add(q, _netdns_negativettl) ;
+    }
+
+    // Store the result for owners which collect it themselves
+
+    NETDNS_WAITER *w, **wprev=&q->waiters ;
+    while ((w=*wprev)) {
+      if (w->callback || w->srvcallback) {
+        wprev = &w->next ;
+        continue ;
+      }
+      *wprev = w->next ;
+      w->next = NULL ;
+      memcpy(w->addrs, q->addrs, q->naddrs*sizeof(NETADDR)) ;
+      w->naddrs = q->naddrs ;
+      w->done = 1 ;
+      unsigned long long one=1 ;
+      if (write(w->eventfd, &one, sizeof(one))<0) {
+        // Already signalled
+      }
+    }
+
+  }
+
+  _netdns_settimer() ;
+
+  pthread_mutex_unlock(&_netdns_mutex) ;
+
+  // Report results, without the lock held, as callbacks may start
+  // further lookups
+
+  _netdns_report(done) ;
+
+  return pending ;
+}
+
+
+//
+// @brief Report results of completed lookups, and free them
+// @param(in) done List of completed lookups
+//
+
+static void _netdns_report(NETDNS_QUERY *done)
+{
+  NETDNS_QUERY *q ;
+
+  while ((q=done)) {
+
+    done = q->next ;
+
+    // Waiters may be cancelled by earlier callbacks
+
+    pthread_mutex_lock(&_netdns_mutex) ;
+    NETDNS_WAITER *w = q->waiters ;
+    q->waiters = NULL ;
+    pthread_mutex_unlock(&_netdns_mutex) ;
+
+    while (w) {
+      NETDNS_WAITER *next = w->next ;
+      if (w->callback) w->callback(w->arg, q->addrs, q->naddrs) ;
+      else w->srvcallback(w->arg, q->srv, q->nsrv) ;
+      free(w) ;
+      w = next ;
+    }
+
+    pthread_mutex_lock(&_netdns_mutex) ;
+    _netdns_freequery(q) ;
+    pthread_mutex_unlock(&_netdns_mutex) ;
+
+  }
+}
+
+
+//
+// @brief Result collector for netresolve
+//
+
+typedef struct {
+  NETADDR *addrs ;
+  int maxaddrs ;
+  int naddrs ;
+  int done ;
+} NETDNS_RESULT ;
+
+static void _netdns_result(void *arg, NETADDR *addrs, int naddrs)
+{
+  NETDNS_RESULT *r = arg ;
+  r->naddrs = (naddrs < r->maxaddrs) ? naddrs : r->maxaddrs ;
+  memcpy(r->addrs, addrs, r->naddrs*sizeof(NETADDR)) ;
+  r->done = 1 ;
+}
+
+
+//
+// @brief Resolve host name, waiting for the result
+// @param(in) hostname Name to resolve
+// @param(out) addrs Addresses found
+// @param(in) maxaddrs Size of addrs
+// @return Number of addresses found, 0 if the name could not be resolved, or -1 on error
+//
+
+int netresolve(char *hostname, NETADDR *addrs, int maxaddrs)
+{
+  NETDNS_RESULT r = { addrs, maxaddrs, 0, 0 } ;
+
+  if (netresolve_start(hostname, _netdns_result, &r)<0) return -1 ;
+
+  while (!r.done) {
+    struct pollfd pfd = { netresolve_fd(), POLLIN, 0 } ;
+    if (poll(&pfd, 1, -1)<0 && errno!=EINTR) {
+      netresolve_cancel(_netdns_result, &r) ;
+      return -1 ;
+    }
+    netresolve_process() ;
+  }
+
+  return r.naddrs ;
+}
+
+
+//
+// @brief Set name servers, instead of those in resolv.conf
+// @param(in) servers Comma or space separated list of addresses, each
+//            optionally with a port ("1.2.3.4:5353", "[::1]:53"), or NULL
+//            to use resolv.conf
+// @return true on success
+//
+
+int netresolve_servers(char *servers)
+{
+  int ok=1 ;
+
+  pthread_mutex_lock(&_netdns_mutex) ;
+
+  _netdns_nservers=-1 ;
+
+  if (servers) {
+
+    char *copy = malloc(strlen(servers)+1) ;
+    if (copy) {
+      strcpy(copy, servers) ;
+      _netdns_nservers=0 ;
+      char *save=NULL, *server ;
+      for (server=strtok_r(copy, ", ", &save); server; server=strtok_r(NULL, ", ", &save)) {
+        ok = _netdns_addserver(server) && ok ;
+      }
+      free(copy) ;
+    }
+
+    if (_netdns_nservers<=0) {
+      _netdns_nservers=-1 ;
+      ok=0 ;
+    }
+
+  }
+
+  _netdns_loadconf() ;
+
+  // Lookups in progress continue from the first of the new servers
+
+  for (NETDNS_QUERY *q=_netdns_queries; q; q=q->next) q->server=0 ;
+
+  pthread_mutex_unlock(&_netdns_mutex) ;
+  return ok ;
+}
+
+
+//
+// @brief Set query timeout and retries
+// @param(in) timeoutms Time to wait for each server to reply, in milliseconds
+// @param(in) attempts Number of times each server is tried
+// @return true on success
+//
+
+int netresolve_timeout(int timeoutms, int attempts)
+{
+  if (timeoutms<1 || attempts<1) return 0 ;
+  pthread_mutex_lock(&_netdns_mutex) ;
+  _netdns_loadconf() ;
+  _netdns_timeout = timeoutms ;
+  _netdns_attempts = attempts ;
+  pthread_mutex_unlock(&_netdns_mutex) ;
+  return 1 ;
+}
+
+
+//
+// @brief Configure address cache
+// @param(in) ttl Maximum seconds to cache any lookup result (default 3600)
+// @param(in) negativettl Seconds to cache failed lookups whose reply had no
+//            SOA record, or which got no reply (default 10)
+// @return true on success
+//
+
+int netresolve_config(int ttl, int negativettl)
+{
+  if (ttl<0 || negativettl<0) return 0 ;
+  pthread_mutex_lock(&_netdns_mutex) ;
+  _netdns_ttl = ttl ;
+  _netdns_negativettl = negativettl ;
+  pthread_mutex_unlock(&_netdns_mutex) ;
+  return 1 ;
+}
+
+
+//
+// @brief Obtain resolver cache statistics
+// @param(out) hits Lookups answered from the cache (or NULL)
+// @param(out) misses Lookups which started a query (or NULL)
+// @param(out) coalesced Lookups which joined a query in progress (or NULL)
+// @return Number of names cached
+//
+
+int netresolve_stats(unsigned long *hits, unsigned long *misses, unsigned long *coalesced)
+{
+  pthread_mutex_lock(&_netdns_mutex) ;
+  if (hits) *hits = _netdns_hits ;
+  if (misses) *misses = _netdns_misses ;
+  if (coalesced) *coalesced = _netdns_coalesced ;
+  int count = _netdns_cachecount ;
+  pthread_mutex_unlock(&_netdns_mutex) ;
+  return count ;
+}
+
+
+//
+// @brief Obtain resolver query statistics
+// @param(out) queries Query messages sent over UDP (or NULL)
+// @param(out) retries Lookups retried after a timeout or server failure (or NULL)
+// @param(out) tcp Queries retried over TCP after truncation (or NULL)
+// @param(out) latencyms Total time taken by completed lookups, in ms (or NULL)
+// @return Number of lookups in progress
+//
+
+int netresolve_querystats(unsigned long *queries, unsigned long *retries,
+                          unsigned long *tcp, unsigned long *latencyms)
+{
+  int count=0 ;
+  pthread_mutex_lock(&_netdns_mutex) ;
+  if (queries) *queries = _netdns_sent ;
+  if (retries) *retries = _netdns_retries ;
+  if (tcp) *tcp = _netdns_tcp ;
+  if (latencyms) *latencyms = _netdns_latency ;
+  for (NETDNS_QUERY *q=_netdns_queries; q; q=q->next) count++ ;
+  pthread_mutex_unlock(&_netdns_mutex) ;
+  return count ;
+}
@@ -0,0 +1,364 @@
+//
+// httpc_bench.c
+//
+// Benchmark and tests for the HTTP client
+//
+//   httpc_bench [port [requests]]
+//
+// NOTES
+//
+// The client is driven against two servers on loopback:
+//
+//  httpd_loop   (on port) closes every HTTP/1.1 connection after its
+//               response, so each request takes a new connection.  The
+//               tests check responses are complete, and that closed
+//               connections never go back to the pool.
+//
+//  keep-alive   (on port+1) a small server in this program, which keeps
+//               connections open and sends every body with chunked
+//               transfer coding (with chunk extensions and a trailer).
+//               It is used for the pipelining, chunked decoding and
+//               connection pool tests.
+//
+// The request rate is reported for one request per connection (httpd_loop),
+// one request at a time on a pooled connection, and pipelined requests.
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../httpd.h"
+#include "../httpc.h"
+
+#define PIPELINE 16
+
+int port=18942 ;
+int numrequests=2000 ;
+int stop=0 ;
+int failures=0 ;
+
+#define CHECK(cond, msg) \
+  if (!(cond)) { fprintf(stderr, "httpc_bench: %s (line %d)\n", msg, __LINE__) ; failures++ ; }
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Fill body for request number n: n+1 bytes, cycling through
+//        the alphabet from a letter chosen by n
+//
+
+void fillbody(char *buf, int n)
+{
+  for (int i=0; i<=n; i++) buf[i] = 'a' + (n+i)%26 ;
+}
+
+
+int checkbody(HTTPC *hc, int n)
+{
+  int len ;
+  char *body = httpc_body(hc, &len) ;
+  if (!body || len!=n+1) return 0 ;
+  for (int i=0; i<=n; i++) {
+    if (body[i] != 'a' + (n+i)%26) return 0 ;
+  }
+  return 1 ;
+}
+
+
+int requestnumber(char *path)
+{
+  char *p = strstr(path, "n=") ;
+  return p ? atoi(&p[2]) : 0 ;
+}
+
+
+long long now()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return ts.tv_sec*1000LL + ts.tv_nsec/1000000 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// httpd_loop server
+//
+
+void handler(HTTPD *hh, int code)
+{
+  static char body[65536] ;
+  char *uri = hgeturi(hh) ;
+  char *n = hgeturiparamstr(hh, "n") ;
+
+  if (code==200 && uri && n && atoi(n)>=0 && atoi(n)<(int)sizeof(body)) {
+    fillbody(body, atoi(n)) ;
+    hsendb(hh, 200, "text/plain", body, atoi(n)+1) ;
+  } else {
+    hsend(hh, (code==200) ? 404 : code, NULL, NULL) ;
+  }
+}
+
+
+void *loopserver(void *arg)
+{
+  while (!stop) httpd_loop_run(10) ;
+  return NULL ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// Keep-alive server, sending chunked responses
+//
+
+int sendall(int fd, char *buf, int len)
+{
+  int n=0, r ;
+  while (n<len && (r=send(fd, &buf[n], len-n, MSG_NOSIGNAL))>0) n+=r ;
+  return n==len ;
+}
+
+
+void *kaconnection(void *arg)
+{
+  int fd = (int)(long)arg ;
+  char *in = malloc(65536) ;
+  char *out = malloc(256*1024) ;
+  char body[65536] ;
+  int inlen=0 ;
+
+  for (;;) {
+
+    // Answer each complete request in the buffer, in one write
+
+    int outlen=0 ;
+    char *end ;
+    while ((end=memmem(in, inlen, "\r\n\r\n", 4))) {
+
+      *end='\0' ;
+      int n = requestnumber(in) ;
+      if (n<0 || n>=(int)sizeof(body)) n=0 ;
+      fillbody(body, n) ;
+
+      outlen += sprintf(&out[outlen], "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                        "Transfer-Encoding: chunked\r\n\r\n") ;
+      for (int p=0; p<=n; p+=700) {
+        int len = (n+1-p < 700) ? n+1-p : 700 ;
+        outlen += sprintf(&out[outlen], p ? "%x\r\n" : "%x;first=1\r\n", len) ;
+        memcpy(&out[outlen], &body[p], len) ;
+        outlen += len ;
+        out[outlen++]='\r' ;
+        out[outlen++]='\n' ;
+      }
+      outlen += sprintf(&out[outlen], "0\r\nX-Trailer: %d\r\n\r\n", n) ;
+
+      int used = (end+4)-in ;
+      memmove(in, end+4, inlen-used) ;
+      inlen -= used ;
+
+      if (outlen > 128*1024) break ;
+
+    }
+
+    if (outlen && !sendall(fd, out, outlen)) break ;
+    if (memmem(in, inlen, "\r\n\r\n", 4)) continue ;
+
+    int r = recv(fd, &in[inlen], 65536-inlen, 0) ;
+    if (r<=0) break ;
+    inlen += r ;
+
+  }
+
+  close(fd) ;
+  free(in) ;
+  free(out) ;
+  return NULL ;
+}
+
+
+void *kaserver(void *arg)
+{
+  int listenfd = (int)(long)arg ;
+  for (;;) {
+    int fd = accept(listenfd, NULL, NULL) ;
+    if (fd<0) break ;
+    pthread_t tid ;
+    pthread_create(&tid, NULL, kaconnection, (void *)(long)fd) ;
+    pthread_detach(tid) ;
+  }
+  return NULL ;
+}
+
+
+int kalisten(int port)
+{
+  struct sockaddr_in sa ;
+  memset(&sa, 0, sizeof(sa)) ;
+  sa.sin_family = AF_INET ;
+  sa.sin_port = htons(port) ;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK) ;
+
+  int on=1 ;
+  int fd = socket(AF_INET, SOCK_STREAM, 0) ;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ;
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa))<0 || listen(fd, 16)<0) {
+    close(fd) ;
+    return -1 ;
+  }
+  return fd ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// Tests
+//
+
+void report(char *name, int requests, long long start)
+{
+  long long elapsed = now()-start ;
+  if (elapsed<1) elapsed=1 ;
+  printf("%-28s %6d requests  %8.0f req/s\n", name, requests, requests*1000.0/elapsed) ;
+}
+
+
+//
+// @brief Requests to httpd_loop, which closes each connection
+//
+
+void testloop()
+{
+  char path[64] ;
+  unsigned long hits0, hits ;
+
+  netpoolstats(&hits0, NULL) ;
+
+  long long start = now() ;
+  int ok=1 ;
+  for (int i=0; i<numrequests && ok; i++) {
+    HTTPC *hc = httpc_open("127.0.0.1", port, 0) ;
+    int n = i%2000 ;
+    sprintf(path, "/data?n=%d", n) ;
+    ok = hc && httpc_send(hc, "GET", path, NULL, NULL, 0) &&
+         httpc_recv(hc)==200 && checkbody(hc, n) ;
+    httpc_close(hc) ;
+  }
+  report("httpd_loop, new connections", numrequests, start) ;
+  CHECK(ok, "bad response from httpd_loop") ;
+
+  netpoolstats(&hits, NULL) ;
+  CHECK(hits==hits0, "connection closed by httpd_loop was taken from the pool") ;
+}
+
+
+//
+// @brief Keep-alive connections: chunked bodies, pooling and pipelining
+//
+
+void testkeepalive(int kaport)
+{
+  char path[64] ;
+  unsigned long hits0, hits ;
+
+  // Chunked bodies, of one chunk and of many, with the trailer skipped
+
+  HTTPC *hc = httpc_open("127.0.0.1", kaport, 0) ;
+  CHECK(hc, "httpc_open failed") ;
+  int sizes[] = { 0, 699, 700, 701, 5000, 60000 } ;
+  for (int i=0; i<6; i++) {
+    sprintf(path, "/chunked?n=%d", sizes[i]) ;
+    CHECK(httpc_send(hc, "GET", path, NULL, NULL, 0) && httpc_recv(hc)==200,
+          "chunked request failed") ;
+    CHECK(checkbody(hc, sizes[i]), "chunked body decoded wrongly") ;
+  }
+  httpc_close(hc) ;
+
+  // Connection goes back to the pool, and is taken from it again
+
+  long long start = now() ;
+  netpoolstats(&hits0, NULL) ;
+  int ok=1 ;
+  for (int i=0; i<numrequests && ok; i++) {
+    hc = httpc_open("127.0.0.1", kaport, 0) ;
+    sprintf(path, "/pooled?n=%d", i%1000) ;
+    ok = hc && httpc_send(hc, "GET", path, NULL, NULL, 0) &&
+         httpc_recv(hc)==200 && checkbody(hc, i%1000) ;
+    httpc_close(hc) ;
+  }
+  netpoolstats(&hits, NULL) ;
+  report("keep-alive, pooled", numrequests, start) ;
+  CHECK(ok, "bad response on pooled connection") ;
+  CHECK(hits-hits0 == (unsigned long)numrequests, "pooled connection not reused") ;
+
+  // Pipelined requests answered in order
+
+  start = now() ;
+  hc = httpc_open("127.0.0.1", kaport, 0) ;
+  CHECK(hc, "httpc_open failed") ;
+  ok=1 ;
+  for (int i=0; i<numrequests && ok; i+=PIPELINE) {
+    for (int j=0; j<PIPELINE; j++) {
+      sprintf(path, "/pipelined?n=%d", (i+j)%1000) ;
+      ok = ok && httpc_send(hc, "GET", path, NULL, NULL, 0) ;
+    }
+    CHECK(httpc_pending(hc)==PIPELINE, "pipelined requests not outstanding") ;
+    for (int j=0; j<PIPELINE && ok; j++) {
+      ok = httpc_recv(hc)==200 && checkbody(hc, (i+j)%1000) ;
+    }
+  }
+  httpc_close(hc) ;
+  report("keep-alive, pipelined", numrequests, start) ;
+  CHECK(ok, "pipelined responses wrong or out of order") ;
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc>1) port = atoi(argv[1]) ;
+  if (argc>2) numrequests = atoi(argv[2]) ;
+  if (numrequests<PIPELINE) numrequests=PIPELINE ;
+  numrequests -= numrequests%PIPELINE ;
+
+  netinit() ;
+
+  if (httpd_init(port)<0 || httpd_loop_init(HTTPD_BACKEND_AUTO, handler)<0) {
+    fprintf(stderr, "httpc_bench: unable to start httpd_loop on port %d\n", port) ;
+    return 1 ;
+  }
+
+  int kafd = kalisten(port+1) ;
+  if (kafd<0) {
+    fprintf(stderr, "httpc_bench: unable to listen on port %d\n", port+1) ;
+    return 1 ;
+  }
+
+  pthread_t looptid, katid ;
+  pthread_create(&looptid, NULL, loopserver, NULL) ;
+  pthread_create(&katid, NULL, kaserver, (void *)(long)kafd) ;
+
+  testloop() ;
+  testkeepalive(port+1) ;
+
+  stop=1 ;
+  pthread_join(looptid, NULL) ;
+  httpd_loop_shutdown() ;
+  httpd_shutdown() ;
+  shutdown(kafd, SHUT_RDWR) ;
+  pthread_join(katid, NULL) ;
+  close(kafd) ;
+  netpoolflush() ;
+
+  printf("httpc_bench: %s\n", failures ? "FAILED" : "passed") ;
+  return failures ? 1 : 0 ;
+}
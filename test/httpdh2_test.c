@@ -0,0 +1,210 @@
+//
+// httpdh2_test.c
+//
+// Tests for HTTP/2 header compression in the httpd server
+//
+//   httpdh2_test [port]
+//
+// NOTES
+//
+// A client on loopback talks h2c with prior knowledge to httpd_loop
+// (epoll, as io_uring may hold the listener open after exit),
+// writing its header blocks by hand.  The handler answers 200 if the
+// request has the test header, and 404 if not.
+//
+// The test header's name refers to a dynamic table entry which is
+// evicted by adding the new entry (RFC 7541 4.4): the first request adds
+// a large entry, the second adds it again by index with an empty value,
+// so evicting the first, and the third sends the new entry by index.
+// The test is built with AddressSanitizer, which reports the evicted
+// name being read after it has been freed.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../httpd.h"
+
+#define NAMELEN 1100
+#define VALUELEN 2000
+
+int port=18961 ;
+int stop=0 ;
+int failures=0 ;
+char name[NAMELEN+1] ;
+
+#define CHECK(cond, msg) \
+  if (!(cond)) { fprintf(stderr, "httpdh2_test: %s (line %d)\n", msg, __LINE__) ; failures++ ; }
+
+
+// Sessions still open when the loop is shut down aren't freed, so
+// leaks aren't reported
+
+const char *__asan_default_options()
+{
+  return "detect_leaks=0" ;
+}
+
+
+void handler(HTTPD *hh, int code)
+{
+  if (code==200 && hgetheader(hh, name)) hsend(hh, 200, "text/plain", "ok") ;
+  else hsend(hh, (code==200) ? 404 : code, NULL, NULL) ;
+}
+
+
+void *loopserver(void *arg)
+{
+  while (!stop) httpd_loop_run(10) ;
+  return NULL ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// Client
+//
+
+int sendframe(int fd, int type, int flags, int id, unsigned char *payload, int len)
+{
+  unsigned char hdr[9] = { len>>16, len>>8, len, type, flags, id>>24, id>>16, id>>8, id } ;
+  return send(fd, hdr, 9, MSG_NOSIGNAL)==9 &&
+         (len==0 || send(fd, payload, len, MSG_NOSIGNAL)==len) ;
+}
+
+
+int readall(int fd, unsigned char *buf, int len)
+{
+  int n=0, r ;
+  while (n<len) {
+    struct pollfd pfd = { fd, POLLIN, 0 } ;
+    if (poll(&pfd, 1, 2000)<=0 || (r=recv(fd, &buf[n], len-n, 0))<=0) return 0 ;
+    n+=r ;
+  }
+  return 1 ;
+}
+
+
+//
+// @brief Add string literal, without Huffman coding
+//
+
+int putstr(unsigned char *b, int p, char *s, int len)
+{
+  if (len<127) {
+    b[p++] = len ;
+  } else {
+    b[p++] = 127 ;
+    for (len-=127; len>=128; len>>=7) b[p++] = (len & 0x7f) | 0x80 ;
+    b[p++] = len ;
+  }
+  memcpy(&b[p], s, strlen(s)) ;
+  return p+strlen(s) ;
+}
+
+
+//
+// @brief Send request on stream, with GET / and the given header field
+//        representation, returning the status byte of the response
+//
+
+int request(int fd, int id, unsigned char *field, int fieldlen)
+{
+  unsigned char block[8192] ;
+  unsigned char frame[16384] ;
+
+  int len=0 ;
+  block[len++] = 0x82 ;  // :method GET
+  block[len++] = 0x86 ;  // :scheme http
+  block[len++] = 0x84 ;  // :path /
+  memcpy(&block[len], field, fieldlen) ;
+  len += fieldlen ;
+
+  if (!sendframe(fd, 1, 0x05, id, block, len)) return -1 ;
+
+  // Skip other frames until the response headers arrive
+
+  for (;;) {
+    unsigned char hdr[9] ;
+    if (!readall(fd, hdr, 9)) return -1 ;
+    int flen = (hdr[0]<<16) | (hdr[1]<<8) | hdr[2] ;
+    int fid = ((hdr[5]&0x7f)<<24) | (hdr[6]<<16) | (hdr[7]<<8) | hdr[8] ;
+    if (flen>(int)sizeof(frame) || !readall(fd, frame, flen)) return -1 ;
+    if (hdr[3]==7) return -1 ;                             // GOAWAY
+    if (hdr[3]==1 && fid==id && flen>0) return frame[0] ;  // HEADERS
+  }
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc>1) port = atoi(argv[1]) ;
+
+  memset(name, 'x', NAMELEN) ;
+  memcpy(name, "x-", 2) ;
+  name[NAMELEN]='\0' ;
+
+  if (httpd_init(port)<0 || !httpd_h2_enable(1) || httpd_loop_init(HTTPD_BACKEND_EPOLL, handler)<0) {
+    fprintf(stderr, "httpdh2_test: unable to start httpd_loop on port %d\n", port) ;
+    return 1 ;
+  }
+
+  pthread_t tid ;
+  pthread_create(&tid, NULL, loopserver, NULL) ;
+
+  struct sockaddr_in sa ;
+  memset(&sa, 0, sizeof(sa)) ;
+  sa.sin_family = AF_INET ;
+  sa.sin_port = htons(port) ;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK) ;
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0) ;
+  CHECK(fd>=0 && connect(fd, (struct sockaddr *)&sa, sizeof(sa))==0, "connect failed") ;
+
+  char *preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" ;
+  CHECK(send(fd, preface, strlen(preface), MSG_NOSIGNAL)==(int)strlen(preface) &&
+        sendframe(fd, 4, 0, 0, NULL, 0), "preface not sent") ;
+
+  unsigned char field[4096] ;
+  char value[VALUELEN+1] ;
+  memset(value, 'v', VALUELEN) ;
+  value[VALUELEN]='\0' ;
+
+  // Literal with incremental indexing, new name: becomes entry 62
+
+  int len=0 ;
+  field[len++] = 0x40 ;
+  len = putstr(field, len, name, NAMELEN) ;
+  len = putstr(field, len, value, VALUELEN) ;
+  CHECK(request(fd, 1, field, len)==0x88, "large header not received") ;
+
+  // Literal with incremental indexing, name from entry 62, which is
+  // evicted to make room for the new entry
+
+  len=0 ;
+  field[len++] = 0x40 | 62 ;
+  len = putstr(field, len, "", 0) ;
+  CHECK(request(fd, 3, field, len)==0x88, "header named by evicted entry not received") ;
+
+  // Indexed: the new entry
+
+  field[0] = 0x80 | 62 ;
+  CHECK(request(fd, 5, field, 1)==0x88, "header from new entry not received") ;
+
+  close(fd) ;
+  stop=1 ;
+  pthread_join(tid, NULL) ;
+  httpd_loop_shutdown() ;
+  httpd_shutdown() ;
+
+  printf("httpdh2_test: %s\n", failures ? "FAILED" : "passed") ;
+  return failures ? 1 : 0 ;
+}
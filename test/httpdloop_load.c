@@ -0,0 +1,290 @@
+//
+// httpdloop_load.c
+//
+// Loopback load test for the httpd_loop backends
+//
+//   httpdloop_load [port [clients [requests]]]
+//
+// NOTES
+//
+// Each backend in turn serves a number of client threads, which make
+// Connection: close requests over loopback as fast as they can.  The
+// request rate and the loop's system calls per request (httpd_loop_stats)
+// are reported for each.
+//
+// io_uring is run twice, the second time with multishot accept refused
+// by the kernel (as before Linux 5.19), to check the loop falls back to
+// re-arming a single accept.
+//
+// Each run ends with clients which reset their connection part way
+// through a large response.  The failed send cancels the linked close,
+// which must be retried, so the run checks no descriptors are left open.
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../httpd.h"
+
+#define BIGLEN (1024*1024)
+
+// Set to have multishot accept refused (see httpdloop.c)
+
+extern int _httpd_loop_nomultishot ;
+
+int port=18931 ;
+int numclients=8 ;
+int numrequests=2000 ;
+
+char *bigbody ;
+int failures=0 ;
+int finished=0 ;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER ;
+
+
+void handler(HTTPD *hh, int code)
+{
+  char *uri = hgeturi(hh) ;
+  if (code==200 && uri && strcmp(uri, "/big")==0) {
+    hsendb(hh, 200, "application/octet-stream", bigbody, BIGLEN) ;
+  } else if (code==200) {
+    hsend(hh, 200, "text/plain", "ok") ;
+  } else {
+    hsend(hh, code, NULL, NULL) ;
+  }
+}
+
+
+void fail(char *msg)
+{
+  pthread_mutex_lock(&lock) ;
+  if (failures++ < 10) fprintf(stderr, "httpdloop_load: %s\n", msg) ;
+  pthread_mutex_unlock(&lock) ;
+}
+
+
+int clientconnect(int rcvbuf)
+{
+  struct sockaddr_in sa ;
+  memset(&sa, 0, sizeof(sa)) ;
+  sa.sin_family = AF_INET ;
+  sa.sin_port = htons(port) ;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK) ;
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0) ;
+  if (fd<0) return -1 ;
+  if (rcvbuf>0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) ;
+  if (connect(fd, (struct sockaddr *)&sa, sizeof(sa))<0) {
+    close(fd) ;
+    return -1 ;
+  }
+  return fd ;
+}
+
+
+int sendrequest(int fd, char *uri)
+{
+  char req[128] ;
+  int len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", uri) ;
+  return send(fd, req, len, MSG_NOSIGNAL)==len ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Make one request, reading the response until the server closes
+// @param[in] uri URI to request
+// @param[in] bodylen Expected length of the response body
+// @return true if the expected response arrived
+//
+
+int request(char *uri, int bodylen)
+{
+  static __thread char *buf ;
+  int bufsz = BIGLEN+4096 ;
+  if (!buf) buf = malloc(bufsz) ;
+
+  int fd = clientconnect(0) ;
+  if (fd<0) return 0 ;
+
+  int len=0, r=0 ;
+  if (sendrequest(fd, uri)) {
+    while (len<bufsz && (r=recv(fd, &buf[len], bufsz-len, 0))>0) len+=r ;
+  }
+  close(fd) ;
+
+  if (r<0 || len<12 || memcmp(buf, "HTTP/1.1 200", 12)!=0) return 0 ;
+  char *body = memmem(buf, len, "\r\n\r\n", 4) ;
+  return body && (&buf[len]-(body+4))==bodylen ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Request a large response, then reset the connection once it
+//        starts to arrive
+//
+
+void resetrequest()
+{
+  int fd = clientconnect(4096) ;
+  if (fd<0) {
+    fail("connect failed") ;
+    return ;
+  }
+
+  char buf[4096] ;
+  if (sendrequest(fd, "/big") && recv(fd, buf, sizeof(buf), 0)>0) {
+    struct linger lg = { 1, 0 } ;
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg)) ;
+  } else {
+    fail("reset request failed") ;
+  }
+  close(fd) ;
+}
+
+
+void *client(void *arg)
+{
+  int n = (int)(long)arg ;
+  for (int i=0; i<n; i++) {
+    if (!request("/small", 2)) fail("bad response to /small") ;
+  }
+  if (!request("/big", BIGLEN)) fail("bad response to /big") ;
+  resetrequest() ;
+
+  pthread_mutex_lock(&lock) ;
+  finished++ ;
+  pthread_mutex_unlock(&lock) ;
+  return NULL ;
+}
+
+
+int countfds()
+{
+  int n=0 ;
+  DIR *d = opendir("/proc/self/fd") ;
+  if (!d) return -1 ;
+  while (readdir(d)) n++ ;
+  closedir(d) ;
+  return n ;
+}
+
+
+long long now()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return ts.tv_sec*1000LL + ts.tv_nsec/1000000 ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Run load against one backend
+// @param[in] backend Backend to test
+// @param[in] name Name to report
+// @return false on failure
+//
+
+int run(enum httpd_backend backend, char *name)
+{
+  if (httpd_loop_init(backend, handler)!=backend) {
+    printf("%-24s unavailable\n", name) ;
+    httpd_loop_shutdown() ;
+    return 1 ;
+  }
+
+  int fds = countfds() ;
+  failures=0 ;
+  finished=0 ;
+
+  pthread_t *tids = calloc(numclients, sizeof(pthread_t)) ;
+  long long start = now() ;
+  for (int i=0; i<numclients; i++) {
+    pthread_create(&tids[i], NULL, client, (void *)(long)(numrequests/numclients)) ;
+  }
+
+  // Serve until the clients are done, then let the last closes complete
+
+  int done=0 ;
+  while (!done) {
+    httpd_loop_run(10) ;
+    pthread_mutex_lock(&lock) ;
+    done = (finished==numclients) ;
+    pthread_mutex_unlock(&lock) ;
+  }
+  long long elapsed = now()-start ;
+
+  long requests, syscalls ;
+  httpd_loop_stats(&requests, &syscalls) ;
+
+  for (int i=0; i<50 && countfds()>fds; i++) httpd_loop_run(10) ;
+  int leaked = countfds()-fds ;
+
+  for (int i=0; i<numclients; i++) pthread_join(tids[i], NULL) ;
+  free(tids) ;
+  httpd_loop_shutdown() ;
+
+  if (elapsed<1) elapsed=1 ;
+  printf("%-24s %6ld requests  %8.0f req/s  %5.2f syscalls/request\n", name,
+         requests, requests*1000.0/elapsed, requests ? (double)syscalls/requests : 0.0) ;
+
+  if (leaked>0) {
+    fprintf(stderr, "httpdloop_load: %s left %d descriptors open\n", name, leaked) ;
+    return 0 ;
+  }
+  if (failures) {
+    fprintf(stderr, "httpdloop_load: %s had %d failed requests\n", name, failures) ;
+    return 0 ;
+  }
+  return 1 ;
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc>1) port = atoi(argv[1]) ;
+  if (argc>2) numclients = atoi(argv[2]) ;
+  if (argc>3) numrequests = atoi(argv[3]) ;
+  if (numclients<1) numclients=1 ;
+
+  bigbody = malloc(BIGLEN) ;
+  memset(bigbody, 'x', BIGLEN) ;
+
+  // A small send buffer keeps large responses from fitting into the
+  // socket buffers, so a reset arrives while the server is still sending
+
+  NETOPTS opts ;
+  memset(&opts, 0, sizeof(opts)) ;
+  opts.sndbuf = 65536 ;
+
+  if (httpd_initopts(port, &opts)<0) {
+    fprintf(stderr, "httpdloop_load: unable to listen on port %d\n", port) ;
+    return 1 ;
+  }
+
+  int ok=1 ;
+  ok &= run(HTTPD_BACKEND_EPOLL, "epoll") ;
+  ok &= run(HTTPD_BACKEND_URING, "io_uring") ;
+  _httpd_loop_nomultishot=1 ;
+  ok &= run(HTTPD_BACKEND_URING, "io_uring (no multishot)") ;
+  _httpd_loop_nomultishot=0 ;
+
+  httpd_shutdown() ;
+  free(bigbody) ;
+
+  printf("httpdloop_load: %s\n", ok ? "passed" : "FAILED") ;
+  return ok ? 0 : 1 ;
+}
@@ -0,0 +1,416 @@
+//
+// netdns_test.c
+//
+// Tests for the stub resolver, against a stub DNS server on loopback
+//
+//   netdns_test [port]
+//
+// NOTES
+//
+// The server answers UDP and TCP queries on 127.0.0.1 for a few names
+// under .test, and counts the questions it is asked, so that the tests
+// can tell which lookups reached it:
+//
+//   ttl.test       A 192.0.2.1, TTL 1s (AAAA has no data, SOA minimum 1s)
+//   missing.test   NXDOMAIN, with SOA minimum 1s
+//   slow.test      A 192.0.2.2, replying after 200ms
+//   big.test       Truncated over UDP, ten A records over TCP
+//   alias.test     CNAME mid.test, CNAME target.test, A 192.0.2.3
+//   failover.test  A 192.0.2.4
+//
+// The resolver is pointed at the server with netresolve_servers, giving
+// its port, and for the last test behind a server which isn't there.
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../net.h"
+
+#define A 1
+#define CNAME 5
+#define SOA 6
+#define AAAA 28
+
+char *names[] = { "ttl.test", "missing.test", "slow.test", "big.test",
+                  "alias.test", "failover.test", NULL } ;
+
+int udpqueries[8] ;
+int tcpqueries[8] ;
+int stop=0 ;
+int failures=0 ;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER ;
+
+#define CHECK(cond, msg) \
+  if (!(cond)) { fprintf(stderr, "netdns_test: %s (line %d)\n", msg, __LINE__) ; failures++ ; }
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// Stub server
+//
+
+int putname(unsigned char *b, int p, char *name)
+{
+  while (*name) {
+    char *dot = strchr(name, '.') ;
+    int len = dot ? (dot-name) : strlen(name) ;
+    b[p++] = len ;
+    memcpy(&b[p], name, len) ;
+    p+=len ;
+    name+=len ;
+    if (*name=='.') name++ ;
+  }
+  b[p++] = 0 ;
+  return p ;
+}
+
+
+int putrr(unsigned char *b, int p, char *name, int type, unsigned int ttl, unsigned char *rdata, int rdlen)
+{
+  p = putname(b, p, name) ;
+  b[p++] = type>>8 ;
+  b[p++] = type&0xFF ;
+  b[p++] = 0 ;
+  b[p++] = 1 ;
+  b[p++] = ttl>>24 ;
+  b[p++] = (ttl>>16)&0xFF ;
+  b[p++] = (ttl>>8)&0xFF ;
+  b[p++] = ttl&0xFF ;
+  b[p++] = rdlen>>8 ;
+  b[p++] = rdlen&0xFF ;
+  memcpy(&b[p], rdata, rdlen) ;
+  return p+rdlen ;
+}
+
+
+int putsoa(unsigned char *b, int p, unsigned int minimum)
+{
+  unsigned char rdata[64] ;
+  int n = putname(rdata, 0, "ns.test") ;
+  n = putname(rdata, n, "admin.test") ;
+  unsigned int v[5] = { 1, 3600, 600, 86400, minimum } ;
+  for (int i=0; i<5; i++) {
+    rdata[n++] = v[i]>>24 ;
+    rdata[n++] = (v[i]>>16)&0xFF ;
+    rdata[n++] = (v[i]>>8)&0xFF ;
+    rdata[n++] = v[i]&0xFF ;
+  }
+  return putrr(b, p, "test", SOA, 60, rdata, n) ;
+}
+
+
+int puta(unsigned char *b, int p, char *name, unsigned int ttl, char *ip)
+{
+  unsigned char addr[4] ;
+  inet_pton(AF_INET, ip, addr) ;
+  return putrr(b, p, name, A, ttl, addr, 4) ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Build reply to query
+// @param[in] q Query message
+// @param[in] qlen Length of query
+// @param[out] r Reply message
+// @param[in] tcp True if query arrived over TCP
+// @return Length of reply, or 0 to ignore the query
+//
+
+int answer(unsigned char *q, int qlen, unsigned char *r, int tcp)
+{
+  char qname[256] ;
+  int p=12, n=0 ;
+
+  if (qlen<17) return 0 ;
+  while (q[p] && p<qlen) {
+    int len = q[p] ;
+    if (n) qname[n++]='.' ;
+    memcpy(&qname[n], &q[p+1], len) ;
+    n+=len ;
+    p+=len+1 ;
+  }
+  qname[n]='\0' ;
+  p++ ;
+  if (p+4>qlen) return 0 ;
+  int qtype = (q[p]<<8) | q[p+1] ;
+  p+=4 ;
+
+  int zone ;
+  for (zone=0; names[zone] && strcmp(names[zone], qname)!=0; zone++) ;
+
+  pthread_mutex_lock(&lock) ;
+  if (names[zone]) {
+    if (tcp) tcpqueries[zone]++ ;
+    else udpqueries[zone]++ ;
+  }
+  pthread_mutex_unlock(&lock) ;
+
+  // Header and question
+
+  memcpy(r, q, p) ;
+  r[2] = 0x81 ;
+  r[3] = 0x80 ;
+  memset(&r[6], 0, 6) ;
+
+  int an=0, ns=0 ;
+
+  if (!names[zone] || strcmp(qname, "missing.test")==0) {
+    r[3] |= 3 ;
+    p = putsoa(r, p, 1) ;
+    ns++ ;
+  } else if (strcmp(qname, "big.test")==0 && !tcp) {
+    r[2] |= 0x02 ;
+  } else if (qtype!=A) {
+    p = putsoa(r, p, 1) ;
+    ns++ ;
+  } else if (strcmp(qname, "ttl.test")==0) {
+    p = puta(r, p, qname, 1, "192.0.2.1") ;
+    an++ ;
+  } else if (strcmp(qname, "slow.test")==0) {
+    usleep(200000) ;
+    p = puta(r, p, qname, 60, "192.0.2.2") ;
+    an++ ;
+  } else if (strcmp(qname, "big.test")==0) {
+    for (int i=0; i<10; i++) {
+      char ip[16] ;
+      sprintf(ip, "192.0.2.%d", 10+i) ;
+      p = puta(r, p, qname, 60, ip) ;
+      an++ ;
+    }
+  } else if (strcmp(qname, "alias.test")==0) {
+    unsigned char target[32] ;
+    p = putrr(r, p, "alias.test", CNAME, 60, target, putname(target, 0, "mid.test")) ;
+    p = putrr(r, p, "mid.test", CNAME, 60, target, putname(target, 0, "target.test")) ;
+    p = puta(r, p, "target.test", 60, "192.0.2.3") ;
+    an+=3 ;
+  } else if (strcmp(qname, "failover.test")==0) {
+    p = puta(r, p, qname, 60, "192.0.2.4") ;
+    an++ ;
+  }
+
+  r[7] = an ;
+  r[9] = ns ;
+  return p ;
+}
+
+
+int readall(int fd, unsigned char *buf, int len)
+{
+  int n=0, r ;
+  while (n<len && (r=recv(fd, &buf[n], len-n, 0))>0) n+=r ;
+  return n==len ;
+}
+
+
+void *server(void *arg)
+{
+  int port = (int)(long)arg ;
+  struct sockaddr_in sa ;
+  memset(&sa, 0, sizeof(sa)) ;
+  sa.sin_family = AF_INET ;
+  sa.sin_port = htons(port) ;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK) ;
+
+  int on=1 ;
+  int udpfd = socket(AF_INET, SOCK_DGRAM, 0) ;
+  int tcpfd = socket(AF_INET, SOCK_STREAM, 0) ;
+  setsockopt(tcpfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ;
+  if (bind(udpfd, (struct sockaddr *)&sa, sizeof(sa))<0 ||
+      bind(tcpfd, (struct sockaddr *)&sa, sizeof(sa))<0 || listen(tcpfd, 8)<0) {
+    perror("netdns_test: stub server") ;
+    exit(1) ;
+  }
+
+  unsigned char q[512], r[2+4096] ;
+
+  while (!stop) {
+
+    struct pollfd pfd[2] = { { udpfd, POLLIN, 0 }, { tcpfd, POLLIN, 0 } } ;
+    if (poll(pfd, 2, 100)<=0) continue ;
+
+    if (pfd[0].revents & POLLIN) {
+      struct sockaddr_in from ;
+      socklen_t fromlen = sizeof(from) ;
+      int len = recvfrom(udpfd, q, sizeof(q), 0, (struct sockaddr *)&from, &fromlen) ;
+      int rlen = (len>0) ? answer(q, len, r, 0) : 0 ;
+      if (rlen>0) sendto(udpfd, r, rlen, 0, (struct sockaddr *)&from, fromlen) ;
+    }
+
+    if (pfd[1].revents & POLLIN) {
+      int fd = accept(tcpfd, NULL, NULL) ;
+      unsigned char lenbuf[2] ;
+      if (fd>=0 && readall(fd, lenbuf, 2)) {
+        int len = (lenbuf[0]<<8) | lenbuf[1] ;
+        if (len<=sizeof(q) && readall(fd, q, len)) {
+          int rlen = answer(q, len, &r[2], 1) ;
+          r[0] = rlen>>8 ;
+          r[1] = rlen&0xFF ;
+          if (rlen>0) send(fd, r, rlen+2, MSG_NOSIGNAL) ;
+        }
+      }
+      if (fd>=0) close(fd) ;
+    }
+
+  }
+
+  close(udpfd) ;
+  close(tcpfd) ;
+  return NULL ;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// Tests
+//
+
+int queries(char *name)
+{
+  int zone ;
+  for (zone=0; strcmp(names[zone], name)!=0; zone++) ;
+  pthread_mutex_lock(&lock) ;
+  int n = udpqueries[zone]+tcpqueries[zone] ;
+  pthread_mutex_unlock(&lock) ;
+  return n ;
+}
+
+
+int hasaddr(NETADDR *addrs, int naddrs, char *ip)
+{
+  unsigned char addr[4] ;
+  inet_pton(AF_INET, ip, addr) ;
+  for (int i=0; i<naddrs; i++) {
+    if (addrs[i].family==AF_INET && memcmp(addrs[i].addr, addr, 4)==0) return 1 ;
+  }
+  return 0 ;
+}
+
+
+typedef struct {
+  int done ;
+  int naddrs ;
+  NETADDR addrs[NET_MAXADDRS] ;
+} RESULT ;
+
+void result(void *arg, NETADDR *addrs, int naddrs)
+{
+  RESULT *r = arg ;
+  r->done = 1 ;
+  r->naddrs = naddrs ;
+  memcpy(r->addrs, addrs, naddrs*sizeof(NETADDR)) ;
+}
+
+
+int main(int argc, char *argv[])
+{
+  int port = (argc>1) ? atoi(argv[1]) : 18953 ;
+  char servers[64] ;
+  NETADDR addrs[NET_MAXADDRS] ;
+  unsigned long hits, hits0, coalesced, coalesced0, tcp, tcp0, retries, retries0 ;
+  int n ;
+
+  pthread_t tid ;
+  pthread_create(&tid, NULL, server, (void *)(long)port) ;
+  usleep(50000) ;
+
+  // Server given with its port
+
+  sprintf(servers, "127.0.0.1:%d", port) ;
+  CHECK(netresolve_servers(servers), "netresolve_servers refused server with port") ;
+  netresolve_timeout(500, 2) ;
+
+  // Positive result cached for the record's TTL
+
+  n = netresolve("ttl.test", addrs, NET_MAXADDRS) ;
+  CHECK(n==1 && hasaddr(addrs, n, "192.0.2.1"), "ttl.test not resolved") ;
+  CHECK(queries("ttl.test")==2, "ttl.test not queried for A and AAAA") ;
+
+  netresolve_stats(&hits0, NULL, NULL) ;
+  n = netresolve("ttl.test", addrs, NET_MAXADDRS) ;
+  netresolve_stats(&hits, NULL, NULL) ;
+  CHECK(n==1 && hasaddr(addrs, n, "192.0.2.1"), "cached ttl.test wrong") ;
+  CHECK(queries("ttl.test")==2 && hits==hits0+1, "ttl.test not answered from cache") ;
+
+  // Failure cached for the SOA minimum
+
+  n = netresolve("missing.test", addrs, NET_MAXADDRS) ;
+  CHECK(n==0, "missing.test resolved") ;
+  CHECK(queries("missing.test")==2, "missing.test not queried") ;
+  n = netresolve("missing.test", addrs, NET_MAXADDRS) ;
+  CHECK(n==0 && queries("missing.test")==2, "missing.test failure not cached") ;
+
+  // Both expire after a second
+
+  sleep(2) ;
+  n = netresolve("ttl.test", addrs, NET_MAXADDRS) ;
+  CHECK(n==1 && queries("ttl.test")==4, "ttl.test not queried again after TTL") ;
+  n = netresolve("missing.test", addrs, NET_MAXADDRS) ;
+  CHECK(n==0 && queries("missing.test")==4, "missing.test not queried again after SOA minimum") ;
+
+  // Simultaneous lookups share a query
+
+  RESULT r[5] ;
+  memset(r, 0, sizeof(r)) ;
+  netresolve_stats(NULL, NULL, &coalesced0) ;
+  for (int i=0; i<5; i++) {
+    CHECK(netresolve_start("slow.test", result, &r[i])==0, "slow.test lookup not started") ;
+  }
+  int pending=1 ;
+  while (pending) {
+    struct pollfd pfd = { netresolve_fd(), POLLIN, 0 } ;
+    poll(&pfd, 1, 1000) ;
+    netresolve_process() ;
+    pending=0 ;
+    for (int i=0; i<5; i++) pending = pending || !r[i].done ;
+  }
+  netresolve_stats(NULL, NULL, &coalesced) ;
+  for (int i=0; i<5; i++) {
+    CHECK(r[i].naddrs==1 && hasaddr(r[i].addrs, r[i].naddrs, "192.0.2.2"), "slow.test not resolved") ;
+  }
+  CHECK(queries("slow.test")==2, "slow.test lookups not coalesced") ;
+  CHECK(coalesced==coalesced0+4, "coalesced count wrong") ;
+
+  // Truncated reply retried over TCP
+
+  netresolve_querystats(NULL, NULL, &tcp0, NULL) ;
+  n = netresolve("big.test", addrs, NET_MAXADDRS) ;
+  netresolve_querystats(NULL, NULL, &tcp, NULL) ;
+  CHECK(n==10 && hasaddr(addrs, n, "192.0.2.10") && hasaddr(addrs, n, "192.0.2.19"), "big.test not resolved over TCP") ;
+  CHECK(tcp>tcp0 && tcpqueries[3]>0, "big.test not retried over TCP") ;
+
+  // CNAME chain followed within the answer
+
+  n = netresolve("alias.test", addrs, NET_MAXADDRS) ;
+  CHECK(n==1 && hasaddr(addrs, n, "192.0.2.3"), "alias.test CNAME chain not followed") ;
+
+  // Next server used when the first isn't there
+
+  sprintf(servers, "127.0.0.1:%d, 127.0.0.1:%d", port+1, port) ;
+  CHECK(netresolve_servers(servers), "netresolve_servers refused two servers") ;
+  netresolve_querystats(NULL, &retries0, NULL, NULL) ;
+  n = netresolve("failover.test", addrs, NET_MAXADDRS) ;
+  netresolve_querystats(NULL, &retries, NULL, NULL) ;
+  CHECK(n==1 && hasaddr(addrs, n, "192.0.2.4"), "failover.test not resolved by second server") ;
+  CHECK(retries>retries0, "failover.test not retried") ;
+
+  CHECK(!netresolve_servers("127.0.0.1:0"), "netresolve_servers accepted port 0") ;
+
+  stop=1 ;
+  pthread_join(tid, NULL) ;
+
+  printf("netdns_test: %s\n", failures ? "FAILED" : "passed") ;
+  return failures ? 1 : 0 ;
+}
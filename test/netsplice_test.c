@@ -0,0 +1,207 @@
+//
+// netsplice_test.c
+//
+// Tests for netsplice relaying between a TLS and a plaintext connection
+//
+//   netsplice_test [port]
+//
+// NOTES
+//
+// A TLS echo server on loopback (with a certificate made at start up)
+// is reached with netconnect, and spliced to one end of a socket pair,
+// adopted with netadopt.  The test writes to the other end of the pair,
+// and checks the data comes back through the relay unchanged.
+//
+// While nothing is sent the relay must wait in poll, so the process's
+// CPU time is measured over an idle period.  Finally the test shuts
+// down its end for writing, which must be passed on to the echo server,
+// whose close in turn ends the relay.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "../net.h"
+
+#define IDLEMS 500
+#define CHUNK 65536
+#define TOTAL (4*1024*1024)
+
+int port=18971 ;
+int failures=0 ;
+SSL_CTX *ctx ;
+int listenfd ;
+NET *tls, *plain ;
+int spliced ;
+
+#define CHECK(cond, msg) \
+  if (!(cond)) { fprintf(stderr, "netsplice_test: %s (line %d)\n", msg, __LINE__) ; failures++ ; }
+
+
+///////////////////////////////////////////////////////////////////////
+//
+// @brief Make server context, with a self-signed certificate
+//
+
+SSL_CTX *makectx()
+{
+  EVP_PKEY *key = EVP_EC_gen("P-256") ;
+  X509 *cert = X509_new() ;
+  if (!key || !cert) return NULL ;
+
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) ;
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0) ;
+  X509_gmtime_adj(X509_getm_notAfter(cert), 3600) ;
+  X509_set_pubkey(cert, key) ;
+  X509_NAME *name = X509_get_subject_name(cert) ;
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char *)"localhost", -1, -1, 0) ;
+  X509_set_issuer_name(cert, name) ;
+  X509_sign(cert, key, EVP_sha256()) ;
+
+  SSL_CTX *c = SSL_CTX_new(TLS_server_method()) ;
+  if (c && (!SSL_CTX_use_certificate(c, cert) || !SSL_CTX_use_PrivateKey(c, key))) {
+    SSL_CTX_free(c) ;
+    c = NULL ;
+  }
+  X509_free(cert) ;
+  EVP_PKEY_free(key) ;
+  return c ;
+}
+
+
+void *echoserver(void *arg)
+{
+  char buf[16384] ;
+  int fd = accept(listenfd, NULL, NULL) ;
+  if (fd<0) return NULL ;
+
+  // Echoes end in a small record, which Nagle's algorithm would hold
+  // until the relay's delayed acknowledgement
+
+  int on=1 ;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) ;
+
+  SSL *ssl = SSL_new(ctx) ;
+  SSL_set_fd(ssl, fd) ;
+  if (SSL_accept(ssl)==1) {
+    int n ;
+    while ((n=SSL_read(ssl, buf, sizeof(buf)))>0) {
+      if (SSL_write(ssl, buf, n)!=n) break ;
+    }
+    SSL_shutdown(ssl) ;
+  }
+  SSL_free(ssl) ;
+  close(fd) ;
+  return NULL ;
+}
+
+
+void *splicer(void *arg)
+{
+  spliced = netsplice(tls, plain) ;
+  return NULL ;
+}
+
+
+double cputime()
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) ;
+  return ts.tv_sec + ts.tv_nsec/1e9 ;
+}
+
+
+int readall(int fd, char *buf, int len)
+{
+  int n=0, r ;
+  while (n<len && (r=recv(fd, &buf[n], len-n, 0))>0) n+=r ;
+  return n==len ;
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc>1) port = atoi(argv[1]) ;
+
+  netinit() ;
+
+  ctx = makectx() ;
+  CHECK(ctx, "unable to make server certificate") ;
+
+  struct sockaddr_in sa ;
+  memset(&sa, 0, sizeof(sa)) ;
+  sa.sin_family = AF_INET ;
+  sa.sin_port = htons(port) ;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK) ;
+
+  int on=1 ;
+  listenfd = socket(AF_INET, SOCK_STREAM, 0) ;
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ;
+  if (!ctx || bind(listenfd, (struct sockaddr *)&sa, sizeof(sa))<0 || listen(listenfd, 1)<0) {
+    fprintf(stderr, "netsplice_test: unable to listen on port %d\n", port) ;
+    return 1 ;
+  }
+
+  pthread_t servertid, splicetid ;
+  pthread_create(&servertid, NULL, echoserver, NULL) ;
+
+  int sv[2] ;
+  socketpair(AF_UNIX, SOCK_STREAM, 0, sv) ;
+  tls = netconnect("127.0.0.1", port, TLS) ;
+  plain = netadopt(sv[0], OPEN) ;
+  CHECK(tls && plain, "unable to connect") ;
+  if (!tls || !plain) return 1 ;
+
+  pthread_create(&splicetid, NULL, splicer, NULL) ;
+
+  // Idle relay waits in poll
+
+  double cpu = cputime() ;
+  usleep(IDLEMS*1000) ;
+  cpu = cputime()-cpu ;
+  printf("idle TLS relay used %.3fs CPU in %.3fs\n", cpu, IDLEMS/1000.0) ;
+  CHECK(cpu < IDLEMS/1000.0/10, "idle TLS relay is spinning") ;
+
+  // Data comes back through the relay unchanged
+
+  char *out = malloc(CHUNK) ;
+  char *in = malloc(CHUNK) ;
+  int ok=1 ;
+  for (int sent=0; sent<TOTAL && ok; sent+=CHUNK) {
+    for (int i=0; i<CHUNK; i++) out[i] = (sent/CHUNK + i) % 251 ;
+    ok = send(sv[1], out, CHUNK, MSG_NOSIGNAL)==CHUNK && readall(sv[1], in, CHUNK) &&
+         memcmp(in, out, CHUNK)==0 ;
+  }
+  CHECK(ok, "data not echoed through TLS relay") ;
+
+  // Closing passes through the relay and back
+
+  shutdown(sv[1], SHUT_WR) ;
+  CHECK(recv(sv[1], in, CHUNK, 0)==0, "close not passed through TLS relay") ;
+  pthread_join(splicetid, NULL) ;
+  CHECK(spliced, "netsplice failed") ;
+
+  pthread_join(servertid, NULL) ;
+  netclose(tls) ;
+  netclose(plain) ;
+  close(sv[1]) ;
+  close(listenfd) ;
+  SSL_CTX_free(ctx) ;
+  free(out) ;
+  free(in) ;
+
+  printf("netsplice_test: %s\n", failures ? "FAILED" : "passed") ;
+  return failures ? 1 : 0 ;
+}